@@ -1739,6 +1739,44 @@ done:
 	return result;
 }
 
+int
+evbuffer_readln_inplace_(struct evbuffer *buffer, char **line_out,
+    size_t *n_read_out, size_t *n_drain_out,
+    enum evbuffer_eol_style eol_style)
+{
+	struct evbuffer_ptr it;
+	unsigned char *line;
+	size_t extra_drain = 0;
+	int result = -1;
+
+	EVBUFFER_LOCK(buffer);
+
+	if (buffer->freeze_start) {
+		goto done;
+	}
+
+	it = evbuffer_search_eol(buffer, NULL, &extra_drain, eol_style);
+	if (it.pos < 0)
+		goto done;
+
+	/* the first byte of the end of line gets replaced by a NUL */
+	result = 1;
+	if ((line = evbuffer_pullup(buffer, it.pos + 1)) == NULL)
+		goto done;
+	if (buffer->first->flags & EVBUFFER_IMMUTABLE)
+		goto done;
+	line[it.pos] = '\0';
+
+	*line_out = (char *)line;
+	*n_read_out = it.pos;
+	*n_drain_out = it.pos + extra_drain;
+	result = 0;
+done:
+	EVBUFFER_UNLOCK(buffer);
+
+	return result;
+}
+
 #define EVBUFFER_CHAIN_MAX_AUTO_SIZE 4096
 
 /* Adds data to an event buffer */
@@ -35,6 +35,8 @@ extern "C" {
 #include "evconfig-private.h"
 #include "event2/util.h"
 #include "event2/event_struct.h"
+#include "event2/buffer.h"
+#include "event2/buffer_compat.h"
 #include "util-internal.h"
 #include "defer-internal.h"
 
@@ -346,6 +348,20 @@ int evbuffer_get_callbacks_(struct evbuffer *buffer,
     struct event_callback **cbs,
     int max_cbs);
 
+/** As evbuffer_readln, but leaves the line inside buf instead of copying
+ * it out: the line is made contiguous, which copies it only if it spans
+ * several chains, and NUL-terminated by overwriting its end of line.  On
+ * success, sets *line_out, *n_read_out to the length of the line, and
+ * *n_drain_out to the number of bytes the caller has to drain from buf
+ * once it is done with the line; until then, buf must not be modified.
+ * Returns 0 on success, -1 if there is no complete line, and 1 if the line
+ * cannot be modified in place, in which case evbuffer_readln has to be
+ * used instead. */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_readln_inplace_(struct evbuffer *buf, char **line_out,
+    size_t *n_read_out, size_t *n_drain_out,
+    enum evbuffer_eol_style eol_style);
+
 #ifdef __cplusplus
 }
 #endif
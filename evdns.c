@@ -92,6 +92,9 @@
 #include "event2/event.h"
 #include "event2/event_struct.h"
 #include "event2/thread.h"
+#include "event2/buffer.h"
+#include "event2/bufferevent.h"
+#include "event2/listener.h"
 
 #include "defer-internal.h"
 #include "log-internal.h"
@@ -100,6 +103,7 @@
 #include "ipv6-internal.h"
 #include "util-internal.h"
 #include "evthread-internal.h"
+#include "ht-internal.h"
 #ifdef _WIN32
 #include <ctype.h>
 #include <winsock2.h>
@@ -116,6 +120,11 @@
 #include <netinet/in6.h>
 #endif
 
+/* recvmmsg() and sendmmsg() move many datagrams per system call */
+#if defined(EVENT__HAVE_RECVMMSG) && defined(EVENT__HAVE_SENDMMSG)
+#define EVDNS_USE_MMSG
+#endif
+
 #define EVDNS_LOG_DEBUG EVENT_LOG_DEBUG
 #define EVDNS_LOG_WARN EVENT_LOG_WARN
 #define EVDNS_LOG_MSG EVENT_LOG_MSG
@@ -164,9 +173,13 @@ struct evdns_request {
 
 	/* elements used by the searching code */
 	int search_index;
+	int search_misses;  /* search domains that gave NXDOMAIN */
 	struct search_state *search_state;
 	char *search_origname;	/* needs to be free()ed */
 	int search_flags;
+
+	/* given to each request made for this handle */
+	char **put_cname_in_ptr;
 };
 
 struct request {
@@ -188,6 +201,21 @@ struct request {
 	u16 trans_id;  /* the transaction id */
 	unsigned request_appended :1;	/* true if the request pointer is data which follows this struct */
 	unsigned transmit_me :1;  /* needs to be transmitted */
+	unsigned no_cache :1;  /* DNS_QUERY_NO_CACHE */
+	unsigned refresh :1;  /* refreshes a cached answer */
+	unsigned probe :1;  /* sent by nameserver_send_probe() */
+	unsigned coalescing :1;  /* in base->coalesce */
+	unsigned usevc :1;  /* goes over TCP */
+	unsigned igntc :1;  /* DNS_QUERY_IGNTC */
+	unsigned truncated :1;  /* got a truncated reply, see igntc */
+	unsigned hedge_pending :1;  /* timeout_event is for the hedge */
+	unsigned hedged :1;  /* was sent to a second nameserver */
+	unsigned tx_queued :1;  /* in the tx_queue of its nameserver */
+
+	struct timeval tx_time;  /* when it was last sent */
+	TAILQ_ENTRY(request) tx_next;
+	/* picks the UDP socket of each nameserver it is sent to */
+	u16 sock_index;
 
 	/* XXXX This is a horrible hack. */
 	char **put_cname_in_ptr; /* store the cname here if we get one. */
@@ -195,6 +223,16 @@ struct request {
 	struct evdns_base *base;
 
 	struct evdns_request *handle;
+
+	/* the name asked for, in lower case; follows the request data */
+	char *name;
+
+	/* Identical requests submitted while this one is outstanding wait
+	 * for its answer instead of being sent, see request_coalesce(). */
+	HT_ENTRY(request) coalesce_node;
+	struct request *waiters;  /* linked by next_waiter */
+	struct request *next_waiter;
+	struct request *primary;  /* the request a waiter waits for */
 };
 
 struct reply {
@@ -215,13 +253,59 @@ struct reply {
 	} data;
 };
 
+/* An answer kept in the cache of an evdns_base. */
+struct evdns_cache_entry {
+	HT_ENTRY(evdns_cache_entry) node;
+	TAILQ_ENTRY(evdns_cache_entry) lru;
+
+	char *name;  /* lower case; stored right after the entry */
+	u16 type;
+	u16 class;
+	int err;  /* DNS_ERR_NONE, DNS_ERR_NOTEXIST or DNS_ERR_NODATA */
+	u32 ttl;  /* as stored, after clipping */
+	struct timeval expires;
+	struct timeval refresh_until;  /* a refresh may be in flight until */
+	char *cname;  /* the canonical name, if any */
+	unsigned have_cname :1;  /* cname is known, even if NULL */
+	struct reply reply;  /* the answer, if err is DNS_ERR_NONE */
+};
+
+#ifdef EVDNS_USE_MMSG
+/* Buffers for moving up to size datagrams with one recvmmsg() or */
+/* sendmmsg(). */
+struct udp_batch {
+	int size;
+	struct mmsghdr *msgs;
+	struct iovec *iovs;
+	struct sockaddr_storage *addrs;
+	u8 *packets;  /* size packets of EVDNS_UDP_PACKET_SIZE bytes */
+};
+#endif
+
+/* A TCP connection to a nameserver or from a DNS client. */
+struct tcp_connection {
+	struct bufferevent *bev;  /* NULL if closed */
+	u16 awaiting_packet_size;  /* 0 while the length is still to come */
+};
+
+/* One of the UDP sockets of a nameserver. */
+struct nameserver_socket {
+	evutil_socket_t fd;
+	struct event event;
+	struct nameserver *ns;
+	char write_waiting;  /* true if we are waiting for EV_WRITE events */
+	/* with udp-batch-size, requests to be sent by the next tx_flush */
+	TAILQ_HEAD(request_tx_queue, request) tx_queue;
+};
+
 struct nameserver {
-	evutil_socket_t socket;	 /* a connected UDP socket */
+	/* udp-sockets UDP sockets, each with a port of its own */
+	struct nameserver_socket *sockets;
+	int n_sockets;
 	struct sockaddr_storage address;
 	ev_socklen_t addrlen;
 	int failed_times;  /* number of times which we have given this server a chance */
 	int timedout;  /* number of times in a row a request has timed out */
-	struct event event;
 	/* these objects are kept in a circular list */
 	struct nameserver *next, *prev;
 	struct event timeout_event;  /* used to keep the timeout for */
@@ -231,17 +315,34 @@ struct nameserver {
 	struct evdns_request *probe_request;
 	char state;  /* zero if we think that this server is down */
 	char choked;  /* true if we have an EAGAIN from this server's socket */
-	char write_waiting;  /* true if we are waiting for EV_WRITE events */
 	struct evdns_base *base;
 
 	/* Number of currently inflight requests: used
 	 * to track when we should add/del the event. */
 	int requests_inflight;
+
+	/* for the requests that go over TCP */
+	struct tcp_connection connection;
+
+	/* smoothed round-trip time and its variation, in microseconds; */
+	/* srtt is 0 until the first sample */
+	long srtt;
+	long rttvar;
+};
+
+/* A TCP connection accepted by the listener of a server port. */
+struct client_tcp_connection {
+	TAILQ_ENTRY(client_tcp_connection) next;
+	struct tcp_connection connection;
+	struct evdns_server_port *port;  /* holds a reference to it */
+	struct sockaddr_storage addr;
+	ev_socklen_t addrlen;
+	int refcnt;  /* one while open, and one per request from it */
 };
 
 
-/* Represents a local port where we're listening for DNS requests. Right now, */
-/* only UDP is supported. */
+/* Represents a local port where we're listening for DNS requests, either */
+/* on a UDP socket or on a TCP listener. */
 struct evdns_server_port {
 	evutil_socket_t socket; /* socket we use to read queries and write replies. */
 	int refcnt; /* reference count. */
@@ -254,6 +355,22 @@ struct evdns_server_port {
 	struct server_request *pending_replies;
 	struct event_base *event_base;
 
+	/* TCP only: the listener, and the connections that it accepted. */
+	struct evconnlistener *listener;
+	TAILQ_HEAD(client_tcp_list, client_tcp_connection) client_connections;
+	struct timeval tcp_idle_timeout;
+
+	/* UDP only, see EVDNS_SOPT_UDP_BATCH_SIZE.  While a batch of */
+	/* requests is being read, replies wait in pending_replies and go */
+	/* out together after it. */
+	char batching;
+#ifdef EVDNS_USE_MMSG
+	struct udp_batch udp_batch;
+#endif
+
+	/* see evdns_server_port_set_zone(); not owned by the port */
+	struct evdns_zone *zone;
+
 #ifndef EVENT__DISABLE_THREAD_SUPPORT
 	void *lock;
 #endif
@@ -276,12 +393,13 @@ struct server_reply_item {
 struct server_request {
 	/* Pointers to the next and previous entries on the list of replies */
 	/* that we're waiting to write.	 Only set if we have tried to respond */
-	/* and gotten EAGAIN. */
+	/* and gotten EAGAIN, or responded while a batch was being read. */
 	struct server_request *next_pending;
 	struct server_request *prev_pending;
 
 	u16 trans_id; /* Transaction id. */
 	struct evdns_server_port *port; /* Which port received this request on? */
+	struct client_tcp_connection *client; /* The connection it came over, if TCP */
 	struct sockaddr_storage addr; /* Where to send the response */
 	ev_socklen_t addrlen; /* length of addr */
 
@@ -350,6 +468,25 @@ struct evdns_base {
 	int so_rcvbuf;
 	int so_sndbuf;
 
+	/* DNS_QUERY_USEVC and DNS_QUERY_IGNTC for every request */
+	int global_tcp_flags;
+
+	/* UDP sockets for each nameserver added from now on */
+	int global_udp_sockets;
+
+	/* pick the fastest nameserver rather than the next one */
+	int global_select_fastest;
+	/* send requests to a second nameserver when the first is slow */
+	int global_hedge;
+	struct timeval global_tcp_idle_timeout;
+
+#ifdef EVDNS_USE_MMSG
+	/* see udp-batch-size */
+	struct udp_batch udp_batch;
+	/* sends the tx_queue of every nameserver */
+	struct event_callback tx_flush;
+#endif
+
 	int getaddrinfo_ipv4_timeouts;
 	int getaddrinfo_ipv6_timeouts;
 	int getaddrinfo_ipv4_answered;
@@ -358,6 +495,26 @@ struct evdns_base {
 	struct search_state *global_search_state;
 
 	TAILQ_HEAD(hosts_list, hosts_entry) hostsdb;
+	HT_HEAD(evdns_hosts_map, hosts_entry) hosts;
+
+	/* names to look up without the search domains, oldest first; see */
+	/* search-negative-ttl */
+	HT_HEAD(evdns_search_miss_map, search_miss) search_misses;
+	TAILQ_HEAD(search_miss_list, search_miss) search_miss_list;
+	int search_negative_ttl;  /* 0 if off */
+
+	/* answer cache, see the cache-* options */
+	HT_HEAD(evdns_cache_map, evdns_cache_entry) cache;
+	TAILQ_HEAD(evdns_cache_lru, evdns_cache_entry) cache_lru;
+	int cache_max_entries;  /* 0 if the cache is off */
+	u32 cache_min_ttl;
+	u32 cache_max_ttl;
+	int cache_prefetch;  /* percentage of the TTL, 0 if off */
+	int cache_serve_stale;  /* seconds past expiry, 0 if off */
+	struct evdns_cache_stats cache_stats;
+
+	/* outstanding requests that others may wait for */
+	HT_HEAD(evdns_request_map, request) coalesce;
 
 #ifndef EVENT__DISABLE_THREAD_SUPPORT
 	void *lock;
@@ -368,13 +525,49 @@ struct evdns_base {
 
 struct hosts_entry {
 	TAILQ_ENTRY(hosts_entry) next;
+	/* the first entry for a name is in base->hosts, and the others */
+	/* follow it on next_same in the order of the file */
+	HT_ENTRY(hosts_entry) node;
+	struct hosts_entry *next_same;
+	struct hosts_entry *last_same;  /* in the first entry only */
 	union {
 		struct sockaddr sa;
 		struct sockaddr_in sin;
 		struct sockaddr_in6 sin6;
 	} addr;
 	int addrlen;
-	char hostname[1];
+	char *hostname;  /* lower case; stored right after the entry */
+};
+
+/* Case-insensitive, so that lookups can use the name as given. */
+static unsigned
+hosts_entry_hash(const struct hosts_entry *e)
+{
+	const char *cp = e->hostname;
+	unsigned h = (unsigned char)EVUTIL_TOLOWER_(*cp) << 7;
+	while (*cp)
+		h = (1000003*h) ^ (unsigned char)EVUTIL_TOLOWER_(*cp++);
+	h ^= (unsigned)(cp - e->hostname);
+	return h;
+}
+
+static int
+hosts_entry_eq(const struct hosts_entry *a, const struct hosts_entry *b)
+{
+	return !evutil_ascii_strcasecmp(a->hostname, b->hostname);
+}
+
+HT_PROTOTYPE(evdns_hosts_map, hosts_entry, node, hosts_entry_hash,
+    hosts_entry_eq)
+HT_GENERATE(evdns_hosts_map, hosts_entry, node, hosts_entry_hash,
+    hosts_entry_eq, 0.5, mm_malloc, mm_realloc, mm_free)
+
+/* A name that none of the search domains made resolvable. */
+struct search_miss {
+	HT_ENTRY(search_miss) node;
+	TAILQ_ENTRY(search_miss) next;
+	char *name;  /* lower case; stored right after the entry */
+	struct timeval expires;
 };
 
 static struct evdns_base *current_base = NULL;
@@ -393,15 +586,32 @@ evdns_get_global_base(void)
 
 #define REQ_HEAD(base, id) ((base)->req_heads[id % (base)->n_req_heads])
 
+/* seconds before an idle TCP connection is closed */
+#define EVDNS_TCP_IDLE_TIMEOUT 10
+
+/* the largest datagram we read, and the most we move per system call */
+#define EVDNS_UDP_PACKET_SIZE 1500
+#define EVDNS_MAX_UDP_BATCH 64
+
+/* the most UDP sockets a nameserver can have */
+#define EVDNS_MAX_UDP_SOCKETS 64
+
+/* the socket of ns that req goes out on, and takes replies from */
+#define REQ_SOCKET(req, ns) \
+	(&(ns)->sockets[(req)->sock_index % (ns)->n_sockets])
+
 static struct nameserver *nameserver_pick(struct evdns_base *base);
+static struct nameserver *nameserver_pick_except(struct evdns_base *base, const struct nameserver *except);
 static void evdns_request_insert(struct request *req, struct request **head);
 static void evdns_request_remove(struct request *req, struct request **head);
 static void nameserver_ready_callback(evutil_socket_t fd, short events, void *arg);
+static void nameserver_write_waiting(struct nameserver_socket *s, char waiting);
+static void nameserver_sockets_free(struct nameserver *ns);
 static int evdns_transmit(struct evdns_base *base);
 static int evdns_request_transmit(struct request *req);
 static void nameserver_send_probe(struct nameserver *const ns);
 static void search_request_finished(struct evdns_request *const);
-static int search_try_next(struct evdns_request *const req);
+static int search_try_next(struct evdns_request *const req, int err);
 static struct request *search_request_new(struct evdns_base *base, struct evdns_request *handle, int type, const char *const name, int flags, evdns_callback_type user_callback, void *user_arg);
 static void evdns_requests_pump_waiting_queue(struct evdns_base *base);
 static u16 transaction_id_pick(struct evdns_base *base);
@@ -412,11 +622,26 @@ static int server_request_free(struct server_request *req);
 static void server_request_free_answers(struct server_request *req);
 static void server_port_free(struct evdns_server_port *port);
 static void server_port_ready_callback(evutil_socket_t fd, short events, void *arg);
+static void server_port_write_waiting(struct evdns_server_port *port, char waiting);
+static int server_port_flush(struct evdns_server_port *port);
 static int evdns_base_resolv_conf_parse_impl(struct evdns_base *base, int flags, const char *const filename);
 static int evdns_base_set_option_impl(struct evdns_base *base,
     const char *option, const char *val, int flags);
 static void evdns_base_free_and_unlock(struct evdns_base *base, int fail_requests);
 static void evdns_request_timeout_callback(evutil_socket_t fd, short events, void *arg);
+static void evdns_cache_trim(struct evdns_base *base, int n);
+static void evdns_hosts_clear(struct evdns_base *base);
+static void search_misses_clear(struct evdns_base *base);
+static void request_uncoalesce(struct request *req);
+static int reply_parse(struct evdns_base *base, struct nameserver *ns, struct nameserver_socket *sock, u8 *packet, int length);
+static int request_parse(u8 *packet, int length, struct evdns_server_port *port, struct client_tcp_connection *client, struct sockaddr *addr, ev_socklen_t addrlen);
+static int zone_answer(u8 *packet, int length, struct evdns_server_port *port, struct client_tcp_connection *client, struct sockaddr *addr, ev_socklen_t addrlen);
+static int nameserver_tcp_connect(struct nameserver *ns);
+static int tcp_write_message(struct tcp_connection *conn, const void *msg, size_t len);
+static void tcp_connection_close(struct tcp_connection *conn);
+static int client_tcp_connection_close(struct client_tcp_connection *client);
+static int client_tcp_connection_decref(struct client_tcp_connection *client);
+static void server_port_accept_cb(struct evconnlistener *listener, evutil_socket_t fd, struct sockaddr *addr, int socklen, void *arg);
 
 static int strtoint(const char *const str);
 
@@ -424,6 +649,7 @@ static int strtoint(const char *const str);
 #define EVDNS_LOCK(base)  EVUTIL_NIL_STMT_
 #define EVDNS_UNLOCK(base) EVUTIL_NIL_STMT_
 #define ASSERT_LOCKED(base) EVUTIL_NIL_STMT_
+#define EVDNS_THREADSAFE(base) 0
 #else
 #define EVDNS_LOCK(base)			\
 	EVLOCK_LOCK((base)->lock, 0)
@@ -431,6 +657,8 @@ static int strtoint(const char *const str);
 	EVLOCK_UNLOCK((base)->lock, 0)
 #define ASSERT_LOCKED(base)			\
 	EVLOCK_ASSERT_LOCKED((base)->lock)
+#define EVDNS_THREADSAFE(base)			\
+	((base)->lock != NULL)
 #endif
 
 static evdns_debug_log_fn_type evdns_log_fn = NULL;
@@ -545,6 +773,15 @@ nameserver_probe_failed(struct nameserver *const ns) {
 	}
 }
 
+/* take a request off the tx_queue of its nameserver, if it is there */
+static void
+request_tx_dequeue(struct request *req) {
+	if (req->tx_queued) {
+		TAILQ_REMOVE(&REQ_SOCKET(req, req->ns)->tx_queue, req, tx_next);
+		req->tx_queued = 0;
+	}
+}
+
 static void
 request_swap_ns(struct request *req, struct nameserver *ns) {
 	if (ns && req->ns != ns) {
@@ -552,6 +789,12 @@ request_swap_ns(struct request *req, struct nameserver *ns) {
 		req->ns->requests_inflight--;
 		ns->requests_inflight++;
 
+		if (req->tx_queued) {
+			request_tx_dequeue(req);
+			TAILQ_INSERT_TAIL(&REQ_SOCKET(req, ns)->tx_queue, req,
+			    tx_next);
+			req->tx_queued = 1;
+		}
 		req->ns = ns;
 	}
 }
@@ -652,19 +895,30 @@ request_trans_id_set(struct request *const req, const u16 trans_id) {
 static void
 request_finished(struct request *const req, struct request **head, int free_handle) {
 	struct evdns_base *base = req->base;
-	int was_inflight = (head != &base->req_waiting_head);
+	int was_inflight = head && head != &base->req_waiting_head;
+	struct request *w;
+	int i;
 	EVDNS_LOCK(base);
 	ASSERT_VALID_REQUEST(req);
 
 	if (head)
 		evdns_request_remove(req, head);
+	request_tx_dequeue(req);
+
+	/* waiters still here are dropped along with their request */
+	request_uncoalesce(req);
+	while ((w = req->waiters) != NULL) {
+		req->waiters = w->next_waiter;
+		w->next_waiter = w->primary = NULL;
+		request_finished(w, NULL, 1);
+	}
 
 	log(EVDNS_LOG_DEBUG, "Removing timeout for request %p", req);
 	if (was_inflight) {
 		evtimer_del(&req->timeout_event);
 		base->global_requests_inflight--;
 		req->ns->requests_inflight--;
-	} else {
+	} else if (head) {
 		base->global_requests_waiting--;
 	}
 	/* it was initialized during request_new / evtimer_assign */
@@ -673,7 +927,8 @@ request_finished(struct request *const req, struct request **head, int free_hand
 	if (req->ns &&
 	    req->ns->requests_inflight == 0 &&
 	    req->base->disable_when_inactive) {
-		event_del(&req->ns->event);
+		for (i = 0; i < req->ns->n_sockets; ++i)
+			event_del(&req->ns->sockets[i].event);
 		evtimer_del(&req->ns->timeout_event);
 	}
 
@@ -868,202 +1123,766 @@ reply_schedule_callback(struct request *const req, u32 ttl, u32 err, struct repl
 }
 
 
-#define _QR_MASK    0x8000U
-#define _OP_MASK    0x7800U
-#define _AA_MASK    0x0400U
-#define _TC_MASK    0x0200U
-#define _RD_MASK    0x0100U
-#define _RA_MASK    0x0080U
-#define _Z_MASK     0x0040U
-#define _AD_MASK    0x0020U
-#define _CD_MASK    0x0010U
-#define _RCODE_MASK 0x000fU
-#define _Z_MASK_DEPRECATED 0x0070U
+/* ================================================================= */
+/* Answer cache */
+/* */
+/* Answers, NXDOMAIN and NODATA replies are kept for their TTL, clipped */
+/* to [cache-min-ttl, cache-max-ttl], under the name that was sent, so */
+/* each name tried by the search code gets an entry of its own.  The */
+/* cache is off until the cache-size option is set. */
+/* */
+/* Answers in the last cache-prefetch percent of their TTL, and expired */
+/* ones served under cache-serve-stale, are refreshed by a query of */
+/* their own whose reply replaces the entry.  A refresh that fails */
+/* leaves the entry as it was. */
 
-/* this processes a parsed reply packet */
-static void
-reply_handle(struct request *const req, u16 flags, u32 ttl, struct reply *reply) {
-	int error;
-	char addrbuf[128];
-	static const int error_codes[] = {
-		DNS_ERR_FORMAT, DNS_ERR_SERVERFAILED, DNS_ERR_NOTEXIST,
-		DNS_ERR_NOTIMPL, DNS_ERR_REFUSED
-	};
+/* TTL of stale answers, as recommended by RFC 8767 */
+#define EVDNS_STALE_TTL 30
 
-	ASSERT_LOCKED(req->base);
-	ASSERT_VALID_REQUEST(req);
+static unsigned
+evdns_cache_hash(const struct evdns_cache_entry *e)
+{
+	return ht_string_hash_(e->name) ^ ((unsigned)e->type << 16 | e->class);
+}
 
-	if (flags & (_RCODE_MASK | _TC_MASK) || !reply || !reply->have_answer) {
-		/* there was an error */
-		if (flags & _TC_MASK) {
-			error = DNS_ERR_TRUNCATED;
-		} else if (flags & _RCODE_MASK) {
-			u16 error_code = (flags & _RCODE_MASK) - 1;
-			if (error_code > 4) {
-				error = DNS_ERR_UNKNOWN;
-			} else {
-				error = error_codes[error_code];
-			}
-		} else if (reply && !reply->have_answer) {
-			error = DNS_ERR_NODATA;
-		} else {
-			error = DNS_ERR_UNKNOWN;
-		}
+static int
+evdns_cache_eq(const struct evdns_cache_entry *a,
+    const struct evdns_cache_entry *b)
+{
+	return a->type == b->type && a->class == b->class &&
+	    !strcmp(a->name, b->name);
+}
 
-		switch (error) {
-		case DNS_ERR_NOTIMPL:
-		case DNS_ERR_REFUSED:
-			/* we regard these errors as marking a bad nameserver */
-			if (req->reissue_count < req->base->global_max_reissues) {
-				char msg[64];
-				evutil_snprintf(msg, sizeof(msg), "Bad response %d (%s)",
-					 error, evdns_err_to_string(error));
-				nameserver_failed(req->ns, msg);
-				if (!request_reissue(req)) return;
-			}
-			break;
-		case DNS_ERR_SERVERFAILED:
-			/* rcode 2 (servfailed) sometimes means "we
-			 * are broken" and sometimes (with some binds)
-			 * means "that request was very confusing."
-			 * Treat this as a timeout, not a failure.
-			 */
-			log(EVDNS_LOG_DEBUG, "Got a SERVERFAILED from nameserver"
-				"at %s; will allow the request to time out.",
-			    evutil_format_sockaddr_port_(
-				    (struct sockaddr *)&req->ns->address,
-				    addrbuf, sizeof(addrbuf)));
-			/* Call the timeout function */
-			evdns_request_timeout_callback(0, 0, req);
-			return;
-		default:
-			/* we got a good reply from the nameserver: it is up. */
-			if (req->handle == req->ns->probe_request) {
-				/* Avoid double-free */
-				req->ns->probe_request = NULL;
-			}
+HT_PROTOTYPE(evdns_cache_map, evdns_cache_entry, node, evdns_cache_hash,
+    evdns_cache_eq)
+HT_GENERATE(evdns_cache_map, evdns_cache_entry, node, evdns_cache_hash,
+    evdns_cache_eq, 0.5, mm_malloc, mm_realloc, mm_free)
 
-			nameserver_up(req->ns);
-		}
+static void
+evdns_cache_entry_free(struct evdns_base *base, struct evdns_cache_entry *e)
+{
+	ASSERT_LOCKED(base);
+	HT_REMOVE(evdns_cache_map, &base->cache, e);
+	TAILQ_REMOVE(&base->cache_lru, e, lru);
+	if (e->cname)
+		mm_free(e->cname);
+	mm_free(e);
+}
 
-		if (req->handle->search_state &&
-		    req->request_type != TYPE_PTR) {
-			/* if we have a list of domains to search in,
-			 * try the next one */
-			if (!search_try_next(req->handle)) {
-				/* a new request was issued so this
-				 * request is finished and */
-				/* the user callback will be made when
-				 * that request (or a */
-				/* child of it) finishes. */
-				return;
-			}
-		}
+/* drops the least recently used entries until at most n are left */
+static void
+evdns_cache_trim(struct evdns_base *base, int n)
+{
+	struct evdns_cache_entry *e;
 
-		/* all else failed. Pass the failure up */
-		reply_schedule_callback(req, ttl, error, NULL);
-		request_finished(req, &REQ_HEAD(req->base, req->trans_id), 1);
-	} else {
-		/* all ok, tell the user */
-		reply_schedule_callback(req, ttl, 0, reply);
-		if (req->handle == req->ns->probe_request)
-			req->ns->probe_request = NULL; /* Avoid double-free */
-		nameserver_up(req->ns);
-		request_finished(req, &REQ_HEAD(req->base, req->trans_id), 1);
+	ASSERT_LOCKED(base);
+	while ((int)HT_SIZE(&base->cache) > n) {
+		e = TAILQ_FIRST(&base->cache_lru);
+		evdns_cache_entry_free(base, e);
+		++base->cache_stats.evictions;
 	}
 }
 
-static int
-name_parse(u8 *packet, int length, int *idx, char *name_out, int name_out_len) {
-	int name_end = -1;
-	int j = *idx;
-	int ptr_count = 0;
-#define GET32(x) do { if (j + 4 > length) goto err; memcpy(&t32_, packet + j, 4); j += 4; x = ntohl(t32_); } while (0)
-#define GET16(x) do { if (j + 2 > length) goto err; memcpy(&t_, packet + j, 2); j += 2; x = ntohs(t_); } while (0)
-#define GET8(x) do { if (j >= length) goto err; x = packet[j++]; } while (0)
+/* fills key with the name, type and class asked for by req */
+static void
+evdns_cache_key(const struct request *req, struct evdns_cache_entry *key)
+{
+	key->name = req->name;
+	key->type = req->request_type;
+	key->class = CLASS_INET;
+}
 
-	char *cp = name_out;
-	const char *const end = name_out + name_out_len;
+/* returns the entry for req that may still be served at now, if any, */
+/* and marks it recently used */
+static struct evdns_cache_entry *
+evdns_cache_find(struct evdns_base *base, struct request *req,
+    const struct timeval *now)
+{
+	struct evdns_cache_entry key, *e;
+	struct timeval limit;
 
-	/* Normally, names are a series of length prefixed strings terminated */
-	/* with a length of 0 (the lengths are u8's < 63). */
-	/* However, the length can start with a pair of 1 bits and that */
-	/* means that the next 14 bits are a pointer within the current */
-	/* packet. */
+	evdns_cache_key(req, &key);
+	e = HT_FIND(evdns_cache_map, &base->cache, &key);
+	if (!e)
+		return NULL;
 
-	for (;;) {
-		u8 label_len;
-		GET8(label_len);
-		if (!label_len) break;
-		if (label_len & 0xc0) {
-			u8 ptr_low;
-			GET8(ptr_low);
-			if (name_end < 0) name_end = j;
-			j = (((int)label_len & 0x3f) << 8) + ptr_low;
-			/* Make sure that the target offset is in-bounds. */
-			if (j < 0 || j >= length) return -1;
-			/* If we've jumped more times than there are characters in the
-			 * message, we must have a loop. */
-			if (++ptr_count > length) return -1;
-			continue;
-		}
-		if (label_len > 63) return -1;
-		if (cp != name_out) {
-			if (cp + 1 >= end) return -1;
-			*cp++ = '.';
-		}
-		if (cp + label_len >= end) return -1;
-		if (j + label_len > length) return -1;
-		memcpy(cp, packet + j, label_len);
-		cp += label_len;
-		j += label_len;
+	limit = e->expires;
+	limit.tv_sec += base->cache_serve_stale;
+	if (evutil_timercmp(&limit, now, <=)) {
+		evdns_cache_entry_free(base, e);
+		return NULL;
 	}
-	if (cp >= end) return -1;
-	*cp = '\0';
-	if (name_end < 0)
-		*idx = j;
-	else
-		*idx = name_end;
-	return 0;
- err:
-	return -1;
-}
 
-/* parses a raw request from a nameserver */
-static int
-reply_parse(struct evdns_base *base, u8 *packet, int length) {
-	int j = 0, k = 0;  /* index into packet */
-	u16 t_;	 /* used by the macros */
-	u32 t32_;  /* used by the macros */
-	char tmp_name[256], cmp_name[256]; /* used by the macros */
-	int name_matches = 0;
+	TAILQ_REMOVE(&base->cache_lru, e, lru);
+	TAILQ_INSERT_TAIL(&base->cache_lru, e, lru);
+	return e;
+}
 
-	u16 trans_id, questions, answers, authority, additional, datalength;
-	u16 flags = 0;
-	u32 ttl, ttl_r = 0xffffffff;
-	struct reply reply;
-	struct request *req = NULL;
-	unsigned int i;
+/* remembers the answer to req; err is 0 if reply holds the answer */
+static void
+evdns_cache_store(struct request *req, u32 ttl, int err,
+    const struct reply *reply)
+{
+	struct evdns_base *base = req->base;
+	struct evdns_cache_entry key, *e;
+	size_t len;
 
 	ASSERT_LOCKED(base);
+	/* a truncated answer might be missing records */
+	if (!base->cache_max_entries || req->no_cache || req->truncated)
+		return;
 
-	GET16(trans_id);
-	GET16(flags);
-	GET16(questions);
-	GET16(answers);
-	GET16(authority);
-	GET16(additional);
-	(void) authority; /* suppress "unused variable" warnings. */
-	(void) additional; /* suppress "unused variable" warnings. */
+	if (ttl < base->cache_min_ttl)
+		ttl = base->cache_min_ttl;
+	if (ttl > base->cache_max_ttl)
+		ttl = base->cache_max_ttl;
+	if (!ttl)
+		return;
 
-	req = request_find_from_trans_id(base, trans_id);
-	if (!req) return -1;
-	EVUTIL_ASSERT(req->base == base);
+	evdns_cache_key(req, &key);
+	if ((e = HT_FIND(evdns_cache_map, &base->cache, &key)) != NULL)
+		evdns_cache_entry_free(base, e);
 
-	memset(&reply, 0, sizeof(reply));
+	len = strlen(req->name) + 1;
+	e = mm_calloc(1, sizeof(*e) + len);
+	if (e == NULL) {
+		event_warn("%s: calloc", __func__);
+		return;
+	}
+	e->name = (char *)(e + 1);
+	memcpy(e->name, req->name, len);
+	e->type = key.type;
+	e->class = key.class;
+	e->err = err;
+	e->ttl = ttl;
+	if (reply)
+		memcpy(&e->reply, reply, sizeof(*reply));
+	event_base_gettimeofday_cached(base->event_base, &e->expires);
+	e->expires.tv_sec += ttl;
+
+	/* a request that did not ask for the canonical name did not
+	 * parse it either */
+	if (req->put_cname_in_ptr) {
+		e->have_cname = 1;
+		if (*req->put_cname_in_ptr &&
+		    !(e->cname = mm_strdup(*req->put_cname_in_ptr)))
+			e->have_cname = 0;
+	}
+
+	evdns_cache_trim(base, base->cache_max_entries - 1);
+	HT_INSERT(evdns_cache_map, &base->cache, e);
+	TAILQ_INSERT_TAIL(&base->cache_lru, e, lru);
+}
+
+static void
+evdns_cache_refresh_cb(int result, char type, int count, int ttl,
+    void *addresses, void *arg)
+{
+	/* reply_handle() has already stored the answer */
+}
+
+/* sends a query for e unless one may still be in flight */
+static void
+evdns_cache_refresh(struct evdns_base *base, struct evdns_cache_entry *e,
+    const struct timeval *now)
+{
+	struct evdns_request *handle;
+	struct request *req;
+	struct timeval tv;
+	u64 window;
+
+	ASSERT_LOCKED(base);
+	if (evutil_timercmp(&e->refresh_until, now, >))
+		return;
+	/* nothing to refresh from; the probes will tell when a
+	 * nameserver is back */
+	if (!base->global_good_nameservers)
+		return;
+
+	handle = mm_calloc(1, sizeof(*handle));
+	if (!handle)
+		return;
+	req = request_new(base, handle, e->type, e->name, DNS_QUERY_NO_SEARCH,
+	    evdns_cache_refresh_cb, NULL);
+	if (!req) {
+		mm_free(handle);
+		return;
+	}
+	req->refresh = 1;
+
+	/* long enough for all the retransmits to time out */
+	window = ((u64)base->global_timeout.tv_sec * 1000000 +
+	    base->global_timeout.tv_usec) * (base->global_max_retransmits + 1);
+	tv.tv_sec = window / 1000000;
+	tv.tv_usec = window % 1000000;
+	evutil_timeradd(now, &tv, &e->refresh_until);
+	++base->cache_stats.refreshes;
+
+	request_submit(req);
+}
+
+/* Answers req from the cache without sending it. */
+/* */
+/* return: */
+/*   0 req has to be sent */
+/*   1 req has been answered and freed */
+static int
+request_answer_from_cache(struct request *const req)
+{
+	struct evdns_base *base = req->base;
+	struct evdns_cache_entry *e;
+	struct timeval now;
+	u32 ttl;
+	int err;
+
+	ASSERT_LOCKED(base);
+	ASSERT_VALID_REQUEST(req);
+	if (!base->cache_max_entries || req->no_cache || req->refresh)
+		return 0;
+
+	event_base_gettimeofday_cached(base->event_base, &now);
+	e = evdns_cache_find(base, req, &now);
+	if (e && req->put_cname_in_ptr && !e->have_cname)
+		e = NULL;
+	if (!e) {
+		++base->cache_stats.misses;
+		return 0;
+	}
+
+	++base->cache_stats.hits;
+	if (evutil_timercmp(&e->expires, &now, <=)) {
+		++base->cache_stats.stale_hits;
+		ttl = EVDNS_STALE_TTL;
+		evdns_cache_refresh(base, e, &now);
+	} else {
+		struct timeval left;
+		evutil_timersub(&e->expires, &now, &left);
+		ttl = (u32)left.tv_sec;
+		if (((ev_uint64_t)left.tv_sec * 1000000 + left.tv_usec) * 100 <
+		    (ev_uint64_t)e->ttl * 1000000 * base->cache_prefetch)
+			evdns_cache_refresh(base, e, &now);
+	}
+	err = e->err;
+	if (err == DNS_ERR_NONE) {
+		if (e->cname && req->put_cname_in_ptr &&
+		    !*req->put_cname_in_ptr)
+			*req->put_cname_in_ptr = mm_strdup(e->cname);
+		reply_schedule_callback(req, ttl, DNS_ERR_NONE, &e->reply);
+	} else {
+		++base->cache_stats.negative_hits;
+		if (req->handle->search_state &&
+		    req->request_type != TYPE_PTR &&
+		    !search_try_next(req->handle, err))
+			return 1;
+		reply_schedule_callback(req, ttl, err, NULL);
+	}
+	request_finished(req, NULL, 1);
+	return 1;
+}
+
+void
+evdns_base_get_cache_stats(struct evdns_base *base,
+    struct evdns_cache_stats *stats)
+{
+	EVDNS_LOCK(base);
+	memcpy(stats, &base->cache_stats, sizeof(*stats));
+	stats->entries = HT_SIZE(&base->cache);
+	EVDNS_UNLOCK(base);
+}
+
+void
+evdns_base_clear_cache(struct evdns_base *base)
+{
+	struct evdns_cache_entry *e;
+
+	EVDNS_LOCK(base);
+	while ((e = TAILQ_FIRST(&base->cache_lru)) != NULL)
+		evdns_cache_entry_free(base, e);
+	EVDNS_UNLOCK(base);
+}
+
+
+/* ================================================================= */
+/* Coalescing */
+/* */
+/* A request for a name and type that is already outstanding is not */
+/* sent: it waits on the primary request and gets the primary's answer. */
+/* Waiters that are searching go on with their own search when the */
+/* answer is an error. */
+
+static unsigned
+request_hash(const struct request *req)
+{
+	return ht_string_hash_(req->name) ^ req->request_type;
+}
+
+static int
+request_eq(const struct request *a, const struct request *b)
+{
+	/* a truncated answer is only good for those that accept one */
+	return a->request_type == b->request_type && a->igntc == b->igntc &&
+	    !strcmp(a->name, b->name);
+}
+
+HT_PROTOTYPE(evdns_request_map, request, coalesce_node, request_hash,
+    request_eq)
+HT_GENERATE(evdns_request_map, request, coalesce_node, request_hash,
+    request_eq, 0.5, mm_malloc, mm_realloc, mm_free)
+
+/* makes req wait for an identical outstanding request, if there is one, */
+/* or lets others wait for it */
+/* */
+/* return: */
+/*   0 req has to be sent */
+/*   1 req is waiting */
+static int
+request_coalesce(struct request *const req)
+{
+	struct evdns_base *base = req->base;
+	struct request *primary;
+
+	ASSERT_LOCKED(base);
+	if (req->probe)
+		return 0;
+
+	primary = HT_FIND(evdns_request_map, &base->coalesce, req);
+	if (!primary) {
+		HT_INSERT(evdns_request_map, &base->coalesce, req);
+		req->coalescing = 1;
+		return 0;
+	}
+	/* only a primary that parses the canonical name can pass it on */
+	if (req->put_cname_in_ptr && !primary->put_cname_in_ptr)
+		return 0;
+
+	log(EVDNS_LOG_DEBUG, "Request %p waits for request %p", req, primary);
+	req->ns = NULL;
+	req->primary = primary;
+	req->next_waiter = primary->waiters;
+	primary->waiters = req;
+	return 1;
+}
+
+static void
+request_uncoalesce(struct request *const req)
+{
+	if (req->coalescing) {
+		HT_REMOVE(evdns_request_map, &req->base->coalesce, req);
+		req->coalescing = 0;
+	}
+}
+
+/* Passes the answer to req on to the requests waiting for it; with */
+/* search set, the waiters that are searching try their next name on */
+/* errors, as in reply_handle(). */
+static void
+request_answer_waiters(struct request *const req, u32 ttl, int err,
+    struct reply *reply, int search)
+{
+	struct request *w;
+
+	ASSERT_LOCKED(req->base);
+	/* nothing may wait for an answer that is already known */
+	request_uncoalesce(req);
+
+	while ((w = req->waiters) != NULL) {
+		req->waiters = w->next_waiter;
+		w->next_waiter = w->primary = NULL;
+
+		if (err == DNS_ERR_NONE) {
+			if (w->put_cname_in_ptr && !*w->put_cname_in_ptr &&
+			    req->put_cname_in_ptr && *req->put_cname_in_ptr)
+				*w->put_cname_in_ptr =
+				    mm_strdup(*req->put_cname_in_ptr);
+		} else if (search && w->handle->search_state &&
+		    w->request_type != TYPE_PTR &&
+		    !search_try_next(w->handle, err)) {
+			continue;
+		}
+		reply_schedule_callback(w, ttl, err, reply);
+		request_finished(w, NULL, 1);
+	}
+}
+
+/* Points req at where its own handle wants the canonical name, or else */
+/* at where the first of its waiters that wants one does. */
+static void
+request_pick_cname_ptr(struct request *const req)
+{
+	struct request *w;
+
+	req->put_cname_in_ptr = req->handle->put_cname_in_ptr;
+	for (w = req->waiters; w && !req->put_cname_in_ptr; w = w->next_waiter)
+		req->put_cname_in_ptr = w->put_cname_in_ptr;
+}
+
+/* stops waiting for the answer of the primary request */
+static void
+request_remove_waiter(struct request *const req)
+{
+	struct request *primary = req->primary;
+	struct request **wp;
+
+	for (wp = &primary->waiters; *wp != req; wp = &(*wp)->next_waiter)
+		EVUTIL_ASSERT(*wp);
+	*wp = req->next_waiter;
+	req->next_waiter = req->primary = NULL;
+	/* the storage goes away with the handle of req */
+	if (req->put_cname_in_ptr &&
+	    primary->put_cname_in_ptr == req->put_cname_in_ptr)
+		request_pick_cname_ptr(primary);
+}
+
+/* Hands req, whose handle has been canceled, to its first waiter, so */
+/* that the other waiters still get its answer. */
+static void
+request_adopt_waiter(struct request *const req)
+{
+	struct request *w = req->waiters;
+	struct evdns_request *handle = req->handle;
+	struct request *it;
+
+	ASSERT_LOCKED(req->base);
+	req->waiters = w->next_waiter;
+	for (it = req->waiters; it; it = it->next_waiter)
+		EVUTIL_ASSERT(it->primary == req);
+
+	search_request_finished(handle);
+	handle->current_req = NULL;
+	if (!handle->pending_cb)
+		mm_free(handle);
+
+	req->handle = w->handle;
+	req->handle->current_req = req;
+	req->user_callback = w->user_callback;
+	req->user_pointer = w->user_pointer;
+	req->no_cache = w->no_cache;
+	/* later waiters might want the canonical name even if w does not */
+	request_pick_cname_ptr(req);
+
+	event_debug_unassign(&w->timeout_event);
+	mm_free(w);
+}
+
+
+/* ================================================================= */
+/* Round-trip times */
+/* */
+/* Each nameserver keeps a smoothed round-trip time and its variation, */
+/* updated as in RFC 6298 from the replies to requests that it got only */
+/* once, and from how long requests waited for it before they timed out */
+/* or were hedged.  With select-fastest, nameserver_pick() prefers the */
+/* good nameserver with the lowest one.  With hedge, a request that gets */
+/* no reply within srtt + 4 * rttvar is sent to another nameserver too. */
+
+/* the least and the first delay before a request is hedged */
+#define EVDNS_HEDGE_MIN_USEC 10000
+#define EVDNS_HEDGE_INITIAL_USEC 1000000
+
+static long
+usec_since(const struct timeval *then, const struct timeval *now)
+{
+	struct timeval d;
+	evutil_timersub(now, then, &d);
+	if (d.tv_sec < 0)
+		return 0;
+	if (d.tv_sec >= 3600)
+		return 3600L * 1000000L;
+	return d.tv_sec * 1000000L + d.tv_usec;
+}
+
+static void
+nameserver_rtt_sample(struct nameserver *ns, long usec)
+{
+	long delta;
+
+	/* a known srtt is never 0 */
+	if (usec < 1)
+		usec = 1;
+	if (!ns->srtt) {
+		ns->srtt = usec;
+		ns->rttvar = usec / 2;
+		return;
+	}
+	delta = usec - ns->srtt;
+	ns->rttvar += ((delta < 0 ? -delta : delta) - ns->rttvar) / 4;
+	ns->srtt += delta / 8;
+	if (ns->srtt < 1)
+		ns->srtt = 1;
+}
+
+/* how long a request waits for ns before it is hedged */
+static void
+nameserver_hedge_delay(const struct nameserver *ns, struct timeval *tv)
+{
+	long usec = ns->srtt ? ns->srtt + 4 * ns->rttvar :
+	    EVDNS_HEDGE_INITIAL_USEC;
+	if (usec < EVDNS_HEDGE_MIN_USEC)
+		usec = EVDNS_HEDGE_MIN_USEC;
+	tv->tv_sec = usec / 1000000;
+	tv->tv_usec = usec % 1000000;
+}
+
+/* the good nameserver other than except with the lowest srtt; the others */
+/* age, so that they get another chance once in a while */
+static struct nameserver *
+nameserver_pick_fastest(struct evdns_base *base,
+    const struct nameserver *except)
+{
+	struct nameserver *ns = base->server_head, *picked = NULL;
+
+	do {
+		if (ns->state && ns != except &&
+		    (!picked || ns->srtt < picked->srtt))
+			picked = ns;
+		ns = ns->next;
+	} while (ns != base->server_head);
+
+	do {
+		if (ns != picked)
+			ns->srtt -= ns->srtt >> 6;
+		ns = ns->next;
+	} while (ns != base->server_head);
+
+	return picked;
+}
+
+
+#define _QR_MASK    0x8000U
+#define _OP_MASK    0x7800U
+#define _AA_MASK    0x0400U
+#define _TC_MASK    0x0200U
+#define _RD_MASK    0x0100U
+#define _RA_MASK    0x0080U
+#define _Z_MASK     0x0040U
+#define _AD_MASK    0x0020U
+#define _CD_MASK    0x0010U
+#define _RCODE_MASK 0x000fU
+#define _Z_MASK_DEPRECATED 0x0070U
+
+/* this processes a parsed reply packet */
+static void
+reply_handle(struct request *const req, u16 flags, u32 ttl, struct reply *reply) {
+	int error;
+	char addrbuf[128];
+	static const int error_codes[] = {
+		DNS_ERR_FORMAT, DNS_ERR_SERVERFAILED, DNS_ERR_NOTEXIST,
+		DNS_ERR_NOTIMPL, DNS_ERR_REFUSED
+	};
+
+	ASSERT_LOCKED(req->base);
+	ASSERT_VALID_REQUEST(req);
+
+	if ((flags & _TC_MASK) && !req->usevc) {
+		/* the answer did not fit: ask again over TCP */
+		log(EVDNS_LOG_DEBUG, "Truncated reply to request %p; "
+		    "retrying over TCP", req);
+		if (req->handle == req->ns->probe_request)
+			req->ns->probe_request = NULL;
+		nameserver_up(req->ns);
+		req->usevc = 1;
+		(void) evtimer_del(&req->timeout_event);
+		evdns_request_transmit(req);
+		return;
+	}
+
+	if (flags & (_RCODE_MASK | _TC_MASK) || !reply || !reply->have_answer) {
+		/* there was an error */
+		if (flags & _TC_MASK) {
+			error = DNS_ERR_TRUNCATED;
+		} else if (flags & _RCODE_MASK) {
+			u16 error_code = (flags & _RCODE_MASK) - 1;
+			if (error_code > 4) {
+				error = DNS_ERR_UNKNOWN;
+			} else {
+				error = error_codes[error_code];
+			}
+		} else if (reply && !reply->have_answer) {
+			error = DNS_ERR_NODATA;
+		} else {
+			error = DNS_ERR_UNKNOWN;
+		}
+
+		switch (error) {
+		case DNS_ERR_NOTIMPL:
+		case DNS_ERR_REFUSED:
+			/* we regard these errors as marking a bad nameserver */
+			if (req->reissue_count < req->base->global_max_reissues) {
+				char msg[64];
+				evutil_snprintf(msg, sizeof(msg), "Bad response %d (%s)",
+					 error, evdns_err_to_string(error));
+				nameserver_failed(req->ns, msg);
+				if (!request_reissue(req)) return;
+			}
+			break;
+		case DNS_ERR_NOTEXIST:
+		case DNS_ERR_NODATA:
+			evdns_cache_store(req, ttl, error, NULL);
+			goto answered;
+		case DNS_ERR_SERVERFAILED:
+			/* rcode 2 (servfailed) sometimes means "we
+			 * are broken" and sometimes (with some binds)
+			 * means "that request was very confusing."
+			 * Treat this as a timeout, not a failure.
+			 */
+			log(EVDNS_LOG_DEBUG, "Got a SERVERFAILED from nameserver"
+				"at %s; will allow the request to time out.",
+			    evutil_format_sockaddr_port_(
+				    (struct sockaddr *)&req->ns->address,
+				    addrbuf, sizeof(addrbuf)));
+			/* Call the timeout function */
+			evdns_request_timeout_callback(0, 0, req);
+			return;
+		default:
+		answered:
+			/* we got a good reply from the nameserver: it is up. */
+			if (req->handle == req->ns->probe_request) {
+				/* Avoid double-free */
+				req->ns->probe_request = NULL;
+			}
+
+			nameserver_up(req->ns);
+		}
+
+		request_answer_waiters(req, ttl, error, NULL, 1);
+
+		if (req->handle->search_state &&
+		    req->request_type != TYPE_PTR) {
+			/* if we have a list of domains to search in,
+			 * try the next one */
+			if (!search_try_next(req->handle, error)) {
+				/* a new request was issued so this
+				 * request is finished and */
+				/* the user callback will be made when
+				 * that request (or a */
+				/* child of it) finishes. */
+				return;
+			}
+		}
+
+		/* all else failed. Pass the failure up */
+		reply_schedule_callback(req, ttl, error, NULL);
+		request_finished(req, &REQ_HEAD(req->base, req->trans_id), 1);
+	} else {
+		/* all ok, tell the user */
+		evdns_cache_store(req, ttl, 0, reply);
+		reply_schedule_callback(req, ttl, 0, reply);
+		request_answer_waiters(req, ttl, 0, reply, 0);
+		if (req->handle == req->ns->probe_request)
+			req->ns->probe_request = NULL; /* Avoid double-free */
+		nameserver_up(req->ns);
+		request_finished(req, &REQ_HEAD(req->base, req->trans_id), 1);
+	}
+}
+
+static int
+name_parse(u8 *packet, int length, int *idx, char *name_out, int name_out_len) {
+	int name_end = -1;
+	int j = *idx;
+	int ptr_count = 0;
+#define GET32(x) do { if (j + 4 > length) goto err; memcpy(&t32_, packet + j, 4); j += 4; x = ntohl(t32_); } while (0)
+#define GET16(x) do { if (j + 2 > length) goto err; memcpy(&t_, packet + j, 2); j += 2; x = ntohs(t_); } while (0)
+#define GET8(x) do { if (j >= length) goto err; x = packet[j++]; } while (0)
+
+	char *cp = name_out;
+	const char *const end = name_out + name_out_len;
+
+	/* Normally, names are a series of length prefixed strings terminated */
+	/* with a length of 0 (the lengths are u8's < 63). */
+	/* However, the length can start with a pair of 1 bits and that */
+	/* means that the next 14 bits are a pointer within the current */
+	/* packet. */
+
+	for (;;) {
+		u8 label_len;
+		GET8(label_len);
+		if (!label_len) break;
+		if (label_len & 0xc0) {
+			u8 ptr_low;
+			GET8(ptr_low);
+			if (name_end < 0) name_end = j;
+			j = (((int)label_len & 0x3f) << 8) + ptr_low;
+			/* Make sure that the target offset is in-bounds. */
+			if (j < 0 || j >= length) return -1;
+			/* If we've jumped more times than there are characters in the
+			 * message, we must have a loop. */
+			if (++ptr_count > length) return -1;
+			continue;
+		}
+		if (label_len > 63) return -1;
+		if (cp != name_out) {
+			if (cp + 1 >= end) return -1;
+			*cp++ = '.';
+		}
+		if (cp + label_len >= end) return -1;
+		if (j + label_len > length) return -1;
+		memcpy(cp, packet + j, label_len);
+		cp += label_len;
+		j += label_len;
+	}
+	if (cp >= end) return -1;
+	*cp = '\0';
+	if (name_end < 0)
+		*idx = j;
+	else
+		*idx = name_end;
+	return 0;
+ err:
+	return -1;
+}
+
+/* parses a raw request from a nameserver */
+static int
+reply_parse(struct evdns_base *base, struct nameserver *ns,
+    struct nameserver_socket *sock, u8 *packet, int length) {
+	int j = 0, k = 0;  /* index into packet */
+	u16 t_;	 /* used by the macros */
+	u32 t32_;  /* used by the macros */
+	char tmp_name[256], cmp_name[256]; /* used by the macros */
+	int name_matches = 0;
+
+	u16 trans_id, questions, answers, authority, additional, datalength;
+	u16 flags = 0;
+	u32 ttl, ttl_r = 0xffffffff;
+	struct reply reply;
+	struct request *req = NULL;
+	unsigned int i;
+
+	ASSERT_LOCKED(base);
+
+	GET16(trans_id);
+	GET16(flags);
+	GET16(questions);
+	GET16(answers);
+	GET16(authority);
+	GET16(additional);
+	(void) authority; /* suppress "unused variable" warnings. */
+	(void) additional; /* suppress "unused variable" warnings. */
+
+	req = request_find_from_trans_id(base, trans_id);
+	if (!req) return -1;
+	EVUTIL_ASSERT(req->base == base);
+	/* over UDP, only the socket that it was sent from takes the reply */
+	if (sock && sock != REQ_SOCKET(req, ns)) return -1;
+
+	/* Over TCP the time includes the connection setup; after a */
+	/* retransmit we do not know which one is answered. */
+	if (ns == req->ns && !req->usevc &&
+	    req->tx_count == 1 + (int)req->hedged) {
+		struct timeval now;
+		event_base_gettimeofday_cached(base->event_base, &now);
+		nameserver_rtt_sample(ns, usec_since(&req->tx_time, &now));
+	}
+
+	memset(&reply, 0, sizeof(reply));
 
 	/* If it's not an answer, it doesn't correspond to any request. */
 	if (!(flags & _QR_MASK)) return -1;  /* must be an answer */
+	/* with DNS_QUERY_IGNTC, use what made it into a truncated reply */
+	if (req->igntc && (flags & _TC_MASK)) {
+		req->truncated = 1;
+		flags &= ~_TC_MASK;
+	}
 	if ((flags & (_RCODE_MASK|_TC_MASK)) && (flags & (_RCODE_MASK|_TC_MASK)) != DNS_ERR_NOTEXIST) {
 		/* there was an error and it's not NXDOMAIN */
 		goto err;
@@ -1221,6 +2040,11 @@ reply_parse(struct evdns_base *base, u8 *packet, int length) {
 	reply_handle(req, flags, ttl_r, &reply);
 	return 0;
  err:
+	if (req && req->igntc && reply.have_answer) {
+		/* a truncated reply ends in the middle of the answers */
+		reply_handle(req, flags, ttl_r == 0xffffffff ? 0 : ttl_r, &reply);
+		return 0;
+	}
 	if (req)
 		reply_handle(req, flags, 0, NULL);
 	return -1;
@@ -1230,7 +2054,7 @@ reply_parse(struct evdns_base *base, u8 *packet, int length) {
 /* a DNS client (addr,addrlen), and if it's well-formed, call the corresponding */
 /* callback. */
 static int
-request_parse(u8 *packet, int length, struct evdns_server_port *port, struct sockaddr *addr, ev_socklen_t addrlen)
+request_parse(u8 *packet, int length, struct evdns_server_port *port, struct client_tcp_connection *client, struct sockaddr *addr, ev_socklen_t addrlen)
 {
 	int j = 0;	/* index into packet */
 	u16 t_;	 /* used by the macros */
@@ -1242,6 +2066,10 @@ request_parse(u8 *packet, int length, struct evdns_server_port *port, struct soc
 
 	ASSERT_LOCKED(port);
 
+	if (port->zone &&
+	    !zone_answer(packet, length, port, client, addr, addrlen))
+		return 0;
+
 	/* Get the header fields */
 	GET16(trans_id);
 	GET16(flags);
@@ -1292,6 +2120,10 @@ request_parse(u8 *packet, int length, struct evdns_server_port *port, struct soc
 
 	server_req->port = port;
 	port->refcnt++;
+	if (client) {
+		server_req->client = client;
+		client->refcnt++;
+	}
 
 	/* Only standard queries are supported. */
 	if (flags & _OP_MASK) {
@@ -1348,6 +2180,14 @@ transaction_id_pick(struct evdns_base *base) {
 /* by updating the server_head global each time. */
 static struct nameserver *
 nameserver_pick(struct evdns_base *base) {
+	return nameserver_pick_except(base, NULL);
+}
+
+/* choose a good nameserver other than except, which is good itself, or */
+/* NULL; see nameserver_pick() */
+static struct nameserver *
+nameserver_pick_except(struct evdns_base *base,
+    const struct nameserver *except) {
 	struct nameserver *started_at = base->server_head, *picked;
 	ASSERT_LOCKED(base);
 	if (!base->server_head) return NULL;
@@ -1359,9 +2199,12 @@ nameserver_pick(struct evdns_base *base) {
 		return base->server_head;
 	}
 
+	if (base->global_select_fastest)
+		return nameserver_pick_fastest(base, except);
+
 	/* remember that nameservers are in a circular list */
 	for (;;) {
-		if (base->server_head->state) {
+		if (base->server_head->state && base->server_head != except) {
 			/* we think this server is currently good */
 			picked = base->server_head;
 			base->server_head = base->server_head->next;
@@ -1370,6 +2213,8 @@ nameserver_pick(struct evdns_base *base) {
 
 		base->server_head = base->server_head->next;
 		if (base->server_head == started_at) {
+			if (except)
+				return NULL;
 			/* all the nameservers seem to be down */
 			/* so we just return this one and hope for the */
 			/* best */
@@ -1381,21 +2226,220 @@ nameserver_pick(struct evdns_base *base) {
 	}
 }
 
+/* ================================================================= */
+/* UDP batches */
+/* */
+/* With udp-batch-size above 1, nameserver sockets are read with */
+/* recvmmsg(), and the requests sent during one run of the event loop */
+/* go out together from tx_flush with sendmmsg().  With */
+/* EVDNS_SOPT_UDP_BATCH_SIZE above 1, a server port reads requests the */
+/* same way, and the replies given while they are handled are sent */
+/* together afterwards.  Without these calls, datagrams are read and */
+/* written one at a time whatever the size. */
+
+#ifdef EVDNS_USE_MMSG
+static void
+udp_batch_free(struct udp_batch *b)
+{
+	if (b->msgs)
+		mm_free(b->msgs);
+	if (b->iovs)
+		mm_free(b->iovs);
+	if (b->addrs)
+		mm_free(b->addrs);
+	if (b->packets)
+		mm_free(b->packets);
+	memset(b, 0, sizeof(*b));
+}
+
+/* a size of 1 frees the buffers */
+static int
+udp_batch_resize(struct udp_batch *b, int size)
+{
+	struct udp_batch n;
+
+	memset(&n, 0, sizeof(n));
+	if (size > 1) {
+		n.size = size;
+		n.msgs = mm_calloc(size, sizeof(*n.msgs));
+		n.iovs = mm_calloc(size, sizeof(*n.iovs));
+		n.addrs = mm_calloc(size, sizeof(*n.addrs));
+		n.packets = mm_malloc(size * EVDNS_UDP_PACKET_SIZE);
+		if (!n.msgs || !n.iovs || !n.addrs || !n.packets) {
+			event_warn("%s: calloc", __func__);
+			udp_batch_free(&n);
+			return -1;
+		}
+	}
+	udp_batch_free(b);
+	*b = n;
+	return 0;
+}
+
+/* message i of b is len bytes of data, to or from addr */
+static void
+udp_batch_set(struct udp_batch *b, int i, void *data, size_t len,
+    void *addr, ev_socklen_t addrlen)
+{
+	struct msghdr *hdr = &b->msgs[i].msg_hdr;
+
+	b->iovs[i].iov_base = data;
+	b->iovs[i].iov_len = len;
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->msg_name = addr;
+	hdr->msg_namelen = addrlen;
+	hdr->msg_iov = &b->iovs[i];
+	hdr->msg_iovlen = 1;
+}
+
+/* read up to b->size datagrams; returns how many, or -1 */
+static int
+udp_batch_recv(struct udp_batch *b, evutil_socket_t fd)
+{
+	int i;
+
+	for (i = 0; i < b->size; ++i)
+		udp_batch_set(b, i, b->packets + i * EVDNS_UDP_PACKET_SIZE,
+		    EVDNS_UDP_PACKET_SIZE, &b->addrs[i], sizeof(b->addrs[i]));
+	return recvmmsg(fd, b->msgs, b->size, 0, NULL);
+}
+
+/* send the tx_queue of a nameserver socket */
+static void
+nameserver_tx_flush(struct nameserver_socket *s)
+{
+	struct nameserver *ns = s->ns;
+	struct udp_batch *b = &ns->base->udp_batch;
+	struct request *req;
+	int n, r;
+
+	ASSERT_LOCKED(ns->base);
+	while (!TAILQ_EMPTY(&s->tx_queue)) {
+		n = 0;
+		TAILQ_FOREACH(req, &s->tx_queue, tx_next) {
+			if (n == b->size)
+				break;
+			udp_batch_set(b, n++, req->request, req->request_len,
+			    &ns->address, ns->addrlen);
+		}
+		r = sendmmsg(s->fd, b->msgs, n, 0);
+		if (r < 0) {
+			int err = evutil_socket_geterror(s->fd);
+			int retriable = EVUTIL_ERR_RW_RETRIABLE(err);
+			while ((req = TAILQ_FIRST(&s->tx_queue))) {
+				request_tx_dequeue(req);
+				if (retriable) {
+					/* evdns_transmit() sends it again */
+					(void) evtimer_del(&req->timeout_event);
+					req->tx_count--;
+					req->transmit_me = 1;
+				}
+				/* otherwise it times out and is sent again */
+			}
+			if (retriable) {
+				ns->choked = 1;
+				nameserver_write_waiting(s, 1);
+			} else {
+				nameserver_failed(ns,
+				    evutil_socket_error_to_string(err));
+			}
+			return;
+		}
+		while (r--)
+			request_tx_dequeue(TAILQ_FIRST(&s->tx_queue));
+	}
+}
+
+static void
+evdns_tx_flush(struct evdns_base *base)
+{
+	struct nameserver *ns = base->server_head;
+	int i;
+
+	ASSERT_LOCKED(base);
+	if (!ns)
+		return;
+	do {
+		for (i = 0; i < ns->n_sockets; ++i)
+			nameserver_tx_flush(&ns->sockets[i]);
+		ns = ns->next;
+	} while (ns != base->server_head);
+}
+
+static void
+evdns_tx_flush_cb(struct event_callback *cb, void *arg)
+{
+	struct evdns_base *base = arg;
+	(void)cb;
+
+	EVDNS_LOCK(base);
+	evdns_tx_flush(base);
+	EVDNS_UNLOCK(base);
+}
+
+/* have tx_flush send req to ns */
+static void
+request_tx_enqueue(struct request *req, struct nameserver *ns)
+{
+	TAILQ_INSERT_TAIL(&REQ_SOCKET(req, ns)->tx_queue, req, tx_next);
+	req->tx_queued = 1;
+	event_deferred_cb_schedule_(req->base->event_base,
+	    &req->base->tx_flush);
+}
+#endif
+
 /* this is called when a namesever socket is ready for reading */
 static void
-nameserver_read(struct nameserver *ns) {
+nameserver_read(struct nameserver_socket *s) {
+	struct nameserver *ns = s->ns;
 	struct sockaddr_storage ss;
 	ev_socklen_t addrlen = sizeof(ss);
-	u8 packet[1500];
+	u8 packet[EVDNS_UDP_PACKET_SIZE];
 	char addrbuf[128];
+#ifdef EVDNS_USE_MMSG
+	struct udp_batch *b = &ns->base->udp_batch;
+	int i, n;
+#endif
 	ASSERT_LOCKED(ns->base);
 
+#ifdef EVDNS_USE_MMSG
+	while (b->size > 1) {
+		n = udp_batch_recv(b, s->fd);
+		if (n < 0) {
+			int err = evutil_socket_geterror(s->fd);
+			if (EVUTIL_ERR_RW_RETRIABLE(err))
+				return;
+			nameserver_failed(ns,
+			    evutil_socket_error_to_string(err));
+			return;
+		}
+		for (i = 0; i < n; ++i) {
+			struct sockaddr *sa = (struct sockaddr *)&b->addrs[i];
+			if (evutil_sockaddr_cmp(sa,
+				(struct sockaddr*)&ns->address, 0)) {
+				log(EVDNS_LOG_WARN, "Address mismatch on "
+				    "received DNS packet.  Apparent source "
+				    "was %s", evutil_format_sockaddr_port_(
+					sa, addrbuf, sizeof(addrbuf)));
+				continue;
+			}
+			ns->timedout = 0;
+			reply_parse(ns->base, ns, s,
+			    b->packets + i * EVDNS_UDP_PACKET_SIZE,
+			    (int)b->msgs[i].msg_len);
+		}
+		/* a short batch drained the socket */
+		if (n < b->size)
+			return;
+	}
+#endif
+
 	for (;;) {
-		const int r = recvfrom(ns->socket, (void*)packet,
+		const int r = recvfrom(s->fd, (void*)packet,
 		    sizeof(packet), 0,
 		    (struct sockaddr*)&ss, &addrlen);
 		if (r < 0) {
-			int err = evutil_socket_geterror(ns->socket);
+			int err = evutil_socket_geterror(s->fd);
 			if (EVUTIL_ERR_RW_RETRIABLE(err))
 				return;
 			nameserver_failed(ns,
@@ -1413,7 +2457,7 @@ nameserver_read(struct nameserver *ns) {
 		}
 
 		ns->timedout = 0;
-		reply_parse(ns->base, packet, r);
+		reply_parse(ns->base, ns, s, packet, r);
 	}
 }
 
@@ -1421,12 +2465,42 @@ nameserver_read(struct nameserver *ns) {
 /* act accordingly. */
 static void
 server_port_read(struct evdns_server_port *s) {
-	u8 packet[1500];
+	u8 packet[EVDNS_UDP_PACKET_SIZE];
 	struct sockaddr_storage addr;
 	ev_socklen_t addrlen;
 	int r;
+#ifdef EVDNS_USE_MMSG
+	struct udp_batch *b = &s->udp_batch;
+	int i, n;
+#endif
 	ASSERT_LOCKED(s);
 
+#ifdef EVDNS_USE_MMSG
+	while (b->size > 1 && !s->closing) {
+		n = udp_batch_recv(b, s->socket);
+		if (n < 0) {
+			int err = evutil_socket_geterror(s->socket);
+			if (EVUTIL_ERR_RW_RETRIABLE(err))
+				return;
+			log(EVDNS_LOG_WARN,
+			    "Error %s (%d) while reading request.",
+			    evutil_socket_error_to_string(err), err);
+			return;
+		}
+		s->batching = 1;
+		for (i = 0; i < n && !s->closing; ++i)
+			request_parse(b->packets + i * EVDNS_UDP_PACKET_SIZE,
+			    (int)b->msgs[i].msg_len, s, NULL,
+			    (struct sockaddr *)&b->addrs[i],
+			    b->msgs[i].msg_hdr.msg_namelen);
+		s->batching = 0;
+		if (s->pending_replies)
+			server_port_flush(s);
+		if (n < b->size)
+			return;
+	}
+#endif
+
 	for (;;) {
 		addrlen = sizeof(struct sockaddr_storage);
 		r = recvfrom(s->socket, (void*)packet, sizeof(packet), 0,
@@ -1440,28 +2514,63 @@ server_port_read(struct evdns_server_port *s) {
 			    evutil_socket_error_to_string(err), err);
 			return;
 		}
-		request_parse(packet, r, s, (struct sockaddr*) &addr, addrlen);
+		request_parse(packet, r, s, NULL, (struct sockaddr*) &addr, addrlen);
 	}
 }
 
 /* Try to write all pending replies on a given DNS server port. */
-static void
+/* return true iff we just wound up freeing the server_port. */
+static int
 server_port_flush(struct evdns_server_port *port)
 {
 	struct server_request *req = port->pending_replies;
+	int r;
+#ifdef EVDNS_USE_MMSG
+	struct udp_batch *b = &port->udp_batch;
+	int n;
+#endif
 	ASSERT_LOCKED(port);
+
+#ifdef EVDNS_USE_MMSG
+	while (b->size > 1 && (req = port->pending_replies)) {
+		n = 0;
+		do {
+			udp_batch_set(b, n++, req->response, req->response_len,
+			    &req->addr, req->addrlen);
+			req = req->next_pending;
+		} while (n < b->size && req != port->pending_replies);
+		r = sendmmsg(port->socket, b->msgs, n, 0);
+		if (r < 0) {
+			int err = evutil_socket_geterror(port->socket);
+			if (EVUTIL_ERR_RW_RETRIABLE(err)) {
+				server_port_write_waiting(port, 1);
+				return (0);
+			}
+			log(EVDNS_LOG_WARN, "Error %s (%d) while writing response to port; dropping", evutil_socket_error_to_string(err), err);
+			r = 1;
+		}
+		while (r--) {
+			if (server_request_free(port->pending_replies))
+				return (1);
+		}
+	}
+	req = port->pending_replies;
+#endif
+
 	while (req) {
-		int r = sendto(port->socket, req->response, (int)req->response_len, 0,
+		r = sendto(port->socket, req->response, (int)req->response_len, 0,
 			   (struct sockaddr*) &req->addr, (ev_socklen_t)req->addrlen);
 		if (r < 0) {
 			int err = evutil_socket_geterror(port->socket);
-			if (EVUTIL_ERR_RW_RETRIABLE(err))
-				return;
+			if (EVUTIL_ERR_RW_RETRIABLE(err)) {
+				server_port_write_waiting(port, 1);
+				return (0);
+			}
 			log(EVDNS_LOG_WARN, "Error %s (%d) while writing response to port; dropping", evutil_socket_error_to_string(err), err);
 		}
 		if (server_request_free(req)) {
 			/* we released the last reference to req->port. */
-			return;
+			return (1);
 		} else {
 			EVUTIL_ASSERT(req != port->pending_replies);
 			req = port->pending_replies;
@@ -1469,75 +2578,407 @@ server_port_flush(struct evdns_server_port *port)
 	}
 
 	/* We have no more pending requests; stop listening for 'writeable' events. */
-	(void) event_del(&port->event);
-	event_assign(&port->event, port->event_base,
-				 port->socket, EV_READ | EV_PERSIST,
-				 server_port_ready_callback, port);
+	server_port_write_waiting(port, 0);
+	return (0);
+}
+
+/* set if we are waiting for the ability to write to this server port. */
+static void
+server_port_write_waiting(struct evdns_server_port *port, char waiting)
+{
+	ASSERT_LOCKED(port);
+	if (port->choked == waiting)
+		return;
 
+	port->choked = waiting;
+	(void) event_del(&port->event);
+	event_assign(&port->event, port->event_base, port->socket,
+	    (port->closing ? 0 : EV_READ) | (waiting ? EV_WRITE : 0) | EV_PERSIST,
+	    server_port_ready_callback, port);
 	if (event_add(&port->event, NULL) < 0) {
 		log(EVDNS_LOG_WARN, "Error from libevent when adding event for DNS server.");
 		/* ???? Do more? */
 	}
 }
 
-/* set if we are waiting for the ability to write to this server. */
-/* if waiting is true then we ask libevent for EV_WRITE events, otherwise */
-/* we stop these events. */
+/* set if we are waiting for the ability to write to this server socket. */
+/* if waiting is true then we ask libevent for EV_WRITE events, otherwise */
+/* we stop these events. */
+static void
+nameserver_write_waiting(struct nameserver_socket *s, char waiting) {
+	struct nameserver *ns = s->ns;
+	ASSERT_LOCKED(ns->base);
+	if (s->write_waiting == waiting) return;
+
+	s->write_waiting = waiting;
+	(void) event_del(&s->event);
+	event_assign(&s->event, ns->base->event_base,
+	    s->fd, EV_READ | (waiting ? EV_WRITE : 0) | EV_PERSIST,
+	    nameserver_ready_callback, s);
+	if (event_add(&s->event, NULL) < 0) {
+		char addrbuf[128];
+		log(EVDNS_LOG_WARN, "Error from libevent when adding event for %s",
+		    evutil_format_sockaddr_port_(
+			    (struct sockaddr *)&ns->address,
+			    addrbuf, sizeof(addrbuf)));
+		/* ???? Do more? */
+	}
+}
+
+/* a callback function. Called by libevent when the kernel says that */
+/* a nameserver socket is ready for writing or reading */
+static void
+nameserver_ready_callback(evutil_socket_t fd, short events, void *arg) {
+	struct nameserver_socket *s = arg;
+	struct nameserver *ns = s->ns;
+	(void)fd;
+
+	EVDNS_LOCK(ns->base);
+	if (events & EV_WRITE) {
+		ns->choked = 0;
+		if (!evdns_transmit(ns->base)) {
+			nameserver_write_waiting(s, 0);
+		}
+	}
+	if (events & EV_READ) {
+		nameserver_read(s);
+	}
+	EVDNS_UNLOCK(ns->base);
+}
+
+/* a callback function. Called by libevent when the kernel says that */
+/* a server socket is ready for writing or reading. */
+static void
+server_port_ready_callback(evutil_socket_t fd, short events, void *arg) {
+	struct evdns_server_port *port = (struct evdns_server_port *) arg;
+	(void) fd;
+
+	EVDNS_LOCK(port);
+	/* the callback of a request may close the port */
+	++port->refcnt;
+	if (events & EV_WRITE) {
+		server_port_flush(port);
+	}
+	if (events & EV_READ) {
+		server_port_read(port);
+	}
+	if (--port->refcnt == 0) {
+		EVDNS_UNLOCK(port);
+		server_port_free(port);
+		return;
+	}
+	EVDNS_UNLOCK(port);
+}
+
+/* ================================================================= */
+/* TCP */
+/* */
+/* Messages over TCP are prefixed with their two-byte length (RFC 1035, */
+/* 4.2.2).  A nameserver has at most one connection, opened by the first */
+/* request that needs it and closed once it has been idle for */
+/* tcp-idle-timeout.  Any number of requests can be outstanding on it: */
+/* the replies are matched to them by transaction id, as over UDP */
+/* (RFC 7766, 6.2.1).  Server ports with a listener work the same way. */
+
+/* a bufferevent for a TCP connection on fd; with locking, it has a lock */
+/* of its own and runs its callbacks without it, since they take ours */
+static struct bufferevent *
+tcp_bufferevent_new(struct event_base *base, evutil_socket_t fd,
+    int threadsafe)
+{
+	int options = BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS;
+	if (threadsafe)
+		options |= BEV_OPT_THREADSAFE | BEV_OPT_UNLOCK_CALLBACKS;
+	return bufferevent_socket_new(base, fd, options);
+}
+
+static void
+tcp_connection_close(struct tcp_connection *conn)
+{
+	if (conn->bev) {
+		bufferevent_free(conn->bev);
+		conn->bev = NULL;
+	}
+	conn->awaiting_packet_size = 0;
+}
+
+/* Takes the next message off conn. */
+/* */
+/* return: */
+/*   1 *msg (to be freed) and *len are set */
+/*   0 the message is not complete yet */
+/*  -1 error */
+static int
+tcp_read_message(struct tcp_connection *conn, u8 **msg, u16 *len)
+{
+	struct evbuffer *input = bufferevent_get_input(conn->bev);
+
+	if (!conn->awaiting_packet_size) {
+		u16 n;
+		if (evbuffer_get_length(input) < sizeof(n))
+			return 0;
+		evbuffer_remove(input, &n, sizeof(n));
+		conn->awaiting_packet_size = ntohs(n);
+		if (!conn->awaiting_packet_size)
+			return -1;
+	}
+	if (evbuffer_get_length(input) < conn->awaiting_packet_size)
+		return 0;
+
+	*len = conn->awaiting_packet_size;
+	conn->awaiting_packet_size = 0;
+	if (!(*msg = mm_malloc(*len))) {
+		event_warn("%s: malloc", __func__);
+		return -1;
+	}
+	evbuffer_remove(input, *msg, *len);
+	return 1;
+}
+
+static int
+tcp_write_message(struct tcp_connection *conn, const void *msg, size_t len)
+{
+	u16 n = htons((u16)len);
+	EVUTIL_ASSERT(len <= 65535);
+	if (bufferevent_write(conn->bev, &n, sizeof(n)) < 0 ||
+	    bufferevent_write(conn->bev, msg, len) < 0)
+		return -1;
+	return 0;
+}
+
+/* true iff a request is waiting for a reply over ns's connection */
+static int
+nameserver_tcp_busy(struct nameserver *ns)
+{
+	struct evdns_base *base = ns->base;
+	int i;
+
+	ASSERT_LOCKED(base);
+	for (i = 0; i < base->n_req_heads; ++i) {
+		struct request *req = base->req_heads[i];
+		struct request *const started_at = req;
+		if (!req)
+			continue;
+		do {
+			if (req->ns == ns && req->usevc)
+				return 1;
+			req = req->next;
+		} while (req != started_at);
+	}
+	return 0;
+}
+
 static void
-nameserver_write_waiting(struct nameserver *ns, char waiting) {
-	ASSERT_LOCKED(ns->base);
-	if (ns->write_waiting == waiting) return;
-
-	ns->write_waiting = waiting;
-	(void) event_del(&ns->event);
-	event_assign(&ns->event, ns->base->event_base,
-	    ns->socket, EV_READ | (waiting ? EV_WRITE : 0) | EV_PERSIST,
-	    nameserver_ready_callback, ns);
-	if (event_add(&ns->event, NULL) < 0) {
+nameserver_tcp_read_cb(struct bufferevent *bev, void *arg)
+{
+	struct nameserver *ns = arg;
+	u8 *packet;
+	u16 len;
+	int r;
+	(void)bev;
+
+	EVDNS_LOCK(ns->base);
+	while ((r = tcp_read_message(&ns->connection, &packet, &len)) > 0) {
+		ns->timedout = 0;
+		reply_parse(ns->base, ns, NULL, packet, len);
+		mm_free(packet);
+	}
+	if (r < 0) {
 		char addrbuf[128];
-		log(EVDNS_LOG_WARN, "Error from libevent when adding event for %s",
+		log(EVDNS_LOG_WARN, "Bad message over TCP from %s",
 		    evutil_format_sockaddr_port_(
 			    (struct sockaddr *)&ns->address,
 			    addrbuf, sizeof(addrbuf)));
-		/* ???? Do more? */
+		tcp_connection_close(&ns->connection);
 	}
+	EVDNS_UNLOCK(ns->base);
 }
 
-/* a callback function. Called by libevent when the kernel says that */
-/* a nameserver socket is ready for writing or reading */
 static void
-nameserver_ready_callback(evutil_socket_t fd, short events, void *arg) {
-	struct nameserver *ns = (struct nameserver *) arg;
-	(void)fd;
+nameserver_tcp_event_cb(struct bufferevent *bev, short events, void *arg)
+{
+	struct nameserver *ns = arg;
+	char addrbuf[128];
+	(void)bev;
 
 	EVDNS_LOCK(ns->base);
-	if (events & EV_WRITE) {
-		ns->choked = 0;
-		if (!evdns_transmit(ns->base)) {
-			nameserver_write_waiting(ns, 0);
-		}
-	}
-	if (events & EV_READ) {
-		nameserver_read(ns);
+	if (events & BEV_EVENT_CONNECTED) {
+		log(EVDNS_LOG_DEBUG, "Connected to %s over TCP",
+		    evutil_format_sockaddr_port_(
+			    (struct sockaddr *)&ns->address,
+			    addrbuf, sizeof(addrbuf)));
+	} else if ((events & BEV_EVENT_TIMEOUT) && nameserver_tcp_busy(ns)) {
+		/* not idle: the requests time out on their own */
+		bufferevent_enable(ns->connection.bev, EV_READ);
+	} else {
+		/* The requests still waiting for a reply on the connection */
+		/* are sent again when they time out. */
+		log(EVDNS_LOG_DEBUG, "Closing TCP connection to %s (%s)",
+		    evutil_format_sockaddr_port_(
+			    (struct sockaddr *)&ns->address,
+			    addrbuf, sizeof(addrbuf)),
+		    (events & BEV_EVENT_TIMEOUT) ? "idle" :
+		    (events & BEV_EVENT_EOF) ? "closed by the server" :
+		    evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+		tcp_connection_close(&ns->connection);
 	}
 	EVDNS_UNLOCK(ns->base);
 }
 
-/* a callback function. Called by libevent when the kernel says that */
-/* a server socket is ready for writing or reading. */
+static int
+nameserver_tcp_connect(struct nameserver *ns)
+{
+	struct evdns_base *base = ns->base;
+	struct tcp_connection *conn = &ns->connection;
+	evutil_socket_t fd;
+
+	ASSERT_LOCKED(base);
+	fd = evutil_socket_(ns->address.ss_family,
+	    SOCK_STREAM|EVUTIL_SOCK_NONBLOCK|EVUTIL_SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	if (base->global_outgoing_addrlen &&
+	    !evutil_sockaddr_is_loopback_((struct sockaddr *)&ns->address) &&
+	    bind(fd, (struct sockaddr*)&base->global_outgoing_address,
+		base->global_outgoing_addrlen) < 0) {
+		log(EVDNS_LOG_WARN, "Couldn't bind to outgoing address");
+		evutil_closesocket(fd);
+		return -1;
+	}
+
+	conn->bev = tcp_bufferevent_new(base->event_base, fd,
+	    EVDNS_THREADSAFE(base));
+	if (!conn->bev) {
+		evutil_closesocket(fd);
+		return -1;
+	}
+	bufferevent_setcb(conn->bev, nameserver_tcp_read_cb, NULL,
+	    nameserver_tcp_event_cb, ns);
+	if (evutil_timerisset(&base->global_tcp_idle_timeout))
+		bufferevent_set_timeouts(conn->bev,
+		    &base->global_tcp_idle_timeout, NULL);
+	if (bufferevent_socket_connect(conn->bev,
+		(struct sockaddr *)&ns->address, ns->addrlen) < 0 ||
+	    bufferevent_enable(conn->bev, EV_READ) < 0) {
+		tcp_connection_close(conn);
+		return -1;
+	}
+	return 0;
+}
+
+/* drops a reference to client */
+/* */
+/* return true iff we just wound up freeing the server_port. */
+static int
+client_tcp_connection_decref(struct client_tcp_connection *client)
+{
+	struct evdns_server_port *port = client->port;
+
+	ASSERT_LOCKED(port);
+	if (--client->refcnt)
+		return 0;
+	EVUTIL_ASSERT(!client->connection.bev);
+	TAILQ_REMOVE(&port->client_connections, client, next);
+	mm_free(client);
+	if (--port->refcnt)
+		return 0;
+	EVDNS_UNLOCK(port);
+	server_port_free(port);
+	return 1;
+}
+
+/* return true iff we just wound up freeing the server_port. */
+static int
+client_tcp_connection_close(struct client_tcp_connection *client)
+{
+	if (!client->connection.bev)
+		return 0;
+	tcp_connection_close(&client->connection);
+	return client_tcp_connection_decref(client);
+}
+
 static void
-server_port_ready_callback(evutil_socket_t fd, short events, void *arg) {
-	struct evdns_server_port *port = (struct evdns_server_port *) arg;
-	(void) fd;
+server_tcp_read_cb(struct bufferevent *bev, void *arg)
+{
+	struct client_tcp_connection *client = arg;
+	struct evdns_server_port *port = client->port;
+	u8 *packet;
+	u16 len;
+	int r = 0;
+	(void)bev;
 
 	EVDNS_LOCK(port);
-	if (events & EV_WRITE) {
-		port->choked = 0;
-		server_port_flush(port);
+	/* the callback may close the port, and with it the connection */
+	++client->refcnt;
+	while (client->connection.bev &&
+	    (r = tcp_read_message(&client->connection, &packet, &len)) > 0) {
+		request_parse(packet, len, port, client,
+		    (struct sockaddr *)&client->addr, client->addrlen);
+		mm_free(packet);
 	}
-	if (events & EV_READ) {
-		server_port_read(port);
+	if (r < 0) {
+		log(EVDNS_LOG_WARN, "Bad message over TCP from a client");
+		client_tcp_connection_close(client);
+	}
+	if (!client_tcp_connection_decref(client))
+		EVDNS_UNLOCK(port);
+}
+
+static void
+server_tcp_event_cb(struct bufferevent *bev, short events, void *arg)
+{
+	struct client_tcp_connection *client = arg;
+	struct evdns_server_port *port = client->port;
+	(void)bev;
+
+	EVDNS_LOCK(port);
+	if ((events & BEV_EVENT_TIMEOUT) && client->refcnt > 1) {
+		/* still answering: not idle */
+		bufferevent_enable(client->connection.bev, EV_READ);
+	} else if (client_tcp_connection_close(client)) {
+		return;
+	}
+	EVDNS_UNLOCK(port);
+}
+
+static void
+server_port_accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
+    struct sockaddr *addr, int socklen, void *arg)
+{
+	struct evdns_server_port *port = arg;
+	struct client_tcp_connection *client;
+	(void)listener;
+
+	EVDNS_LOCK(port);
+	if (!(client = mm_calloc(1, sizeof(*client)))) {
+		event_warn("%s: calloc", __func__);
+		goto err;
 	}
+	client->connection.bev = tcp_bufferevent_new(port->event_base, fd,
+	    EVDNS_THREADSAFE(port));
+	if (!client->connection.bev) {
+		mm_free(client);
+		goto err;
+	}
+	if (socklen > (int)sizeof(client->addr))
+		socklen = sizeof(client->addr);
+	memcpy(&client->addr, addr, socklen);
+	client->addrlen = socklen;
+	client->port = port;
+	client->refcnt = 1;
+	++port->refcnt;
+	TAILQ_INSERT_TAIL(&port->client_connections, client, next);
+
+	bufferevent_setcb(client->connection.bev, server_tcp_read_cb, NULL,
+	    server_tcp_event_cb, client);
+	bufferevent_set_timeouts(client->connection.bev,
+	    &port->tcp_idle_timeout, NULL);
+	if (bufferevent_enable(client->connection.bev, EV_READ) < 0)
+		client_tcp_connection_close(client);
+	EVDNS_UNLOCK(port);
+	return;
+err:
+	evutil_closesocket(fd);
 	EVDNS_UNLOCK(port);
 }
 
@@ -1756,11 +3197,48 @@ evdns_add_server_port(evutil_socket_t socket, int flags, evdns_request_callback_
 	return evdns_add_server_port_with_base(NULL, socket, flags, cb, user_data);
 }
 
+/* exported function */
+struct evdns_server_port *
+evdns_add_server_port_with_listener(struct event_base *base, struct evconnlistener *listener, int flags, evdns_request_callback_fn_type cb, void *user_data)
+{
+	struct evdns_server_port *port;
+	if (flags)
+		return NULL; /* flags not yet implemented */
+	if (!(port = mm_calloc(1, sizeof(struct evdns_server_port))))
+		return NULL;
+
+	port->socket = -1;
+	port->refcnt = 1;
+	port->user_callback = cb;
+	port->user_data = user_data;
+	port->event_base = base ? base : evconnlistener_get_base(listener);
+	port->listener = listener;
+	TAILQ_INIT(&port->client_connections);
+	port->tcp_idle_timeout.tv_sec = EVDNS_TCP_IDLE_TIMEOUT;
+
+	EVTHREAD_ALLOC_LOCK(port->lock, EVTHREAD_LOCKTYPE_RECURSIVE);
+	evconnlistener_set_cb(listener, server_port_accept_cb, port);
+	return port;
+}
+
 /* exported function */
 void
 evdns_close_server_port(struct evdns_server_port *port)
 {
+	struct client_tcp_connection *client, *next;
+
 	EVDNS_LOCK(port);
+	if (port->listener) {
+		evconnlistener_free(port->listener);
+		port->listener = NULL;
+		/* the requests that are still being answered keep their
+		 * connection until they are done with it */
+		for (client = TAILQ_FIRST(&port->client_connections); client;
+		     client = next) {
+			next = TAILQ_NEXT(client, next);
+			client_tcp_connection_close(client);
+		}
+	}
 	if (--port->refcnt == 0) {
 		EVDNS_UNLOCK(port);
 		server_port_free(port);
@@ -1770,6 +3248,363 @@ evdns_close_server_port(struct evdns_server_port *port)
 	}
 }
 
+/* exported function */
+int
+evdns_server_port_set_option(struct evdns_server_port *port,
+    enum evdns_server_option option, size_t value)
+{
+	int res = 0;
+
+	EVDNS_LOCK(port);
+	switch (option) {
+	case EVDNS_SOPT_TCP_IDLE_TIMEOUT:
+		if (!port->listener) {
+			res = -1;
+			break;
+		}
+		port->tcp_idle_timeout.tv_sec = (long)value;
+		port->tcp_idle_timeout.tv_usec = 0;
+		break;
+	case EVDNS_SOPT_UDP_BATCH_SIZE:
+		/* the buffers are in use while a batch is being read */
+		if (port->listener || port->batching ||
+		    value < 1 || value > EVDNS_MAX_UDP_BATCH) {
+			res = -1;
+			break;
+		}
+#ifdef EVDNS_USE_MMSG
+		res = udp_batch_resize(&port->udp_batch, (int)value);
+#endif
+		break;
+	default:
+		res = -1;
+		break;
+	}
+	EVDNS_UNLOCK(port);
+	return res;
+}
+
+/* ================================================================= */
+/* Zones */
+/* */
+/* An evdns_zone holds records that server ports answer from without */
+/* calling back into the application.  The records of each RRset are */
+/* kept as they go in the answer section of a reply, with their owner */
+/* name as a pointer to the question, so that a reply is the header, */
+/* the question copied from the request, and one memcpy. */
+
+/* One RRset of a name in a zone. */
+struct zone_rrset {
+	u16 type;
+	u16 class;
+	u16 n_rrs;
+	u16 len;  /* of wire */
+	u8 *wire;  /* the records, in wire format */
+};
+
+/* A name in a zone, with all of its RRsets. */
+struct zone_name {
+	HT_ENTRY(zone_name) node;
+	struct zone_rrset *rrsets;
+	int n_rrsets;
+	int len;  /* of name */
+	u8 *name;  /* wire format, lower case; stored right after the entry */
+};
+
+struct evdns_zone {
+	HT_HEAD(evdns_zone_map, zone_name) names;
+#ifndef EVENT__DISABLE_THREAD_SUPPORT
+	void *lock;
+#endif
+};
+
+static unsigned
+zone_name_hash(const struct zone_name *n)
+{
+	/* ht_string_hash_(), for a name that may hold 0 bytes */
+	unsigned h = (unsigned)n->name[0] << 7;
+	int i;
+	for (i = 0; i < n->len; ++i)
+		h = (1000003*h) ^ n->name[i];
+	return h ^ (unsigned)n->len;
+}
+
+static int
+zone_name_eq(const struct zone_name *a, const struct zone_name *b)
+{
+	return a->len == b->len && !memcmp(a->name, b->name, a->len);
+}
+
+HT_PROTOTYPE(evdns_zone_map, zone_name, node, zone_name_hash, zone_name_eq)
+HT_GENERATE(evdns_zone_map, zone_name, node, zone_name_hash, zone_name_eq,
+    0.5, mm_malloc, mm_realloc, mm_free)
+
+/* exported function */
+struct evdns_zone *
+evdns_zone_new(void)
+{
+	struct evdns_zone *zone = mm_calloc(1, sizeof(struct evdns_zone));
+	if (!zone) {
+		event_warn("%s: calloc", __func__);
+		return (NULL);
+	}
+	HT_INIT(evdns_zone_map, &zone->names);
+	EVTHREAD_ALLOC_LOCK(zone->lock, EVTHREAD_LOCKTYPE_RECURSIVE);
+	return (zone);
+}
+
+/* exported function */
+void
+evdns_zone_free(struct evdns_zone *zone)
+{
+	struct zone_name **np, *n;
+	int i;
+
+	for (np = HT_START(evdns_zone_map, &zone->names); np; ) {
+		n = *np;
+		np = HT_NEXT_RMV(evdns_zone_map, &zone->names, np);
+		for (i = 0; i < n->n_rrsets; ++i)
+			mm_free(n->rrsets[i].wire);
+		mm_free(n->rrsets);
+		mm_free(n);
+	}
+	HT_CLEAR(evdns_zone_map, &zone->names);
+	EVTHREAD_FREE_LOCK(zone->lock, EVTHREAD_LOCKTYPE_RECURSIVE);
+	mm_free(zone);
+}
+
+/* exported function */
+int
+evdns_zone_add_record(struct evdns_zone *zone, const char *name, int type,
+    int class, int ttl, int datalen, int is_name, const char *data)
+{
+	u8 key[256], rdata[256];
+	const u8 *rd = (const u8 *)data;
+	struct zone_name find, *n;
+	struct zone_rrset *set = NULL;
+	off_t len;
+	size_t rr_len;
+	u8 *wire, *p;
+	u16 t_;
+	u32 t32_;
+	int i, res = -1;
+
+	if ((len = dnsname_to_labels(key, sizeof(key), 0, name, strlen(name),
+		    NULL)) < 0)
+		return (-1);
+	for (i = 0; i < len; ++i)
+		key[i] = EVUTIL_TOLOWER_(key[i]);
+	if (is_name) {
+		off_t r = dnsname_to_labels(rdata, sizeof(rdata), 0, data,
+		    strlen(data), NULL);
+		if (r < 0)
+			return (-1);
+		datalen = (int)r;
+		rd = rdata;
+	}
+	if (datalen < 0 || datalen > 65535)
+		return (-1);
+	/* a pointer to the question, type, class, ttl, rdlength, rdata */
+	rr_len = 12 + (size_t)datalen;
+
+	EVDNS_LOCK(zone);
+	find.name = key;
+	find.len = (int)len;
+	if (!(n = HT_FIND(evdns_zone_map, &zone->names, &find))) {
+		if (!(n = mm_calloc(1, sizeof(struct zone_name) + len))) {
+			event_warn("%s: calloc", __func__);
+			goto done;
+		}
+		n->name = (u8 *)(n + 1);
+		n->len = (int)len;
+		memcpy(n->name, key, len);
+		HT_INSERT(evdns_zone_map, &zone->names, n);
+	}
+	for (i = 0; i < n->n_rrsets; ++i) {
+		if (n->rrsets[i].type == type && n->rrsets[i].class == class) {
+			set = &n->rrsets[i];
+			break;
+		}
+	}
+	if (!set) {
+		struct zone_rrset *sets = mm_realloc(n->rrsets,
+		    (n->n_rrsets + 1) * sizeof(struct zone_rrset));
+		if (!sets) {
+			event_warn("%s: realloc", __func__);
+			goto done;
+		}
+		n->rrsets = sets;
+		set = &n->rrsets[n->n_rrsets++];
+		memset(set, 0, sizeof(*set));
+		set->type = (u16)type;
+		set->class = (u16)class;
+	}
+	/* the whole RRset has to fit in a reply over TCP */
+	if (set->len + rr_len > 65535 - 12 - 4 - 255)
+		goto done;
+	if (!(wire = mm_realloc(set->wire, set->len + rr_len))) {
+		event_warn("%s: realloc", __func__);
+		goto done;
+	}
+	set->wire = wire;
+	p = wire + set->len;
+	t_ = htons(0xc000 | 12);
+	memcpy(p, &t_, 2);
+	t_ = htons((u16)type);
+	memcpy(p + 2, &t_, 2);
+	t_ = htons((u16)class);
+	memcpy(p + 4, &t_, 2);
+	t32_ = htonl((u32)ttl);
+	memcpy(p + 6, &t32_, 4);
+	t_ = htons((u16)datalen);
+	memcpy(p + 10, &t_, 2);
+	if (datalen)
+		memcpy(p + 12, rd, datalen);
+	set->len += (u16)rr_len;
+	++set->n_rrs;
+	res = 0;
+done:
+	EVDNS_UNLOCK(zone);
+	return (res);
+}
+
+/* exported function */
+void
+evdns_server_port_set_zone(struct evdns_server_port *port,
+    struct evdns_zone *zone)
+{
+	EVDNS_LOCK(port);
+	port->zone = zone;
+	EVDNS_UNLOCK(port);
+}
+
+/* Answer the request (packet,length) from the zone of port, if it has the */
+/* name asked about.  Return 0 if it did, or -1 to leave the request to */
+/* the callback of the port. */
+static int
+zone_answer(u8 *packet, int length, struct evdns_server_port *port,
+    struct client_tcp_connection *client, struct sockaddr *addr,
+    ev_socklen_t addrlen)
+{
+	struct evdns_zone *zone = port->zone;
+	u8 key[256], udp_buf[512];
+	u8 *buf = udp_buf;
+	struct zone_name find, *n;
+	const struct zone_rrset *set = NULL;
+	struct server_request *req;
+	u16 flags, type, class, n_rrs = 0;
+	u16 t_;
+	int i, j = 12, namelen = 0;
+	size_t len;
+
+	ASSERT_LOCKED(port);
+
+	if (length < 12)
+		return (-1);
+	flags = (packet[2] << 8) | packet[3];
+	if ((flags & (_QR_MASK|_OP_MASK)) || packet[4] || packet[5] != 1)
+		return (-1);
+	/* the name of the only question, which is never compressed */
+	for (;;) {
+		int label;
+		if (j >= length)
+			return (-1);
+		label = packet[j];
+		if (label > 63 || j + 1 + label > length ||
+		    namelen + 1 + label > (int)sizeof(key))
+			return (-1);
+		for (i = 0; i <= label; ++i)
+			key[namelen++] = EVUTIL_TOLOWER_(packet[j++]);
+		if (!label)
+			break;
+	}
+	if (j + 4 > length)
+		return (-1);
+	type = (packet[j] << 8) | packet[j + 1];
+	class = (packet[j + 2] << 8) | packet[j + 3];
+	j += 4;
+
+	EVDNS_LOCK(zone);
+	find.name = key;
+	find.len = namelen;
+	if (!(n = HT_FIND(evdns_zone_map, &zone->names, &find))) {
+		EVDNS_UNLOCK(zone);
+		return (-1);
+	}
+	/* the RRset asked for, or else a CNAME; a name that has neither */
+	/* gets an answer without records */
+	for (i = 0; i < n->n_rrsets; ++i) {
+		if (n->rrsets[i].class != class)
+			continue;
+		if (n->rrsets[i].type == type) {
+			set = &n->rrsets[i];
+			break;
+		}
+		if (n->rrsets[i].type == EVDNS_TYPE_CNAME)
+			set = &n->rrsets[i];
+	}
+
+	len = j + (set ? set->len : 0);
+	flags = _QR_MASK | _AA_MASK | (flags & (_RD_MASK|_CD_MASK));
+	if (len > (client ? 65535 : sizeof(udp_buf))) {
+		/* only the question fits */
+		len = j;
+		flags |= _TC_MASK;
+		set = NULL;
+	}
+	if (len > sizeof(udp_buf) && !(buf = mm_malloc(len))) {
+		EVDNS_UNLOCK(zone);
+		return (-1);
+	}
+	memcpy(buf, packet, j);
+	t_ = htons(flags);
+	memcpy(buf + 2, &t_, 2);
+	if (set) {
+		memcpy(buf + j, set->wire, set->len);
+		n_rrs = set->n_rrs;
+	}
+	EVDNS_UNLOCK(zone);
+	t_ = htons(n_rrs);
+	memcpy(buf + 6, &t_, 2);
+	memset(buf + 8, 0, 4);  /* no authority or additional records */
+
+	if (!client && !port->batching) {
+		if (sendto(port->socket, (void *)buf, (int)len, 0, addr,
+			addrlen) >= 0)
+			return (0);
+		if (!EVUTIL_ERR_RW_RETRIABLE(
+			evutil_socket_geterror(port->socket)))
+			return (0);
+	}
+
+	/* it has to wait, so it goes out as a server_request does */
+	if (!(req = mm_calloc(1, sizeof(struct server_request)))) {
+		if (buf != udp_buf)
+			mm_free(buf);
+		return (0);
+	}
+	if (buf == udp_buf) {
+		if (!(buf = mm_malloc(len))) {
+			mm_free(req);
+			return (0);
+		}
+		memcpy(buf, udp_buf, len);
+	}
+	req->response = (char *)buf;
+	req->response_len = len;
+	req->trans_id = (packet[0] << 8) | packet[1];
+	memcpy(&req->addr, addr, addrlen);
+	req->addrlen = addrlen;
+	req->port = port;
+	port->refcnt++;
+	if (client) {
+		req->client = client;
+		client->refcnt++;
+	}
+	evdns_server_request_respond(&req->base, 0);
+	return (0);
+}
+
 /* exported function */
 int
 evdns_server_request_add_reply(struct evdns_server_request *req_, int section, const char *name, int type, int class, int ttl, int datalen, int is_name, const char *data)
@@ -1906,8 +3741,11 @@ evdns_server_request_set_flags(struct evdns_server_request *exreq, int flags)
 static int
 evdns_server_request_format_response(struct server_request *req, int err)
 {
-	unsigned char buf[1500];
-	size_t buf_len = sizeof(buf);
+	unsigned char udp_buf[1500];
+	unsigned char *buf = udp_buf;
+	size_t buf_len = sizeof(udp_buf);
+	/* over TCP, only the length prefix limits the size of a reply */
+	const off_t max_len = req->client ? 65535 : 512;
 	off_t j = 0, r;
 	u16 t_;
 	u32 t32_;
@@ -1917,6 +3755,12 @@ evdns_server_request_format_response(struct server_request *req, int err)
 
 	if (err < 0 || err > 15) return -1;
 
+	if (req->client) {
+		buf_len = max_len;
+		if (!(buf = mm_malloc(buf_len)))
+			return (-1);
+	}
+
 	/* Set response bit and error code; copy OPCODE and RD fields from
 	 * question; copy RA and AA if set by caller. */
 	flags = req->base.flags;
@@ -1936,6 +3780,8 @@ evdns_server_request_format_response(struct server_request *req, int err)
 		j = dnsname_to_labels(buf, buf_len, j, s, strlen(s), &table);
 		if (j < 0) {
 			dnslabel_clear(&table);
+			if (buf != udp_buf)
+				mm_free(buf);
 			return (int) j;
 		}
 		APPEND16(req->base.questions[i]->type);
@@ -1981,9 +3827,9 @@ evdns_server_request_format_response(struct server_request *req, int err)
 		}
 	}
 
-	if (j > 512) {
+	if (j > max_len) {
 overflow:
-		j = 512;
+		j = max_len;
 		buf[2] |= 0x02; /* set the truncated bit. */
 	}
 
@@ -1992,14 +3838,34 @@ overflow:
 	if (!(req->response = mm_malloc(req->response_len))) {
 		server_request_free_answers(req);
 		dnslabel_clear(&table);
+		if (buf != udp_buf)
+			mm_free(buf);
 		return (-1);
 	}
 	memcpy(req->response, buf, req->response_len);
 	server_request_free_answers(req);
 	dnslabel_clear(&table);
+	if (buf != udp_buf)
+		mm_free(buf);
 	return (0);
 }
 
+/* add req to the replies that we want to write */
+static void
+server_port_queue_reply(struct evdns_server_port *port,
+    struct server_request *req)
+{
+	if (port->pending_replies) {
+		req->prev_pending = port->pending_replies->prev_pending;
+		req->next_pending = port->pending_replies;
+		req->prev_pending->next_pending =
+			req->next_pending->prev_pending = req;
+	} else {
+		req->prev_pending = req->next_pending = req;
+		port->pending_replies = req;
+	}
+}
+
 /* exported function */
 int
 evdns_server_request_respond(struct evdns_server_request *req_, int err)
@@ -2008,37 +3874,41 @@ evdns_server_request_respond(struct evdns_server_request *req_, int err)
 	struct evdns_server_port *port = req->port;
 	int r = -1;
 
-	EVDNS_LOCK(port);
-	if (!req->response) {
-		if ((r = evdns_server_request_format_response(req, err))<0)
-			goto done;
+	EVDNS_LOCK(port);
+	if (!req->response) {
+		if ((r = evdns_server_request_format_response(req, err))<0)
+			goto done;
+	}
+
+	if (req->client) {
+		/* the connection may have been closed in the meantime */
+		if (req->client->connection.bev &&
+		    tcp_write_message(&req->client->connection,
+			req->response, req->response_len) < 0)
+			log(EVDNS_LOG_WARN, "Error while writing response over "
+			    "TCP; dropping");
+		if (server_request_free(req))
+			return 0;
+		r = 0;
+		goto done;
+	}
+
+	if (port->batching) {
+		/* server_port_read() sends it with the rest of the batch */
+		server_port_queue_reply(port, req);
+		r = 0;
+		goto done;
 	}
 
 	r = sendto(port->socket, req->response, (int)req->response_len, 0,
 			   (struct sockaddr*) &req->addr, (ev_socklen_t)req->addrlen);
 	if (r<0) {
 		int sock_err = evutil_socket_geterror(port->socket);
-		if (EVUTIL_ERR_RW_RETRIABLE(sock_err))
+		if (!EVUTIL_ERR_RW_RETRIABLE(sock_err))
 			goto done;
 
-		if (port->pending_replies) {
-			req->prev_pending = port->pending_replies->prev_pending;
-			req->next_pending = port->pending_replies;
-			req->prev_pending->next_pending =
-				req->next_pending->prev_pending = req;
-		} else {
-			req->prev_pending = req->next_pending = req;
-			port->pending_replies = req;
-			port->choked = 1;
-
-			(void) event_del(&port->event);
-			event_assign(&port->event, port->event_base, port->socket, (port->closing?0:EV_READ) | EV_WRITE | EV_PERSIST, server_port_ready_callback, port);
-
-			if (event_add(&port->event, NULL) < 0) {
-				log(EVDNS_LOG_WARN, "Error from libevent when adding event for DNS server");
-			}
-
-		}
+		server_port_queue_reply(port, req);
+		server_port_write_waiting(port, 1);
 
 		r = 1;
 		goto done;
@@ -2048,8 +3918,8 @@ evdns_server_request_respond(struct evdns_server_request *req_, int err)
 		goto done;
 	}
 
-	if (port->pending_replies)
-		server_port_flush(port);
+	if (port->pending_replies && server_port_flush(port))
+		return 0;
 
 	r = 0;
 done:
@@ -2105,6 +3975,12 @@ server_request_free(struct server_request *req)
 			else
 				req->port->pending_replies = NULL;
 		}
+		if (req->client) {
+			/* req holds the port, so this cannot free it */
+			int port_freed = client_tcp_connection_decref(req->client);
+			EVUTIL_ASSERT(!port_freed);
+			(void)port_freed;
+		}
 		rc = --req->port->refcnt;
 	}
 
@@ -2138,12 +4014,19 @@ server_port_free(struct evdns_server_port *port)
 	EVUTIL_ASSERT(port);
 	EVUTIL_ASSERT(!port->refcnt);
 	EVUTIL_ASSERT(!port->pending_replies);
+	EVUTIL_ASSERT(!port->listener);
 	if (port->socket > 0) {
 		evutil_closesocket(port->socket);
 		port->socket = -1;
 	}
-	(void) event_del(&port->event);
-	event_debug_unassign(&port->event);
+	if (event_initialized(&port->event)) {
+		/* not a TCP port */
+		(void) event_del(&port->event);
+		event_debug_unassign(&port->event);
+	}
+#ifdef EVDNS_USE_MMSG
+	udp_batch_free(&port->udp_batch);
+#endif
 	EVTHREAD_FREE_LOCK(port->lock, EVTHREAD_LOCKTYPE_RECURSIVE);
 	mm_free(port);
 }
@@ -2177,12 +4060,42 @@ static void
 evdns_request_timeout_callback(evutil_socket_t fd, short events, void *arg) {
 	struct request *const req = (struct request *) arg;
 	struct evdns_base *base = req->base;
+	struct timeval now;
+	long waited;
 
 	(void) fd;
 	(void) events;
 
-	log(EVDNS_LOG_DEBUG, "Request %p timed out", arg);
 	EVDNS_LOCK(base);
+	event_base_gettimeofday_cached(base->event_base, &now);
+	waited = usec_since(&req->tx_time, &now);
+	/* no reply for that long */
+	nameserver_rtt_sample(req->ns, waited);
+
+	if (req->hedge_pending) {
+		struct nameserver *ns = nameserver_pick_except(base, req->ns);
+		req->hedge_pending = 0;
+		req->hedged = 1;
+		(void) evtimer_del(&req->timeout_event);
+		if (ns) {
+			log(EVDNS_LOG_DEBUG, "Hedging request %p", arg);
+			request_swap_ns(req, ns);
+			evdns_request_transmit(req);
+		} else {
+			/* keep waiting for the first one */
+			struct timeval left, tv;
+			tv.tv_sec = waited / 1000000;
+			tv.tv_usec = waited % 1000000;
+			evutil_timersub(&base->global_timeout, &tv, &left);
+			if (left.tv_sec < 0)
+				evutil_timerclear(&left);
+			evtimer_add(&req->timeout_event, &left);
+		}
+		EVDNS_UNLOCK(base);
+		return;
+	}
+
+	log(EVDNS_LOG_DEBUG, "Request %p timed out", arg);
 
 	if (req->tx_count >= req->base->global_max_retransmits) {
 		struct nameserver *ns = req->ns;
@@ -2190,6 +4103,7 @@ evdns_request_timeout_callback(evutil_socket_t fd, short events, void *arg) {
 		log(EVDNS_LOG_DEBUG, "Giving up on request %p; tx_count==%d",
 		    arg, req->tx_count);
 		reply_schedule_callback(req, 0, DNS_ERR_TIMEOUT, NULL);
+		request_answer_waiters(req, 0, DNS_ERR_TIMEOUT, NULL, 0);
 
 		request_finished(req, &REQ_HEAD(req->base, req->trans_id), 1);
 		nameserver_failed(ns, "request timed out.");
@@ -2219,20 +4133,42 @@ evdns_request_timeout_callback(evutil_socket_t fd, short events, void *arg) {
 /*   2 other failure */
 static int
 evdns_request_transmit_to(struct request *req, struct nameserver *server) {
+	struct nameserver_socket *sock;
 	int r;
 	ASSERT_LOCKED(req->base);
 	ASSERT_VALID_REQUEST(req);
 
+	if (req->usevc) {
+		/* the connection buffers the request while it is not up */
+		if (!server->connection.bev && nameserver_tcp_connect(server) < 0)
+			return 2;
+		if (tcp_write_message(&server->connection, req->request,
+			req->request_len) < 0)
+			return 2;
+		return 0;
+	}
+
 	if (server->requests_inflight == 1 &&
-		req->base->disable_when_inactive &&
-		event_add(&server->event, NULL) < 0) {
-		return 1;
+		req->base->disable_when_inactive) {
+		int i;
+		for (i = 0; i < server->n_sockets; ++i)
+			if (event_add(&server->sockets[i].event, NULL) < 0)
+				return 1;
+	}
+
+#ifdef EVDNS_USE_MMSG
+	if (req->base->udp_batch.size > 1) {
+		if (!req->tx_queued)
+			request_tx_enqueue(req, server);
+		return 0;
 	}
+#endif
 
-	r = sendto(server->socket, (void*)req->request, req->request_len, 0,
+	sock = REQ_SOCKET(req, server);
+	r = sendto(sock->fd, (void*)req->request, req->request_len, 0,
 	    (struct sockaddr *)&server->address, server->addrlen);
 	if (r < 0) {
-		int err = evutil_socket_geterror(server->socket);
+		int err = evutil_socket_geterror(sock->fd);
 		if (EVUTIL_ERR_RW_RETRIABLE(err))
 			return 1;
 		nameserver_failed(req->ns, evutil_socket_error_to_string(err));
@@ -2253,6 +4189,7 @@ evdns_request_transmit_to(struct request *req, struct nameserver *server) {
 static int
 evdns_request_transmit(struct request *req) {
 	int retcode = 0, r;
+	struct timeval tv;
 
 	ASSERT_LOCKED(req->base);
 	ASSERT_VALID_REQUEST(req);
@@ -2267,7 +4204,7 @@ evdns_request_transmit(struct request *req) {
 		return 1;
 	}
 
-	if (req->ns->choked) {
+	if (req->ns->choked && !req->usevc) {
 		/* don't bother trying to write to a socket */
 		/* which we have had EAGAIN from */
 		return 1;
@@ -2278,7 +4215,7 @@ evdns_request_transmit(struct request *req) {
 	case 1:
 		/* temp failure */
 		req->ns->choked = 1;
-		nameserver_write_waiting(req->ns, 1);
+		nameserver_write_waiting(REQ_SOCKET(req, req->ns), 1);
 		return 1;
 	case 2:
 		/* failed to transmit the request entirely. we can fallthrough since
@@ -2290,7 +4227,21 @@ evdns_request_transmit(struct request *req) {
 		/* all ok */
 		log(EVDNS_LOG_DEBUG,
 		    "Setting timeout for request %p, sent to nameserver %p", req, req->ns);
-		if (evtimer_add(&req->timeout_event, &req->base->global_timeout) < 0) {
+		tv = req->base->global_timeout;
+		req->hedge_pending = 0;
+		/* a probe is only about its own nameserver */
+		if (req->base->global_hedge && !req->hedged && !req->usevc &&
+		    !req->probe && req->base->global_good_nameservers > 1) {
+			struct timeval delay;
+			nameserver_hedge_delay(req->ns, &delay);
+			if (evutil_timercmp(&delay, &tv, <)) {
+				tv = delay;
+				req->hedge_pending = 1;
+			}
+		}
+		event_base_gettimeofday_cached(req->base->event_base,
+		    &req->tx_time);
+		if (evtimer_add(&req->timeout_event, &tv) < 0) {
 			log(EVDNS_LOG_WARN,
 		      "Error from libevent when adding timer for request %p",
 			    req);
@@ -2343,12 +4294,15 @@ nameserver_send_probe(struct nameserver *const ns) {
 		    addrbuf, sizeof(addrbuf)));
 	handle = mm_calloc(1, sizeof(*handle));
 	if (!handle) return;
-	req = request_new(ns->base, handle, TYPE_A, "google.com", DNS_QUERY_NO_SEARCH, nameserver_probe_callback, ns);
+	req = request_new(ns->base, handle, TYPE_A, "google.com",
+	    DNS_QUERY_NO_SEARCH | DNS_QUERY_NO_CACHE,
+	    nameserver_probe_callback, ns);
 	if (!req) {
 		mm_free(handle);
 		return;
 	}
 	ns->probe_request = handle;
+	req->probe = 1;
 	/* we force this into the inflight queue no matter what */
 	request_trans_id_set(req, transaction_id_pick(ns->base));
 	req->ns = ns;
@@ -2424,15 +4378,14 @@ evdns_base_clear_nameservers_and_suspend(struct evdns_base *base)
 	}
 	while (1) {
 		struct nameserver *next = server->next;
-		(void) event_del(&server->event);
 		if (evtimer_initialized(&server->timeout_event))
 			(void) evtimer_del(&server->timeout_event);
 		if (server->probe_request) {
 			evdns_cancel_request(server->base, server->probe_request);
 			server->probe_request = NULL;
 		}
-		if (server->socket >= 0)
-			evutil_closesocket(server->socket);
+		nameserver_sockets_free(server);
+		tcp_connection_close(&server->connection);
 		mm_free(server);
 		if (next == started_at)
 			break;
@@ -2447,6 +4400,8 @@ evdns_base_clear_nameservers_and_suspend(struct evdns_base *base)
 		while (req) {
 			struct request *next = req->next;
 			req->tx_count = req->reissue_count = 0;
+			/* its nameserver, with the tx_queue, is gone */
+			req->tx_queued = 0;
 			req->ns = NULL;
 			/* ???? What to do about searches? */
 			(void) evtimer_del(&req->timeout_event);
@@ -2498,6 +4453,92 @@ evdns_resume(void)
 	return evdns_base_resume(current_base);
 }
 
+/* open a UDP socket for ns; returns 0 or an error of */
+/* evdns_nameserver_add_impl_() */
+static int
+nameserver_socket_open(struct nameserver *ns, struct nameserver_socket *s)
+{
+	struct evdns_base *base = ns->base;
+	struct sockaddr *address = (struct sockaddr *)&ns->address;
+	int err = 0;
+
+	s->ns = ns;
+	TAILQ_INIT(&s->tx_queue);
+	/* the kernel picks an unused, random port for each socket */
+	s->fd = evutil_socket_(address->sa_family,
+	    SOCK_DGRAM|EVUTIL_SOCK_NONBLOCK|EVUTIL_SOCK_CLOEXEC, 0);
+	if (s->fd < 0)
+		return 1;
+
+	if (base->global_outgoing_addrlen &&
+	    !evutil_sockaddr_is_loopback_(address)) {
+		struct sockaddr_storage local;
+		memcpy(&local, &base->global_outgoing_address,
+		    base->global_outgoing_addrlen);
+		/* only the first socket gets the port of bind-to */
+		if (s != ns->sockets) {
+			if (local.ss_family == AF_INET)
+				((struct sockaddr_in *)&local)->sin_port = 0;
+			else if (local.ss_family == AF_INET6)
+				((struct sockaddr_in6 *)&local)->sin6_port = 0;
+		}
+		if (bind(s->fd, (struct sockaddr*)&local,
+			base->global_outgoing_addrlen) < 0) {
+			log(EVDNS_LOG_WARN,"Couldn't bind to outgoing address");
+			err = 2;
+			goto out;
+		}
+	}
+
+	if (base->so_rcvbuf) {
+		if (setsockopt(s->fd, SOL_SOCKET, SO_RCVBUF,
+		    (void *)&base->so_rcvbuf, sizeof(base->so_rcvbuf))) {
+			log(EVDNS_LOG_WARN, "Couldn't set SO_RCVBUF to %i", base->so_rcvbuf);
+			err = -SO_RCVBUF;
+			goto out;
+		}
+	}
+	if (base->so_sndbuf) {
+		if (setsockopt(s->fd, SOL_SOCKET, SO_SNDBUF,
+		    (void *)&base->so_sndbuf, sizeof(base->so_sndbuf))) {
+			log(EVDNS_LOG_WARN, "Couldn't set SO_SNDBUF to %i", base->so_sndbuf);
+			err = -SO_SNDBUF;
+			goto out;
+		}
+	}
+
+	event_assign(&s->event, base->event_base, s->fd,
+				 EV_READ | EV_PERSIST, nameserver_ready_callback, s);
+	if (!base->disable_when_inactive && event_add(&s->event, NULL) < 0) {
+		event_debug_unassign(&s->event);
+		err = 2;
+		goto out;
+	}
+	return 0;
+
+out:
+	evutil_closesocket(s->fd);
+	return err;
+}
+
+/* close the sockets of ns */
+static void
+nameserver_sockets_free(struct nameserver *ns)
+{
+	int i;
+
+	for (i = 0; i < ns->n_sockets; ++i) {
+		struct nameserver_socket *s = &ns->sockets[i];
+		(void) event_del(&s->event);
+		event_debug_unassign(&s->event);
+		evutil_closesocket(s->fd);
+	}
+	if (ns->sockets)
+		mm_free(ns->sockets);
+	ns->sockets = NULL;
+	ns->n_sockets = 0;
+}
+
 static int
 evdns_nameserver_add_impl_(struct evdns_base *base, const struct sockaddr *address, int addrlen) {
 	/* first check to see if we already have this nameserver */
@@ -2527,46 +4568,18 @@ evdns_nameserver_add_impl_(struct evdns_base *base, const struct sockaddr *addre
 
 	evtimer_assign(&ns->timeout_event, ns->base->event_base, nameserver_prod_callback, ns);
 
-	ns->socket = evutil_socket_(address->sa_family,
-	    SOCK_DGRAM|EVUTIL_SOCK_NONBLOCK|EVUTIL_SOCK_CLOEXEC, 0);
-	if (ns->socket < 0) { err = 1; goto out1; }
-
-	if (base->global_outgoing_addrlen &&
-	    !evutil_sockaddr_is_loopback_(address)) {
-		if (bind(ns->socket,
-			(struct sockaddr*)&base->global_outgoing_address,
-			base->global_outgoing_addrlen) < 0) {
-			log(EVDNS_LOG_WARN,"Couldn't bind to outgoing address");
-			err = 2;
-			goto out2;
-		}
-	}
-
-	if (base->so_rcvbuf) {
-		if (setsockopt(ns->socket, SOL_SOCKET, SO_RCVBUF,
-		    (void *)&base->so_rcvbuf, sizeof(base->so_rcvbuf))) {
-			log(EVDNS_LOG_WARN, "Couldn't set SO_RCVBUF to %i", base->so_rcvbuf);
-			err = -SO_RCVBUF;
-			goto out2;
-		}
-	}
-	if (base->so_sndbuf) {
-		if (setsockopt(ns->socket, SOL_SOCKET, SO_SNDBUF,
-		    (void *)&base->so_sndbuf, sizeof(base->so_sndbuf))) {
-			log(EVDNS_LOG_WARN, "Couldn't set SO_SNDBUF to %i", base->so_sndbuf);
-			err = -SO_SNDBUF;
-			goto out2;
-		}
-	}
-
 	memcpy(&ns->address, address, addrlen);
 	ns->addrlen = addrlen;
 	ns->state = 1;
-	event_assign(&ns->event, ns->base->event_base, ns->socket,
-				 EV_READ | EV_PERSIST, nameserver_ready_callback, ns);
-	if (!base->disable_when_inactive && event_add(&ns->event, NULL) < 0) {
-		err = 2;
-		goto out2;
+
+	ns->sockets = mm_calloc(base->global_udp_sockets,
+	    sizeof(struct nameserver_socket));
+	if (!ns->sockets) { err = -1; goto out; }
+	while (ns->n_sockets < base->global_udp_sockets) {
+		err = nameserver_socket_open(ns, &ns->sockets[ns->n_sockets]);
+		if (err)
+			goto out;
+		++ns->n_sockets;
 	}
 
 	log(EVDNS_LOG_DEBUG, "Added nameserver %s as %p",
@@ -2587,10 +4600,8 @@ evdns_nameserver_add_impl_(struct evdns_base *base, const struct sockaddr *addre
 
 	return 0;
 
-out2:
-	evutil_closesocket(ns->socket);
-out1:
-	event_debug_unassign(&ns->event);
+out:
+	nameserver_sockets_free(ns);
 	mm_free(ns);
 	log(EVDNS_LOG_WARN, "Unable to add nameserver %s: error %d",
 	    evutil_format_sockaddr_port_(address, addrbuf, sizeof(addrbuf)), err);
@@ -2788,12 +4799,13 @@ request_new(struct evdns_base *base, struct evdns_request *handle, int type,
 	const size_t name_len = strlen(name);
 	const size_t request_max_len = evdns_request_len(name_len);
 	const u16 trans_id = issuing_now ? transaction_id_pick(base) : 0xffff;
-	/* the request data is alloced in a single block with the header */
+	/* the request data and the name are alloced in a single block with
+	 * the header */
 	struct request *const req =
-	    mm_malloc(sizeof(struct request) + request_max_len);
+	    mm_malloc(sizeof(struct request) + request_max_len + name_len + 1);
 	int rlen;
+	size_t i;
 	char namebuf[256];
-	(void) flags;
 
 	ASSERT_LOCKED(base);
 
@@ -2809,8 +4821,16 @@ request_new(struct evdns_base *base, struct evdns_request *handle, int type,
 
 	evtimer_assign(&req->timeout_event, req->base->event_base, evdns_request_timeout_callback, req);
 
+	/* the name as asked for, lower case and without a trailing dot, for
+	 * the cache and for coalescing */
+	req->name = (char *)req + sizeof(struct request) + request_max_len;
+	for (i = 0; i < name_len; ++i)
+		req->name[i] = EVUTIL_TOLOWER_(name[i]);
+	if (i && req->name[i-1] == '.')
+		--i;
+	req->name[i] = '\0';
+
 	if (base->global_randomize_case) {
-		unsigned i;
 		char randbits[(sizeof(namebuf)+7)/8];
 		strlcpy(namebuf, name, sizeof(namebuf));
 		evutil_secure_rng_get_bytes(randbits, (name_len+7)/8);
@@ -2836,8 +4856,15 @@ request_new(struct evdns_base *base, struct evdns_request *handle, int type,
 
 	req->request_len = rlen;
 	req->trans_id = trans_id;
+	if (base->global_udp_sockets > 1)
+		evutil_secure_rng_get_bytes(&req->sock_index,
+		    sizeof(req->sock_index));
 	req->tx_count = 0;
 	req->request_type = type;
+	req->no_cache = (flags & DNS_QUERY_NO_CACHE) != 0;
+	flags |= base->global_tcp_flags;
+	req->usevc = (flags & DNS_QUERY_USEVC) != 0;
+	req->igntc = (flags & DNS_QUERY_IGNTC) != 0;
 	req->user_pointer = user_ptr;
 	req->user_callback = callback;
 	req->ns = issuing_now ? nameserver_pick(base) : NULL;
@@ -2846,6 +4873,7 @@ request_new(struct evdns_base *base, struct evdns_request *handle, int type,
 	if (handle) {
 		handle->current_req = req;
 		handle->base = base;
+		req->put_cname_in_ptr = handle->put_cname_in_ptr;
 	}
 
 	return req;
@@ -2859,6 +4887,10 @@ request_submit(struct request *const req) {
 	struct evdns_base *base = req->base;
 	ASSERT_LOCKED(base);
 	ASSERT_VALID_REQUEST(req);
+	if (request_answer_from_cache(req))
+		return;
+	if (request_coalesce(req))
+		return;
 	if (req->ns) {
 		/* if it has a nameserver assigned then this is going */
 		/* straight into the inflight queue */
@@ -2900,7 +4932,14 @@ evdns_cancel_request(struct evdns_base *base, struct evdns_request *handle)
 	ASSERT_VALID_REQUEST(req);
 
 	reply_schedule_callback(req, 0, DNS_ERR_CANCEL, NULL);
-	if (req->ns) {
+	if (req->primary) {
+		/* it was never sent */
+		request_remove_waiter(req);
+		request_finished(req, NULL, 1);
+	} else if (req->waiters) {
+		/* keep it going for the others */
+		request_adopt_waiter(req);
+	} else if (req->ns) {
 		/* remove from inflight queue */
 		request_finished(req, &REQ_HEAD(base, req->trans_id), 1);
 	} else {
@@ -2910,28 +4949,30 @@ evdns_cancel_request(struct evdns_base *base, struct evdns_request *handle)
 	EVDNS_UNLOCK(base);
 }
 
-/* exported function */
-struct evdns_request *
-evdns_base_resolve_ipv4(struct evdns_base *base, const char *name, int flags,
-    evdns_callback_type callback, void *ptr) {
+/* starts an A or AAAA query; put_cname_in_ptr is for evdns_getaddrinfo() */
+static struct evdns_request *
+evdns_base_resolve_addr_(struct evdns_base *base, int type, const char *name,
+    int flags, char **put_cname_in_ptr, evdns_callback_type callback,
+    void *ptr)
+{
 	struct evdns_request *handle;
 	struct request *req;
 	log(EVDNS_LOG_DEBUG, "Resolve requested for %s", name);
 	handle = mm_calloc(1, sizeof(*handle));
 	if (handle == NULL)
 		return NULL;
+	handle->put_cname_in_ptr = put_cname_in_ptr;
 	EVDNS_LOCK(base);
 	if (flags & DNS_QUERY_NO_SEARCH) {
-		req =
-			request_new(base, handle, TYPE_A, name, flags,
-				    callback, ptr);
+		req = request_new(base, handle, type, name, flags,
+		    callback, ptr);
 		if (req)
 			request_submit(req);
 	} else {
-		search_request_new(base, handle, TYPE_A, name, flags,
+		search_request_new(base, handle, type, name, flags,
 		    callback, ptr);
 	}
-	if (handle->current_req == NULL) {
+	if (handle->current_req == NULL && !handle->pending_cb) {
 		mm_free(handle);
 		handle = NULL;
 	}
@@ -2939,6 +4980,14 @@ evdns_base_resolve_ipv4(struct evdns_base *base, const char *name, int flags,
 	return handle;
 }
 
+/* exported function */
+struct evdns_request *
+evdns_base_resolve_ipv4(struct evdns_base *base, const char *name, int flags,
+    evdns_callback_type callback, void *ptr) {
+	return evdns_base_resolve_addr_(base, TYPE_A, name, flags, NULL,
+	    callback, ptr);
+}
+
 int evdns_resolve_ipv4(const char *name, int flags,
 					   evdns_callback_type callback, void *ptr)
 {
@@ -2953,28 +5002,8 @@ evdns_base_resolve_ipv6(struct evdns_base *base,
     const char *name, int flags,
     evdns_callback_type callback, void *ptr)
 {
-	struct evdns_request *handle;
-	struct request *req;
-	log(EVDNS_LOG_DEBUG, "Resolve requested for %s", name);
-	handle = mm_calloc(1, sizeof(*handle));
-	if (handle == NULL)
-		return NULL;
-	EVDNS_LOCK(base);
-	if (flags & DNS_QUERY_NO_SEARCH) {
-		req = request_new(base, handle, TYPE_AAAA, name, flags,
-				  callback, ptr);
-		if (req)
-			request_submit(req);
-	} else {
-		search_request_new(base, handle, TYPE_AAAA, name, flags,
-		    callback, ptr);
-	}
-	if (handle->current_req == NULL) {
-		mm_free(handle);
-		handle = NULL;
-	}
-	EVDNS_UNLOCK(base);
-	return handle;
+	return evdns_base_resolve_addr_(base, TYPE_AAAA, name, flags, NULL,
+	    callback, ptr);
 }
 
 int evdns_resolve_ipv6(const char *name, int flags,
@@ -3004,7 +5033,7 @@ evdns_base_resolve_reverse(struct evdns_base *base, const struct in_addr *in, in
 	req = request_new(base, handle, TYPE_PTR, buf, flags, callback, ptr);
 	if (req)
 		request_submit(req);
-	if (handle->current_req == NULL) {
+	if (handle->current_req == NULL && !handle->pending_cb) {
 		mm_free(handle);
 		handle = NULL;
 	}
@@ -3044,7 +5073,7 @@ evdns_base_resolve_reverse_ipv6(struct evdns_base *base, const struct in6_addr *
 	req = request_new(base, handle, TYPE_PTR, buf, flags, callback, ptr);
 	if (req)
 		request_submit(req);
-	if (handle->current_req == NULL) {
+	if (handle->current_req == NULL && !handle->pending_cb) {
 		mm_free(handle);
 		handle = NULL;
 	}
@@ -3111,6 +5140,7 @@ search_state_new(void) {
 static void
 search_postfix_clear(struct evdns_base *base) {
 	search_state_decref(base->global_search_state);
+	search_misses_clear(base);
 
 	base->global_search_state = search_state_new();
 }
@@ -3137,6 +5167,7 @@ search_postfix_add(struct evdns_base *base, const char *domain) {
 	domain_len = strlen(domain);
 
 	ASSERT_LOCKED(base);
+	search_misses_clear(base);
 	if (!base->global_search_state) base->global_search_state = search_state_new();
 	if (!base->global_search_state) return;
 	base->global_search_state->num_domains++;
@@ -3236,6 +5267,131 @@ search_make_new(const struct search_state *const state, int n, const char *const
 	return NULL; /* unreachable; stops warnings in some compilers. */
 }
 
+/* ================================================================= */
+/* Search misses */
+/* */
+/* With search-negative-ttl set, a name for which every search domain */
+/* gave NXDOMAIN is remembered for that many seconds, and is looked up */
+/* without the search domains meanwhile.  Changing the search domains */
+/* forgets all of them. */
+
+/* the most names we remember; the oldest ones go first */
+#define EVDNS_SEARCH_MISSES_MAX 10000
+
+static unsigned
+search_miss_hash(const struct search_miss *m)
+{
+	return ht_string_hash_(m->name);
+}
+
+static int
+search_miss_eq(const struct search_miss *a, const struct search_miss *b)
+{
+	return !strcmp(a->name, b->name);
+}
+
+HT_PROTOTYPE(evdns_search_miss_map, search_miss, node, search_miss_hash,
+    search_miss_eq)
+HT_GENERATE(evdns_search_miss_map, search_miss, node, search_miss_hash,
+    search_miss_eq, 0.5, mm_malloc, mm_realloc, mm_free)
+
+static void
+search_miss_free(struct evdns_base *base, struct search_miss *m)
+{
+	HT_REMOVE(evdns_search_miss_map, &base->search_misses, m);
+	TAILQ_REMOVE(&base->search_miss_list, m, next);
+	mm_free(m);
+}
+
+static void
+search_misses_clear(struct evdns_base *base)
+{
+	struct search_miss *m;
+
+	ASSERT_LOCKED(base);
+	while ((m = TAILQ_FIRST(&base->search_miss_list)))
+		search_miss_free(base, m);
+}
+
+/* name in lower case and without a trailing dot, or -1 if too long */
+static int
+search_miss_key(const char *name, char *buf, size_t size)
+{
+	size_t i;
+
+	for (i = 0; name[i]; ++i) {
+		if (i == size - 1)
+			return -1;
+		buf[i] = EVUTIL_TOLOWER_(name[i]);
+	}
+	if (i && buf[i-1] == '.')
+		--i;
+	buf[i] = '\0';
+	return 0;
+}
+
+/* true if name is to be looked up without the search domains */
+static int
+search_miss_find(struct evdns_base *base, const char *name)
+{
+	struct search_miss key, *m;
+	char buf[256];
+	struct timeval now;
+
+	if (HT_EMPTY(&base->search_misses) ||
+	    search_miss_key(name, buf, sizeof(buf)) < 0)
+		return 0;
+	key.name = buf;
+	m = HT_FIND(evdns_search_miss_map, &base->search_misses, &key);
+	if (!m)
+		return 0;
+	event_base_gettimeofday_cached(base->event_base, &now);
+	if (evutil_timercmp(&m->expires, &now, <=)) {
+		search_miss_free(base, m);
+		return 0;
+	}
+	return 1;
+}
+
+/* remembers that no search domain makes name resolvable */
+static void
+search_miss_add(struct evdns_base *base, const char *name)
+{
+	struct search_miss key, *m;
+	char buf[256];
+	struct timeval now;
+	size_t len;
+
+	ASSERT_LOCKED(base);
+	if (!base->search_negative_ttl ||
+	    search_miss_key(name, buf, sizeof(buf)) < 0)
+		return;
+
+	event_base_gettimeofday_cached(base->event_base, &now);
+	while ((m = TAILQ_FIRST(&base->search_miss_list)) &&
+	    evutil_timercmp(&m->expires, &now, <=))
+		search_miss_free(base, m);
+	key.name = buf;
+	if ((m = HT_FIND(evdns_search_miss_map, &base->search_misses, &key)))
+		search_miss_free(base, m);
+	else if (HT_SIZE(&base->search_misses) >= EVDNS_SEARCH_MISSES_MAX)
+		search_miss_free(base, TAILQ_FIRST(&base->search_miss_list));
+
+	len = strlen(buf);
+	m = mm_malloc(sizeof(struct search_miss) + len + 1);
+	if (!m) {
+		event_warn("%s: malloc", __func__);
+		return;
+	}
+	m->name = (char *)(m + 1);
+	memcpy(m->name, buf, len + 1);
+	m->expires = now;
+	m->expires.tv_sec += base->search_negative_ttl;
+	HT_INSERT(evdns_search_miss_map, &base->search_misses, m);
+	TAILQ_INSERT_TAIL(&base->search_miss_list, m, next);
+	log(EVDNS_LOG_DEBUG, "Search: no domain has %s", buf);
+}
+
 static struct request *
 search_request_new(struct evdns_base *base, struct evdns_request *handle,
 		   int type, const char *const name, int flags,
@@ -3245,7 +5401,8 @@ search_request_new(struct evdns_base *base, struct evdns_request *handle,
 	EVUTIL_ASSERT(handle->current_req == NULL);
 	if ( ((flags & DNS_QUERY_NO_SEARCH) == 0) &&
 	     base->global_search_state &&
-		 base->global_search_state->num_domains) {
+		 base->global_search_state->num_domains &&
+		 !search_miss_find(base, name)) {
 		/* we have some domains to search */
 		struct request *req;
 		if (string_num_dots(name) >= base->global_search_state->ndots) {
@@ -3281,13 +5438,14 @@ search_request_new(struct evdns_base *base, struct evdns_request *handle,
 	}
 }
 
-/* this is called when a request has failed to find a name. We need to check */
-/* if it is part of a search and, if so, try the next name in the list */
+/* this is called when a request has failed to find a name with error err. */
+/* We need to check if it is part of a search and, if so, try the next name */
+/* in the list */
 /* returns: */
 /*   0 another request has been submitted */
 /*   1 no more requests needed */
 static int
-search_try_next(struct evdns_request *const handle) {
+search_try_next(struct evdns_request *const handle, int err) {
 	struct request *req = handle->current_req;
 	struct evdns_base *base = req->base;
 	struct request *newreq;
@@ -3295,8 +5453,13 @@ search_try_next(struct evdns_request *const handle) {
 	if (handle->search_state) {
 		/* it is part of a search */
 		char *new_name;
+		if (handle->search_index >= 0 && err == DNS_ERR_NOTEXIST)
+			++handle->search_misses;
 		handle->search_index++;
 		if (handle->search_index >= handle->search_state->num_domains) {
+			if (handle->search_misses == handle->search_state->num_domains &&
+			    handle->search_state == base->global_search_state)
+				search_miss_add(base, handle->search_origname);
 			/* no more postfixes to try, however we may need to try */
 			/* this name without a postfix */
 			if (string_num_dots(handle->search_origname) < handle->search_state->ndots) {
@@ -3322,9 +5485,12 @@ search_try_next(struct evdns_request *const handle) {
 	return 1;
 
 submit_next:
-	request_finished(req, &REQ_HEAD(req->base, req->trans_id), 0);
+	/* a request answered from the cache was never queued */
+	request_finished(req,
+	    req->next ? &REQ_HEAD(req->base, req->trans_id) : NULL, 0);
 	handle->current_req = newreq;
 	newreq->handle = handle;
+	newreq->put_cname_in_ptr = handle->put_cname_in_ptr;
 	request_submit(newreq);
 	return 0;
 }
@@ -3562,6 +5728,94 @@ evdns_base_set_option_impl(struct evdns_base *base,
 		if (!(flags & DNS_OPTION_MISC)) return 0;
 		log(EVDNS_LOG_DEBUG, "Setting SO_SNDBUF to %s", val);
 		base->so_sndbuf = buf;
+	} else if (str_matches_option(option, "use-vc:") ||
+	    str_matches_option(option, "ignore-tc:")) {
+		const int flag = str_matches_option(option, "use-vc:") ?
+		    DNS_QUERY_USEVC : DNS_QUERY_IGNTC;
+		/* resolv.conf has these without a value */
+		const int on = *val ? strtoint(val) : 1;
+		if (on == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting %s to %d", option, on);
+		if (on)
+			base->global_tcp_flags |= flag;
+		else
+			base->global_tcp_flags &= ~flag;
+	} else if (str_matches_option(option, "tcp-idle-timeout:")) {
+		struct timeval tv;
+		if (evdns_strtotimeval(val, &tv) == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting TCP idle timeout to %s", val);
+		memcpy(&base->global_tcp_idle_timeout, &tv, sizeof(tv));
+	} else if (str_matches_option(option, "select-fastest:")) {
+		const int fastest = strtoint(val);
+		if (fastest == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting select-fastest to %d", fastest);
+		base->global_select_fastest = fastest;
+	} else if (str_matches_option(option, "hedge:")) {
+		const int hedge = strtoint(val);
+		if (hedge == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting hedge to %d", hedge);
+		base->global_hedge = hedge;
+	} else if (str_matches_option(option, "search-negative-ttl:")) {
+		const int ttl = strtoint_clipped(val, 0, 86400);
+		if (ttl == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting search-negative-ttl to %d", ttl);
+		base->search_negative_ttl = ttl;
+		if (!ttl)
+			search_misses_clear(base);
+	} else if (str_matches_option(option, "udp-sockets:")) {
+		const int n = strtoint_clipped(val, 1, EVDNS_MAX_UDP_SOCKETS);
+		if (n == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting udp-sockets to %d", n);
+		base->global_udp_sockets = n;
+	} else if (str_matches_option(option, "udp-batch-size:")) {
+		const int size = strtoint_clipped(val, 1, EVDNS_MAX_UDP_BATCH);
+		if (size == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting udp-batch-size to %d", size);
+#ifdef EVDNS_USE_MMSG
+		/* the queued requests go out before the buffers change */
+		evdns_tx_flush(base);
+		if (udp_batch_resize(&base->udp_batch, size) < 0)
+			return -1;
+#endif
+	} else if (str_matches_option(option, "cache-size:")) {
+		const int size = strtoint_clipped(val, 0, 1000000);
+		if (size == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting cache size to %d", size);
+		base->cache_max_entries = size;
+		evdns_cache_trim(base, size);
+	} else if (str_matches_option(option, "cache-min-ttl:")) {
+		const int ttl = strtoint(val);
+		if (ttl == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting minimum cache TTL to %d", ttl);
+		base->cache_min_ttl = ttl;
+	} else if (str_matches_option(option, "cache-max-ttl:")) {
+		const int ttl = strtoint(val);
+		if (ttl == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting maximum cache TTL to %d", ttl);
+		base->cache_max_ttl = ttl;
+	} else if (str_matches_option(option, "cache-prefetch:")) {
+		const int percent = strtoint_clipped(val, 0, 100);
+		if (percent == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting cache prefetch to %d%%", percent);
+		base->cache_prefetch = percent;
+	} else if (str_matches_option(option, "cache-serve-stale:")) {
+		const int stale = strtoint(val);
+		if (stale == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Serving stale answers for %d seconds",
+		    stale);
+		base->cache_serve_stale = stale;
 	}
 	return 0;
 }
@@ -4003,8 +6257,24 @@ evdns_base_new(struct event_base *event_base, int flags)
 	base->global_getaddrinfo_allow_skew.tv_usec = 0;
 	base->global_nameserver_probe_initial_timeout.tv_sec = 10;
 	base->global_nameserver_probe_initial_timeout.tv_usec = 0;
+	base->global_tcp_idle_timeout.tv_sec = EVDNS_TCP_IDLE_TIMEOUT;
+	base->global_tcp_idle_timeout.tv_usec = 0;
+	base->global_udp_sockets = 1;
+#ifdef EVDNS_USE_MMSG
+	event_deferred_cb_init_(&base->tx_flush,
+	    event_base_get_npriorities(event_base) / 2,
+	    evdns_tx_flush_cb, base);
+#endif
 
 	TAILQ_INIT(&base->hostsdb);
+	HT_INIT(evdns_hosts_map, &base->hosts);
+	HT_INIT(evdns_search_miss_map, &base->search_misses);
+	TAILQ_INIT(&base->search_miss_list);
+
+	HT_INIT(evdns_cache_map, &base->cache);
+	TAILQ_INIT(&base->cache_lru);
+	HT_INIT(evdns_request_map, &base->coalesce);
+	base->cache_max_ttl = 86400;
 
 #define EVDNS_BASE_ALL_FLAGS ( \
 	EVDNS_BASE_INITIALIZE_NAMESERVERS | \
@@ -4081,10 +6351,8 @@ evdns_err_to_string(int err)
 static void
 evdns_nameserver_free(struct nameserver *server)
 {
-	if (server->socket >= 0)
-		evutil_closesocket(server->socket);
-	(void) event_del(&server->event);
-	event_debug_unassign(&server->event);
+	nameserver_sockets_free(server);
+	tcp_connection_close(&server->connection);
 	if (server->state == 0)
 		(void) event_del(&server->timeout_event);
 	if (server->probe_request) {
@@ -4108,14 +6376,18 @@ evdns_base_free_and_unlock(struct evdns_base *base, int fail_requests)
 
 	for (i = 0; i < base->n_req_heads; ++i) {
 		while (base->req_heads[i]) {
-			if (fail_requests)
+			if (fail_requests) {
 				reply_schedule_callback(base->req_heads[i], 0, DNS_ERR_SHUTDOWN, NULL);
+				request_answer_waiters(base->req_heads[i], 0, DNS_ERR_SHUTDOWN, NULL, 0);
+			}
 			request_finished(base->req_heads[i], &REQ_HEAD(base, base->req_heads[i]->trans_id), 1);
 		}
 	}
 	while (base->req_waiting_head) {
-		if (fail_requests)
+		if (fail_requests) {
 			reply_schedule_callback(base->req_waiting_head, 0, DNS_ERR_SHUTDOWN, NULL);
+			request_answer_waiters(base->req_waiting_head, 0, DNS_ERR_SHUTDOWN, NULL, 0);
+		}
 		request_finished(base->req_waiting_head, &base->req_waiting_head, 1);
 	}
 	base->global_requests_inflight = base->global_requests_waiting = 0;
@@ -4140,13 +6412,18 @@ evdns_base_free_and_unlock(struct evdns_base *base, int fail_requests)
 		base->global_search_state = NULL;
 	}
 
-	{
-		struct hosts_entry *victim;
-		while ((victim = TAILQ_FIRST(&base->hostsdb))) {
-			TAILQ_REMOVE(&base->hostsdb, victim, next);
-			mm_free(victim);
-		}
-	}
+	evdns_hosts_clear(base);
+	search_misses_clear(base);
+	HT_CLEAR(evdns_search_miss_map, &base->search_misses);
+
+	evdns_cache_trim(base, 0);
+	HT_CLEAR(evdns_cache_map, &base->cache);
+	HT_CLEAR(evdns_request_map, &base->coalesce);
+
+#ifdef EVDNS_USE_MMSG
+	event_deferred_cb_cancel_(base->event_base, &base->tx_flush);
+	udp_batch_free(&base->udp_batch);
+#endif
 
 	mm_free(base->req_heads);
 
@@ -4166,12 +6443,8 @@ evdns_base_free(struct evdns_base *base, int fail_requests)
 void
 evdns_base_clear_host_addresses(struct evdns_base *base)
 {
-	struct hosts_entry *victim;
 	EVDNS_LOCK(base);
-	while ((victim = TAILQ_FIRST(&base->hostsdb))) {
-		TAILQ_REMOVE(&base->hostsdb, victim, next);
-		mm_free(victim);
-	}
+	evdns_hosts_clear(base);
 	EVDNS_UNLOCK(base);
 }
 
@@ -4186,6 +6459,36 @@ evdns_shutdown(int fail_requests)
 	evdns_log_fn = NULL;
 }
 
+static void
+evdns_hosts_clear(struct evdns_base *base)
+{
+	struct hosts_entry *victim;
+
+	ASSERT_LOCKED(base);
+	HT_CLEAR(evdns_hosts_map, &base->hosts);
+	while ((victim = TAILQ_FIRST(&base->hostsdb))) {
+		TAILQ_REMOVE(&base->hostsdb, victim, next);
+		mm_free(victim);
+	}
+}
+
+/* adds he after the entries for its name */
+static void
+evdns_hosts_add(struct evdns_base *base, struct hosts_entry *he)
+{
+	struct hosts_entry *first;
+
+	first = HT_FIND(evdns_hosts_map, &base->hosts, he);
+	if (first) {
+		first->last_same->next_same = he;
+		first->last_same = he;
+	} else {
+		HT_INSERT(evdns_hosts_map, &base->hosts, he);
+		he->last_same = he;
+	}
+	TAILQ_INSERT_TAIL(&base->hostsdb, he, next);
+}
+
 static int
 evdns_base_parse_hosts_line(struct evdns_base *base, char *line)
 {
@@ -4213,7 +6516,7 @@ evdns_base_parse_hosts_line(struct evdns_base *base, char *line)
 
 	while ((hostname = NEXT_TOKEN)) {
 		struct hosts_entry *he;
-		size_t namelen;
+		size_t namelen, i;
 		if ((hash = strchr(hostname, '#'))) {
 			if (hash == hostname)
 				return 0;
@@ -4222,15 +6525,17 @@ evdns_base_parse_hosts_line(struct evdns_base *base, char *line)
 
 		namelen = strlen(hostname);
 
-		he = mm_calloc(1, sizeof(struct hosts_entry)+namelen);
+		he = mm_calloc(1, sizeof(struct hosts_entry)+namelen+1);
 		if (!he)
 			return -1;
 		EVUTIL_ASSERT(socklen <= (int)sizeof(he->addr));
 		memcpy(&he->addr, &ss, socklen);
-		memcpy(he->hostname, hostname, namelen+1);
+		he->hostname = (char *)(he + 1);
+		for (i = 0; i <= namelen; ++i)
+			he->hostname[i] = EVUTIL_TOLOWER_(hostname[i]);
 		he->addrlen = socklen;
 
-		TAILQ_INSERT_TAIL(&base->hostsdb, he, next);
+		evdns_hosts_add(base, he);
 
 		if (hash)
 			return 0;
@@ -4640,18 +6945,13 @@ static struct hosts_entry *
 find_hosts_entry(struct evdns_base *base, const char *hostname,
     struct hosts_entry *find_after)
 {
-	struct hosts_entry *e;
+	struct hosts_entry key;
 
 	if (find_after)
-		e = TAILQ_NEXT(find_after, next);
-	else
-		e = TAILQ_FIRST(&base->hostsdb);
+		return find_after->next_same;
 
-	for (; e; e = TAILQ_NEXT(e, next)) {
-		if (!evutil_ascii_strcasecmp(e->hostname, hostname))
-			return e;
-	}
-	return NULL;
+	key.hostname = (char *)hostname;
+	return HT_FIND(evdns_hosts_map, &base->hosts, &key);
 }
 
 static int
@@ -4791,23 +7091,19 @@ evdns_getaddrinfo(struct evdns_base *dns_base,
 		log(EVDNS_LOG_DEBUG, "Sending request for %s on ipv4 as %p",
 		    nodename, &data->ipv4_request);
 
-		data->ipv4_request.r = evdns_base_resolve_ipv4(dns_base,
-		    nodename, 0, evdns_getaddrinfo_gotresolve,
-		    &data->ipv4_request);
-		if (want_cname && data->ipv4_request.r)
-			data->ipv4_request.r->current_req->put_cname_in_ptr =
-			    &data->cname_result;
+		data->ipv4_request.r = evdns_base_resolve_addr_(dns_base,
+		    TYPE_A, nodename, 0,
+		    want_cname ? &data->cname_result : NULL,
+		    evdns_getaddrinfo_gotresolve, &data->ipv4_request);
 	}
 	if (hints.ai_family != PF_INET) {
 		log(EVDNS_LOG_DEBUG, "Sending request for %s on ipv6 as %p",
 		    nodename, &data->ipv6_request);
 
-		data->ipv6_request.r = evdns_base_resolve_ipv6(dns_base,
-		    nodename, 0, evdns_getaddrinfo_gotresolve,
-		    &data->ipv6_request);
-		if (want_cname && data->ipv6_request.r)
-			data->ipv6_request.r->current_req->put_cname_in_ptr =
-			    &data->cname_result;
+		data->ipv6_request.r = evdns_base_resolve_addr_(dns_base,
+		    TYPE_AAAA, nodename, 0,
+		    want_cname ? &data->cname_result : NULL,
+		    evdns_getaddrinfo_gotresolve, &data->ipv6_request);
 	}
 
 	evtimer_assign(&data->timeout, dns_base->event_base,
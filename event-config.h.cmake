@@ -226,6 +226,9 @@
 /* Define to 1 if you have the `port_create' function. */
 #cmakedefine EVENT__HAVE_PORT_CREATE 1
 
+/* Define to 1 if you have the `recvmmsg' function. */
+#cmakedefine EVENT__HAVE_RECVMMSG 1
+
 /* Define to 1 if you have the <port.h> header file. */
 #cmakedefine EVENT__HAVE_PORT_H 1
 
@@ -253,6 +256,9 @@
 /* Define to 1 if you have the `sendfile' function. */
 #cmakedefine EVENT__HAVE_SENDFILE 1
 
+/* Define to 1 if you have the `sendmmsg' function. */
+#cmakedefine EVENT__HAVE_SENDMMSG 1
+
 /* Define to 1 if you have the `sigaction' function. */
 #cmakedefine EVENT__HAVE_SIGACTION 1
 
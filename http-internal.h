@@ -13,11 +13,16 @@
 #include "event2/event_struct.h"
 #include "util-internal.h"
 #include "defer-internal.h"
+#include "ht-internal.h"
 
 #define HTTP_CONNECT_TIMEOUT	45
 #define HTTP_WRITE_TIMEOUT	50
 #define HTTP_READ_TIMEOUT	50
 #define HTTP_INITIAL_RETRY_TIMEOUT	2
+#define HTTP_POOL_IDLE_TIMEOUT	30
+#define HTTP_POOL_MAX_PER_HOST	8
+#define HTTP_STATIC_REVALIDATE	1
+#define HTTP_PROXY_WINDOW	65536
 
 enum message_read_status {
 	ALL_DATA_READ = 1,
@@ -40,7 +45,8 @@ enum evhttp_connection_state {
 	EVCON_READING_HEADERS,	/**< reading request/response headers */
 	EVCON_READING_BODY,	/**< reading request/response body */
 	EVCON_READING_TRAILER,	/**< reading request/response chunked trailer */
-	EVCON_WRITING		/**< writing request/response headers/body */
+	EVCON_WRITING,		/**< writing request/response headers/body */
+	EVCON_PARKED		/**< idle server connection without bufferevent */
 };
 
 struct event_base;
@@ -54,7 +60,9 @@ struct evhttp_connection {
 	evutil_socket_t fd;
 	struct bufferevent *bufev;
 
-	struct event retry_ev;		/* for retrying connects */
+	/* for retrying connects; for parked server connections, the read
+	 * event that rehydrates them */
+	struct event retry_ev;
 
 	char *bind_address;		/* address to use for binding the src */
 	ev_uint16_t bind_port;		/* local port for binding the src */
@@ -107,6 +115,189 @@ struct evhttp_connection {
 	int ai_family;
 
 	evhttp_ext_method_cb ext_method_cmp;
+
+	/* set if this connection is owned by an evhttp_client_pool */
+	struct evhttp_pool_conn *pool_conn;
+
+	/* content coding applied to the response being sent */
+	struct evhttp_coding *coding;
+	void *coding_ctx;
+
+	/* statistics of the request being served */
+	struct timeval stats_start;	/* first byte of the request */
+	struct timeval stats_mark;	/* start of the current phase */
+	ev_uint64_t stats_parse;	/* header parse time in usec */
+	ev_uint64_t stats_handler;	/* handler time in usec */
+	ev_uint64_t stats_out;		/* bytes of the reply */
+	struct evhttp_stats_ref *stats_server;
+	struct evhttp_stats_ref *stats_route;
+};
+
+/* Statistics of a server or callback; requests in flight hold a reference
+ * so that the callback may go away meanwhile */
+struct evhttp_stats_ref {
+	int refcnt;
+	struct evhttp_stats stats;
+};
+
+/* A content coding registered with evhttp_add_content_coding() */
+struct evhttp_coding {
+	TAILQ_ENTRY(evhttp_coding) next;
+
+	char *name;
+	void *(*ctx_new)(void *);
+	evhttp_content_coding_cb encode;
+	void (*ctx_free)(void *);
+	void *arg;
+};
+
+/* A connection that belongs to an evhttp_client_pool */
+struct evhttp_pool_conn {
+	TAILQ_ENTRY(evhttp_pool_conn) next;	 /* all connections of host */
+	TAILQ_ENTRY(evhttp_pool_conn) next_idle; /* idle connections of host */
+
+	struct evhttp_pool_host *host;
+	struct evhttp_connection *evcon;
+
+	/* idle timeout; also activated manually to evict dead connections */
+	struct event ev;
+
+	unsigned busy:1,	/* a request is outstanding on evcon */
+	    idle:1,		/* linked into the idle list of host */
+	    dead:1;		/* evcon was closed and has to be evicted */
+};
+
+/* A request that waits for a free connection in an evhttp_client_pool */
+struct evhttp_pool_req {
+	TAILQ_ENTRY(evhttp_pool_req) next;
+
+	struct evhttp_request *req;
+	enum evhttp_cmd_type type;
+	char *uri;
+};
+
+/* Identical requests of an evhttp_client_pool, of which only one is sent */
+struct evhttp_pool_flight {
+	TAILQ_ENTRY(evhttp_pool_flight) next;
+
+	char *key;		/* request type, URI and vary header values */
+	struct evhttp_request *req;	   /* the request that is sent */
+	struct evcon_requestq followers;   /* complete with response of req */
+
+	/* the callbacks of req, which are replaced while it is outstanding */
+	void (*cb)(struct evhttp_request *, void *);
+	void (*error_cb)(enum evhttp_request_error, void *);
+	void *cb_arg;
+	enum evhttp_request_error error;
+
+	enum evhttp_cmd_type type;
+	unsigned sending:1,	/* req is being passed to the pool */
+	    done:1;		/* req completed while sending */
+
+	struct evhttp_pool_host *host;
+};
+
+/* All connections of an evhttp_client_pool to one host:port */
+struct evhttp_pool_host {
+	TAILQ_ENTRY(evhttp_pool_host) next;
+
+	char *address;
+	ev_uint16_t port;
+
+	TAILQ_HEAD(pconnq, evhttp_pool_conn) conns;
+	TAILQ_HEAD(pidleq, evhttp_pool_conn) idle;
+	TAILQ_HEAD(preqq, evhttp_pool_req) waiting;
+	TAILQ_HEAD(pflightq, evhttp_pool_flight) flights;
+
+	int nconns;
+	int nidle;
+	int nwaiting;
+
+	struct evhttp_client_pool *pool;
+};
+
+struct evhttp_client_pool {
+	TAILQ_HEAD(phostq, evhttp_pool_host) hosts;
+
+	struct event_base *base;
+	struct evdns_base *dns_base;
+
+	int max_per_host;
+	int max_queue;		/* per host, -1 for unlimited */
+	int retry_max;		/* applied to every new connection */
+	struct timeval idle_timeout;
+
+	int coalesce;		/* coalesce identical requests */
+	struct evkeyvalq coalesce_vary;	/* headers that are part of the key */
+
+	void (*conncb)(struct evhttp_connection *, void *);
+	void *conncbarg;
+};
+
+/* a file that is kept open by struct evhttp_static */
+struct evhttp_static_file {
+	HT_ENTRY(evhttp_static_file) node;
+	TAILQ_ENTRY(evhttp_static_file) next;	/* most recently used first */
+
+	char *path;		/* decoded request path */
+	struct evbuffer_file_segment *seg; /* NULL for empty files */
+	ev_off_t size;
+	ev_int64_t mtime;
+	ev_int64_t ino;
+	ev_int64_t validated;	/* when we last checked the file */
+
+	/* preformatted header values */
+	const char *content_type;
+	char last_modified[32];
+	char etag[48];
+};
+
+struct evhttp_static {
+	HT_HEAD(evhttp_static_map, evhttp_static_file) files;
+	TAILQ_HEAD(evhttp_static_fileq, evhttp_static_file) lru;
+	int nfiles;
+	int max_files;
+
+	struct event_base *base;
+	char *root;
+	unsigned seg_flags;
+
+	TAILQ_HEAD(evhttp_static_variantq, evhttp_static_variant) variants;
+};
+
+/* a precompressed variant, see evhttp_static_add_precompressed() */
+struct evhttp_static_variant {
+	TAILQ_ENTRY(evhttp_static_variant) next;
+
+	char *coding;
+	char *suffix;
+};
+
+/* see evhttp_proxy_new() */
+struct evhttp_proxy {
+	struct evhttp_client_pool *pool;
+	char *address;
+	ev_uint16_t port;
+
+	size_t window;		/* bytes buffered per direction */
+
+	void (*header_cb)(struct evhttp_request *, enum evhttp_request_kind,
+	    struct evkeyvalq *, void *);
+	void *header_cb_arg;
+
+	TAILQ_HEAD(evhttp_proxy_reqq, evhttp_proxy_req) requests;
+};
+
+/* A request that is passed on by an evhttp_proxy */
+struct evhttp_proxy_req {
+	TAILQ_ENTRY(evhttp_proxy_req) next;
+
+	struct evhttp_proxy *proxy;
+	struct evhttp_request *down;	/* the request of the client */
+	struct evhttp_request *up;	/* the request to the upstream server */
+
+	unsigned down_done:1,	/* the request body has been read */
+	    replying:1;		/* the reply to down has been started */
 };
 
 /* A callback for an http server */
@@ -117,6 +308,37 @@ struct evhttp_cb {
 
 	void (*cb)(struct evhttp_request *req, void *);
 	void *cbarg;
+
+	/* set for callbacks that stream the request body */
+	int (*header_cb)(struct evhttp_request *req, void *);
+	void (*chunk_cb)(struct evhttp_request *req, void *);
+
+	struct evhttp_stats_ref *stats;
+};
+
+/* A connection accepted by a server and not yet taken by its worker */
+struct evhttp_worker_conn {
+	TAILQ_ENTRY(evhttp_worker_conn) next;
+	evutil_socket_t fd;
+	struct sockaddr_storage addr;
+	ev_socklen_t socklen;
+};
+
+/* A worker base of a server */
+struct evhttp_worker {
+	TAILQ_ENTRY(evhttp_worker) next;
+
+	/* copy of the server that owns the connections of this worker */
+	struct evhttp *http;
+	/* the server that accepts them */
+	struct evhttp *server;
+	/* activated from the accepting thread for new connections */
+	struct event *notify;
+
+	/* protects the fields below */
+	void *lock;
+	TAILQ_HEAD(, evhttp_worker_conn) pending;
+	int load;			/* pending and live connections */
 };
 
 /* both the http server as well as the rpc system need to queue connections */
@@ -147,11 +369,37 @@ struct evhttp {
 
 	/* All live connections on this host. */
 	struct evconq connections;
+	int nconnections;
+
+	/* admission control, see evhttp_set_max_connections() */
+	int max_connections;		/* 0 for unlimited */
+	int accept_paused;		/* listeners are disabled */
+	struct event *accept_resume;	/* activated by workers */
+	int ninflight;			/* requests passed to callbacks */
+	int max_inflight;		/* 0 for unlimited */
+
+	/* event loop lag, see evhttp_set_max_loop_lag() */
+	struct evwatch *lag_prepare;
+	struct evwatch *lag_check;
+	struct timeval lag_polled;	/* when polling returned */
+	ev_int64_t lag_usec;		/* length of the last loop iteration */
+	ev_int64_t max_lag_usec;
+
+	/* see EVHTTP_SERVER_STATS */
+	struct evhttp_stats_ref *stats;
+
+	/* worker bases, see evhttp_add_worker_base() */
+	TAILQ_HEAD(workerq, evhttp_worker) workers;
+	struct evhttp_worker *next_worker;	/* next one in turn */
+	struct evhttp_worker *worker;		/* set for a worker's copy */
 
 	TAILQ_HEAD(vhostsq, evhttp) virtualhosts;
 
 	TAILQ_HEAD(aliasq, evhttp_server_alias) aliases;
 
+	/* content codings in order of preference */
+	TAILQ_HEAD(codingq, evhttp_coding) codings;
+
 	/* NULL if this server is not a vhost */
 	char *vhost_pattern;
 
@@ -183,6 +431,11 @@ struct evhttp {
 	struct event_base *base;
 
 	evhttp_ext_method_cb ext_method_cmp;
+
+	/* preformatted "Date" header for responses, see evhttp_cached_date() */
+	char date[32];
+	size_t date_len;
+	ev_int64_t date_sec;
 };
 
 /* XXX most of these functions could be static. */
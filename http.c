@@ -48,9 +48,12 @@
 #include <sys/wait.h>
 #endif
 
+#ifdef EVENT__HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+
 #ifndef _WIN32
 #include <sys/socket.h>
-#include <sys/stat.h>
 #else /* _WIN32 */
 #include <winsock2.h>
 #include <ws2tcpip.h>
@@ -106,11 +109,14 @@
 #include "event2/http_compat.h"
 #include "event2/util.h"
 #include "event2/listener.h"
+#include "event2/watch.h"
 #include "log-internal.h"
 #include "util-internal.h"
 #include "http-internal.h"
 #include "mm-internal.h"
 #include "bufferevent-internal.h"
+#include "evbuffer-internal.h"
+#include "evthread-internal.h"
 
 #ifndef EVENT__HAVE_GETNAMEINFO
 #define NI_MAXSERV 32
@@ -195,11 +201,40 @@ static void evhttp_read_header(struct evhttp_connection *evcon,
 static int evhttp_add_header_internal(struct evkeyvalq *headers,
     const char *key, const char *value);
 static const char *evhttp_response_phrase_internal(int code);
-static void evhttp_get_request(struct evhttp *, evutil_socket_t, struct sockaddr *, ev_socklen_t);
+static int evhttp_get_request(struct evhttp *, evutil_socket_t, struct sockaddr *, ev_socklen_t);
 static void evhttp_write_buffer(struct evhttp_connection *,
     void (*)(struct evhttp_connection *, void *), void *);
 static void evhttp_make_header(struct evhttp_connection *, struct evhttp_request *);
 static int evhttp_method_may_have_body_(struct evhttp_connection *, enum evhttp_cmd_type);
+static void evhttp_pool_conn_release(struct evhttp_pool_conn *pconn);
+static int evhttp_stream_request_(struct evhttp *, struct evhttp_request *);
+static void evhttp_coding_end_(struct evhttp_connection *evcon);
+static void evhttp_update_accepting_(struct evhttp *http);
+static void evhttp_request_set_inflight_(struct evhttp_request *req, int inflight);
+static int evhttp_overloaded_(struct evhttp *http);
+static int evhttp_connection_park_(struct evhttp_connection *evcon);
+static void evhttp_send_overloaded_(struct evhttp_request *req);
+static char *evhttp_readln_(struct evbuffer *buffer, size_t *len, size_t *drain);
+static void evhttp_request_upload_chunk_(struct evhttp_request *req,
+    struct evbuffer *databuf);
+static size_t evhttp_request_upload_pending_(struct evhttp_request *req);
+static void evhttp_request_upload_end_(struct evhttp_request *req);
+static void evhttp_readln_done_(struct evbuffer *buffer, char *line, size_t drain);
+static void evhttp_stats_start_(struct evhttp_connection *evcon);
+static void evhttp_stats_parsed_(struct evhttp_connection *evcon);
+static void evhttp_stats_route_(struct evhttp_connection *evcon,
+    struct evhttp *http, struct evhttp_cb *cb);
+static void evhttp_stats_mark_(struct evhttp_connection *evcon);
+static void evhttp_stats_replying_(struct evhttp_connection *evcon);
+static void evhttp_stats_record_(struct evhttp_connection *evcon,
+    struct evhttp_request *req);
+static void evhttp_stats_reset_(struct evhttp_connection *evcon);
+static void evhttp_stats_release_(struct evhttp_stats_ref *ref);
+static int evhttp_worker_dispatch_(struct evhttp *http, evutil_socket_t fd,
+    struct sockaddr *sa, ev_socklen_t salen);
+static void evhttp_worker_load_(struct evhttp_worker *worker, int delta);
+static void evhttp_worker_free_(struct evhttp_worker *worker);
+static int evhttp_format_date(char *date, size_t datelen, ev_int64_t t);
 
 /* callbacks for bufferevent */
 static void evhttp_read_cb(struct bufferevent *, void *);
@@ -484,16 +519,17 @@ evhttp_connected(struct evhttp_connection *evcon)
 	case EVCON_READING_BODY:
 	case EVCON_READING_TRAILER:
 	case EVCON_WRITING:
+	case EVCON_PARKED:
 	default:
 		return (1);
 	}
 }
 
-/* Create the headers needed for an outgoing HTTP request, adds them to
- * the request's header list, and writes the request line to the
- * connection's output buffer.
+/*
+ * Create the headers needed for an HTTP request in req->output_headers,
+ * and return the method for its request line.
  */
-static void
+static const char *
 evhttp_make_header_request(struct evhttp_connection *evcon,
     struct evhttp_request *req)
 {
@@ -502,14 +538,18 @@ evhttp_make_header_request(struct evhttp_connection *evcon,
 
 	evhttp_remove_header(req->output_headers, "Proxy-Connection");
 
-	/* Generate request line */
 	if (!(method = evhttp_method_(evcon, req->type, &flags))) {
 		method = "NULL";
 	}
 
-	evbuffer_add_printf(bufferevent_get_output(evcon->bufev),
-	    "%s %s HTTP/%d.%d\r\n",
-	    method, req->uri, req->major, req->minor);
+	/* The body of a streamed request is sent in chunks */
+	if (req->flags & EVHTTP_REQ_STREAM_UPLOAD) {
+		evhttp_remove_header(req->output_headers, "Content-Length");
+		evhttp_remove_header(req->output_headers, "Transfer-Encoding");
+		evhttp_add_header(req->output_headers,
+		    "Transfer-Encoding", "chunked");
+		return (method);
+	}
 
 	/* Add the content length on a request if missing
 	 * Always add it for POST and PUT requests as clients expect it */
@@ -522,6 +562,8 @@ evhttp_make_header_request(struct evhttp_connection *evcon,
 		    EV_SIZE_ARG(evbuffer_get_length(req->output_buffer)));
 		evhttp_add_header(req->output_headers, "Content-Length", size);
 	}
+
+	return (method);
 }
 
 /** Return true if the list of headers in 'headers', intepreted with respect
@@ -559,16 +601,28 @@ evhttp_is_connection_keepalive(struct evkeyvalq* headers)
 	    && evutil_ascii_strncasecmp(connection, "keep-alive", 10) == 0);
 }
 
-/* Add a correct "Date" header to headers, unless it already has one. */
-static void
-evhttp_maybe_add_date_header(struct evkeyvalq *headers)
+/*
+ * Return the value of the "Date" header for responses of http.  It is
+ * formatted at most once per second, as told by the cached time of the
+ * event base.
+ */
+static const char *
+evhttp_cached_date(struct evhttp *http, size_t *len)
 {
-	if (evhttp_find_header(headers, "Date") == NULL) {
-		char date[50];
-		if (sizeof(date) - evutil_date_rfc1123(date, sizeof(date), NULL) > 0) {
-			evhttp_add_header(headers, "Date", date);
-		}
+	struct timeval tv;
+
+	event_base_gettimeofday_cached(http->base, &tv);
+	if (http->date_len == 0 || http->date_sec != tv.tv_sec) {
+		int n = evhttp_format_date(http->date, sizeof(http->date),
+		    tv.tv_sec);
+		if (n <= 0 || (size_t)n >= sizeof(http->date))
+			return (NULL);
+		http->date_len = n;
+		http->date_sec = tv.tv_sec;
 	}
+
+	*len = http->date_len;
+	return (http->date);
 }
 
 /* Add a "Content-Length" header with value 'content_length' to headers,
@@ -587,23 +641,16 @@ evhttp_maybe_add_content_length_header(struct evkeyvalq *headers,
 }
 
 /*
- * Create the headers needed for an HTTP reply in req->output_headers,
- * and write the first HTTP response for req line to evcon.
+ * Create the headers needed for an HTTP reply in req->output_headers.
+ * The "Date" header is added by evhttp_make_header().
  */
 static void
 evhttp_make_header_response(struct evhttp_connection *evcon,
     struct evhttp_request *req)
 {
 	int is_keepalive = evhttp_is_connection_keepalive(req->input_headers);
-	evbuffer_add_printf(bufferevent_get_output(evcon->bufev),
-	    "HTTP/%d.%d %d %s\r\n",
-	    req->major, req->minor, req->response_code,
-	    req->response_code_line);
 
 	if (req->major == 1) {
-		if (req->minor >= 1)
-			evhttp_maybe_add_date_header(req->output_headers);
-
 		/*
 		 * if the protocol is 1.0; and the connection was keep-alive
 		 * we need to add a keep-alive header, too.
@@ -662,6 +709,11 @@ static enum expect evhttp_have_expect(struct evhttp_request *req, int input)
 }
 
 
+#define HTTP_APPEND(p, s, len) do {		\
+	memcpy((p), (s), (len));		\
+	(p) += (len);				\
+} while (0)
+
 /** Generate all headers appropriate for sending the http request in req (or
  * the response, if we're sending a response), and write them to evcon's
  * bufferevent. Also writes all data from req->output_buffer */
@@ -670,22 +722,85 @@ evhttp_make_header(struct evhttp_connection *evcon, struct evhttp_request *req)
 {
 	struct evkeyval *header;
 	struct evbuffer *output = bufferevent_get_output(evcon->bufev);
+	struct evbuffer_iovec v;
+	const char *method = NULL, *reason = NULL, *date = NULL;
+	size_t method_len = 0, reason_len = 0, uri_len = 0, date_len = 0;
+	char version[32];
+	size_t version_len, len;
+	char *p;
 
 	/*
 	 * Depending if this is a HTTP request or response, we might need to
 	 * add some new headers or remove existing headers.
 	 */
 	if (req->kind == EVHTTP_REQUEST) {
-		evhttp_make_header_request(evcon, req);
+		method = evhttp_make_header_request(evcon, req);
+		method_len = strlen(method);
+		uri_len = strlen(req->uri);
+		/* "<method> <uri> HTTP/x.y\r\n" */
+		version_len = evutil_snprintf(version, sizeof(version),
+		    " HTTP/%d.%d\r\n", req->major, req->minor);
+		len = method_len + 1 + uri_len + version_len;
 	} else {
 		evhttp_make_header_response(evcon, req);
+		reason = req->response_code_line ? req->response_code_line : "";
+		reason_len = strlen(reason);
+		/* "HTTP/x.y <code> <reason>\r\n" */
+		version_len = evutil_snprintf(version, sizeof(version),
+		    "HTTP/%d.%d %d ", req->major, req->minor,
+		    req->response_code);
+		len = version_len + reason_len + 2;
+
+		if (req->major == 1 && req->minor >= 1 &&
+		    evhttp_find_header(req->output_headers, "Date") == NULL)
+			date = evhttp_cached_date(evcon->http_server, &date_len);
+		if (date != NULL)
+			len += 6 + date_len + 2;
 	}
 
 	TAILQ_FOREACH(header, req->output_headers, next) {
-		evbuffer_add_printf(output, "%s: %s\r\n",
-		    header->key, header->value);
+		len += strlen(header->key) + 2 + strlen(header->value) + 2;
 	}
-	evbuffer_add(output, "\r\n", 2);
+	len += 2;
+
+	/* Serialize everything into one contiguous chunk of the output */
+	if (evbuffer_reserve_space(output, len, &v, 1) != 1) {
+		event_warn("%s: evbuffer_reserve_space", __func__);
+		return;
+	}
+	p = v.iov_base;
+
+	if (method != NULL) {
+		HTTP_APPEND(p, method, method_len);
+		*p++ = ' ';
+		HTTP_APPEND(p, req->uri, uri_len);
+		HTTP_APPEND(p, version, version_len);
+	} else {
+		HTTP_APPEND(p, version, version_len);
+		HTTP_APPEND(p, reason, reason_len);
+		HTTP_APPEND(p, "\r\n", 2);
+		if (date != NULL) {
+			HTTP_APPEND(p, "Date: ", 6);
+			HTTP_APPEND(p, date, date_len);
+			HTTP_APPEND(p, "\r\n", 2);
+		}
+	}
+
+	TAILQ_FOREACH(header, req->output_headers, next) {
+		HTTP_APPEND(p, header->key, strlen(header->key));
+		HTTP_APPEND(p, ": ", 2);
+		HTTP_APPEND(p, header->value, strlen(header->value));
+		HTTP_APPEND(p, "\r\n", 2);
+	}
+	HTTP_APPEND(p, "\r\n", 2);
+
+	EVUTIL_ASSERT((size_t)(p - (char *)v.iov_base) == len);
+	v.iov_len = len;
+	evbuffer_commit_space(output, &v, 1);
+
+	if (method == NULL)
+		evcon->stats_out += len +
+		    evbuffer_get_length(req->output_buffer);
 
 	if (evhttp_have_expect(req, 0) != CONTINUE &&
 		evbuffer_get_length(req->output_buffer)) {
@@ -693,7 +808,11 @@ evhttp_make_header(struct evhttp_connection *evcon, struct evhttp_request *req)
 		 * For a request, we add the POST data, for a reply, this
 		 * is the regular data.
 		 */
-		evbuffer_add_buffer(output, req->output_buffer);
+		if (req->kind == EVHTTP_REQUEST &&
+		    (req->flags & EVHTTP_REQ_STREAM_UPLOAD))
+			evhttp_request_upload_chunk_(req, req->output_buffer);
+		else
+			evbuffer_add_buffer(output, req->output_buffer);
 	}
 }
 
@@ -740,12 +859,16 @@ evhttp_connection_incoming_fail(struct evhttp_request *req,
 		 * need to disassociated it from the connection here.
 		 */
 		if (!req->userdone) {
+			evhttp_request_set_inflight_(req, 0);
 			/* remove it so that it will not be freed */
 			TAILQ_REMOVE(&req->evcon->requests, req, next);
 			/* indicate that this request no longer has a
 			 * connection object
 			 */
 			req->evcon = NULL;
+			/* the reply cannot be sent anymore */
+			if (req->cancel_cb != NULL)
+				(*req->cancel_cb)(req, req->cancel_cb_arg);
 		}
 		return (-1);
 	case EVREQ_HTTP_INVALID_HEADER:
@@ -831,6 +954,8 @@ evhttp_connection_fail_(struct evhttp_connection *evcon,
 {
 	const int errsave = EVUTIL_SOCKET_ERROR();
 	struct evhttp_request* req = TAILQ_FIRST(&evcon->requests);
+	/* the callbacks might free evcon */
+	struct evhttp_pool_conn *pconn = evcon->pool_conn;
 	void (*cb)(struct evhttp_request *, void *);
 	void *cb_arg;
 	void (*error_cb)(enum evhttp_request_error, void *);
@@ -889,6 +1014,9 @@ evhttp_connection_fail_(struct evhttp_connection *evcon,
 		error_cb(error, error_cb_arg);
 	if (cb != NULL)
 		(*cb)(NULL, cb_arg);
+
+	if (pconn != NULL)
+		evhttp_pool_conn_release(pconn);
 }
 
 /* Bufferevent callback: invoked when any data has been written from an
@@ -915,6 +1043,8 @@ evhttp_connection_done(struct evhttp_connection *evcon)
 {
 	struct evhttp_request *req = TAILQ_FIRST(&evcon->requests);
 	int con_outgoing = evcon->flags & EVHTTP_CON_OUTGOING;
+	/* the callback might free evcon */
+	struct evhttp_pool_conn *pconn = evcon->pool_conn;
 	int free_evcon = 0;
 
 	if (con_outgoing) {
@@ -957,6 +1087,7 @@ evhttp_connection_done(struct evhttp_connection *evcon)
 		 * connection so that we can reply to it.
 		 */
 		evcon->state = EVCON_WRITING;
+		evhttp_stats_mark_(evcon);
 	}
 
 	/* notify the user of the request */
@@ -975,6 +1106,8 @@ evhttp_connection_done(struct evhttp_connection *evcon)
 	 */
 	if (free_evcon && TAILQ_FIRST(&evcon->requests) == NULL) {
 		evhttp_connection_free(evcon);
+	} else if (con_outgoing && pconn != NULL) {
+		evhttp_pool_conn_release(pconn);
 	}
 }
 
@@ -992,6 +1125,75 @@ evhttp_connection_done(struct evhttp_connection *evcon)
  *     ran over the maximum limit
  */
 
+#define get_deferred_queue(evcon)		\
+	((evcon)->base)
+
+/*
+ * Stops reading a streamed request body as long as the consumer has not
+ * drained the input buffer of the request; returns 1 if paused.
+ */
+static int
+evhttp_stream_body_pause_(struct evhttp_request *req)
+{
+	if ((req->flags & EVHTTP_REQ_STREAM_BODY) == 0 ||
+	    evbuffer_get_length(req->input_buffer) == 0)
+		return (0);
+
+	req->flags |= EVHTTP_REQ_STREAM_PAUSED;
+	bufferevent_disable(req->evcon->bufev, EV_READ);
+	return (1);
+}
+
+static void
+evhttp_stream_body_drain_cb(struct evbuffer *buf,
+    const struct evbuffer_cb_info *info, void *arg)
+{
+	struct evhttp_request *req = arg;
+	struct evhttp_connection *evcon = req->evcon;
+
+	if ((req->flags & EVHTTP_REQ_STREAM_PAUSED) == 0 || evcon == NULL ||
+	    info->n_deleted == 0 || evbuffer_get_length(buf) > 0)
+		return;
+
+	req->flags &= ~EVHTTP_REQ_STREAM_PAUSED;
+	bufferevent_enable(evcon->bufev, EV_READ);
+
+	/* the data we already have has to be processed as well; do it
+	 * outside of the callback of the consumer */
+	event_deferred_cb_schedule_(get_deferred_queue(evcon),
+	    &evcon->read_more_deferred_cb);
+}
+
+/* Parses the NUL-terminated size line of a chunk; returns -1 if it is
+ * malformed.  Leading whitespace is skipped, as strtoll() used to. */
+static ev_int64_t
+evhttp_parse_chunk_size_(const char *p)
+{
+	const char *start;
+	ev_int64_t size = 0;
+	int digit;
+
+	while (EVUTIL_ISSPACE_(*p))
+		++p;
+	for (start = p;; ++p) {
+		if (*p >= '0' && *p <= '9')
+			digit = *p - '0';
+		else if (*p >= 'a' && *p <= 'f')
+			digit = *p - 'a' + 10;
+		else if (*p >= 'A' && *p <= 'F')
+			digit = *p - 'A' + 10;
+		else
+			break;
+		if (size > (EV_INT64_MAX >> 4))
+			return (-1);
+		size = (size << 4) | digit;
+	}
+	if (p == start || (*p != '\0' && *p != ' '))
+		return (-1);
+
+	return (size);
+}
+
 static enum message_read_status
 evhttp_handle_chunked_read(struct evhttp_request *req, struct evbuffer *buf)
 {
@@ -1015,22 +1217,18 @@ evhttp_handle_chunked_read(struct evhttp_request *req, struct evbuffer *buf)
 		if (req->ntoread < 0) {
 			/* Read chunk size */
 			ev_int64_t ntoread;
-			char *p = evbuffer_readln(buf, NULL, EVBUFFER_EOL_CRLF);
-			char *endp;
-			int error;
+			size_t len, drain;
+			char *p = evhttp_readln_(buf, &len, &drain);
 			if (p == NULL)
 				break;
 			/* the last chunk is on a new line? */
-			if (strlen(p) == 0) {
-				mm_free(p);
+			if (len == 0) {
+				evhttp_readln_done_(buf, p, drain);
 				continue;
 			}
-			ntoread = evutil_strtoll(p, &endp, 16);
-			error = (*p == '\0' ||
-			    (*endp != '\0' && *endp != ' ') ||
-			    ntoread < 0);
-			mm_free(p);
-			if (error) {
+			ntoread = evhttp_parse_chunk_size_(p);
+			evhttp_readln_done_(buf, p, drain);
+			if (ntoread < 0) {
 				/* could not get chunk size */
 				return (DATA_CORRUPTED);
 			}
@@ -1061,22 +1259,32 @@ evhttp_handle_chunked_read(struct evhttp_request *req, struct evbuffer *buf)
 			return DATA_CORRUPTED;
 		}
 
-		/* don't have enough to complete a chunk; wait for more */
-		if (req->ntoread > 0 && buflen < (ev_uint64_t)req->ntoread)
-			return (MORE_DATA_EXPECTED);
+		if (req->ntoread > 0 && buflen < (ev_uint64_t)req->ntoread) {
+			/* don't have enough to complete a chunk; wait for more */
+			if ((req->flags & EVHTTP_REQ_STREAM_BODY) == 0)
+				return (MORE_DATA_EXPECTED);
 
-		/* Completed chunk */
-		evbuffer_remove_buffer(buf, req->input_buffer, (size_t)req->ntoread);
-		req->ntoread = -1;
+			/* pass on what we have of a streamed chunk */
+			evbuffer_remove_buffer(buf, req->input_buffer, buflen);
+			req->ntoread -= buflen;
+		} else {
+			/* Completed chunk */
+			evbuffer_remove_buffer(buf, req->input_buffer,
+			    (size_t)req->ntoread);
+			req->ntoread = -1;
+		}
 		if (req->chunk_cb != NULL) {
 			req->flags |= EVHTTP_REQ_DEFER_FREE;
 			(*req->chunk_cb)(req, req->cb_arg);
-			evbuffer_drain(req->input_buffer,
-			    evbuffer_get_length(req->input_buffer));
+			if ((req->flags & EVHTTP_REQ_STREAM_BODY) == 0)
+				evbuffer_drain(req->input_buffer,
+				    evbuffer_get_length(req->input_buffer));
 			req->flags &= ~EVHTTP_REQ_DEFER_FREE;
 			if ((req->flags & EVHTTP_REQ_NEEDS_FREE) != 0) {
 				return (REQUEST_CANCELED);
 			}
+			if (evhttp_stream_body_pause_(req))
+				return (MORE_DATA_EXPECTED);
 		}
 	}
 
@@ -1191,16 +1399,20 @@ evhttp_read_body(struct evhttp_connection *evcon, struct evhttp_request *req)
 		return;
 	}
 
-	if (evbuffer_get_length(req->input_buffer) > 0 && req->chunk_cb != NULL) {
+	if (evbuffer_get_length(req->input_buffer) > 0 && req->chunk_cb != NULL &&
+	    (req->flags & EVHTTP_REQ_STREAM_PAUSED) == 0) {
 		req->flags |= EVHTTP_REQ_DEFER_FREE;
 		(*req->chunk_cb)(req, req->cb_arg);
 		req->flags &= ~EVHTTP_REQ_DEFER_FREE;
-		evbuffer_drain(req->input_buffer,
-		    evbuffer_get_length(req->input_buffer));
+		if ((req->flags & EVHTTP_REQ_STREAM_BODY) == 0)
+			evbuffer_drain(req->input_buffer,
+			    evbuffer_get_length(req->input_buffer));
 		if ((req->flags & EVHTTP_REQ_NEEDS_FREE) != 0) {
 			evhttp_request_free_auto(req);
 			return;
 		}
+		if (req->ntoread != 0 && evhttp_stream_body_pause_(req))
+			return;
 	}
 
 	if (!req->ntoread) {
@@ -1211,9 +1423,6 @@ evhttp_read_body(struct evhttp_connection *evcon, struct evhttp_request *req)
 	}
 }
 
-#define get_deferred_queue(evcon)		\
-	((evcon)->base)
-
 /*
  * Gets called when more data becomes available
  */
@@ -1230,6 +1439,7 @@ evhttp_read_cb(struct bufferevent *bufev, void *arg)
 
 	switch (evcon->state) {
 	case EVCON_READING_FIRSTLINE:
+		evhttp_stats_start_(evcon);
 		evhttp_read_firstline(evcon, req);
 		/* note the request may have been freed in
 		 * evhttp_read_body */
@@ -1267,6 +1477,7 @@ evhttp_read_cb(struct bufferevent *bufev, void *arg)
 	case EVCON_DISCONNECTED:
 	case EVCON_CONNECTING:
 	case EVCON_WRITING:
+	case EVCON_PARKED:
 	default:
 		event_errx(1, "%s: illegal connection state %d",
 			   __func__, evcon->state);
@@ -1297,6 +1508,13 @@ evhttp_write_connectioncb(struct evhttp_connection *evcon, void *arg)
 	if (evbuffer_get_length(output) > 0)
 		return;
 
+	/* The body of a streamed request is not complete yet */
+	if (req->flags & EVHTTP_REQ_STREAM_UPLOAD) {
+		if (req->upload_cb != NULL)
+			(*req->upload_cb)(req, req->cb_arg);
+		return;
+	}
+
 	/* We are done writing our header and are now expecting the response */
 	req->kind = EVHTTP_RESPONSE;
 
@@ -1328,9 +1546,16 @@ evhttp_connection_free(struct evhttp_connection *evcon)
 		evhttp_request_free_(evcon, req);
 	}
 
+	evhttp_coding_end_(evcon);
+	evhttp_stats_reset_(evcon);
+
 	if (evcon->http_server != NULL) {
 		struct evhttp *http = evcon->http_server;
 		TAILQ_REMOVE(&http->connections, evcon, next);
+		--http->nconnections;
+		evhttp_update_accepting_(http);
+		if (http->worker != NULL)
+			evhttp_worker_load_(http->worker, -1);
 	}
 
 	if (event_initialized(&evcon->retry_ev)) {
@@ -1348,6 +1573,9 @@ evhttp_connection_free(struct evhttp_connection *evcon)
 			evcon->fd = bufferevent_getfd(evcon->bufev);
 
 		bufferevent_free(evcon->bufev);
+	} else {
+		/* parked */
+		need_close = 1;
 	}
 
 	if (evcon->fd != -1) {
@@ -1469,6 +1697,13 @@ static void
 evhttp_connection_start_detectclose(struct evhttp_connection *evcon)
 {
 	evcon->flags |= EVHTTP_CON_CLOSEDETECT;
+	/* a pipelined request stays in the buffer until the reply is done */
+	if (evcon->flags & EVHTTP_CON_INCOMING)
+		bufferevent_setcb(evcon->bufev,
+		    NULL, /*read*/
+		    evhttp_write_cb,
+		    evhttp_error_cb,
+		    evcon);
 	bufferevent_enable(evcon->bufev, EV_READ);
 }
 
@@ -1492,6 +1727,8 @@ static void
 evhttp_connection_cb_cleanup(struct evhttp_connection *evcon)
 {
 	struct evcon_requestq requests;
+	/* the callbacks might free evcon */
+	struct evhttp_pool_conn *pconn = evcon->pool_conn;
 
 	evhttp_connection_reset_(evcon);
 	if (evcon->retry_max < 0 || evcon->retry_cnt < evcon->retry_max) {
@@ -1539,6 +1776,9 @@ evhttp_connection_cb_cleanup(struct evhttp_connection *evcon)
 		request->cb(request, request->cb_arg);
 		evhttp_request_free_auto(request);
 	}
+
+	if (pconn != NULL)
+		evhttp_pool_conn_release(pconn);
 }
 
 static void
@@ -1601,10 +1841,23 @@ evhttp_error_cb(struct bufferevent *bufev, short what, void *arg)
 	case EVCON_READING_HEADERS:
 	case EVCON_READING_TRAILER:
 	case EVCON_WRITING:
+	case EVCON_PARKED:
 	default:
 		break;
 	}
 
+	/* an incoming connection in close detect mode waits for the reply
+	 * to a pending request; the client going away cancels it. */
+	if ((evcon->flags & EVHTTP_CON_CLOSEDETECT) &&
+	    (evcon->flags & EVHTTP_CON_INCOMING)) {
+		if (what == (BEV_EVENT_READING|BEV_EVENT_TIMEOUT)) {
+			/* the callback may take its time */
+			bufferevent_enable(bufev, EV_READ);
+			return;
+		}
+		evcon->flags &= ~EVHTTP_CON_CLOSEDETECT;
+	}
+
 	/* when we are in close detect mode, a read error means that
 	 * the other side closed their connection.
 	 */
@@ -2181,6 +2434,36 @@ evhttp_add_header_internal(struct evkeyvalq *headers,
 	return (0);
 }
 
+/* Reads a line from buffer, in place unless that is not possible.  Once
+ * done with the line, evhttp_readln_done_() has to be called with the same
+ * drain value. */
+static char *
+evhttp_readln_(struct evbuffer *buffer, size_t *len, size_t *drain)
+{
+	char *line;
+
+	switch (evbuffer_readln_inplace_(buffer, &line, len, drain,
+		EVBUFFER_EOL_CRLF)) {
+	case 0:
+		return (line);
+	case 1:
+		/* a copy of the line has been made */
+		*drain = 0;
+		return (evbuffer_readln(buffer, len, EVBUFFER_EOL_CRLF));
+	default:
+		return (NULL);
+	}
+}
+
+static void
+evhttp_readln_done_(struct evbuffer *buffer, char *line, size_t drain)
+{
+	if (drain)
+		evbuffer_drain(buffer, drain);
+	else
+		mm_free(line);
+}
+
 /*
  * Parses header lines from a request or a response into the specified
  * request object given an event buffer.
@@ -2197,9 +2480,8 @@ evhttp_parse_firstline_(struct evhttp_request *req, struct evbuffer *buffer)
 	char *line;
 	enum message_read_status status = ALL_DATA_READ;
 
-	size_t len;
-	/* XXX try */
-	line = evbuffer_readln(buffer, &len, EVBUFFER_EOL_CRLF);
+	size_t len, drain;
+	line = evhttp_readln_(buffer, &len, &drain);
 	if (line == NULL) {
 		if (req->evcon != NULL &&
 		    evbuffer_get_length(buffer) > req->evcon->max_headers_size)
@@ -2209,7 +2491,7 @@ evhttp_parse_firstline_(struct evhttp_request *req, struct evbuffer *buffer)
 	}
 
 	if (req->evcon != NULL && len > req->evcon->max_headers_size) {
-		mm_free(line);
+		evhttp_readln_done_(buffer, line, drain);
 		return (DATA_TOO_LONG);
 	}
 
@@ -2228,7 +2510,7 @@ evhttp_parse_firstline_(struct evhttp_request *req, struct evbuffer *buffer)
 		status = DATA_CORRUPTED;
 	}
 
-	mm_free(line);
+	evhttp_readln_done_(buffer, line, drain);
 	return (status);
 }
 
@@ -2270,9 +2552,8 @@ evhttp_parse_headers_(struct evhttp_request *req, struct evbuffer* buffer)
 	enum message_read_status status = MORE_DATA_EXPECTED;
 
 	struct evkeyvalq* headers = req->input_headers;
-	size_t len;
-	while ((line = evbuffer_readln(buffer, &len, EVBUFFER_EOL_CRLF))
-	       != NULL) {
+	size_t len, drain;
+	while ((line = evhttp_readln_(buffer, &len, &drain)) != NULL) {
 		char *skey, *svalue;
 
 		req->headers_size += len;
@@ -2285,7 +2566,7 @@ evhttp_parse_headers_(struct evhttp_request *req, struct evbuffer* buffer)
 
 		if (*line == '\0') { /* Last header - Done */
 			status = ALL_DATA_READ;
-			mm_free(line);
+			evhttp_readln_done_(buffer, line, drain);
 			break;
 		}
 
@@ -2293,7 +2574,7 @@ evhttp_parse_headers_(struct evhttp_request *req, struct evbuffer* buffer)
 		if (*line == ' ' || *line == '\t') {
 			if (evhttp_append_to_last_header(headers, line) == -1)
 				goto error;
-			mm_free(line);
+			evhttp_readln_done_(buffer, line, drain);
 			continue;
 		}
 
@@ -2309,7 +2590,7 @@ evhttp_parse_headers_(struct evhttp_request *req, struct evbuffer* buffer)
 		if (evhttp_add_header(headers, skey, svalue) == -1)
 			goto error;
 
-		mm_free(line);
+		evhttp_readln_done_(buffer, line, drain);
 	}
 
 	if (status == MORE_DATA_EXPECTED) {
@@ -2321,7 +2602,7 @@ evhttp_parse_headers_(struct evhttp_request *req, struct evbuffer* buffer)
 	return (status);
 
  error:
-	mm_free(line);
+	evhttp_readln_done_(buffer, line, drain);
 	return (errcode);
 }
 
@@ -2468,6 +2749,17 @@ evhttp_read_header(struct evhttp_connection *evcon,
 		return;
 	}
 
+	if (req->kind == EVHTTP_REQUEST)
+		evhttp_stats_parsed_(evcon);
+
+	/* Requests for streaming callbacks are handed over before their
+	 * body has been read */
+	if (req->kind == EVHTTP_REQUEST && evcon->http_server != NULL &&
+	    evhttp_stream_request_(evcon->http_server, req) == -1) {
+		evhttp_connection_fail_(evcon, EVREQ_HTTP_EOF);
+		return;
+	}
+
 	/* Callback can shut down connection with negative return value */
 	if (req->header_cb != NULL) {
 		if ((*req->header_cb)(req, req->cb_arg) < 0) {
@@ -2666,8 +2958,9 @@ evhttp_connection_set_timeout(struct evhttp_connection *evcon,
 	}
 	evhttp_set_timeout_(&evcon->timeout_read,  timeout, HTTP_READ_TIMEOUT);
 	evhttp_set_timeout_(&evcon->timeout_write, timeout, HTTP_WRITE_TIMEOUT);
-	bufferevent_set_timeouts(evcon->bufev,
-	    &evcon->timeout_read, &evcon->timeout_write);
+	if (evcon->state != EVCON_PARKED)
+		bufferevent_set_timeouts(evcon->bufev,
+		    &evcon->timeout_read, &evcon->timeout_write);
 }
 void
 evhttp_connection_set_timeout_tv(struct evhttp_connection *evcon,
@@ -2680,8 +2973,9 @@ evhttp_connection_set_timeout_tv(struct evhttp_connection *evcon,
 	}
 	evhttp_set_timeout_tv_(&evcon->timeout_read,  tv, HTTP_READ_TIMEOUT);
 	evhttp_set_timeout_tv_(&evcon->timeout_write, tv, HTTP_WRITE_TIMEOUT);
-	bufferevent_set_timeouts(evcon->bufev,
-	    &evcon->timeout_read, &evcon->timeout_write);
+	if (evcon->state != EVCON_PARKED)
+		bufferevent_set_timeouts(evcon->bufev,
+		    &evcon->timeout_read, &evcon->timeout_write);
 }
 void evhttp_connection_set_connect_timeout_tv(struct evhttp_connection *evcon,
     const struct timeval *tv)
@@ -2697,7 +2991,7 @@ void evhttp_connection_set_read_timeout_tv(struct evhttp_connection *evcon,
 {
 	evcon->flags |= EVHTTP_CON_TIMEOUT_ADJUSTED;
 	evhttp_set_timeout_tv_(&evcon->timeout_read, tv, -1);
-	if (evcon->state != EVCON_CONNECTING)
+	if (evcon->state != EVCON_CONNECTING && evcon->state != EVCON_PARKED)
 		bufferevent_set_timeouts(evcon->bufev,
 		    &evcon->timeout_read, &evcon->timeout_write);
 }
@@ -2706,7 +3000,7 @@ void evhttp_connection_set_write_timeout_tv(struct evhttp_connection *evcon,
 {
 	evcon->flags |= EVHTTP_CON_TIMEOUT_ADJUSTED;
 	evhttp_set_timeout_tv_(&evcon->timeout_write, tv, -1);
-	if (evcon->state != EVCON_CONNECTING)
+	if (evcon->state != EVCON_CONNECTING && evcon->state != EVCON_PARKED)
 		bufferevent_set_timeouts(evcon->bufev,
 		    &evcon->timeout_read, &evcon->timeout_write);
 }
@@ -2749,6 +3043,8 @@ evhttp_connection_get_peer(struct evhttp_connection *evcon,
 const struct sockaddr*
 evhttp_connection_get_addr(struct evhttp_connection *evcon)
 {
+	if (evcon->bufev == NULL)
+		return (NULL);
 	return bufferevent_socket_get_conn_address_(evcon->bufev);
 }
 
@@ -2826,14 +3122,9 @@ evhttp_connection_connect_(struct evhttp_connection *evcon)
 	return (0);
 }
 
-/*
- * Starts an HTTP request on the provided evhttp_connection object.
- * If the connection object is not connected to the web server already,
- * this will start the connection.
- */
-
-int
-evhttp_make_request(struct evhttp_connection *evcon,
+/* Like evhttp_make_request(), but leaves req to the caller on failure. */
+static int
+evhttp_make_request_(struct evhttp_connection *evcon,
     struct evhttp_request *req,
     enum evhttp_cmd_type type, const char *uri)
 {
@@ -2844,7 +3135,6 @@ evhttp_make_request(struct evhttp_connection *evcon,
 		mm_free(req->uri);
 	if ((req->uri = mm_strdup(uri)) == NULL) {
 		event_warn("%s: strdup", __func__);
-		evhttp_request_free_auto(req);
 		return (-1);
 	}
 
@@ -2888,6 +3178,23 @@ evhttp_make_request(struct evhttp_connection *evcon,
 	return (0);
 }
 
+/*
+ * Starts an HTTP request on the provided evhttp_connection object.
+ * If the connection object is not connected to the web server already,
+ * this will start the connection.
+ */
+
+int
+evhttp_make_request(struct evhttp_connection *evcon,
+    struct evhttp_request *req,
+    enum evhttp_cmd_type type, const char *uri)
+{
+	int res = evhttp_make_request_(evcon, req, type, uri);
+	if (res == -1 && req->uri == NULL)
+		evhttp_request_free_auto(req);
+	return (res);
+}
+
 void
 evhttp_cancel_request(struct evhttp_request *req)
 {
@@ -2915,827 +3222,3891 @@ evhttp_cancel_request(struct evhttp_request *req)
 }
 
 /*
- * Reads data from file descriptor into request structure
- * Request structure needs to be set up correctly.
+ * Client connection pool
  */
 
-void
-evhttp_start_read_(struct evhttp_connection *evcon)
+static void
+evhttp_pool_conn_free(struct evhttp_pool_conn *pconn)
 {
-	bufferevent_disable(evcon->bufev, EV_WRITE);
-	bufferevent_enable(evcon->bufev, EV_READ);
-
-	evcon->state = EVCON_READING_FIRSTLINE;
-	/* Reset the bufferevent callbacks */
-	bufferevent_setcb(evcon->bufev,
-	    evhttp_read_cb,
-	    evhttp_write_cb,
-	    evhttp_error_cb,
-	    evcon);
+	struct evhttp_pool_host *host = pconn->host;
 
-	/* If there's still data pending, process it next time through the
-	 * loop.  Don't do it now; that could get recusive. */
-	if (evbuffer_get_length(bufferevent_get_input(evcon->bufev))) {
-		event_deferred_cb_schedule_(get_deferred_queue(evcon),
-		    &evcon->read_more_deferred_cb);
+	TAILQ_REMOVE(&host->conns, pconn, next);
+	--host->nconns;
+	if (pconn->idle) {
+		TAILQ_REMOVE(&host->idle, pconn, next_idle);
+		--host->nidle;
 	}
-}
+	event_del(&pconn->ev);
 
-void
-evhttp_start_write_(struct evhttp_connection *evcon)
-{
-	bufferevent_disable(evcon->bufev, EV_WRITE);
-	bufferevent_enable(evcon->bufev, EV_READ);
+	/* do not get notified about the close we are causing */
+	pconn->evcon->pool_conn = NULL;
+	evhttp_connection_set_closecb(pconn->evcon, NULL, NULL);
+	evhttp_connection_free(pconn->evcon);
 
-	evcon->state = EVCON_WRITING;
-	evhttp_write_buffer(evcon, evhttp_write_connectioncb, NULL);
+	mm_free(pconn);
 }
 
+static void evhttp_pool_flight_free(struct evhttp_pool_flight *flight);
+
 static void
-evhttp_send_done(struct evhttp_connection *evcon, void *arg)
+evhttp_pool_host_free(struct evhttp_pool_host *host)
 {
-	int need_close;
-	struct evhttp_request *req = TAILQ_FIRST(&evcon->requests);
-	TAILQ_REMOVE(&evcon->requests, req, next);
+	struct evhttp_pool_flight *flight;
+	struct evhttp_pool_req *preq;
+	struct evhttp_pool_conn *pconn;
 
-	if (req->on_complete_cb != NULL) {
-		req->on_complete_cb(req, req->on_complete_cb_arg);
+	while ((flight = TAILQ_FIRST(&host->flights)) != NULL) {
+		TAILQ_REMOVE(&host->flights, flight, next);
+		evhttp_pool_flight_free(flight);
+	}
+	while ((preq = TAILQ_FIRST(&host->waiting)) != NULL) {
+		TAILQ_REMOVE(&host->waiting, preq, next);
+		evhttp_request_free_auto(preq->req);
+		mm_free(preq->uri);
+		mm_free(preq);
 	}
+	while ((pconn = TAILQ_FIRST(&host->conns)) != NULL)
+		evhttp_pool_conn_free(pconn);
 
-	need_close =
-	    (REQ_VERSION_BEFORE(req, 1, 1) &&
-	    !evhttp_is_connection_keepalive(req->input_headers)) ||
-	    evhttp_is_request_connection_close(req);
+	TAILQ_REMOVE(&host->pool->hosts, host, next);
+	mm_free(host->address);
+	mm_free(host);
+}
 
-	EVUTIL_ASSERT(req->flags & EVHTTP_REQ_OWN_CONNECTION);
-	evhttp_request_free(req);
+/* Mark pconn as unusable and evict it once we are out of its callbacks. */
+static void
+evhttp_pool_conn_kill(struct evhttp_pool_conn *pconn)
+{
+	struct evhttp_pool_host *host = pconn->host;
 
-	if (need_close) {
-		evhttp_connection_free(evcon);
+	if (pconn->dead)
 		return;
+	pconn->dead = 1;
+	if (pconn->idle) {
+		TAILQ_REMOVE(&host->idle, pconn, next_idle);
+		--host->nidle;
+		pconn->idle = 0;
 	}
-
-	/* we have a persistent connection; try to accept another request. */
-	if (evhttp_associate_new_request_with_connection(evcon) == -1) {
-		evhttp_connection_free(evcon);
-	}
+	event_active(&pconn->ev, EV_TIMEOUT, 1);
 }
 
-/*
- * Returns an error page.
- */
-void
-evhttp_send_error(struct evhttp_request *req, int error, const char *reason)
+static void
+evhttp_pool_conn_set_idle(struct evhttp_pool_conn *pconn)
 {
-#define ERR_FORMAT "<html><head>" \
-	"<title>%d %s</title>" \
-	"</head><body>" \
-	"<h1>%d %s</h1>%s" \
-	"</body></html>"
-
-	struct evbuffer *buf = evbuffer_new();
-	struct evhttp *http = req->evcon->http_server;
+	struct evhttp_pool_host *host = pconn->host;
 
-	if (buf == NULL) {
-		/* if we cannot allocate memory; we just drop the connection */
-		evhttp_connection_free(req->evcon);
-		return;
-	}
+	EVUTIL_ASSERT(!pconn->idle && !pconn->busy && !pconn->dead);
 
-	evhttp_response_code_(req, error, reason);
+	/* The most recently used connection is reused first, so that
+	 * connections we do not need anymore can run into the idle
+	 * timeout. */
+	TAILQ_INSERT_HEAD(&host->idle, pconn, next_idle);
+	++host->nidle;
+	pconn->idle = 1;
+	event_add(&pconn->ev, &host->pool->idle_timeout);
+}
 
-	/* Output error using callback for connection's evhttp, if available */
-	if ((http->errorcb == NULL) ||
-	    ((*http->errorcb)(req, buf, error, reason, http->errorcbarg) < 0))
-	{
-		const char *heading = evhttp_response_phrase_internal(error);
+static int
+evhttp_pool_conn_make_request(struct evhttp_pool_conn *pconn,
+    struct evhttp_request *req, enum evhttp_cmd_type type, const char *uri)
+{
+	struct evhttp_pool_host *host = pconn->host;
 
-		evbuffer_drain(buf, evbuffer_get_length(buf));
-		evbuffer_add_printf(buf, ERR_FORMAT,
-		   error, heading, error, heading,
-		   (reason ? reason : ""));
+	if (pconn->idle) {
+		TAILQ_REMOVE(&host->idle, pconn, next_idle);
+		--host->nidle;
+		pconn->idle = 0;
+		event_del(&pconn->ev);
 	}
 
-	evhttp_send_page_(req, buf);
+	/* The request might fail right away, in which case
+	 * evhttp_pool_conn_release() is called before we return. */
+	pconn->busy = 1;
+	if (evhttp_make_request_(pconn->evcon, req, type, uri) == -1) {
+		req->evcon = NULL;
+		pconn->busy = 0;
+		evhttp_pool_conn_kill(pconn);
+		return (-1);
+	}
 
-	evbuffer_free(buf);
-#undef ERR_FORMAT
+	return (0);
 }
+
+/* A waiting request could not be started; tell the user and drop it. */
 static void
-evhttp_send_notfound(struct evhttp_request *req, const char *url)
+evhttp_pool_req_fail(struct evhttp_request *req)
 {
-#define REASON_FORMAT "<p>The requested URL %s was not found on this server.</p>"
-	char   *escaped_url = NULL;
-	char   *reason = NULL;
-	size_t reason_len;
+	if (req->error_cb != NULL)
+		(*req->error_cb)(EVREQ_HTTP_EOF, req->cb_arg);
+	if (req->cb != NULL)
+		(*req->cb)(NULL, req->cb_arg);
+	evhttp_request_free_auto(req);
+}
 
-	url = (url != NULL ? url : req->uri);
-	if (url != NULL)
-		escaped_url = evhttp_htmlescape(url);
+static void evhttp_pool_conn_cb(evutil_socket_t fd, short what, void *arg);
+static void evhttp_pool_conn_closecb(struct evhttp_connection *evcon,
+    void *arg);
 
-	if (escaped_url != NULL) {
-		reason_len = strlen(REASON_FORMAT)+strlen(escaped_url)+1;
-		reason = mm_malloc(reason_len);
+static struct evhttp_pool_conn *
+evhttp_pool_conn_new(struct evhttp_pool_host *host)
+{
+	struct evhttp_client_pool *pool = host->pool;
+	struct evhttp_pool_conn *pconn;
+
+	if ((pconn = mm_calloc(1, sizeof(*pconn))) == NULL) {
+		event_warn("%s: calloc", __func__);
+		return (NULL);
 	}
 
-	if ((escaped_url != NULL) && (reason != NULL))
-		evutil_snprintf(reason, reason_len, REASON_FORMAT, escaped_url);
+	pconn->evcon = evhttp_connection_base_new(pool->base, pool->dns_base,
+	    host->address, host->port);
+	if (pconn->evcon == NULL) {
+		mm_free(pconn);
+		return (NULL);
+	}
 
-	evhttp_send_error(req, HTTP_NOTFOUND, reason);
+	pconn->host = host;
+	pconn->evcon->pool_conn = pconn;
+	evhttp_connection_set_retries(pconn->evcon, pool->retry_max);
+	evhttp_connection_set_closecb(pconn->evcon,
+	    evhttp_pool_conn_closecb, pconn);
+	evtimer_assign(&pconn->ev, pool->base, evhttp_pool_conn_cb, pconn);
 
-	if (reason != NULL)
-		mm_free(reason);
-	if (escaped_url != NULL)
-		mm_free(escaped_url);
-#undef REASON_FORMAT
-}
+	TAILQ_INSERT_TAIL(&host->conns, pconn, next);
+	++host->nconns;
 
+	if (pool->conncb != NULL)
+		(*pool->conncb)(pconn->evcon, pool->conncbarg);
 
-/* Requires that headers and response code are already set up */
+	return (pconn);
+}
 
-static inline void
-evhttp_send(struct evhttp_request *req, struct evbuffer *databuf)
+/* Hand out waiting requests to connections that we are allowed to open. */
+static void
+evhttp_pool_host_pump(struct evhttp_pool_host *host)
 {
-	struct evhttp_connection *evcon = req->evcon;
+	struct evhttp_pool_req *preq;
+	struct evhttp_pool_conn *pconn;
 
-	if (evcon == NULL) {
-		evhttp_request_free(req);
-		return;
-	}
+	while ((preq = TAILQ_FIRST(&host->waiting)) != NULL) {
+		if ((pconn = TAILQ_FIRST(&host->idle)) == NULL) {
+			if (host->nconns >= host->pool->max_per_host)
+				break;
+			if ((pconn = evhttp_pool_conn_new(host)) == NULL)
+				break;
+		}
 
-	EVUTIL_ASSERT(TAILQ_FIRST(&evcon->requests) == req);
+		TAILQ_REMOVE(&host->waiting, preq, next);
+		--host->nwaiting;
+		if (evhttp_pool_conn_make_request(pconn,
+			preq->req, preq->type, preq->uri) == -1)
+			evhttp_pool_req_fail(preq->req);
+		mm_free(preq->uri);
+		mm_free(preq);
+	}
+}
 
-	/* we expect no more calls form the user on this request */
-	req->userdone = 1;
+/* Idle timeout expired, or the connection was killed. */
+static void
+evhttp_pool_conn_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct evhttp_pool_conn *pconn = arg;
+	struct evhttp_pool_host *host = pconn->host;
 
-	/* xxx: not sure if we really should expose the data buffer this way */
-	if (databuf != NULL)
-		evbuffer_add_buffer(req->output_buffer, databuf);
+	event_debug(("%s: evicting connection to \"%s:%d\"%s", __func__,
+		host->address, host->port, pconn->dead ? " (closed)" : ""));
 
-	/* Adds headers to the response */
-	evhttp_make_header(evcon, req);
+	evhttp_pool_conn_free(pconn);
 
-	evhttp_write_buffer(evcon, evhttp_send_done, NULL);
+	evhttp_pool_host_pump(host);
+	if (host->nconns == 0 && host->nwaiting == 0 &&
+	    TAILQ_EMPTY(&host->flights))
+		evhttp_pool_host_free(host);
 }
 
-void
-evhttp_send_reply(struct evhttp_request *req, int code, const char *reason,
-    struct evbuffer *databuf)
+static void
+evhttp_pool_conn_closecb(struct evhttp_connection *evcon, void *arg)
 {
-	evhttp_response_code_(req, code, reason);
+	struct evhttp_pool_conn *pconn = arg;
 
-	evhttp_send(req, databuf);
+	/* Connections with an outstanding request are released, and then
+	 * evicted, once the request completed or failed. */
+	if (!pconn->busy)
+		evhttp_pool_conn_kill(pconn);
 }
 
-void
-evhttp_send_reply_start(struct evhttp_request *req, int code,
-    const char *reason)
+/* Called once the request on a pooled connection completed or failed. */
+static void
+evhttp_pool_conn_release(struct evhttp_pool_conn *pconn)
 {
-	evhttp_response_code_(req, code, reason);
+	struct evhttp_connection *evcon = pconn->evcon;
+	struct evhttp_pool_host *host = pconn->host;
+	struct evhttp_pool_req *preq;
 
-	if (req->evcon == NULL)
+	if (!pconn->busy)
 		return;
-
-	if (evhttp_find_header(req->output_headers, "Content-Length") == NULL &&
-	    REQ_VERSION_ATLEAST(req, 1, 1) &&
-	    evhttp_response_needs_body(req)) {
-		/*
-		 * prefer HTTP/1.1 chunked encoding to closing the connection;
-		 * note RFC 2616 section 4.4 forbids it with Content-Length:
-		 * and it's not necessary then anyway.
-		 */
-		evhttp_add_header(req->output_headers, "Transfer-Encoding",
-		    "chunked");
-		req->chunked = 1;
-	} else {
-		req->chunked = 0;
-	}
-	evhttp_make_header(req->evcon, req);
-	evhttp_write_buffer(req->evcon, NULL, NULL);
-}
-
-void
-evhttp_send_reply_chunk_with_cb(struct evhttp_request *req, struct evbuffer *databuf,
-    void (*cb)(struct evhttp_connection *, void *), void *arg)
-{
-	struct evhttp_connection *evcon = req->evcon;
-	struct evbuffer *output;
-
-	if (evcon == NULL)
+	/* The callback might have issued another request on evcon */
+	if (TAILQ_FIRST(&evcon->requests) != NULL)
 		return;
 
-	output = bufferevent_get_output(evcon->bufev);
+	pconn->busy = 0;
 
-	if (evbuffer_get_length(databuf) == 0)
-		return;
-	if (!evhttp_response_needs_body(req))
+	if (!evhttp_connected(evcon)) {
+		evhttp_pool_conn_kill(pconn);
 		return;
-	if (req->chunked) {
-		evbuffer_add_printf(output, "%x\r\n",
-				    (unsigned)evbuffer_get_length(databuf));
-	}
-	evbuffer_add_buffer(output, databuf);
-	if (req->chunked) {
-		evbuffer_add(output, "\r\n", 2);
 	}
-	evhttp_write_buffer(evcon, cb, arg);
-}
-
-void
-evhttp_send_reply_chunk(struct evhttp_request *req, struct evbuffer *databuf)
-{
-	evhttp_send_reply_chunk_with_cb(req, databuf, NULL, NULL);
-}
-void
-evhttp_send_reply_end(struct evhttp_request *req)
-{
-	struct evhttp_connection *evcon = req->evcon;
-	struct evbuffer *output;
 
-	if (evcon == NULL) {
-		evhttp_request_free(req);
+	if ((preq = TAILQ_FIRST(&host->waiting)) != NULL) {
+		TAILQ_REMOVE(&host->waiting, preq, next);
+		--host->nwaiting;
+		if (evhttp_pool_conn_make_request(pconn,
+			preq->req, preq->type, preq->uri) == -1)
+			evhttp_pool_req_fail(preq->req);
+		mm_free(preq->uri);
+		mm_free(preq);
 		return;
 	}
 
-	output = bufferevent_get_output(evcon->bufev);
+	evhttp_pool_conn_set_idle(pconn);
+}
 
-	/* we expect no more calls form the user on this request */
-	req->userdone = 1;
+static struct evhttp_pool_host *
+evhttp_pool_host_find(struct evhttp_client_pool *pool,
+    const char *address, ev_uint16_t port)
+{
+	struct evhttp_pool_host *host;
 
-	if (req->chunked) {
-		evbuffer_add(output, "0\r\n\r\n", 5);
-		evhttp_write_buffer(req->evcon, evhttp_send_done, NULL);
-		req->chunked = 0;
-	} else if (evbuffer_get_length(output) == 0) {
-		/* let the connection know that we are done with the request */
-		evhttp_send_done(evcon, NULL);
-	} else {
-		/* make the callback execute after all data has been written */
-		evcon->cb = evhttp_send_done;
-		evcon->cb_arg = NULL;
+	TAILQ_FOREACH(host, &pool->hosts, next) {
+		if (host->port == port &&
+		    evutil_ascii_strcasecmp(host->address, address) == 0)
+			return (host);
 	}
+
+	return (NULL);
 }
 
-static const char *informational_phrases[] = {
-	/* 100 */ "Continue",
-	/* 101 */ "Switching Protocols"
-};
+static struct evhttp_pool_host *
+evhttp_pool_host_get(struct evhttp_client_pool *pool,
+    const char *address, ev_uint16_t port)
+{
+	struct evhttp_pool_host *host;
 
-static const char *success_phrases[] = {
-	/* 200 */ "OK",
-	/* 201 */ "Created",
-	/* 202 */ "Accepted",
-	/* 203 */ "Non-Authoritative Information",
-	/* 204 */ "No Content",
-	/* 205 */ "Reset Content",
-	/* 206 */ "Partial Content"
-};
+	if ((host = evhttp_pool_host_find(pool, address, port)) != NULL)
+		return (host);
 
-static const char *redirection_phrases[] = {
-	/* 300 */ "Multiple Choices",
-	/* 301 */ "Moved Permanently",
-	/* 302 */ "Found",
-	/* 303 */ "See Other",
-	/* 304 */ "Not Modified",
-	/* 305 */ "Use Proxy",
-	/* 307 */ "Temporary Redirect"
-};
+	if ((host = mm_calloc(1, sizeof(*host))) == NULL) {
+		event_warn("%s: calloc", __func__);
+		return (NULL);
+	}
+	if ((host->address = mm_strdup(address)) == NULL) {
+		event_warn("%s: strdup", __func__);
+		mm_free(host);
+		return (NULL);
+	}
+	host->port = port;
+	host->pool = pool;
+	TAILQ_INIT(&host->conns);
+	TAILQ_INIT(&host->idle);
+	TAILQ_INIT(&host->waiting);
+	TAILQ_INIT(&host->flights);
 
-static const char *client_error_phrases[] = {
-	/* 400 */ "Bad Request",
-	/* 401 */ "Unauthorized",
-	/* 402 */ "Payment Required",
-	/* 403 */ "Forbidden",
-	/* 404 */ "Not Found",
-	/* 405 */ "Method Not Allowed",
-	/* 406 */ "Not Acceptable",
-	/* 407 */ "Proxy Authentication Required",
-	/* 408 */ "Request Time-out",
-	/* 409 */ "Conflict",
-	/* 410 */ "Gone",
-	/* 411 */ "Length Required",
-	/* 412 */ "Precondition Failed",
-	/* 413 */ "Request Entity Too Large",
-	/* 414 */ "Request-URI Too Large",
-	/* 415 */ "Unsupported Media Type",
-	/* 416 */ "Requested range not satisfiable",
-	/* 417 */ "Expectation Failed"
-};
+	TAILQ_INSERT_TAIL(&pool->hosts, host, next);
 
-static const char *server_error_phrases[] = {
-	/* 500 */ "Internal Server Error",
-	/* 501 */ "Not Implemented",
-	/* 502 */ "Bad Gateway",
-	/* 503 */ "Service Unavailable",
-	/* 504 */ "Gateway Time-out",
-	/* 505 */ "HTTP Version not supported"
-};
+	return (host);
+}
 
-struct response_class {
-	const char *name;
-	size_t num_responses;
-	const char **responses;
-};
+struct evhttp_client_pool *
+evhttp_client_pool_new(struct event_base *base, struct evdns_base *dnsbase)
+{
+	struct evhttp_client_pool *pool;
 
-#ifndef MEMBERSOF
-#define MEMBERSOF(x) (sizeof(x)/sizeof(x[0]))
-#endif
+	if ((pool = mm_calloc(1, sizeof(*pool))) == NULL) {
+		event_warn("%s: calloc", __func__);
+		return (NULL);
+	}
 
-static const struct response_class response_classes[] = {
-	/* 1xx */ { "Informational", MEMBERSOF(informational_phrases), informational_phrases },
-	/* 2xx */ { "Success", MEMBERSOF(success_phrases), success_phrases },
-	/* 3xx */ { "Redirection", MEMBERSOF(redirection_phrases), redirection_phrases },
-	/* 4xx */ { "Client Error", MEMBERSOF(client_error_phrases), client_error_phrases },
-	/* 5xx */ { "Server Error", MEMBERSOF(server_error_phrases), server_error_phrases }
-};
+	TAILQ_INIT(&pool->hosts);
+	TAILQ_INIT(&pool->coalesce_vary);
+	pool->base = base;
+	pool->dns_base = dnsbase;
+	pool->max_per_host = HTTP_POOL_MAX_PER_HOST;
+	pool->max_queue = -1;
+	evhttp_client_pool_set_idle_timeout_tv(pool, NULL);
 
-static const char *
-evhttp_response_phrase_internal(int code)
-{
-	int klass = code / 100 - 1;
-	int subcode = code % 100;
+	return (pool);
+}
 
-	/* Unknown class - can't do any better here */
-	if (klass < 0 || klass >= (int) MEMBERSOF(response_classes))
-		return "Unknown Status Class";
+void
+evhttp_client_pool_free(struct evhttp_client_pool *pool)
+{
+	struct evhttp_pool_host *host;
 
-	/* Unknown sub-code, return class name at least */
-	if (subcode >= (int) response_classes[klass].num_responses)
-		return response_classes[klass].name;
+	while ((host = TAILQ_FIRST(&pool->hosts)) != NULL)
+		evhttp_pool_host_free(host);
+	evhttp_clear_headers(&pool->coalesce_vary);
 
-	return response_classes[klass].responses[subcode];
+	mm_free(pool);
 }
 
 void
-evhttp_response_code_(struct evhttp_request *req, int code, const char *reason)
+evhttp_client_pool_set_max_per_host(struct evhttp_client_pool *pool,
+    int max_per_host)
 {
-	req->kind = EVHTTP_RESPONSE;
-	req->response_code = code;
-	if (req->response_code_line != NULL)
-		mm_free(req->response_code_line);
-	if (reason == NULL)
-		reason = evhttp_response_phrase_internal(code);
-	req->response_code_line = mm_strdup(reason);
-	if (req->response_code_line == NULL) {
-		event_warn("%s: strdup", __func__);
-		/* XXX what else can we do? */
-	}
+	pool->max_per_host = max_per_host > 0 ? max_per_host : 1;
 }
 
 void
-evhttp_send_page_(struct evhttp_request *req, struct evbuffer *databuf)
+evhttp_client_pool_set_max_queue(struct evhttp_client_pool *pool,
+    int max_queue)
 {
-	if (!req->major || !req->minor) {
-		req->major = 1;
-		req->minor = 1;
-	}
+	pool->max_queue = max_queue;
+}
 
-	if (req->kind != EVHTTP_RESPONSE)
-		evhttp_response_code_(req, 200, "OK");
+void
+evhttp_client_pool_set_idle_timeout_tv(struct evhttp_client_pool *pool,
+    const struct timeval *tv)
+{
+	evhttp_set_timeout_tv_(&pool->idle_timeout, tv, HTTP_POOL_IDLE_TIMEOUT);
+}
 
-	evhttp_clear_headers(req->output_headers);
-	evhttp_add_header(req->output_headers, "Content-Type", "text/html");
-	evhttp_add_header(req->output_headers, "Connection", "close");
+void
+evhttp_client_pool_set_retries(struct evhttp_client_pool *pool,
+    int retry_max)
+{
+	pool->retry_max = retry_max;
+}
 
-	evhttp_send(req, databuf);
+void
+evhttp_client_pool_set_conncb(struct evhttp_client_pool *pool,
+    void (*cb)(struct evhttp_connection *, void *), void *cbarg)
+{
+	pool->conncb = cb;
+	pool->conncbarg = cbarg;
 }
 
-static const char uri_chars[256] = {
-	/* 0 */
-	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 1, 1, 0,
-	1, 1, 1, 1, 1, 1, 1, 1,   1, 1, 0, 0, 0, 0, 0, 0,
-	/* 64 */
-	0, 1, 1, 1, 1, 1, 1, 1,   1, 1, 1, 1, 1, 1, 1, 1,
-	1, 1, 1, 1, 1, 1, 1, 1,   1, 1, 1, 0, 0, 0, 0, 1,
-	0, 1, 1, 1, 1, 1, 1, 1,   1, 1, 1, 1, 1, 1, 1, 1,
-	1, 1, 1, 1, 1, 1, 1, 1,   1, 1, 1, 0, 0, 0, 1, 0,
-	/* 128 */
-	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
-	/* 192 */
-	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
-};
+int
+evhttp_client_pool_set_coalescing(struct evhttp_client_pool *pool,
+    int enable, const char *vary)
+{
+	struct evkeyvalq names;
+	struct evkeyval *header;
+	char *copy = NULL, *name, *end;
 
-#define CHAR_IS_UNRESERVED(c)			\
-	(uri_chars[(unsigned char)(c)])
+	TAILQ_INIT(&names);
+	if (vary != NULL && (copy = mm_strdup(vary)) == NULL) {
+		event_warn("%s: strdup", __func__);
+		return (-1);
+	}
+	for (name = copy; name != NULL; name = end) {
+		if ((end = strchr(name, ',')) != NULL)
+			*end++ = '\0';
+		name += strspn(name, " \t");
+		evutil_rtrim_lws_(name);
+		if (*name == '\0')
+			continue;
+		if (evhttp_add_header(&names, name, "") == -1) {
+			evhttp_clear_headers(&names);
+			mm_free(copy);
+			return (-1);
+		}
+	}
+	mm_free(copy);
+
+	evhttp_clear_headers(&pool->coalesce_vary);
+	while ((header = TAILQ_FIRST(&names)) != NULL) {
+		TAILQ_REMOVE(&names, header, next);
+		TAILQ_INSERT_TAIL(&pool->coalesce_vary, header, next);
+	}
+	pool->coalesce = enable;
+
+	return (0);
+}
 
 /*
- * Helper functions to encode/decode a string for inclusion in a URI.
- * The returned string must be freed by the caller.
+ * Coalescing of identical requests
  */
-char *
-evhttp_uriencode(const char *uri, ev_ssize_t len, int space_as_plus)
+
+static void
+evhttp_pool_flight_free(struct evhttp_pool_flight *flight)
 {
-	struct evbuffer *buf = evbuffer_new();
-	const char *p, *end;
-	char *result = NULL;
+	struct evhttp_request *req;
 
-	if (!buf) {
-		goto out;
+	while ((req = TAILQ_FIRST(&flight->followers)) != NULL) {
+		TAILQ_REMOVE(&flight->followers, req, next);
+		evhttp_request_free_auto(req);
 	}
+	mm_free(flight->key);
+	mm_free(flight);
+}
 
-	if (len >= 0) {
-		if (uri + len < uri) {
-			goto out;
+static int
+evhttp_pool_coalescable_(struct evhttp_client_pool *pool,
+    struct evhttp_request *req, enum evhttp_cmd_type type)
+{
+	if (!pool->coalesce)
+		return (0);
+	if (type != EVHTTP_REQ_GET && type != EVHTTP_REQ_HEAD)
+		return (0);
+	if (req->chunk_cb != NULL || req->header_cb != NULL)
+		return (0);
+
+	return (evbuffer_get_length(req->output_buffer) == 0);
+}
+
+/* Returns the key of req among the flights of its host, or NULL */
+static char *
+evhttp_pool_flight_key_(struct evhttp_client_pool *pool,
+    struct evhttp_request *req, enum evhttp_cmd_type type, const char *uri)
+{
+	struct evkeyval *header;
+	struct evbuffer *buf;
+	const char *value;
+	char *key = NULL;
+	size_t len;
+
+	if ((buf = evbuffer_new()) == NULL)
+		return (NULL);
+
+	evbuffer_add_printf(buf, "%d %s", (int)type, uri);
+	TAILQ_FOREACH(header, &pool->coalesce_vary, next) {
+		value = evhttp_find_header(req->output_headers, header->key);
+		/* a missing header differs from an empty one */
+		evbuffer_add_printf(buf, "\n%s%s",
+		    value != NULL ? ":" : "", value != NULL ? value : "");
+	}
+
+	len = evbuffer_get_length(buf);
+	if ((key = mm_malloc(len + 1)) == NULL) {
+		event_warn("%s: malloc", __func__);
+		goto done;
+	}
+	evbuffer_remove(buf, key, len);
+	key[len] = '\0';
+
+ done:
+	evbuffer_free(buf);
+	return (key);
+}
+
+/* Makes dst a response that shares the body of src. */
+static void
+evhttp_pool_flight_copy_(struct evhttp_request *dst,
+    struct evhttp_request *src)
+{
+	struct evkeyval *header;
+
+	dst->kind = EVHTTP_RESPONSE;
+	dst->major = src->major;
+	dst->minor = src->minor;
+	dst->response_code = src->response_code;
+	if (src->response_code_line != NULL) {
+		if (dst->response_code_line != NULL)
+			mm_free(dst->response_code_line);
+		dst->response_code_line = mm_strdup(src->response_code_line);
+	}
+	TAILQ_FOREACH(header, src->input_headers, next)
+		evhttp_add_header(dst->input_headers,
+		    header->key, header->value);
+
+	if (evbuffer_add_buffer_reference(dst->input_buffer,
+		src->input_buffer) == -1) {
+		evbuffer_add(dst->input_buffer,
+		    evbuffer_pullup(src->input_buffer, -1),
+		    evbuffer_get_length(src->input_buffer));
+	}
+}
+
+static void
+evhttp_pool_flight_errorcb(enum evhttp_request_error error, void *arg)
+{
+	struct evhttp_pool_flight *flight = arg;
+
+	flight->error = error;
+	if (flight->error_cb != NULL)
+		(*flight->error_cb)(error, flight->cb_arg);
+}
+
+/* The request of flight completed (or failed, if req is NULL). */
+static void
+evhttp_pool_flight_cb(struct evhttp_request *req, void *arg)
+{
+	struct evhttp_pool_flight *flight = arg;
+	struct evcon_requestq followers;
+	struct evhttp_request *follower;
+
+	TAILQ_REMOVE(&flight->host->flights, flight, next);
+	if (flight->sending)
+		flight->done = 1;
+
+	/* the body has to be shared before the callback consumes it */
+	TAILQ_INIT(&followers);
+	while ((follower = TAILQ_FIRST(&flight->followers)) != NULL) {
+		TAILQ_REMOVE(&flight->followers, follower, next);
+		if (req != NULL)
+			evhttp_pool_flight_copy_(follower, req);
+		TAILQ_INSERT_TAIL(&followers, follower, next);
+	}
+
+	if (flight->cb != NULL)
+		(*flight->cb)(req, flight->cb_arg);
+
+	while ((follower = TAILQ_FIRST(&followers)) != NULL) {
+		TAILQ_REMOVE(&followers, follower, next);
+		if (req == NULL && follower->error_cb != NULL)
+			(*follower->error_cb)(flight->error,
+			    follower->cb_arg);
+		if (follower->cb != NULL)
+			(*follower->cb)(req != NULL ? follower : NULL,
+			    follower->cb_arg);
+		evhttp_request_free_auto(follower);
+	}
+
+	if (!flight->sending)
+		evhttp_pool_flight_free(flight);
+}
+
+static int evhttp_pool_host_make_request(struct evhttp_pool_host *host,
+    struct evhttp_request *req, enum evhttp_cmd_type type, const char *uri);
+static int evhttp_pool_host_make_request_(struct evhttp_pool_host *host,
+    struct evhttp_request *req, enum evhttp_cmd_type type, const char *uri);
+
+/* Sends req on behalf of flight.  On failure the followers of flight are
+ * failed through their callbacks, flight is freed, and req is left to the
+ * caller with its own callbacks. */
+static int
+evhttp_pool_flight_send_(struct evhttp_pool_flight *flight,
+    struct evhttp_request *req, const char *uri)
+{
+	struct evhttp_pool_host *host = flight->host;
+	int res;
+
+	flight->req = req;
+	flight->cb = req->cb;
+	flight->error_cb = req->error_cb;
+	flight->cb_arg = req->cb_arg;
+	req->cb = evhttp_pool_flight_cb;
+	req->error_cb = evhttp_pool_flight_errorcb;
+	req->cb_arg = flight;
+	TAILQ_INSERT_TAIL(&host->flights, flight, next);
+
+	/* the request might complete or fail before we return */
+	flight->sending = 1;
+	flight->done = 0;
+	res = evhttp_pool_host_make_request_(host, req, flight->type, uri);
+	flight->sending = 0;
+	if (res == -1) {
+		req->cb = flight->cb;
+		req->error_cb = flight->error_cb;
+		req->cb_arg = flight->cb_arg;
+		flight->cb = NULL;
+		flight->error = EVREQ_HTTP_EOF;
+		evhttp_pool_flight_cb(NULL, flight);
+		return (-1);
+	}
+	if (flight->done)
+		evhttp_pool_flight_free(flight);
+
+	return (0);
+}
+
+static int
+evhttp_pool_flight_make_request(struct evhttp_pool_host *host,
+    struct evhttp_request *req, enum evhttp_cmd_type type, const char *uri)
+{
+	struct evhttp_pool_flight *flight;
+	char *key;
+
+	if ((key = evhttp_pool_flight_key_(host->pool, req, type, uri)) == NULL)
+		return (evhttp_pool_host_make_request(host, req, type, uri));
+
+	TAILQ_FOREACH(flight, &host->flights, next) {
+		if (strcmp(flight->key, key) == 0)
+			break;
+	}
+
+	if (flight != NULL) {
+		/* wait for the response of the outstanding request */
+		mm_free(key);
+		if (req->uri != NULL)
+			mm_free(req->uri);
+		if ((req->uri = mm_strdup(uri)) == NULL) {
+			event_warn("%s: strdup", __func__);
+			evhttp_request_free_auto(req);
+			return (-1);
 		}
+		req->kind = EVHTTP_REQUEST;
+		req->type = type;
+		TAILQ_INSERT_TAIL(&flight->followers, req, next);
+		return (0);
+	}
 
-		end = uri + len;
-	} else {
-		size_t slen = strlen(uri);
+	if ((flight = mm_calloc(1, sizeof(*flight))) == NULL) {
+		event_warn("%s: calloc", __func__);
+		mm_free(key);
+		return (evhttp_pool_host_make_request(host, req, type, uri));
+	}
+	flight->key = key;
+	flight->type = type;
+	flight->host = host;
+	TAILQ_INIT(&flight->followers);
 
-		if (slen >= EV_SSIZE_MAX) {
-			/* we don't want to mix signed and unsigned */
-			goto out;
+	if (evhttp_pool_flight_send_(flight, req, uri) == -1) {
+		evhttp_request_free_auto(req);
+		return (-1);
+	}
+	return (0);
+}
+
+/* Removes req from the flights of pool; returns 1 if it was a follower. */
+static int
+evhttp_pool_flight_cancel_(struct evhttp_client_pool *pool,
+    struct evhttp_request *req)
+{
+	struct evhttp_pool_host *host;
+	struct evhttp_pool_flight *flight;
+	struct evhttp_request *follower;
+	char *uri;
+
+	TAILQ_FOREACH(host, &pool->hosts, next) {
+		TAILQ_FOREACH(flight, &host->flights, next) {
+			if (flight->req == req)
+				goto found;
+			TAILQ_FOREACH(follower, &flight->followers, next) {
+				if (follower == req) {
+					TAILQ_REMOVE(&flight->followers,
+					    req, next);
+					return (1);
+				}
+			}
+		}
+	}
+	return (0);
+
+ found:
+	TAILQ_REMOVE(&host->flights, flight, next);
+	req->cb = flight->cb;
+	req->error_cb = flight->error_cb;
+	req->cb_arg = flight->cb_arg;
+
+	/* the first follower takes over */
+	if ((follower = TAILQ_FIRST(&flight->followers)) == NULL) {
+		evhttp_pool_flight_free(flight);
+		return (0);
+	}
+	TAILQ_REMOVE(&flight->followers, follower, next);
+	uri = follower->uri;
+	follower->uri = NULL;
+	if (evhttp_pool_flight_send_(flight, follower, uri) == -1)
+		evhttp_pool_req_fail(follower);
+	mm_free(uri);
+
+	return (0);
+}
+
+int
+evhttp_client_pool_make_request(struct evhttp_client_pool *pool,
+    const char *address, ev_uint16_t port, struct evhttp_request *req,
+    enum evhttp_cmd_type type, const char *uri)
+{
+	struct evhttp_pool_host *host;
+	int res;
+
+	if ((host = evhttp_pool_host_get(pool, address, port)) == NULL) {
+		evhttp_request_free_auto(req);
+		return (-1);
+	}
+
+	if (evhttp_find_header(req->output_headers, "Host") == NULL) {
+		char hostport[NI_MAXHOST + NI_MAXSERV + 3];
+		int ipv6 = strchr(address, ':') != NULL;
+		if (port == 80)
+			evutil_snprintf(hostport, sizeof(hostport), "%s%s%s",
+			    ipv6 ? "[" : "", address, ipv6 ? "]" : "");
+		else
+			evutil_snprintf(hostport, sizeof(hostport), "%s%s%s:%d",
+			    ipv6 ? "[" : "", address, ipv6 ? "]" : "", port);
+		evhttp_add_header(req->output_headers, "Host", hostport);
+	}
+
+	if (evhttp_pool_coalescable_(pool, req, type))
+		res = evhttp_pool_flight_make_request(host, req, type, uri);
+	else
+		res = evhttp_pool_host_make_request(host, req, type, uri);
+	if (res == -1 && host->nconns == 0 && host->nwaiting == 0 &&
+	    TAILQ_EMPTY(&host->flights))
+		evhttp_pool_host_free(host);
+
+	return (res);
+}
+
+/* Sends req over an idle or a new connection, or queues it until a
+ * connection becomes free; on failure req is left to the caller. */
+static int
+evhttp_pool_host_make_request_(struct evhttp_pool_host *host,
+    struct evhttp_request *req, enum evhttp_cmd_type type, const char *uri)
+{
+	struct evhttp_client_pool *pool = host->pool;
+	struct evhttp_pool_conn *pconn;
+	struct evhttp_pool_req *preq;
+
+	pconn = TAILQ_FIRST(&host->idle);
+	if (pconn == NULL && host->nconns < pool->max_per_host)
+		pconn = evhttp_pool_conn_new(host);
+	if (pconn != NULL)
+		return (evhttp_pool_conn_make_request(pconn, req, type, uri));
+
+	/* all connections are busy; wait for the first one to be released */
+	if (pool->max_queue >= 0 && host->nwaiting >= pool->max_queue) {
+		event_debug(("%s: too many requests waiting for \"%s:%d\"",
+			__func__, host->address, host->port));
+		return (-1);
+	}
+
+	if ((preq = mm_calloc(1, sizeof(*preq))) == NULL) {
+		event_warn("%s: calloc", __func__);
+		return (-1);
+	}
+	if ((preq->uri = mm_strdup(uri)) == NULL) {
+		event_warn("%s: strdup", __func__);
+		mm_free(preq);
+		return (-1);
+	}
+	preq->req = req;
+	preq->type = type;
+
+	TAILQ_INSERT_TAIL(&host->waiting, preq, next);
+	++host->nwaiting;
+
+	return (0);
+}
+
+/* Like evhttp_pool_host_make_request_(), but on failure req is freed. */
+static int
+evhttp_pool_host_make_request(struct evhttp_pool_host *host,
+    struct evhttp_request *req, enum evhttp_cmd_type type, const char *uri)
+{
+	if (evhttp_pool_host_make_request_(host, req, type, uri) == -1) {
+		evhttp_request_free_auto(req);
+		return (-1);
+	}
+	return (0);
+}
+
+void
+evhttp_client_pool_cancel_request(struct evhttp_client_pool *pool,
+    struct evhttp_request *req)
+{
+	struct evhttp_pool_host *host;
+	struct evhttp_pool_req *preq;
+
+	if (evhttp_pool_flight_cancel_(pool, req))
+		goto done;
+
+	if (req->evcon != NULL) {
+		evhttp_cancel_request(req);
+		return;
+	}
+
+	TAILQ_FOREACH(host, &pool->hosts, next) {
+		TAILQ_FOREACH(preq, &host->waiting, next) {
+			if (preq->req != req)
+				continue;
+
+			TAILQ_REMOVE(&host->waiting, preq, next);
+			--host->nwaiting;
+			mm_free(preq->uri);
+			mm_free(preq);
+			goto done;
+		}
+	}
+
+ done:
+	evhttp_request_free_auto(req);
+}
+
+int
+evhttp_client_pool_get_host_stats(struct evhttp_client_pool *pool,
+    const char *address, ev_uint16_t port,
+    int *nconns, int *nidle, int *nwaiting)
+{
+	struct evhttp_pool_host *host;
+
+	if ((host = evhttp_pool_host_find(pool, address, port)) == NULL)
+		return (-1);
+
+	if (nconns)
+		*nconns = host->nconns;
+	if (nidle)
+		*nidle = host->nidle;
+	if (nwaiting)
+		*nwaiting = host->nwaiting;
+
+	return (0);
+}
+
+/*
+ * Reverse proxy
+ */
+
+/* Returns whether name is one of the comma separated tokens in list */
+static int
+evhttp_proxy_listed_(const char *list, const char *name)
+{
+	size_t len = strlen(name), n;
+
+	while (*list != '\0') {
+		list += strspn(list, " \t,");
+		n = strcspn(list, " \t,");
+		if (n == len && evutil_ascii_strncasecmp(list, name, len) == 0)
+			return (1);
+		list += n;
+	}
+
+	return (0);
+}
+
+/* Copies the end-to-end headers of src to dst */
+static void
+evhttp_proxy_copy_headers_(struct evkeyvalq *dst, struct evkeyvalq *src,
+    enum evhttp_request_kind kind)
+{
+	static const char *hop_by_hop[] = {
+		"Connection", "Keep-Alive", "Proxy-Connection",
+		"Proxy-Authenticate", "Proxy-Authorization", "TE", "Trailer",
+		"Transfer-Encoding", "Upgrade", NULL
+	};
+	const char *connection = evhttp_find_header(src, "Connection");
+	struct evkeyval *header;
+	int i;
+
+	TAILQ_FOREACH(header, src, next) {
+		for (i = 0; hop_by_hop[i] != NULL; ++i) {
+			if (!evutil_ascii_strcasecmp(header->key, hop_by_hop[i]))
+				break;
 		}
+		if (hop_by_hop[i] != NULL)
+			continue;
+		if (connection != NULL &&
+		    evhttp_proxy_listed_(connection, header->key))
+			continue;
+		/* the request body is framed anew, and 100-continue has been
+		 * dealt with already */
+		if (kind == EVHTTP_REQUEST &&
+		    (!evutil_ascii_strcasecmp(header->key, "Content-Length") ||
+		     !evutil_ascii_strcasecmp(header->key, "Expect")))
+			continue;
+		evhttp_add_header(dst, header->key, header->value);
+	}
+}
+
+static void
+evhttp_proxy_req_free_(struct evhttp_proxy_req *pr)
+{
+	TAILQ_REMOVE(&pr->proxy->requests, pr, next);
+	mm_free(pr);
+}
+
+/* Sends the request body that has been read upstream, within the window */
+static void
+evhttp_proxy_pump_up_(struct evhttp_proxy_req *pr)
+{
+	struct evbuffer *body = pr->down->input_buffer;
+
+	if (pr->up == NULL) {
+		/* nobody is interested in the body anymore */
+		evbuffer_drain(body, evbuffer_get_length(body));
+		return;
+	}
+
+	if (evhttp_request_upload_pending_(pr->up) < pr->proxy->window)
+		evhttp_request_upload_chunk_(pr->up, body);
+	if (pr->down_done && evbuffer_get_length(body) == 0)
+		evhttp_request_upload_end_(pr->up);
+}
+
+static void evhttp_proxy_written_cb(struct evhttp_connection *evcon,
+    void *arg);
+
+/* Passes the response body that has been read on, within the window */
+static void
+evhttp_proxy_pump_down_(struct evhttp_proxy_req *pr)
+{
+	struct evbuffer *body = pr->up->input_buffer;
+	struct evhttp_connection *evcon = pr->down->evcon;
+
+	if (evcon == NULL) {
+		/* the client went away */
+		evbuffer_drain(body, evbuffer_get_length(body));
+		return;
+	}
+
+	if (evbuffer_get_length(bufferevent_get_output(evcon->bufev)) <
+	    pr->proxy->window)
+		evhttp_send_reply_chunk_with_cb(pr->down, body,
+		    evhttp_proxy_written_cb, pr);
+}
+
+static void
+evhttp_proxy_written_cb(struct evhttp_connection *evcon, void *arg)
+{
+	struct evhttp_proxy_req *pr = arg;
+
+	if (pr->up != NULL)
+		evhttp_proxy_pump_down_(pr);
+}
+
+static void
+evhttp_proxy_upload_cb(struct evhttp_request *req, void *arg)
+{
+	evhttp_proxy_pump_up_(arg);
+}
+
+static int
+evhttp_proxy_response_cb(struct evhttp_request *req, void *arg)
+{
+	struct evhttp_proxy_req *pr = arg;
+	struct evhttp_proxy *proxy = pr->proxy;
+	struct evhttp_request *down = pr->down;
+
+	/* interim responses are not passed on */
+	if (req->response_code == 100)
+		return (0);
+	if (down->evcon == NULL)
+		return (-1);
+
+	evhttp_proxy_copy_headers_(down->output_headers, req->input_headers,
+	    EVHTTP_RESPONSE);
+	if (proxy->header_cb != NULL)
+		(*proxy->header_cb)(down, EVHTTP_RESPONSE, down->output_headers,
+		    proxy->header_cb_arg);
+
+	pr->replying = 1;
+	evhttp_send_reply_start(down, req->response_code,
+	    req->response_code_line);
+
+	return (0);
+}
+
+static void
+evhttp_proxy_response_chunk_cb(struct evhttp_request *req, void *arg)
+{
+	evhttp_proxy_pump_down_(arg);
+}
+
+/* The upstream request completed, or failed if req is NULL */
+static void
+evhttp_proxy_response_done_cb(struct evhttp_request *req, void *arg)
+{
+	struct evhttp_proxy_req *pr = arg;
+	struct evhttp_request *down = pr->down;
+
+	/* req is freed once we return */
+	pr->up = NULL;
+
+	if (req != NULL && pr->replying) {
+		evhttp_send_reply_chunk(down, req->input_buffer);
+		evhttp_send_reply_end(down);
+	} else if (pr->replying) {
+		/* the client has to notice that the reply is incomplete */
+		if (down->evcon != NULL)
+			evhttp_connection_fail_(down->evcon, EVREQ_HTTP_EOF);
+		evhttp_request_free(down);
+	} else if (down->evcon == NULL) {
+		evhttp_request_free(down);
+	} else if (pr->down_done) {
+		evhttp_send_error(down, HTTP_BADGATEWAY, NULL);
+	} else {
+		/* the error is sent once the request has been read */
+		return;
+	}
+
+	evhttp_proxy_req_free_(pr);
+}
+
+/* Returns whether the request of the client has a body */
+static int
+evhttp_proxy_has_body_(struct evhttp_request *req)
+{
+	const char *length;
+
+	if (evhttp_find_header(req->input_headers, "Transfer-Encoding"))
+		return (1);
+	length = evhttp_find_header(req->input_headers, "Content-Length");
+	return (length != NULL && strcmp(length, "0") != 0);
+}
+
+/* The headers of a request of a client have been read */
+static int
+evhttp_proxy_request_cb(struct evhttp_request *req, void *arg)
+{
+	struct evhttp_proxy *proxy = arg;
+	struct evhttp_proxy_req *pr;
+	struct evhttp_request *up;
+	const char *forwarded;
+
+	if ((pr = mm_calloc(1, sizeof(*pr))) == NULL) {
+		event_warn("%s: calloc", __func__);
+		return (-1);
+	}
+	pr->proxy = proxy;
+	pr->down = req;
+	TAILQ_INSERT_TAIL(&proxy->requests, pr, next);
+
+	/* the remaining callbacks of req get the state as argument */
+	req->cb_arg = pr;
+	req->flags |= EVHTTP_REQ_NO_CONTENT_CODING;
+
+	if ((up = evhttp_request_new(evhttp_proxy_response_done_cb,
+		    pr)) == NULL)
+		return (0);
+	if (evbuffer_add_cb(up->input_buffer,
+		evhttp_stream_body_drain_cb, up) == NULL) {
+		evhttp_request_free(up);
+		return (0);
+	}
+	/* the response is read no faster than the client takes it */
+	up->flags |= EVHTTP_REQ_STREAM_BODY;
+	up->header_cb = evhttp_proxy_response_cb;
+	up->chunk_cb = evhttp_proxy_response_chunk_cb;
+	if (evhttp_proxy_has_body_(req)) {
+		up->flags |= EVHTTP_REQ_STREAM_UPLOAD;
+		up->upload_cb = evhttp_proxy_upload_cb;
+	}
+
+	evhttp_proxy_copy_headers_(up->output_headers, req->input_headers,
+	    EVHTTP_REQUEST);
+	if (req->remote_host != NULL) {
+		forwarded = evhttp_find_header(up->output_headers,
+		    "X-Forwarded-For");
+		if (forwarded != NULL) {
+			char *value;
+			size_t len = strlen(forwarded) +
+			    strlen(req->remote_host) + 3;
+			if ((value = mm_malloc(len)) != NULL) {
+				evutil_snprintf(value, len, "%s, %s",
+				    forwarded, req->remote_host);
+				evhttp_remove_header(up->output_headers,
+				    "X-Forwarded-For");
+				evhttp_add_header(up->output_headers,
+				    "X-Forwarded-For", value);
+				mm_free(value);
+			}
+		} else {
+			evhttp_add_header(up->output_headers,
+			    "X-Forwarded-For", req->remote_host);
+		}
+	}
+	if (proxy->header_cb != NULL)
+		(*proxy->header_cb)(req, EVHTTP_REQUEST, up->output_headers,
+		    proxy->header_cb_arg);
+
+	pr->up = up;
+	if (evhttp_client_pool_make_request(proxy->pool, proxy->address,
+		proxy->port, up, req->type, req->uri) == -1)
+		pr->up = NULL;
+
+	return (0);
+}
+
+static void
+evhttp_proxy_request_chunk_cb(struct evhttp_request *req, void *arg)
+{
+	evhttp_proxy_pump_up_(arg);
+}
+
+/* The body of a request of a client has been read, or reading it failed */
+static void
+evhttp_proxy_request_done_cb(struct evhttp_request *req, void *arg)
+{
+	struct evhttp_proxy_req *pr = arg;
+	struct evhttp_request *up = pr->up;
+
+	if (req->uri == NULL) {
+		/* the callback looks at the uri to determine errors */
+		if (up != NULL)
+			evhttp_client_pool_cancel_request(pr->proxy->pool, up);
+		evhttp_proxy_req_free_(pr);
+		evhttp_send_error(req, req->response_code, NULL);
+		return;
+	}
+
+	pr->down_done = 1;
+	if (up == NULL) {
+		evhttp_proxy_req_free_(pr);
+		evhttp_send_error(req, HTTP_BADGATEWAY, NULL);
+		return;
+	}
+
+	evhttp_proxy_pump_up_(pr);
+}
+
+struct evhttp_proxy *
+evhttp_proxy_new(struct evhttp_client_pool *pool,
+    const char *address, ev_uint16_t port)
+{
+	struct evhttp_proxy *proxy;
+
+	if ((proxy = mm_calloc(1, sizeof(*proxy))) == NULL) {
+		event_warn("%s: calloc", __func__);
+		return (NULL);
+	}
+	if ((proxy->address = mm_strdup(address)) == NULL) {
+		event_warn("%s: strdup", __func__);
+		mm_free(proxy);
+		return (NULL);
+	}
+	proxy->pool = pool;
+	proxy->port = port;
+	proxy->window = HTTP_PROXY_WINDOW;
+	TAILQ_INIT(&proxy->requests);
+
+	return (proxy);
+}
+
+void
+evhttp_proxy_free(struct evhttp_proxy *proxy)
+{
+	struct evhttp_proxy_req *pr;
+	struct evhttp_request *down;
+
+	while ((pr = TAILQ_FIRST(&proxy->requests)) != NULL) {
+		down = pr->down;
+		if (pr->up != NULL)
+			evhttp_client_pool_cancel_request(proxy->pool, pr->up);
+		evhttp_proxy_req_free_(pr);
+		if (down->evcon != NULL)
+			evhttp_connection_fail_(down->evcon, EVREQ_HTTP_EOF);
+		evhttp_request_free(down);
+	}
+
+	mm_free(proxy->address);
+	mm_free(proxy);
+}
+
+void
+evhttp_proxy_set_window(struct evhttp_proxy *proxy, size_t window)
+{
+	proxy->window = window > 0 ? window : 1;
+}
+
+void
+evhttp_proxy_set_header_cb(struct evhttp_proxy *proxy,
+    void (*cb)(struct evhttp_request *, enum evhttp_request_kind,
+	struct evkeyvalq *, void *), void *arg)
+{
+	proxy->header_cb = cb;
+	proxy->header_cb_arg = arg;
+}
+
+int
+evhttp_set_proxy_cb(struct evhttp *http, const char *path,
+    struct evhttp_proxy *proxy)
+{
+	return (evhttp_set_stream_cb(http, path, evhttp_proxy_request_cb,
+		evhttp_proxy_request_chunk_cb, evhttp_proxy_request_done_cb,
+		proxy));
+}
+
+/*
+ * Reads data from file descriptor into request structure
+ * Request structure needs to be set up correctly.
+ */
+
+void
+evhttp_start_read_(struct evhttp_connection *evcon)
+{
+	bufferevent_disable(evcon->bufev, EV_WRITE);
+	bufferevent_enable(evcon->bufev, EV_READ);
+
+	evcon->state = EVCON_READING_FIRSTLINE;
+	/* Reset the bufferevent callbacks */
+	bufferevent_setcb(evcon->bufev,
+	    evhttp_read_cb,
+	    evhttp_write_cb,
+	    evhttp_error_cb,
+	    evcon);
+
+	/* If there's still data pending, process it next time through the
+	 * loop.  Don't do it now; that could get recusive. */
+	if (evbuffer_get_length(bufferevent_get_input(evcon->bufev))) {
+		event_deferred_cb_schedule_(get_deferred_queue(evcon),
+		    &evcon->read_more_deferred_cb);
+	}
+}
+
+void
+evhttp_start_write_(struct evhttp_connection *evcon)
+{
+	bufferevent_disable(evcon->bufev, EV_WRITE);
+	bufferevent_enable(evcon->bufev, EV_READ);
+
+	evcon->state = EVCON_WRITING;
+	evhttp_write_buffer(evcon, evhttp_write_connectioncb, NULL);
+}
+
+static void
+evhttp_send_done(struct evhttp_connection *evcon, void *arg)
+{
+	int need_close;
+	struct evhttp_request *req = TAILQ_FIRST(&evcon->requests);
+	TAILQ_REMOVE(&evcon->requests, req, next);
+
+	evcon->flags &= ~EVHTTP_CON_CLOSEDETECT;
+	evhttp_stats_record_(evcon, req);
+
+	if (req->on_complete_cb != NULL) {
+		req->on_complete_cb(req, req->on_complete_cb_arg);
+	}
+
+	need_close =
+	    (REQ_VERSION_BEFORE(req, 1, 1) &&
+	    !evhttp_is_connection_keepalive(req->input_headers)) ||
+	    evhttp_is_request_connection_close(req);
+
+	EVUTIL_ASSERT(req->flags & EVHTTP_REQ_OWN_CONNECTION);
+	evhttp_request_free(req);
+
+	if (need_close) {
+		evhttp_connection_free(evcon);
+		return;
+	}
+
+	/* idle connections can wait for the next request without
+	 * bufferevent and request */
+	if (evhttp_connection_park_(evcon) == 0)
+		return;
+
+	/* we have a persistent connection; try to accept another request. */
+	if (evhttp_associate_new_request_with_connection(evcon) == -1) {
+		evhttp_connection_free(evcon);
+	}
+}
+
+/* Rehydrates a parked connection once the next request arrives */
+static void
+evhttp_connection_unpark_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct evhttp_connection *evcon = arg;
+	struct sockaddr_storage ss;
+	ev_socklen_t socklen = sizeof(ss);
+
+	if (what & EV_TIMEOUT) {
+		event_debug(("%s: idle timeout on "EV_SOCK_FMT,
+			__func__, EV_SOCK_ARG(fd)));
+		evhttp_connection_free(evcon);
+		return;
+	}
+
+	evcon->bufev = bufferevent_socket_new(evcon->base, fd, 0);
+	if (evcon->bufev == NULL) {
+		event_warn("%s: bufferevent_socket_new", __func__);
+		evhttp_connection_free(evcon);
+		return;
+	}
+	bufferevent_set_timeouts(evcon->bufev,
+	    &evcon->timeout_read, &evcon->timeout_write);
+	if (getpeername(fd, (struct sockaddr *)&ss, &socklen) == 0)
+		bufferevent_socket_set_conn_address_(evcon->bufev,
+		    (struct sockaddr *)&ss, socklen);
+	evcon->state = EVCON_IDLE;
+
+	if (evhttp_associate_new_request_with_connection(evcon) == -1)
+		evhttp_connection_free(evcon);
+}
+
+/* Parks an idle server connection if its server asks for it; returns -1 if
+ * the connection has to stay as it is */
+static int
+evhttp_connection_park_(struct evhttp_connection *evcon)
+{
+	struct evhttp *http = evcon->http_server;
+	const struct timeval *tv = NULL;
+
+	if (!(http->flags & EVHTTP_SERVER_PARK_IDLE) || http->bevcb != NULL ||
+	    BEV_UPCAST(evcon->bufev)->rate_limiting != NULL ||
+	    evbuffer_get_length(bufferevent_get_input(evcon->bufev)) ||
+	    evbuffer_get_length(bufferevent_get_output(evcon->bufev)))
+		return (-1);
+
+	if (evutil_timerisset(&evcon->timeout_read))
+		tv = &evcon->timeout_read;
+	event_assign(&evcon->retry_ev, evcon->base, evcon->fd, EV_READ,
+	    evhttp_connection_unpark_cb, evcon);
+	if (event_add(&evcon->retry_ev, tv) == -1)
+		return (-1);
+
+	event_deferred_cb_cancel_(get_deferred_queue(evcon),
+	    &evcon->read_more_deferred_cb);
+	bufferevent_free(evcon->bufev);
+	evcon->bufev = NULL;
+	evcon->state = EVCON_PARKED;
+
+	return (0);
+}
+
+/*
+ * Returns an error page.
+ */
+void
+evhttp_send_error(struct evhttp_request *req, int error, const char *reason)
+{
+#define ERR_FORMAT "<html><head>" \
+	"<title>%d %s</title>" \
+	"</head><body>" \
+	"<h1>%d %s</h1>%s" \
+	"</body></html>"
+
+	struct evbuffer *buf;
+	struct evhttp *http;
+
+	/* the connection went away, e.g. when the request was canceled */
+	if (req->evcon == NULL) {
+		evhttp_request_free(req);
+		return;
+	}
+
+	buf = evbuffer_new();
+	http = req->evcon->http_server;
+	if (buf == NULL) {
+		/* if we cannot allocate memory; we just drop the connection */
+		evhttp_connection_free(req->evcon);
+		return;
+	}
+
+	evhttp_response_code_(req, error, reason);
+
+	/* Output error using callback for connection's evhttp, if available */
+	if ((http->errorcb == NULL) ||
+	    ((*http->errorcb)(req, buf, error, reason, http->errorcbarg) < 0))
+	{
+		const char *heading = evhttp_response_phrase_internal(error);
+
+		evbuffer_drain(buf, evbuffer_get_length(buf));
+		evbuffer_add_printf(buf, ERR_FORMAT,
+		   error, heading, error, heading,
+		   (reason ? reason : ""));
+	}
+
+	evhttp_send_page_(req, buf);
+
+	evbuffer_free(buf);
+#undef ERR_FORMAT
+}
+static void
+evhttp_send_notfound(struct evhttp_request *req, const char *url)
+{
+#define REASON_FORMAT "<p>The requested URL %s was not found on this server.</p>"
+	char   *escaped_url = NULL;
+	char   *reason = NULL;
+	size_t reason_len;
+
+	url = (url != NULL ? url : req->uri);
+	if (url != NULL)
+		escaped_url = evhttp_htmlescape(url);
+
+	if (escaped_url != NULL) {
+		reason_len = strlen(REASON_FORMAT)+strlen(escaped_url)+1;
+		reason = mm_malloc(reason_len);
+	}
+
+	if ((escaped_url != NULL) && (reason != NULL))
+		evutil_snprintf(reason, reason_len, REASON_FORMAT, escaped_url);
+
+	evhttp_send_error(req, HTTP_NOTFOUND, reason);
+
+	if (reason != NULL)
+		mm_free(reason);
+	if (escaped_url != NULL)
+		mm_free(escaped_url);
+#undef REASON_FORMAT
+}
+
+/*
+ * Content codings
+ */
+
+/* Returns whether a qvalue other than 0 has been given */
+static int
+evhttp_qvalue_nonzero(const char *q)
+{
+	if (*q++ != '0')
+		return (1);
+	if (*q++ != '.')
+		return (0);
+	for (; EVUTIL_ISDIGIT_(*q); ++q) {
+		if (*q != '0')
+			return (1);
+	}
+	return (0);
+}
+
+/* Returns whether the value of an "Accept-Encoding" header accepts the
+ * given content coding, see RFC 7231 section 5.3.4 */
+static int
+evhttp_coding_accepted(const char *accept, const char *coding)
+{
+	size_t len = strlen(coding);
+	int wildcard = 0;
+	const char *p = accept;
+
+	while (*p) {
+		const char *name;
+		size_t namelen;
+		int accepted = 1;
+
+		while (*p == ' ' || *p == '\t' || *p == ',')
+			++p;
+		name = p;
+		while (*p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t')
+			++p;
+		namelen = p - name;
+		/* parameters; only the qvalue is of interest */
+		for (; *p && *p != ','; ++p) {
+			if ((p[0] == ';' || p[0] == ' ') &&
+			    (p[1] == 'q' || p[1] == 'Q') && p[2] == '=')
+				accepted = evhttp_qvalue_nonzero(p + 3);
+		}
+		if (namelen == len &&
+		    !evutil_ascii_strncasecmp(name, coding, len))
+			return (accepted);
+		if (namelen == 1 && *name == '*')
+			wildcard = accepted;
+	}
+
+	return (wildcard);
+}
+
+/* Picks the content coding for the response to req, if there is any, and
+ * sets up its encoder */
+static void
+evhttp_coding_start_(struct evhttp_request *req)
+{
+	struct evhttp_connection *evcon = req->evcon;
+	struct evhttp *http = evcon->http_server;
+	struct evhttp_coding *coding;
+	const char *accept;
+	void *ctx;
+
+	if (http == NULL || TAILQ_EMPTY(&http->codings) ||
+	    (req->flags & EVHTTP_REQ_NO_CONTENT_CODING) ||
+	    !evhttp_response_needs_body(req) ||
+	    req->response_code == HTTP_PARTIAL ||
+	    evhttp_find_header(req->output_headers,
+		"Content-Encoding") != NULL)
+		return;
+
+	/* the response depends on the header even if we do not encode it;
+	 * evhttp_static_handler() might have said so already */
+	if (evhttp_find_header(req->output_headers, "Vary") == NULL)
+		evhttp_add_header(req->output_headers, "Vary",
+		    "Accept-Encoding");
+
+	accept = evhttp_find_header(req->input_headers, "Accept-Encoding");
+	if (accept == NULL)
+		return;
+	TAILQ_FOREACH(coding, &http->codings, next) {
+		if (evhttp_coding_accepted(accept, coding->name))
+			break;
+	}
+	if (coding == NULL)
+		return;
+
+	if (coding->ctx_new != NULL) {
+		/* fall back to sending the response as is */
+		if ((ctx = (*coding->ctx_new)(coding->arg)) == NULL) {
+			event_warnx("%s: cannot set up content coding %s",
+			    __func__, coding->name);
+			return;
+		}
+	} else {
+		ctx = coding->arg;
+	}
+
+	evcon->coding = coding;
+	evcon->coding_ctx = ctx;
+
+	evhttp_remove_header(req->output_headers, "Content-Length");
+	evhttp_add_header(req->output_headers, "Content-Encoding",
+	    coding->name);
+}
+
+/* Replaces the contents of buf with their encoded form */
+static int
+evhttp_coding_encode_(struct evhttp_connection *evcon, struct evbuffer *buf,
+    int finish)
+{
+	struct evbuffer *src;
+	int res;
+
+	if ((src = evbuffer_new()) == NULL) {
+		event_warn("%s: evbuffer_new", __func__);
+		return (-1);
+	}
+	evbuffer_add_buffer(src, buf);
+	res = (*evcon->coding->encode)(src, buf, finish, evcon->coding_ctx);
+	evbuffer_free(src);
+
+	return (res);
+}
+
+static void
+evhttp_coding_end_(struct evhttp_connection *evcon)
+{
+	struct evhttp_coding *coding = evcon->coding;
+
+	if (coding == NULL)
+		return;
+	if (coding->ctx_new != NULL && coding->ctx_free != NULL)
+		(*coding->ctx_free)(evcon->coding_ctx);
+	evcon->coding = NULL;
+	evcon->coding_ctx = NULL;
+}
+
+/* Requires that headers and response code are already set up */
+
+static inline void
+evhttp_send(struct evhttp_request *req, struct evbuffer *databuf)
+{
+	struct evhttp_connection *evcon = req->evcon;
+
+	if (evcon == NULL) {
+		evhttp_request_free(req);
+		return;
+	}
+
+	EVUTIL_ASSERT(TAILQ_FIRST(&evcon->requests) == req);
+
+	/* we expect no more calls form the user on this request */
+	req->userdone = 1;
+
+	/* xxx: not sure if we really should expose the data buffer this way */
+	if (databuf != NULL)
+		evbuffer_add_buffer(req->output_buffer, databuf);
+
+	evhttp_coding_start_(req);
+	if (evcon->coding != NULL) {
+		int res = evhttp_coding_encode_(evcon, req->output_buffer, 1);
+		evhttp_coding_end_(evcon);
+		if (res == -1) {
+			evhttp_connection_free(evcon);
+			return;
+		}
+	}
+
+	/* Adds headers to the response */
+	evhttp_stats_replying_(evcon);
+	evhttp_make_header(evcon, req);
+
+	evhttp_write_buffer(evcon, evhttp_send_done, NULL);
+}
+
+void
+evhttp_send_reply(struct evhttp_request *req, int code, const char *reason,
+    struct evbuffer *databuf)
+{
+	evhttp_response_code_(req, code, reason);
+
+	evhttp_send(req, databuf);
+}
+
+void
+evhttp_send_reply_start(struct evhttp_request *req, int code,
+    const char *reason)
+{
+	evhttp_response_code_(req, code, reason);
+
+	if (req->evcon == NULL)
+		return;
+
+	evhttp_coding_start_(req);
+
+	if (evhttp_find_header(req->output_headers, "Content-Length") == NULL &&
+	    REQ_VERSION_ATLEAST(req, 1, 1) &&
+	    evhttp_response_needs_body(req)) {
+		/*
+		 * prefer HTTP/1.1 chunked encoding to closing the connection;
+		 * note RFC 2616 section 4.4 forbids it with Content-Length:
+		 * and it's not necessary then anyway.
+		 */
+		evhttp_add_header(req->output_headers, "Transfer-Encoding",
+		    "chunked");
+		req->chunked = 1;
+	} else {
+		req->chunked = 0;
+	}
+	evhttp_stats_replying_(req->evcon);
+	evhttp_make_header(req->evcon, req);
+	evhttp_write_buffer(req->evcon, NULL, NULL);
+}
+
+int
+evhttp_send_early_hints(struct evhttp_request *req,
+    const struct evkeyvalq *headers)
+{
+	struct evhttp_connection *evcon = req->evcon;
+	struct evkeyval *header;
+	struct evbuffer *output;
+	size_t len;
+
+	/* interim responses are new in HTTP/1.1 */
+	if (evcon == NULL || evcon->http_server == NULL ||
+	    !REQ_VERSION_ATLEAST(req, 1, 1))
+		return (-1);
+	/* and have to precede the reply; evhttp_send_reply(),
+	 * evhttp_send_reply_start() and evhttp_send_error() all turn req
+	 * into a response */
+	if (req->kind != EVHTTP_REQUEST)
+		return (-1);
+
+	output = bufferevent_get_output(evcon->bufev);
+	len = evbuffer_get_length(output);
+	evbuffer_add_printf(output, "HTTP/%d.%d %d %s\r\n",
+	    req->major, req->minor, HTTP_EARLYHINTS,
+	    evhttp_response_phrase_internal(HTTP_EARLYHINTS));
+	TAILQ_FOREACH(header, headers, next) {
+		evbuffer_add_printf(output, "%s: %s\r\n",
+		    header->key, header->value);
+	}
+	evbuffer_add(output, "\r\n", 2);
+	evcon->stats_out += evbuffer_get_length(output) - len;
+	bufferevent_enable(evcon->bufev, EV_WRITE);
+
+	return (0);
+}
+
+/* Formats the size line of a chunk into buf, returning its length */
+static size_t
+evhttp_chunk_size_line_(char *buf, size_t size)
+{
+	static const char hex[] = "0123456789abcdef";
+	char digits[sizeof(size_t) * 2];
+	size_t ndigits = 0, len = 0;
+
+	do {
+		digits[ndigits++] = hex[size & 0xf];
+		size >>= 4;
+	} while (size);
+	while (ndigits)
+		buf[len++] = digits[--ndigits];
+	buf[len++] = '\r';
+	buf[len++] = '\n';
+
+	return (len);
+}
+
+void
+evhttp_send_reply_chunk_with_cb(struct evhttp_request *req, struct evbuffer *databuf,
+    void (*cb)(struct evhttp_connection *, void *), void *arg)
+{
+	struct evhttp_connection *evcon = req->evcon;
+	struct evbuffer *output;
+
+	if (evcon == NULL)
+		return;
+
+	output = bufferevent_get_output(evcon->bufev);
+
+	if (evbuffer_get_length(databuf) == 0)
+		return;
+	if (!evhttp_response_needs_body(req))
+		return;
+	if (evcon->coding != NULL) {
+		if (evhttp_coding_encode_(evcon, databuf, 0) == -1) {
+			/* the response cannot be completed anymore */
+			evhttp_connection_fail_(evcon, EVREQ_HTTP_EOF);
+			return;
+		}
+		if (evbuffer_get_length(databuf) == 0) {
+			/* the coding kept it all; cb is still owed a call
+			 * once everything written so far has gone out */
+			evhttp_write_buffer(evcon, cb, arg);
+			if (evbuffer_get_length(output) == 0)
+				bufferevent_trigger(evcon->bufev, EV_WRITE,
+				    BEV_TRIG_DEFER_CALLBACKS);
+			return;
+		}
+	}
+	evcon->stats_out += evbuffer_get_length(databuf);
+	if (req->chunked) {
+		char line[sizeof(size_t) * 2 + 2];
+		size_t line_len = evhttp_chunk_size_line_(line,
+		    evbuffer_get_length(databuf));
+		evbuffer_add(output, line, line_len);
+		evcon->stats_out += line_len + 2;
+	}
+	/* moves the chains of databuf without copying them */
+	evbuffer_add_buffer(output, databuf);
+	if (req->chunked) {
+		evbuffer_add(output, "\r\n", 2);
+	}
+	evhttp_write_buffer(evcon, cb, arg);
+}
+
+void
+evhttp_send_reply_chunk(struct evhttp_request *req, struct evbuffer *databuf)
+{
+	evhttp_send_reply_chunk_with_cb(req, databuf, NULL, NULL);
+}
+
+/*
+ * Returns true once the request line of a streamed request has been
+ * written, so that its body goes straight to the connection.
+ */
+static int
+evhttp_request_uploading_(struct evhttp_request *req)
+{
+	struct evhttp_connection *evcon = req->evcon;
+
+	return (evcon != NULL && evcon->state == EVCON_WRITING &&
+	    TAILQ_FIRST(&evcon->requests) == req);
+}
+
+/* Returns how much of the body of a streamed request is not sent yet */
+static size_t
+evhttp_request_upload_pending_(struct evhttp_request *req)
+{
+	if (!evhttp_request_uploading_(req))
+		return (evbuffer_get_length(req->output_buffer));
+	return (evbuffer_get_length(bufferevent_get_output(req->evcon->bufev)));
+}
+
+/* Sends databuf as the next chunk of the body of a streamed request */
+static void
+evhttp_request_upload_chunk_(struct evhttp_request *req,
+    struct evbuffer *databuf)
+{
+	struct evbuffer *output;
+	char line[sizeof(size_t) * 2 + 2];
+
+	if (evbuffer_get_length(databuf) == 0)
+		return;
+	if (!evhttp_request_uploading_(req)) {
+		/* sent along with the request line */
+		evbuffer_add_buffer(req->output_buffer, databuf);
+		return;
+	}
+
+	output = bufferevent_get_output(req->evcon->bufev);
+	evbuffer_add(output, line, evhttp_chunk_size_line_(line,
+		evbuffer_get_length(databuf)));
+	evbuffer_add_buffer(output, databuf);
+	evbuffer_add(output, "\r\n", 2);
+}
+
+/*
+ * Completes the body of a streamed request; the response is read once it
+ * has been written.
+ */
+static void
+evhttp_request_upload_end_(struct evhttp_request *req)
+{
+	if ((req->flags & EVHTTP_REQ_STREAM_UPLOAD) == 0)
+		return;
+	req->flags &= ~EVHTTP_REQ_STREAM_UPLOAD;
+
+	/* if the request has not been sent yet, it is sent with a
+	 * Content-Length instead */
+	if (evhttp_request_uploading_(req))
+		evbuffer_add(bufferevent_get_output(req->evcon->bufev),
+		    "0\r\n\r\n", 5);
+}
+void
+evhttp_send_reply_end(struct evhttp_request *req)
+{
+	evhttp_send_reply_end_with_trailers(req, NULL);
+}
+
+void
+evhttp_send_reply_end_with_trailers(struct evhttp_request *req,
+    const struct evkeyvalq *trailers)
+{
+	struct evhttp_connection *evcon = req->evcon;
+	struct evbuffer *output;
+
+	if (evcon == NULL) {
+		evhttp_request_free(req);
+		return;
+	}
+
+	output = bufferevent_get_output(evcon->bufev);
+
+	if (evcon->coding != NULL) {
+		struct evbuffer *buf = evbuffer_new();
+		if (buf == NULL ||
+		    evhttp_coding_encode_(evcon, buf, 1) == -1) {
+			if (buf != NULL)
+				evbuffer_free(buf);
+			evhttp_connection_fail_(evcon, EVREQ_HTTP_EOF);
+			evhttp_request_free(req);
+			return;
+		}
+		evhttp_coding_end_(evcon);
+		evhttp_send_reply_chunk(req, buf);
+		evbuffer_free(buf);
+	}
+
+	/* we expect no more calls form the user on this request */
+	req->userdone = 1;
+
+	if (req->chunked) {
+		size_t len = evbuffer_get_length(output);
+		struct evkeyval *header;
+
+		evbuffer_add(output, "0\r\n", 3);
+		if (trailers != NULL) {
+			TAILQ_FOREACH(header, trailers, next) {
+				evbuffer_add_printf(output, "%s: %s\r\n",
+				    header->key, header->value);
+			}
+		}
+		evbuffer_add(output, "\r\n", 2);
+		evcon->stats_out += evbuffer_get_length(output) - len;
+		evhttp_write_buffer(req->evcon, evhttp_send_done, NULL);
+		req->chunked = 0;
+	} else if (evbuffer_get_length(output) == 0) {
+		/* let the connection know that we are done with the request */
+		evhttp_send_done(evcon, NULL);
+	} else {
+		/* make the callback execute after all data has been written */
+		evcon->cb = evhttp_send_done;
+		evcon->cb_arg = NULL;
+	}
+}
+
+/*
+ * Static file serving
+ */
+
+#ifdef _WIN32
+#ifndef fstat
+#define fstat _fstat
+#endif
+#ifndef stat
+#define stat _stat
+#endif
+#ifndef S_ISREG
+#define S_ISREG(m) (((m) & _S_IFMT) == _S_IFREG)
+#endif
+#endif
+
+static const struct {
+	const char *extension;
+	const char *content_type;
+} evhttp_static_types[] = {
+	{ "html", "text/html" },
+	{ "htm", "text/html" },
+	{ "txt", "text/plain" },
+	{ "css", "text/css" },
+	{ "js", "application/javascript" },
+	{ "json", "application/json" },
+	{ "xml", "text/xml" },
+	{ "svg", "image/svg+xml" },
+	{ "png", "image/png" },
+	{ "jpg", "image/jpeg" },
+	{ "jpeg", "image/jpeg" },
+	{ "gif", "image/gif" },
+	{ "ico", "image/x-icon" },
+	{ "pdf", "application/pdf" },
+	{ "wasm", "application/wasm" },
+	{ NULL, NULL },
+};
+
+static inline unsigned
+evhttp_static_file_hash(struct evhttp_static_file *file)
+{
+	return ht_string_hash_(file->path);
+}
+
+static inline int
+evhttp_static_file_eq(struct evhttp_static_file *a,
+    struct evhttp_static_file *b)
+{
+	return !strcmp(a->path, b->path);
+}
+
+HT_PROTOTYPE(evhttp_static_map, evhttp_static_file, node,
+    evhttp_static_file_hash, evhttp_static_file_eq)
+HT_GENERATE(evhttp_static_map, evhttp_static_file, node,
+    evhttp_static_file_hash, evhttp_static_file_eq,
+    0.5, mm_malloc, mm_realloc, mm_free)
+
+/* Days since the epoch for a date of the proleptic Gregorian calendar */
+static ev_int64_t
+evhttp_days_from_civil(ev_int64_t y, int m, int d)
+{
+	ev_int64_t era, yoe, doy, doe;
+
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
+}
+
+/* Format t as an RFC 1123 date; does not depend on gmtime() */
+static int
+evhttp_format_date(char *date, size_t datelen, ev_int64_t t)
+{
+	struct tm tm;
+	ev_int64_t days = t / 86400, secs = t % 86400;
+	ev_int64_t z, era, doe, yoe, doy, mp;
+
+	if (secs < 0) {
+		secs += 86400;
+		--days;
+	}
+
+	z = days + 719468;
+	era = (z >= 0 ? z : z - 146096) / 146097;
+	doe = z - era * 146097;
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_mday = (int)(doy - (153 * mp + 2) / 5 + 1);
+	tm.tm_mon = (int)(mp < 10 ? mp + 2 : mp - 10);
+	tm.tm_year = (int)(yoe + era * 400 + (tm.tm_mon <= 1) - 1900);
+	tm.tm_wday = (int)((days % 7 + 11) % 7);
+	tm.tm_hour = (int)(secs / 3600);
+	tm.tm_min = (int)(secs / 60 % 60);
+	tm.tm_sec = (int)(secs % 60);
+
+	return (evutil_date_rfc1123(date, datelen, &tm));
+}
+
+/* Parse an RFC 1123 date, as sent in "If-Modified-Since" */
+static int
+evhttp_parse_date(const char *date, ev_int64_t *t)
+{
+	static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	char mon[4];
+	int day, year, hour, min, sec;
+	const char *p;
+
+	if ((p = strchr(date, ',')) == NULL ||
+	    sscanf(p + 1, "%2d %3s %4d %2d:%2d:%2d",
+		&day, mon, &year, &hour, &min, &sec) != 6 ||
+	    strlen(mon) != 3 ||
+	    (p = strstr(months, mon)) == NULL || (p - months) % 3 != 0)
+		return (-1);
+
+	*t = evhttp_days_from_civil(year, (int)(p - months) / 3 + 1, day) *
+	    86400 + hour * 3600 + min * 60 + sec;
+	return (0);
+}
+
+static const char *
+evhttp_static_content_type(const char *path)
+{
+	const char *ext = strrchr(path, '.');
+	int i;
+
+	if (ext != NULL && strchr(ext, '/') == NULL) {
+		for (i = 0; evhttp_static_types[i].extension != NULL; ++i) {
+			if (!evutil_ascii_strcasecmp(ext + 1,
+				evhttp_static_types[i].extension))
+				return (evhttp_static_types[i].content_type);
+		}
+	}
+
+	return ("application/octet-stream");
+}
+
+/*
+ * Return the decoded path of the request, or NULL if it is not a path
+ * we would serve.
+ */
+static char *
+evhttp_static_path(struct evhttp_request *req)
+{
+	static const char index[] = "index.html";
+	const char *path = evhttp_uri_get_path(req->uri_elems);
+	char *decoded, *p;
+	size_t len;
+
+	if (path == NULL || *path != '/')
+		return (NULL);
+	if ((decoded = evhttp_uridecode(path, 0, &len)) == NULL)
+		return (NULL);
+
+	/* nothing that could escape the root directory */
+	if (strlen(decoded) != len || strchr(decoded, '\\') != NULL)
+		goto error;
+	for (p = decoded; (p = strstr(p, "/..")) != NULL; p += 3) {
+		if (p[3] == '/' || p[3] == '\0')
+			goto error;
+	}
+
+	if (decoded[len - 1] == '/') {
+		if ((p = mm_realloc(decoded, len + sizeof(index))) == NULL)
+			goto error;
+		decoded = p;
+		memcpy(decoded + len, index, sizeof(index));
+	}
+
+	return (decoded);
+
+ error:
+	mm_free(decoded);
+	return (NULL);
+}
+
+static char *
+evhttp_static_fullpath(struct evhttp_static *st, const char *path)
+{
+	size_t rootlen = strlen(st->root), len = strlen(path);
+	char *fullpath;
+
+	if ((fullpath = mm_malloc(rootlen + len + 1)) == NULL) {
+		event_warn("%s: malloc", __func__);
+		return (NULL);
+	}
+	memcpy(fullpath, st->root, rootlen);
+	memcpy(fullpath + rootlen, path, len + 1);
+
+	return (fullpath);
+}
+
+static struct evhttp_static_file *
+evhttp_static_file_open(struct evhttp_static *st, const char *path,
+    ev_int64_t now)
+{
+	struct evhttp_static_file *file = NULL;
+	char *fullpath;
+	struct stat sb;
+	int fd = -1, flags = O_RDONLY;
+
+#ifdef _WIN32
+	flags |= O_BINARY;
+#endif
+
+	if ((fullpath = evhttp_static_fullpath(st, path)) == NULL)
+		return (NULL);
+	fd = evutil_open_closeonexec_(fullpath, flags, 0);
+	mm_free(fullpath);
+	if (fd < 0)
+		return (NULL);
+	if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode))
+		goto error;
+
+	if ((file = mm_calloc(1, sizeof(*file))) == NULL) {
+		event_warn("%s: calloc", __func__);
+		goto error;
+	}
+	if ((file->path = mm_strdup(path)) == NULL) {
+		event_warn("%s: strdup", __func__);
+		goto error;
+	}
+
+	file->size = sb.st_size;
+	file->mtime = sb.st_mtime;
+	file->ino = sb.st_ino;
+	file->validated = now;
+
+	if (file->size > 0) {
+		/* the segment owns the fd from now on */
+		file->seg = evbuffer_file_segment_new(fd, 0, file->size,
+		    st->seg_flags | EVBUF_FS_CLOSE_ON_FREE);
+		if (file->seg == NULL)
+			goto error;
+	} else {
+		close(fd);
+	}
+
+	file->content_type = evhttp_static_content_type(path);
+	evhttp_format_date(file->last_modified, sizeof(file->last_modified),
+	    file->mtime);
+	evutil_snprintf(file->etag, sizeof(file->etag),
+	    "\"" EV_I64_FMT "-" EV_I64_FMT "\"",
+	    EV_I64_ARG(file->mtime), EV_I64_ARG(file->size));
+
+	return (file);
+
+ error:
+	if (file != NULL) {
+		mm_free(file->path);
+		mm_free(file);
+	}
+	close(fd);
+	return (NULL);
+}
+
+static void
+evhttp_static_file_free(struct evhttp_static *st,
+    struct evhttp_static_file *file)
+{
+	HT_REMOVE(evhttp_static_map, &st->files, file);
+	TAILQ_REMOVE(&st->lru, file, next);
+	--st->nfiles;
+
+	/* closes the fd once the file is not being sent anymore */
+	if (file->seg != NULL)
+		evbuffer_file_segment_free(file->seg);
+	mm_free(file->path);
+	mm_free(file);
+}
+
+/* Returns whether the file changed since it has been opened */
+static int
+evhttp_static_file_changed(struct evhttp_static *st,
+    struct evhttp_static_file *file)
+{
+	char *fullpath;
+	struct stat sb;
+	int res;
+
+	if ((fullpath = evhttp_static_fullpath(st, file->path)) == NULL)
+		return (1);
+	res = stat(fullpath, &sb);
+	mm_free(fullpath);
+
+	return (res < 0 || !S_ISREG(sb.st_mode) ||
+	    sb.st_size != file->size || sb.st_mtime != file->mtime ||
+	    (ev_int64_t)sb.st_ino != file->ino);
+}
+
+static struct evhttp_static_file *
+evhttp_static_file_get(struct evhttp_static *st, const char *path)
+{
+	struct evhttp_static_file find, *file;
+	struct timeval tv;
+	ev_int64_t now;
+
+	event_base_gettimeofday_cached(st->base, &tv);
+	now = tv.tv_sec;
+
+	find.path = (char *)path;
+	file = HT_FIND(evhttp_static_map, &st->files, &find);
+	if (file != NULL && now - file->validated >= HTTP_STATIC_REVALIDATE) {
+		if (evhttp_static_file_changed(st, file)) {
+			evhttp_static_file_free(st, file);
+			file = NULL;
+		} else {
+			file->validated = now;
+		}
+	}
+
+	if (file != NULL) {
+		if (file != TAILQ_FIRST(&st->lru)) {
+			TAILQ_REMOVE(&st->lru, file, next);
+			TAILQ_INSERT_HEAD(&st->lru, file, next);
+		}
+		return (file);
+	}
+
+	if ((file = evhttp_static_file_open(st, path, now)) == NULL)
+		return (NULL);
+
+	if (st->nfiles >= st->max_files)
+		evhttp_static_file_free(st,
+		    TAILQ_LAST(&st->lru, evhttp_static_fileq));
+	HT_INSERT(evhttp_static_map, &st->files, file);
+	TAILQ_INSERT_HEAD(&st->lru, file, next);
+	++st->nfiles;
+
+	return (file);
+}
+
+/*
+ * Parse a "Range" header for a file of the given size.  Returns 1 for a
+ * satisfiable single byte range, -1 for an unsatisfiable one and 0 if the
+ * header is to be ignored.
+ */
+static int
+evhttp_static_parse_range(const char *range, ev_off_t size,
+    ev_off_t *offset, ev_off_t *length)
+{
+	ev_int64_t first, last;
+	char *endp;
+
+	if (evutil_ascii_strncasecmp(range, "bytes=", 6) != 0)
+		return (0);
+	range += 6;
+
+	/* we only deal with a single range */
+	if (strchr(range, ',') != NULL)
+		return (0);
+
+	if (*range == '-') {
+		/* the last bytes of the file */
+		if (!EVUTIL_ISDIGIT_(range[1]))
+			return (0);
+		last = evutil_strtoll(range + 1, &endp, 10);
+		if (*endp != '\0')
+			return (0);
+		if (last == 0 || size == 0)
+			return (-1);
+		if (last > size)
+			last = size;
+		*offset = size - last;
+		*length = last;
+		return (1);
+	}
+
+	if (!EVUTIL_ISDIGIT_(*range))
+		return (0);
+	first = evutil_strtoll(range, &endp, 10);
+	if (*endp++ != '-')
+		return (0);
+	if (*endp == '\0') {
+		last = size - 1;
+	} else {
+		if (!EVUTIL_ISDIGIT_(*endp))
+			return (0);
+		last = evutil_strtoll(endp, &endp, 10);
+		if (*endp != '\0' || last < first)
+			return (0);
+		if (last >= size)
+			last = size - 1;
+	}
+	if (first >= size)
+		return (-1);
+
+	*offset = first;
+	*length = last - first + 1;
+	return (1);
+}
+
+static int
+evhttp_static_not_modified(struct evhttp_request *req,
+    struct evhttp_static_file *file)
+{
+	const char *value;
+	ev_int64_t t;
+
+	/* If-None-Match takes precedence over If-Modified-Since */
+	value = evhttp_find_header(req->input_headers, "If-None-Match");
+	if (value != NULL)
+		return (!strcmp(value, "*") || strstr(value, file->etag) != NULL);
+
+	value = evhttp_find_header(req->input_headers, "If-Modified-Since");
+	if (value != NULL && evhttp_parse_date(value, &t) == 0)
+		return (file->mtime <= t);
+
+	return (0);
+}
+
+struct evhttp_static *
+evhttp_static_new(struct event_base *base, const char *root, int max_files,
+    unsigned flags)
+{
+	struct evhttp_static *st;
+	size_t len;
+
+	if ((st = mm_calloc(1, sizeof(*st))) == NULL) {
+		event_warn("%s: calloc", __func__);
+		return (NULL);
+	}
+	if ((st->root = mm_strdup(root)) == NULL) {
+		event_warn("%s: strdup", __func__);
+		mm_free(st);
+		return (NULL);
+	}
+	/* request paths start with a '/' */
+	len = strlen(st->root);
+	while (len > 0 && st->root[len - 1] == '/')
+		st->root[--len] = '\0';
+
+	HT_INIT(evhttp_static_map, &st->files);
+	TAILQ_INIT(&st->lru);
+	TAILQ_INIT(&st->variants);
+	st->max_files = max_files > 0 ? max_files : 1;
+	st->base = base;
+	st->seg_flags = flags;
+
+	return (st);
+}
+
+void
+evhttp_static_free(struct evhttp_static *st)
+{
+	struct evhttp_static_file *file;
+	struct evhttp_static_variant *variant;
+
+	while ((file = TAILQ_FIRST(&st->lru)) != NULL)
+		evhttp_static_file_free(st, file);
+	HT_CLEAR(evhttp_static_map, &st->files);
+
+	while ((variant = TAILQ_FIRST(&st->variants)) != NULL) {
+		TAILQ_REMOVE(&st->variants, variant, next);
+		mm_free(variant->coding);
+		mm_free(variant->suffix);
+		mm_free(variant);
+	}
+
+	mm_free(st->root);
+	mm_free(st);
+}
+
+int
+evhttp_static_add_precompressed(struct evhttp_static *st,
+    const char *coding, const char *suffix)
+{
+	struct evhttp_static_variant *variant;
+
+	if ((variant = mm_calloc(1, sizeof(*variant))) == NULL) {
+		event_warn("%s: calloc", __func__);
+		return (-1);
+	}
+	if ((variant->coding = mm_strdup(coding)) == NULL ||
+	    (variant->suffix = mm_strdup(suffix)) == NULL) {
+		event_warn("%s: strdup", __func__);
+		if (variant->coding != NULL)
+			mm_free(variant->coding);
+		mm_free(variant);
+		return (-1);
+	}
+
+	TAILQ_INSERT_TAIL(&st->variants, variant, next);
+
+	return (0);
+}
+
+/* Looks up the first precompressed variant of path the client accepts */
+static struct evhttp_static_file *
+evhttp_static_variant_get(struct evhttp_static *st,
+    struct evhttp_request *req, const char *path, const char **coding)
+{
+	struct evhttp_static_variant *variant;
+	struct evhttp_static_file *file = NULL;
+	const char *accept;
+	char *vpath;
+	size_t len;
+
+	accept = evhttp_find_header(req->input_headers, "Accept-Encoding");
+	if (accept == NULL)
+		return (NULL);
+
+	len = strlen(path);
+	TAILQ_FOREACH(variant, &st->variants, next) {
+		if (!evhttp_coding_accepted(accept, variant->coding))
+			continue;
+		vpath = mm_malloc(len + strlen(variant->suffix) + 1);
+		if (vpath == NULL) {
+			event_warn("%s: malloc", __func__);
+			return (NULL);
+		}
+		memcpy(vpath, path, len);
+		strcpy(vpath + len, variant->suffix);
+		file = evhttp_static_file_get(st, vpath);
+		mm_free(vpath);
+		if (file != NULL) {
+			*coding = variant->coding;
+			break;
+		}
+	}
+
+	return (file);
+}
+
+void
+evhttp_static_handler(struct evhttp_request *req, void *arg)
+{
+	struct evhttp_static *st = arg;
+	struct evhttp_static_file *file = NULL;
+	struct evkeyvalq *headers = req->output_headers;
+	const char *range, *if_range, *coding = NULL, *content_type;
+	ev_off_t offset = 0, length;
+	int code = HTTP_OK;
+	char buf[80];
+	char *path;
+
+	if (req->type != EVHTTP_REQ_GET && req->type != EVHTTP_REQ_HEAD) {
+		/* evhttp_send_error() would drop the header */
+		evhttp_add_header(headers, "Allow", "GET, HEAD");
+		evhttp_send_reply(req, HTTP_BADMETHOD, NULL, NULL);
+		return;
+	}
+
+	if ((path = evhttp_static_path(req)) == NULL) {
+		evhttp_send_notfound(req, NULL);
+		return;
+	}
+	if (!TAILQ_EMPTY(&st->variants)) {
+		evhttp_add_header(headers, "Vary", "Accept-Encoding");
+		file = evhttp_static_variant_get(st, req, path, &coding);
+	}
+	if (file == NULL) {
+		file = evhttp_static_file_get(st, path);
+		content_type = file ? file->content_type : NULL;
+	} else {
+		content_type = evhttp_static_content_type(path);
+		evhttp_add_header(headers, "Content-Encoding", coding);
+	}
+	mm_free(path);
+	if (file == NULL) {
+		evhttp_send_notfound(req, NULL);
+		return;
+	}
+
+	/* sendfile bypasses the content coding */
+	if (!(st->seg_flags & EVBUF_FS_DISABLE_SENDFILE))
+		req->flags |= EVHTTP_REQ_NO_CONTENT_CODING;
+
+	evhttp_add_header(headers, "Last-Modified", file->last_modified);
+	evhttp_add_header(headers, "ETag", file->etag);
+	evhttp_add_header(headers, "Accept-Ranges", "bytes");
+
+	if (evhttp_static_not_modified(req, file)) {
+		evhttp_send_reply(req, HTTP_NOTMODIFIED, NULL, NULL);
+		return;
+	}
+
+	if (evhttp_find_header(headers, "Content-Type") == NULL)
+		evhttp_add_header(headers, "Content-Type", content_type);
+
+	length = file->size;
+	range = evhttp_find_header(req->input_headers, "Range");
+	if_range = evhttp_find_header(req->input_headers, "If-Range");
+	if (range != NULL && (if_range == NULL ||
+		!strcmp(if_range, file->etag) ||
+		!strcmp(if_range, file->last_modified))) {
+		switch (evhttp_static_parse_range(range, file->size,
+			&offset, &length)) {
+		case -1:
+			evutil_snprintf(buf, sizeof(buf), "bytes */" EV_I64_FMT,
+			    EV_I64_ARG(file->size));
+			evhttp_add_header(headers, "Content-Range", buf);
+			evhttp_send_reply(req, HTTP_BADRANGE, NULL, NULL);
+			return;
+		case 1:
+			code = HTTP_PARTIAL;
+			evutil_snprintf(buf, sizeof(buf),
+			    "bytes " EV_I64_FMT "-" EV_I64_FMT "/" EV_I64_FMT,
+			    EV_I64_ARG(offset), EV_I64_ARG(offset + length - 1),
+			    EV_I64_ARG(file->size));
+			evhttp_add_header(headers, "Content-Range", buf);
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (req->type == EVHTTP_REQ_HEAD) {
+		evutil_snprintf(buf, sizeof(buf), EV_I64_FMT,
+		    EV_I64_ARG(length));
+		evhttp_add_header(headers, "Content-Length", buf);
+	} else if (length > 0 && evbuffer_add_file_segment(req->output_buffer,
+		file->seg, offset, length) == -1) {
+		evhttp_send_error(req, HTTP_INTERNAL, NULL);
+		return;
+	}
+
+	evhttp_send_reply(req, code, NULL, NULL);
+}
+
+static const char *informational_phrases[] = {
+	/* 100 */ "Continue",
+	/* 101 */ "Switching Protocols",
+	/* 102 */ "Processing",
+	/* 103 */ "Early Hints"
+};
+
+static const char *success_phrases[] = {
+	/* 200 */ "OK",
+	/* 201 */ "Created",
+	/* 202 */ "Accepted",
+	/* 203 */ "Non-Authoritative Information",
+	/* 204 */ "No Content",
+	/* 205 */ "Reset Content",
+	/* 206 */ "Partial Content"
+};
+
+static const char *redirection_phrases[] = {
+	/* 300 */ "Multiple Choices",
+	/* 301 */ "Moved Permanently",
+	/* 302 */ "Found",
+	/* 303 */ "See Other",
+	/* 304 */ "Not Modified",
+	/* 305 */ "Use Proxy",
+	/* 307 */ "Temporary Redirect"
+};
+
+static const char *client_error_phrases[] = {
+	/* 400 */ "Bad Request",
+	/* 401 */ "Unauthorized",
+	/* 402 */ "Payment Required",
+	/* 403 */ "Forbidden",
+	/* 404 */ "Not Found",
+	/* 405 */ "Method Not Allowed",
+	/* 406 */ "Not Acceptable",
+	/* 407 */ "Proxy Authentication Required",
+	/* 408 */ "Request Time-out",
+	/* 409 */ "Conflict",
+	/* 410 */ "Gone",
+	/* 411 */ "Length Required",
+	/* 412 */ "Precondition Failed",
+	/* 413 */ "Request Entity Too Large",
+	/* 414 */ "Request-URI Too Large",
+	/* 415 */ "Unsupported Media Type",
+	/* 416 */ "Requested range not satisfiable",
+	/* 417 */ "Expectation Failed"
+};
+
+static const char *server_error_phrases[] = {
+	/* 500 */ "Internal Server Error",
+	/* 501 */ "Not Implemented",
+	/* 502 */ "Bad Gateway",
+	/* 503 */ "Service Unavailable",
+	/* 504 */ "Gateway Time-out",
+	/* 505 */ "HTTP Version not supported"
+};
+
+struct response_class {
+	const char *name;
+	size_t num_responses;
+	const char **responses;
+};
+
+#ifndef MEMBERSOF
+#define MEMBERSOF(x) (sizeof(x)/sizeof(x[0]))
+#endif
+
+static const struct response_class response_classes[] = {
+	/* 1xx */ { "Informational", MEMBERSOF(informational_phrases), informational_phrases },
+	/* 2xx */ { "Success", MEMBERSOF(success_phrases), success_phrases },
+	/* 3xx */ { "Redirection", MEMBERSOF(redirection_phrases), redirection_phrases },
+	/* 4xx */ { "Client Error", MEMBERSOF(client_error_phrases), client_error_phrases },
+	/* 5xx */ { "Server Error", MEMBERSOF(server_error_phrases), server_error_phrases }
+};
+
+static const char *
+evhttp_response_phrase_internal(int code)
+{
+	int klass = code / 100 - 1;
+	int subcode = code % 100;
+
+	/* Unknown class - can't do any better here */
+	if (klass < 0 || klass >= (int) MEMBERSOF(response_classes))
+		return "Unknown Status Class";
+
+	/* Unknown sub-code, return class name at least */
+	if (subcode >= (int) response_classes[klass].num_responses)
+		return response_classes[klass].name;
+
+	return response_classes[klass].responses[subcode];
+}
+
+void
+evhttp_response_code_(struct evhttp_request *req, int code, const char *reason)
+{
+	req->kind = EVHTTP_RESPONSE;
+	req->response_code = code;
+	if (req->response_code_line != NULL)
+		mm_free(req->response_code_line);
+	if (reason == NULL)
+		reason = evhttp_response_phrase_internal(code);
+	req->response_code_line = mm_strdup(reason);
+	if (req->response_code_line == NULL) {
+		event_warn("%s: strdup", __func__);
+		/* XXX what else can we do? */
+	}
+}
+
+void
+evhttp_send_page_(struct evhttp_request *req, struct evbuffer *databuf)
+{
+	if (!req->major || !req->minor) {
+		req->major = 1;
+		req->minor = 1;
+	}
+
+	if (req->kind != EVHTTP_RESPONSE)
+		evhttp_response_code_(req, 200, "OK");
+
+	evhttp_clear_headers(req->output_headers);
+	evhttp_add_header(req->output_headers, "Content-Type", "text/html");
+	evhttp_add_header(req->output_headers, "Connection", "close");
+
+	evhttp_send(req, databuf);
+}
+
+/* Character classes of RFC3986 */
+#define URI_CHAR_UNRESERVED	0x01	/* ALPHA DIGIT "-" "." "_" "~" */
+#define URI_CHAR_SUBDELIM	0x02	/* "!$&'()*+,;=" */
+#define URI_CHAR_COLON		0x04
+#define URI_CHAR_PATH		0x08	/* "@" "/" */
+
+static const unsigned char uri_chars[256] = {
+	/* 0 */
+	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
+	0, 2, 0, 0, 2, 0, 2, 2,   2, 2, 2, 2, 2, 1, 1, 8,
+	1, 1, 1, 1, 1, 1, 1, 1,   1, 1, 4, 2, 0, 2, 0, 0,
+	/* 64 */
+	8, 1, 1, 1, 1, 1, 1, 1,   1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1,   1, 1, 1, 0, 0, 0, 0, 1,
+	0, 1, 1, 1, 1, 1, 1, 1,   1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1,   1, 1, 1, 0, 0, 0, 1, 0,
+	/* 128 */
+	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
+	/* 192 */
+	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+#define CHAR_IS_UNRESERVED(c)			\
+	(uri_chars[(unsigned char)(c)] & URI_CHAR_UNRESERVED)
+#define CHAR_IS_URI_CLASS(c, classes)		\
+	(uri_chars[(unsigned char)(c)] & (classes))
+
+/*
+ * Helper functions to encode/decode a string for inclusion in a URI.
+ * The returned string must be freed by the caller.
+ */
+char *
+evhttp_uriencode(const char *uri, ev_ssize_t len, int space_as_plus)
+{
+	struct evbuffer *buf = evbuffer_new();
+	const char *p, *end;
+	char *result = NULL;
+
+	if (!buf) {
+		goto out;
+	}
+
+	if (len >= 0) {
+		if (uri + len < uri) {
+			goto out;
+		}
+
+		end = uri + len;
+	} else {
+		size_t slen = strlen(uri);
+
+		if (slen >= EV_SSIZE_MAX) {
+			/* we don't want to mix signed and unsigned */
+			goto out;
+		}
+
+		if (uri + slen < uri) {
+			goto out;
+		}
+
+		end = uri + slen;
+	}
+
+	for (p = uri; p < end; p++) {
+		if (CHAR_IS_UNRESERVED(*p)) {
+			evbuffer_add(buf, p, 1);
+		} else if (*p == ' ' && space_as_plus) {
+			evbuffer_add(buf, "+", 1);
+		} else {
+			evbuffer_add_printf(buf, "%%%02X", (unsigned char)(*p));
+		}
+	}
+
+	evbuffer_add(buf, "", 1); /* NUL-terminator. */
+	result = mm_malloc(evbuffer_get_length(buf));
+
+	if (result)
+		evbuffer_remove(buf, result, evbuffer_get_length(buf));
+
+out:
+	if (buf)
+		evbuffer_free(buf);
+	return result;
+}
+
+char *
+evhttp_encode_uri(const char *str)
+{
+	return evhttp_uriencode(str, -1, 0);
+}
+
+/*
+ * @param decode_plus_ctl: if 1, we decode plus into space.  If 0, we don't.
+ *     If -1, when true we transform plus to space only after we've seen
+ *     a ?.  -1 is deprecated.
+ * @return the number of bytes written to 'ret'.
+ */
+static int
+evhttp_hex_value_(char c)
+{
+	if (c >= '0' && c <= '9')
+		return (c - '0');
+	if (c >= 'a' && c <= 'f')
+		return (c - 'a' + 10);
+	return (c - 'A' + 10);
+}
+
+int
+evhttp_decode_uri_internal(
+	const char *uri, size_t length, char *ret, int decode_plus_ctl)
+{
+	char c;
+	int j;
+	int decode_plus = (decode_plus_ctl == 1) ? 1: 0;
+	size_t i, run;
+
+	for (i = j = 0; i < length; i++) {
+		/* copy runs of characters that need no decoding at once */
+		run = i;
+		while (run < length && CHAR_IS_URI_CLASS(uri[run],
+			URI_CHAR_UNRESERVED|URI_CHAR_COLON|URI_CHAR_PATH))
+			++run;
+		if (run != i) {
+			memcpy(ret + j, uri + i, run - i);
+			j += (int)(run - i);
+			i = run;
+			if (i == length)
+				break;
+		}
+
+		c = uri[i];
+		if (c == '?') {
+			if (decode_plus_ctl < 0)
+				decode_plus = 1;
+		} else if (c == '+' && decode_plus) {
+			c = ' ';
+		} else if ((i + 2) < length && c == '%' &&
+			EVUTIL_ISXDIGIT_(uri[i+1]) && EVUTIL_ISXDIGIT_(uri[i+2])) {
+			c = (char)(evhttp_hex_value_(uri[i+1]) << 4 |
+			    evhttp_hex_value_(uri[i+2]));
+			i += 2;
+		}
+		ret[j++] = c;
+	}
+	ret[j] = '\0';
+
+	return (j);
+}
+
+/* deprecated */
+char *
+evhttp_decode_uri(const char *uri)
+{
+	char *ret;
+
+	if ((ret = mm_malloc(strlen(uri) + 1)) == NULL) {
+		event_warn("%s: malloc(%lu)", __func__,
+			  (unsigned long)(strlen(uri) + 1));
+		return (NULL);
+	}
+
+	evhttp_decode_uri_internal(uri, strlen(uri),
+	    ret, -1 /*always_decode_plus*/);
+
+	return (ret);
+}
+
+char *
+evhttp_uridecode(const char *uri, int decode_plus, size_t *size_out)
+{
+	char *ret;
+	int n;
+
+	if ((ret = mm_malloc(strlen(uri) + 1)) == NULL) {
+		event_warn("%s: malloc(%lu)", __func__,
+			  (unsigned long)(strlen(uri) + 1));
+		return (NULL);
+	}
+
+	n = evhttp_decode_uri_internal(uri, strlen(uri),
+	    ret, !!decode_plus/*always_decode_plus*/);
+
+	if (size_out) {
+		EVUTIL_ASSERT(n >= 0);
+		*size_out = (size_t)n;
+	}
+
+	return (ret);
+}
+
+int
+evhttp_query_next(const char **query, const char **key, size_t *key_len,
+    const char **value, size_t *value_len)
+{
+	const char *p = *query, *end, *eq;
+
+	if (p == NULL || *p == '\0')
+		return (0);
+
+	end = p + strcspn(p, "&");
+	eq = memchr(p, '=', end - p);
+	*key = p;
+	if (eq != NULL) {
+		*key_len = eq - p;
+		*value = eq + 1;
+		*value_len = end - eq - 1;
+	} else {
+		*key_len = end - p;
+		*value = NULL;
+		*value_len = 0;
+	}
+	*query = *end == '&' ? end + 1 : end;
+
+	return (1);
+}
+
+size_t
+evhttp_query_decode(const char *s, size_t len, char *out)
+{
+	return ((size_t)evhttp_decode_uri_internal(s, len, out,
+	    1 /*always_decode_plus*/));
+}
+
+/*
+ * Helper function to parse out arguments in a query.
+ * The arguments are separated by key and value.
+ */
+
+static int
+evhttp_parse_query_impl(const char *str, struct evkeyvalq *headers,
+    int is_whole_uri, unsigned flags)
+{
+	char *line = NULL;
+	const char *query_part, *key, *value;
+	size_t key_len, value_len;
+	int result = -1;
+	struct evhttp_uri *uri=NULL;
+
+	TAILQ_INIT(headers);
+
+	if (is_whole_uri) {
+		uri = evhttp_uri_parse(str);
+		if (!uri)
+			goto error;
+		query_part = evhttp_uri_get_query(uri);
+	} else {
+		query_part = str;
+	}
+
+	/* No arguments - we are done */
+	if (!query_part || !*query_part) {
+		result = 0;
+		goto done;
+	}
+
+	/* holds the key and the decoded value of any one argument */
+	if ((line = mm_malloc(strlen(query_part) + 2)) == NULL) {
+		event_warn("%s: malloc", __func__);
+		goto error;
+	}
+
+	while (evhttp_query_next(&query_part, &key, &key_len,
+		&value, &value_len)) {
+		char *decoded_value = line + key_len + 1;
+
+		if (flags & EVHTTP_URI_QUERY_NONCONFORMANT) {
+			if (key_len == 0)
+				continue;
+		} else {
+			if (value == NULL || key_len == 0)
+				goto error;
+		}
+
+		memcpy(line, key, key_len);
+		line[key_len] = '\0';
+		evhttp_decode_uri_internal(value ? value : "", value_len,
+		    decoded_value, 1 /*always_decode_plus*/);
+		event_debug(("Query Param: %s -> %s\n", line, decoded_value));
+		if (flags & EVHTTP_URI_QUERY_LAST_VAL)
+			evhttp_remove_header(headers, line);
+		evhttp_add_header_internal(headers, line, decoded_value);
+	}
+
+	result = 0;
+	goto done;
+error:
+	evhttp_clear_headers(headers);
+done:
+	if (line)
+		mm_free(line);
+	if (uri)
+		evhttp_uri_free(uri);
+	return result;
+}
+
+int
+evhttp_parse_query(const char *uri, struct evkeyvalq *headers)
+{
+	return evhttp_parse_query_impl(uri, headers, 1, 0);
+}
+int
+evhttp_parse_query_str(const char *uri, struct evkeyvalq *headers)
+{
+	return evhttp_parse_query_impl(uri, headers, 0, 0);
+}
+int
+evhttp_parse_query_str_flags(const char *uri, struct evkeyvalq *headers, unsigned flags)
+{
+	return evhttp_parse_query_impl(uri, headers, 0, flags);
+}
+
+static struct evhttp_cb *
+evhttp_dispatch_callback(struct httpcbq *callbacks, struct evhttp_request *req)
+{
+	struct evhttp_cb *cb;
+	size_t offset = 0;
+	char buf[256], *translated;
+	const char *path;
+
+	/* Test for different URLs */
+	path = evhttp_uri_get_path(req->uri_elems);
+	offset = strlen(path);
+	if (offset < sizeof(buf))
+		translated = buf;
+	else if ((translated = mm_malloc(offset + 1)) == NULL)
+		return (NULL);
+	evhttp_decode_uri_internal(path, offset, translated,
+	    0 /* decode_plus */);
+
+	TAILQ_FOREACH(cb, callbacks, next) {
+		if (!strcmp(cb->what, translated))
+			break;
+	}
+
+	if (translated != buf)
+		mm_free(translated);
+	return (cb);
+}
+
+
+static int
+prefix_suffix_match(const char *pattern, const char *name, int ignorecase)
+{
+	char c;
+
+	while (1) {
+		switch (c = *pattern++) {
+		case '\0':
+			return *name == '\0';
+
+		case '*':
+			while (*name != '\0') {
+				if (prefix_suffix_match(pattern, name,
+					ignorecase))
+					return (1);
+				++name;
+			}
+			return (0);
+		default:
+			if (c != *name) {
+				if (!ignorecase ||
+				    EVUTIL_TOLOWER_(c) != EVUTIL_TOLOWER_(*name))
+					return (0);
+			}
+			++name;
+		}
+	}
+	/* NOTREACHED */
+}
+
+/*
+   Search the vhost hierarchy beginning with http for a server alias
+   matching hostname.  If a match is found, and outhttp is non-null,
+   outhttp is set to the matching http object and 1 is returned.
+*/
+
+static int
+evhttp_find_alias(struct evhttp *http, struct evhttp **outhttp,
+		  const char *hostname)
+{
+	struct evhttp_server_alias *alias;
+	struct evhttp *vhost;
+
+	TAILQ_FOREACH(alias, &http->aliases, next) {
+		/* XXX Do we need to handle IP addresses? */
+		if (!evutil_ascii_strcasecmp(alias->alias, hostname)) {
+			if (outhttp)
+				*outhttp = http;
+			return 1;
+		}
+	}
+
+	/* XXX It might be good to avoid recursion here, but I don't
+	   see a way to do that w/o a list. */
+	TAILQ_FOREACH(vhost, &http->virtualhosts, next_vhost) {
+		if (evhttp_find_alias(vhost, outhttp, hostname))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+   Attempts to find the best http object to handle a request for a hostname.
+   All aliases for the root http object and vhosts are searched for an exact
+   match. Then, the vhost hierarchy is traversed again for a matching
+   pattern.
+
+   If an alias or vhost is matched, 1 is returned, and outhttp, if non-null,
+   is set with the best matching http object. If there are no matches, the
+   root http object is stored in outhttp and 0 is returned.
+*/
+
+static int
+evhttp_find_vhost(struct evhttp *http, struct evhttp **outhttp,
+		  const char *hostname)
+{
+	struct evhttp *vhost;
+	struct evhttp *oldhttp;
+	int match_found = 0;
+
+	if (evhttp_find_alias(http, outhttp, hostname))
+		return 1;
+
+	do {
+		oldhttp = http;
+		TAILQ_FOREACH(vhost, &http->virtualhosts, next_vhost) {
+			if (prefix_suffix_match(vhost->vhost_pattern,
+				hostname, 1 /* ignorecase */)) {
+				http = vhost;
+				match_found = 1;
+				break;
+			}
+		}
+	} while (oldhttp != http);
+
+	if (outhttp)
+		*outhttp = http;
+
+	return match_found;
+}
+
+static void
+evhttp_handle_request(struct evhttp_request *req, void *arg)
+{
+	struct evhttp *http = arg;
+	struct evhttp_cb *cb = NULL;
+	const char *hostname;
+
+	/* we have a new request on which the user needs to take action */
+	req->userdone = 0;
+
+	bufferevent_disable(req->evcon->bufev, EV_READ);
+
+	if (req->uri == NULL) {
+		evhttp_send_error(req, req->response_code, NULL);
+		return;
+	}
+
+	if ((http->allowed_methods & req->type) == 0) {
+		event_debug(("Rejecting disallowed method %x (allowed: %x)\n",
+			(unsigned)req->type, (unsigned)http->allowed_methods));
+		evhttp_send_error(req, HTTP_NOTIMPLEMENTED, NULL);
+		return;
+	}
+
+	if (evhttp_overloaded_(http)) {
+		evhttp_send_overloaded_(req);
+		return;
+	}
+	evhttp_request_set_inflight_(req, 1);
+
+	/* handle potential virtual hosts */
+	hostname = evhttp_request_get_host(req);
+	if (hostname != NULL) {
+		evhttp_find_vhost(http, &http, hostname);
+	}
+
+	cb = evhttp_dispatch_callback(&http->callbacks, req);
+	evhttp_stats_route_(req->evcon, http, cb);
+	if (cb != NULL) {
+		(*cb->cb)(req, cb->cbarg);
+		return;
+	}
+
+	/* Generic call back */
+	if (http->gencb) {
+		(*http->gencb)(req, http->gencbarg);
+		return;
+	} else
+		evhttp_send_notfound(req, NULL);
+}
+
+/*
+ * If the request matches a callback that streams the request body, make
+ * it the callback of the request itself so that it is invoked directly
+ * once the body has been read, and set up the streaming.
+ */
+static int
+evhttp_stream_request_(struct evhttp *http, struct evhttp_request *req)
+{
+	struct evhttp_cb *cb;
+	const char *hostname;
+
+	/* anything else is left to evhttp_handle_request() */
+	if (req->uri == NULL || (http->allowed_methods & req->type) == 0 ||
+	    evhttp_overloaded_(http))
+		return (0);
+
+	hostname = evhttp_request_get_host(req);
+	if (hostname != NULL)
+		evhttp_find_vhost(http, &http, hostname);
+
+	cb = evhttp_dispatch_callback(&http->callbacks, req);
+	if (cb == NULL || cb->chunk_cb == NULL)
+		return (0);
+
+	if (evbuffer_add_cb(req->input_buffer,
+		evhttp_stream_body_drain_cb, req) == NULL)
+		return (-1);
+
+	evhttp_request_set_inflight_(req, 1);
+	evhttp_stats_route_(req->evcon, http, cb);
+	req->flags |= EVHTTP_REQ_STREAM_BODY;
+	req->cb = cb->cb;
+	req->cb_arg = cb->cbarg;
+	req->header_cb = cb->header_cb;
+	req->chunk_cb = cb->chunk_cb;
+
+	return (0);
+}
+
+/*
+ * Admission control
+ */
 
-		if (uri + slen < uri) {
-			goto out;
-		}
+static void
+evhttp_set_accepting_(struct evhttp *http, int accepting)
+{
+	struct evhttp_bound_socket *bound;
 
-		end = uri + slen;
+	if (http->accept_paused == !accepting)
+		return;
+	TAILQ_FOREACH(bound, &http->sockets, next) {
+		if (accepting)
+			evconnlistener_enable(bound->listener);
+		else
+			evconnlistener_disable(bound->listener);
 	}
+	http->accept_paused = !accepting;
+}
 
-	for (p = uri; p < end; p++) {
-		if (CHAR_IS_UNRESERVED(*p)) {
-			evbuffer_add(buf, p, 1);
-		} else if (*p == ' ' && space_as_plus) {
-			evbuffer_add(buf, "+", 1);
-		} else {
-			evbuffer_add_printf(buf, "%%%02X", (unsigned char)(*p));
-		}
+/* The connections of the workers count against the limit of the server
+ * that accepted them. */
+static int
+evhttp_count_connections_(struct evhttp *http)
+{
+	struct evhttp_worker *worker;
+	int n = http->nconnections;
+
+	TAILQ_FOREACH(worker, &http->workers, next) {
+		EVLOCK_LOCK(worker->lock, 0);
+		n += worker->load;
+		EVLOCK_UNLOCK(worker->lock, 0);
 	}
+	return (n);
+}
 
-	evbuffer_add(buf, "", 1); /* NUL-terminator. */
-	result = mm_malloc(evbuffer_get_length(buf));
+static void
+evhttp_update_accepting_(struct evhttp *http)
+{
+	evhttp_set_accepting_(http, http->max_connections <= 0 ||
+	    evhttp_count_connections_(http) < http->max_connections);
+}
 
-	if (result)
-		evbuffer_remove(buf, result, evbuffer_get_length(buf));
+static void
+evhttp_request_set_inflight_(struct evhttp_request *req, int inflight)
+{
+	struct evhttp *http;
 
-out:
-	if (buf)
-		evbuffer_free(buf);
-	return result;
+	if (req->evcon == NULL || (http = req->evcon->http_server) == NULL)
+		return;
+	if (inflight && !(req->flags & EVHTTP_REQ_INFLIGHT)) {
+		req->flags |= EVHTTP_REQ_INFLIGHT;
+		++http->ninflight;
+	} else if (!inflight && (req->flags & EVHTTP_REQ_INFLIGHT)) {
+		req->flags &= ~EVHTTP_REQ_INFLIGHT;
+		--http->ninflight;
+	}
 }
 
-char *
-evhttp_encode_uri(const char *str)
+static ev_int64_t
+evhttp_usec_since_(const struct timeval *tv)
 {
-	return evhttp_uriencode(str, -1, 0);
+	struct timeval now, diff;
+
+	evutil_gettimeofday(&now, NULL);
+	evutil_timersub(&now, tv, &diff);
+	return ((ev_int64_t)diff.tv_sec * 1000000 + diff.tv_usec);
 }
 
-/*
- * @param decode_plus_ctl: if 1, we decode plus into space.  If 0, we don't.
- *     If -1, when true we transform plus to space only after we've seen
- *     a ?.  -1 is deprecated.
- * @return the number of bytes written to 'ret'.
- */
-int
-evhttp_decode_uri_internal(
-	const char *uri, size_t length, char *ret, int decode_plus_ctl)
+/* Runs before polling, i.e. once the callbacks have been run */
+static void
+evhttp_lag_prepare_cb(struct evwatch *watcher,
+    const struct evwatch_prepare_cb_info *info, void *arg)
 {
-	char c;
-	int j;
-	int decode_plus = (decode_plus_ctl == 1) ? 1: 0;
-	unsigned i;
+	struct evhttp *http = arg;
 
-	for (i = j = 0; i < length; i++) {
-		c = uri[i];
-		if (c == '?') {
-			if (decode_plus_ctl < 0)
-				decode_plus = 1;
-		} else if (c == '+' && decode_plus) {
-			c = ' ';
-		} else if ((i + 2) < length && c == '%' &&
-			EVUTIL_ISXDIGIT_(uri[i+1]) && EVUTIL_ISXDIGIT_(uri[i+2])) {
-			char tmp[3];
-			tmp[0] = uri[i+1];
-			tmp[1] = uri[i+2];
-			tmp[2] = '\0';
-			c = (char)strtol(tmp, NULL, 16);
-			i += 2;
-		}
-		ret[j++] = c;
+	if (evutil_timerisset(&http->lag_polled)) {
+		http->lag_usec = evhttp_usec_since_(&http->lag_polled);
+		evutil_timerclear(&http->lag_polled);
 	}
-	ret[j] = '\0';
+}
 
-	return (j);
+/* Runs after polling, i.e. before the callbacks are run */
+static void
+evhttp_lag_check_cb(struct evwatch *watcher,
+    const struct evwatch_check_cb_info *info, void *arg)
+{
+	struct evhttp *http = arg;
+
+	evutil_gettimeofday(&http->lag_polled, NULL);
 }
 
-/* deprecated */
-char *
-evhttp_decode_uri(const char *uri)
+static int
+evhttp_overloaded_(struct evhttp *http)
 {
-	char *ret;
+	ev_int64_t lag;
 
-	if ((ret = mm_malloc(strlen(uri) + 1)) == NULL) {
-		event_warn("%s: malloc(%lu)", __func__,
-			  (unsigned long)(strlen(uri) + 1));
-		return (NULL);
+	if (http->max_inflight > 0 && http->ninflight >= http->max_inflight)
+		return (1);
+
+	if (http->lag_prepare == NULL)
+		return (0);
+	lag = http->lag_usec;
+	if (evutil_timerisset(&http->lag_polled)) {
+		ev_int64_t running = evhttp_usec_since_(&http->lag_polled);
+		if (running > lag)
+			lag = running;
 	}
+	return (lag > http->max_lag_usec);
+}
 
-	evhttp_decode_uri_internal(uri, strlen(uri),
-	    ret, -1 /*always_decode_plus*/);
+static const char evhttp_overloaded_body[] =
+	"<html><head><title>503 Service Unavailable</title></head>"
+	"<body><h1>503 Service Unavailable</h1></body></html>";
 
-	return (ret);
+/* Rejects a request as cheaply as possible */
+static void
+evhttp_send_overloaded_(struct evhttp_request *req)
+{
+	evhttp_response_code_(req, HTTP_SERVUNAVAIL, NULL);
+	req->flags |= EVHTTP_REQ_NO_CONTENT_CODING;
+	evhttp_add_header(req->output_headers, "Content-Type", "text/html");
+	evhttp_add_header(req->output_headers, "Connection", "close");
+	evbuffer_add_reference(req->output_buffer, evhttp_overloaded_body,
+	    sizeof(evhttp_overloaded_body) - 1, NULL, NULL);
+	evhttp_send(req, NULL);
 }
 
-char *
-evhttp_uridecode(const char *uri, int decode_plus, size_t *size_out)
+void
+evhttp_set_max_connections(struct evhttp *http, int max_connections)
 {
-	char *ret;
-	int n;
+	http->max_connections = max_connections;
+	evhttp_update_accepting_(http);
+}
 
-	if ((ret = mm_malloc(strlen(uri) + 1)) == NULL) {
-		event_warn("%s: malloc(%lu)", __func__,
-			  (unsigned long)(strlen(uri) + 1));
-		return (NULL);
+void
+evhttp_set_max_inflight_requests(struct evhttp *http, int max_requests)
+{
+	http->max_inflight = max_requests;
+}
+
+int
+evhttp_set_max_loop_lag(struct evhttp *http, const struct timeval *max_lag)
+{
+	if (max_lag == NULL) {
+		if (http->lag_prepare != NULL) {
+			evwatch_free(http->lag_prepare);
+			evwatch_free(http->lag_check);
+			http->lag_prepare = http->lag_check = NULL;
+		}
+		return (0);
 	}
 
-	n = evhttp_decode_uri_internal(uri, strlen(uri),
-	    ret, !!decode_plus/*always_decode_plus*/);
+	http->max_lag_usec =
+	    (ev_int64_t)max_lag->tv_sec * 1000000 + max_lag->tv_usec;
+	if (http->lag_prepare != NULL)
+		return (0);
 
-	if (size_out) {
-		EVUTIL_ASSERT(n >= 0);
-		*size_out = (size_t)n;
+	http->lag_prepare = evwatch_prepare_new(http->base,
+	    evhttp_lag_prepare_cb, http);
+	http->lag_check = evwatch_check_new(http->base,
+	    evhttp_lag_check_cb, http);
+	if (http->lag_prepare == NULL || http->lag_check == NULL) {
+		if (http->lag_prepare != NULL)
+			evwatch_free(http->lag_prepare);
+		if (http->lag_check != NULL)
+			evwatch_free(http->lag_check);
+		http->lag_prepare = http->lag_check = NULL;
+		return (-1);
 	}
+	http->lag_usec = 0;
+	evutil_timerclear(&http->lag_polled);
 
-	return (ret);
+	return (0);
 }
 
 /*
- * Helper function to parse out arguments in a query.
- * The arguments are separated by key and value.
+ * Server statistics
  */
 
 static int
-evhttp_parse_query_impl(const char *str, struct evkeyvalq *headers,
-    int is_whole_uri, unsigned flags)
+evhttp_stats_enabled_(struct evhttp_connection *evcon)
 {
-	char *line=NULL;
-	char *argument;
-	char *p;
-	const char *query_part;
-	int result = -1;
-	struct evhttp_uri *uri=NULL;
-
-	TAILQ_INIT(headers);
+	return (evcon->http_server != NULL &&
+	    (evcon->http_server->flags & EVHTTP_SERVER_STATS));
+}
 
-	if (is_whole_uri) {
-		uri = evhttp_uri_parse(str);
-		if (!uri)
-			goto error;
-		query_part = evhttp_uri_get_query(uri);
-	} else {
-		query_part = str;
+/* Takes a reference on the statistics in slot, allocating them first */
+static struct evhttp_stats_ref *
+evhttp_stats_ref_(struct evhttp_stats_ref **slot)
+{
+	if (*slot == NULL) {
+		if ((*slot = mm_calloc(1, sizeof(**slot))) == NULL) {
+			event_warn("%s: calloc", __func__);
+			return (NULL);
+		}
+		/* owned by the slot */
+		(*slot)->refcnt = 1;
 	}
+	++(*slot)->refcnt;
+	return (*slot);
+}
 
-	/* No arguments - we are done */
-	if (!query_part || !strlen(query_part)) {
-		result = 0;
-		goto done;
-	}
+static void
+evhttp_stats_release_(struct evhttp_stats_ref *ref)
+{
+	if (ref != NULL && --ref->refcnt == 0)
+		mm_free(ref);
+}
 
-	if ((line = mm_strdup(query_part)) == NULL) {
-		event_warn("%s: strdup", __func__);
-		goto error;
-	}
+/* Four buckets per power of two */
+static int
+evhttp_histogram_bucket_(ev_uint64_t usec)
+{
+	int e = 0, idx;
 
-	p = argument = line;
-	while (p != NULL && *p != '\0') {
-		char *key, *value, *decoded_value;
-		argument = strsep(&p, "&");
+	if (usec < 4)
+		return ((int)usec);
+	while ((usec >> e) > 1)
+		++e;
+	idx = 4 * (e - 1) + (int)((usec >> (e - 2)) & 3);
+	return (idx < EVHTTP_HISTOGRAM_BUCKETS ?
+	    idx : EVHTTP_HISTOGRAM_BUCKETS - 1);
+}
 
-		value = argument;
-		key = strsep(&value, "=");
-		if (flags & EVHTTP_URI_QUERY_NONCONFORMANT) {
-			if (value == NULL)
-				value = (char *)"";
-			if (*key == '\0')
-				continue;
-		} else {
-			if (value == NULL || *key == '\0')
-				goto error;
-		}
+/* The largest latency that falls into bucket idx */
+static ev_uint64_t
+evhttp_histogram_upper_(int idx)
+{
+	int e = idx / 4 + 1;
 
-		if ((decoded_value = mm_malloc(strlen(value) + 1)) == NULL) {
-			event_warn("%s: mm_malloc", __func__);
-			goto error;
+	if (idx < 4)
+		return (idx);
+	return (((ev_uint64_t)(4 + idx % 4) << (e - 2)) +
+	    ((ev_uint64_t)1 << (e - 2)) - 1);
+}
+
+static void
+evhttp_histogram_add_(struct evhttp_histogram *h, ev_uint64_t usec)
+{
+	++h->count;
+	h->sum += usec;
+	if (usec > h->max)
+		h->max = usec;
+	++h->buckets[evhttp_histogram_bucket_(usec)];
+}
+
+static void
+evhttp_histogram_merge_(struct evhttp_histogram *dst,
+    const struct evhttp_histogram *src)
+{
+	int i;
+
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->max > dst->max)
+		dst->max = src->max;
+	for (i = 0; i < EVHTTP_HISTOGRAM_BUCKETS; ++i)
+		dst->buckets[i] += src->buckets[i];
+}
+
+ev_uint64_t
+evhttp_histogram_percentile(const struct evhttp_histogram *h,
+    double percentile)
+{
+	ev_uint64_t rank, seen = 0;
+	int i;
+
+	if (h->count == 0)
+		return (0);
+	if (percentile <= 0)
+		rank = 1;
+	else if (percentile >= 100)
+		rank = h->count;
+	else {
+		double r = h->count * percentile / 100;
+		rank = (ev_uint64_t)r;
+		if ((double)rank < r)
+			++rank;
+		if (rank == 0)
+			rank = 1;
+	}
+
+	for (i = 0; i < EVHTTP_HISTOGRAM_BUCKETS; ++i) {
+		seen += h->buckets[i];
+		if (seen >= rank) {
+			ev_uint64_t upper = evhttp_histogram_upper_(i);
+			return (upper < h->max ? upper : h->max);
 		}
-		evhttp_decode_uri_internal(value, strlen(value),
-		    decoded_value, 1 /*always_decode_plus*/);
-		event_debug(("Query Param: %s -> %s\n", key, decoded_value));
-		if (flags & EVHTTP_URI_QUERY_LAST_VAL)
-			evhttp_remove_header(headers, key);
-		evhttp_add_header_internal(headers, key, decoded_value);
-		mm_free(decoded_value);
 	}
+	return (h->max);
+}
 
-	result = 0;
-	goto done;
-error:
-	evhttp_clear_headers(headers);
-done:
-	if (line)
-		mm_free(line);
-	if (uri)
-		evhttp_uri_free(uri);
-	return result;
+void
+evhttp_stats_merge(struct evhttp_stats *dst, const struct evhttp_stats *src)
+{
+	int i;
+
+	dst->requests += src->requests;
+	for (i = 0; i < 5; ++i)
+		dst->status[i] += src->status[i];
+	dst->bytes_in += src->bytes_in;
+	dst->bytes_out += src->bytes_out;
+	evhttp_histogram_merge_(&dst->parse, &src->parse);
+	evhttp_histogram_merge_(&dst->handler, &src->handler);
+	evhttp_histogram_merge_(&dst->write, &src->write);
 }
 
-int
-evhttp_parse_query(const char *uri, struct evkeyvalq *headers)
+/* The first byte of a request has arrived */
+static void
+evhttp_stats_start_(struct evhttp_connection *evcon)
 {
-	return evhttp_parse_query_impl(uri, headers, 1, 0);
+	if (!evutil_timerisset(&evcon->stats_start) &&
+	    evhttp_stats_enabled_(evcon))
+		evutil_gettimeofday(&evcon->stats_start, NULL);
 }
-int
-evhttp_parse_query_str(const char *uri, struct evkeyvalq *headers)
+
+/* The headers of a request have been parsed */
+static void
+evhttp_stats_parsed_(struct evhttp_connection *evcon)
 {
-	return evhttp_parse_query_impl(uri, headers, 0, 0);
+	if (evutil_timerisset(&evcon->stats_start))
+		evcon->stats_parse = evhttp_usec_since_(&evcon->stats_start);
 }
-int
-evhttp_parse_query_str_flags(const char *uri, struct evkeyvalq *headers, unsigned flags)
+
+/* The request has been dispatched to http and cb */
+static void
+evhttp_stats_route_(struct evhttp_connection *evcon, struct evhttp *http,
+    struct evhttp_cb *cb)
 {
-	return evhttp_parse_query_impl(uri, headers, 0, flags);
+	if (evcon == NULL || !evhttp_stats_enabled_(evcon))
+		return;
+	/* callbacks and virtual hosts are shared by all workers, so a
+	 * worker only keeps the totals of its own connections */
+	if (evcon->http_server->worker != NULL) {
+		if (evcon->stats_server == NULL)
+			evcon->stats_server =
+			    evhttp_stats_ref_(&evcon->http_server->stats);
+		return;
+	}
+	if (evcon->stats_server == NULL)
+		evcon->stats_server = evhttp_stats_ref_(&http->stats);
+	if (cb != NULL && evcon->stats_route == NULL)
+		evcon->stats_route = evhttp_stats_ref_(&cb->stats);
 }
 
-static struct evhttp_cb *
-evhttp_dispatch_callback(struct httpcbq *callbacks, struct evhttp_request *req)
+/* The callback of a request is about to be invoked */
+static void
+evhttp_stats_mark_(struct evhttp_connection *evcon)
 {
-	struct evhttp_cb *cb;
-	size_t offset = 0;
-	char *translated;
-	const char *path;
+	if (evhttp_stats_enabled_(evcon))
+		evutil_gettimeofday(&evcon->stats_mark, NULL);
+}
 
-	/* Test for different URLs */
-	path = evhttp_uri_get_path(req->uri_elems);
-	offset = strlen(path);
-	if ((translated = mm_malloc(offset + 1)) == NULL)
-		return (NULL);
-	evhttp_decode_uri_internal(path, offset, translated,
-	    0 /* decode_plus */);
+/* The callback has started to reply */
+static void
+evhttp_stats_replying_(struct evhttp_connection *evcon)
+{
+	if (!evhttp_stats_enabled_(evcon))
+		return;
+	if (evutil_timerisset(&evcon->stats_mark))
+		evcon->stats_handler = evhttp_usec_since_(&evcon->stats_mark);
+	evutil_gettimeofday(&evcon->stats_mark, NULL);
+}
 
-	TAILQ_FOREACH(cb, callbacks, next) {
-		if (!strcmp(cb->what, translated)) {
-			mm_free(translated);
-			return (cb);
-		}
+static void
+evhttp_stats_reset_(struct evhttp_connection *evcon)
+{
+	evhttp_stats_release_(evcon->stats_server);
+	evhttp_stats_release_(evcon->stats_route);
+	evcon->stats_server = evcon->stats_route = NULL;
+	evutil_timerclear(&evcon->stats_start);
+	evutil_timerclear(&evcon->stats_mark);
+	evcon->stats_parse = evcon->stats_handler = evcon->stats_out = 0;
+}
+
+/* The reply to req has been written */
+static void
+evhttp_stats_record_(struct evhttp_connection *evcon,
+    struct evhttp_request *req)
+{
+	struct evhttp_stats_ref *refs[2];
+	ev_uint64_t write_usec = 0;
+	int i, status = req->response_code / 100 - 1;
+
+	if (!evhttp_stats_enabled_(evcon)) {
+		evhttp_stats_reset_(evcon);
+		return;
 	}
 
-	mm_free(translated);
-	return (NULL);
-}
+	/* requests that were not dispatched count for the server */
+	if (evcon->stats_server == NULL)
+		evcon->stats_server =
+		    evhttp_stats_ref_(&evcon->http_server->stats);
+	if (evutil_timerisset(&evcon->stats_mark))
+		write_usec = evhttp_usec_since_(&evcon->stats_mark);
 
+	refs[0] = evcon->stats_server;
+	refs[1] = evcon->stats_route;
+	for (i = 0; i < 2; ++i) {
+		struct evhttp_stats *stats;
 
-static int
-prefix_suffix_match(const char *pattern, const char *name, int ignorecase)
+		if (refs[i] == NULL)
+			continue;
+		stats = &refs[i]->stats;
+		++stats->requests;
+		if (status >= 0 && status < 5)
+			++stats->status[status];
+		stats->bytes_in += req->headers_size + req->body_size;
+		stats->bytes_out += evcon->stats_out;
+		if (evutil_timerisset(&evcon->stats_start))
+			evhttp_histogram_add_(&stats->parse,
+			    evcon->stats_parse);
+		evhttp_histogram_add_(&stats->handler, evcon->stats_handler);
+		evhttp_histogram_add_(&stats->write, write_usec);
+	}
+
+	evhttp_stats_reset_(evcon);
+}
+
+static void
+evhttp_stats_get_(const struct evhttp_stats_ref *ref,
+    struct evhttp_stats *stats)
 {
-	char c;
+	if (ref != NULL)
+		memcpy(stats, &ref->stats, sizeof(*stats));
+	else
+		memset(stats, 0, sizeof(*stats));
+}
 
-	while (1) {
-		switch (c = *pattern++) {
-		case '\0':
-			return *name == '\0';
+int
+evhttp_get_stats(struct evhttp *http, const char *path,
+    struct evhttp_stats *stats)
+{
+	struct evhttp_cb *cb;
+	struct evhttp_worker *worker;
+	struct evhttp_stats totals;
+
+	if (path == NULL) {
+		evhttp_stats_get_(http->stats, stats);
+		TAILQ_FOREACH(worker, &http->workers, next) {
+			evhttp_stats_get_(worker->http->stats, &totals);
+			evhttp_stats_merge(stats, &totals);
+		}
+		return (0);
+	}
 
-		case '*':
-			while (*name != '\0') {
-				if (prefix_suffix_match(pattern, name,
-					ignorecase))
-					return (1);
-				++name;
-			}
+	TAILQ_FOREACH(cb, &http->callbacks, next) {
+		if (strcmp(cb->what, path) == 0) {
+			evhttp_stats_get_(cb->stats, stats);
 			return (0);
-		default:
-			if (c != *name) {
-				if (!ignorecase ||
-				    EVUTIL_TOLOWER_(c) != EVUTIL_TOLOWER_(*name))
-					return (0);
-			}
-			++name;
 		}
 	}
-	/* NOTREACHED */
+	return (-1);
 }
 
-/*
-   Search the vhost hierarchy beginning with http for a server alias
-   matching hostname.  If a match is found, and outhttp is non-null,
-   outhttp is set to the matching http object and 1 is returned.
-*/
+static void
+evhttp_stats_json_string_(struct evbuffer *buf, const char *s)
+{
+	evbuffer_add(buf, "\"", 1);
+	for (; *s; ++s) {
+		unsigned char c = *s;
+		if (c == '"' || c == '\\')
+			evbuffer_add_printf(buf, "\\%c", c);
+		else if (c < 0x20)
+			evbuffer_add_printf(buf, "\\u%04x", c);
+		else
+			evbuffer_add(buf, s, 1);
+	}
+	evbuffer_add(buf, "\"", 1);
+}
 
-static int
-evhttp_find_alias(struct evhttp *http, struct evhttp **outhttp,
-		  const char *hostname)
+static void
+evhttp_stats_json_histogram_(struct evbuffer *buf, const char *name,
+    const struct evhttp_histogram *h)
 {
-	struct evhttp_server_alias *alias;
+	evbuffer_add_printf(buf, "\"%s\":{\"count\":"EV_U64_FMT
+	    ",\"p50\":"EV_U64_FMT",\"p90\":"EV_U64_FMT
+	    ",\"p99\":"EV_U64_FMT",\"max\":"EV_U64_FMT"}", name,
+	    EV_U64_ARG(h->count),
+	    EV_U64_ARG(evhttp_histogram_percentile(h, 50)),
+	    EV_U64_ARG(evhttp_histogram_percentile(h, 90)),
+	    EV_U64_ARG(evhttp_histogram_percentile(h, 99)),
+	    EV_U64_ARG(h->max));
+}
+
+static void
+evhttp_stats_json_(struct evbuffer *buf, const struct evhttp_stats_ref *ref)
+{
+	struct evhttp_stats stats;
+	int i;
+
+	evhttp_stats_get_(ref, &stats);
+	evbuffer_add_printf(buf, "\"requests\":"EV_U64_FMT",\"status\":{",
+	    EV_U64_ARG(stats.requests));
+	for (i = 0; i < 5; ++i)
+		evbuffer_add_printf(buf, "%s\"%dxx\":"EV_U64_FMT,
+		    i ? "," : "", i + 1, EV_U64_ARG(stats.status[i]));
+	evbuffer_add_printf(buf, "},\"bytes_in\":"EV_U64_FMT
+	    ",\"bytes_out\":"EV_U64_FMT",",
+	    EV_U64_ARG(stats.bytes_in), EV_U64_ARG(stats.bytes_out));
+	evhttp_stats_json_histogram_(buf, "parse", &stats.parse);
+	evbuffer_add(buf, ",", 1);
+	evhttp_stats_json_histogram_(buf, "handler", &stats.handler);
+	evbuffer_add(buf, ",", 1);
+	evhttp_stats_json_histogram_(buf, "write", &stats.write);
+}
+
+static void
+evhttp_stats_json_server_(struct evbuffer *buf, struct evhttp *http)
+{
+	struct evhttp_cb *cb;
 	struct evhttp *vhost;
 
-	TAILQ_FOREACH(alias, &http->aliases, next) {
-		/* XXX Do we need to handle IP addresses? */
-		if (!evutil_ascii_strcasecmp(alias->alias, hostname)) {
-			if (outhttp)
-				*outhttp = http;
-			return 1;
-		}
+	evbuffer_add(buf, "{", 1);
+	evhttp_stats_json_(buf, http->stats);
+
+	evbuffer_add_printf(buf, ",\"routes\":{");
+	TAILQ_FOREACH(cb, &http->callbacks, next) {
+		if (cb != TAILQ_FIRST(&http->callbacks))
+			evbuffer_add(buf, ",", 1);
+		evhttp_stats_json_string_(buf, cb->what);
+		evbuffer_add(buf, ":{", 2);
+		evhttp_stats_json_(buf, cb->stats);
+		evbuffer_add(buf, "}", 1);
 	}
 
-	/* XXX It might be good to avoid recursion here, but I don't
-	   see a way to do that w/o a list. */
+	evbuffer_add_printf(buf, "},\"vhosts\":{");
 	TAILQ_FOREACH(vhost, &http->virtualhosts, next_vhost) {
-		if (evhttp_find_alias(vhost, outhttp, hostname))
-			return 1;
+		if (vhost != TAILQ_FIRST(&http->virtualhosts))
+			evbuffer_add(buf, ",", 1);
+		evhttp_stats_json_string_(buf, vhost->vhost_pattern);
+		evbuffer_add(buf, ":", 1);
+		evhttp_stats_json_server_(buf, vhost);
 	}
+	evbuffer_add(buf, "}}", 2);
+}
 
-	return 0;
+void
+evhttp_stats_handler(struct evhttp_request *req, void *arg)
+{
+	struct evhttp *http = arg;
+	struct evbuffer *buf;
+
+	if (http == NULL && req->evcon != NULL)
+		http = req->evcon->http_server;
+	if (http == NULL || (buf = evbuffer_new()) == NULL) {
+		evhttp_send_error(req, HTTP_INTERNAL, NULL);
+		return;
+	}
+
+	evhttp_stats_json_server_(buf, http);
+	evbuffer_add(buf, "\n", 1);
+	evhttp_add_header(evhttp_request_get_output_headers(req),
+	    "Content-Type", "application/json");
+	evhttp_send_reply(req, HTTP_OK, "OK", buf);
+	evbuffer_free(buf);
 }
 
 /*
-   Attempts to find the best http object to handle a request for a hostname.
-   All aliases for the root http object and vhosts are searched for an exact
-   match. Then, the vhost hierarchy is traversed again for a matching
-   pattern.
+ * Worker bases
+ */
 
-   If an alias or vhost is matched, 1 is returned, and outhttp, if non-null,
-   is set with the best matching http object. If there are no matches, the
-   root http object is stored in outhttp and 0 is returned.
-*/
+static void
+evhttp_worker_load_(struct evhttp_worker *worker, int delta)
+{
+	EVLOCK_LOCK(worker->lock, 0);
+	worker->load += delta;
+	EVLOCK_UNLOCK(worker->lock, 0);
 
-static int
-evhttp_find_vhost(struct evhttp *http, struct evhttp **outhttp,
-		  const char *hostname)
+	/* the listeners belong to the accepting thread */
+	if (delta < 0 && worker->server->max_connections > 0)
+		event_active(worker->server->accept_resume, EV_READ, 0);
+}
+
+/* Runs on the accepting base once a worker connection went away */
+static void
+evhttp_accept_resume_cb(evutil_socket_t fd, short what, void *arg)
 {
-	struct evhttp *vhost;
-	struct evhttp *oldhttp;
-	int match_found = 0;
+	evhttp_update_accepting_(arg);
+}
 
-	if (evhttp_find_alias(http, outhttp, hostname))
-		return 1;
+/* Runs on the worker base to take the connections handed to it */
+static void
+evhttp_worker_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct evhttp_worker *worker = arg;
+	struct evhttp_worker_conn *conn;
 
-	do {
-		oldhttp = http;
-		TAILQ_FOREACH(vhost, &http->virtualhosts, next_vhost) {
-			if (prefix_suffix_match(vhost->vhost_pattern,
-				hostname, 1 /* ignorecase */)) {
-				http = vhost;
-				match_found = 1;
-				break;
+	for (;;) {
+		EVLOCK_LOCK(worker->lock, 0);
+		if ((conn = TAILQ_FIRST(&worker->pending)) != NULL)
+			TAILQ_REMOVE(&worker->pending, conn, next);
+		EVLOCK_UNLOCK(worker->lock, 0);
+		if (conn == NULL)
+			break;
+
+		if (evhttp_get_request(worker->http, conn->fd,
+			(struct sockaddr *)&conn->addr, conn->socklen) == -1)
+			evhttp_worker_load_(worker, -1);
+		mm_free(conn);
+	}
+}
+
+/* Hands a connection accepted by http to one of its workers */
+static int
+evhttp_worker_dispatch_(struct evhttp *http, evutil_socket_t fd,
+    struct sockaddr *sa, ev_socklen_t salen)
+{
+	struct evhttp_worker *worker, *it;
+	struct evhttp_worker_conn *conn;
+
+	if ((size_t)salen > sizeof(conn->addr))
+		return (-1);
+	if ((conn = mm_malloc(sizeof(*conn))) == NULL) {
+		event_warn("%s: malloc", __func__);
+		return (-1);
+	}
+	conn->fd = fd;
+	memcpy(&conn->addr, sa, salen);
+	conn->socklen = salen;
+
+	if (http->flags & EVHTTP_SERVER_LEAST_LOADED) {
+		int load, min_load = 0;
+
+		worker = NULL;
+		TAILQ_FOREACH(it, &http->workers, next) {
+			EVLOCK_LOCK(it->lock, 0);
+			load = it->load;
+			EVLOCK_UNLOCK(it->lock, 0);
+			if (worker == NULL || load < min_load) {
+				worker = it;
+				min_load = load;
 			}
 		}
-	} while (oldhttp != http);
+	} else {
+		worker = http->next_worker != NULL ?
+		    http->next_worker : TAILQ_FIRST(&http->workers);
+		http->next_worker = TAILQ_NEXT(worker, next);
+	}
 
-	if (outhttp)
-		*outhttp = http;
+	EVLOCK_LOCK(worker->lock, 0);
+	TAILQ_INSERT_TAIL(&worker->pending, conn, next);
+	++worker->load;
+	EVLOCK_UNLOCK(worker->lock, 0);
+	event_active(worker->notify, EV_READ, 0);
 
-	return match_found;
+	return (0);
 }
 
 static void
-evhttp_handle_request(struct evhttp_request *req, void *arg)
+evhttp_worker_free_(struct evhttp_worker *worker)
 {
-	struct evhttp *http = arg;
-	struct evhttp_cb *cb = NULL;
-	const char *hostname;
+	struct evhttp_worker_conn *conn;
+	struct evhttp_connection *evcon;
+	struct evhttp *http = worker->http;
 
-	/* we have a new request on which the user needs to take action */
-	req->userdone = 0;
+	if (worker->notify != NULL)
+		event_free(worker->notify);
 
-	bufferevent_disable(req->evcon->bufev, EV_READ);
+	while ((conn = TAILQ_FIRST(&worker->pending)) != NULL) {
+		TAILQ_REMOVE(&worker->pending, conn, next);
+		evutil_closesocket(conn->fd);
+		mm_free(conn);
+	}
 
-	if (req->uri == NULL) {
-		evhttp_send_error(req, req->response_code, NULL);
-		return;
+	/* the configuration belongs to the server, the rest is our own */
+	if (http != NULL) {
+		while ((evcon = TAILQ_FIRST(&http->connections)) != NULL)
+			evhttp_connection_free(evcon);
+		evhttp_set_max_loop_lag(http, NULL);
+		evhttp_stats_release_(http->stats);
+		mm_free(http);
 	}
 
-	if ((http->allowed_methods & req->type) == 0) {
-		event_debug(("Rejecting disallowed method %x (allowed: %x)\n",
-			(unsigned)req->type, (unsigned)http->allowed_methods));
-		evhttp_send_error(req, HTTP_NOTIMPLEMENTED, NULL);
-		return;
+	EVTHREAD_FREE_LOCK(worker->lock, 0);
+	mm_free(worker);
+}
+
+int
+evhttp_add_worker_base(struct evhttp *http, struct event_base *base)
+{
+	struct evhttp_worker *worker;
+	struct evhttp *copy;
+
+	/* only a server that accepts connections has workers */
+	if (http->worker != NULL || http->vhost_pattern != NULL)
+		return (-1);
+
+	if ((worker = mm_calloc(1, sizeof(*worker))) == NULL) {
+		event_warn("%s: calloc", __func__);
+		return (-1);
 	}
+	TAILQ_INIT(&worker->pending);
+	EVTHREAD_ALLOC_LOCK(worker->lock, 0);
 
-	/* handle potential virtual hosts */
-	hostname = evhttp_request_get_host(req);
-	if (hostname != NULL) {
-		evhttp_find_vhost(http, &http, hostname);
+	worker->notify = event_new(base, -1, 0, evhttp_worker_cb, worker);
+	if (worker->notify == NULL)
+		goto error;
+	if (http->accept_resume == NULL) {
+		http->accept_resume = event_new(http->base, -1, 0,
+		    evhttp_accept_resume_cb, http);
+		if (http->accept_resume == NULL)
+			goto error;
 	}
+	worker->server = http;
 
-	if ((cb = evhttp_dispatch_callback(&http->callbacks, req)) != NULL) {
-		(*cb->cb)(req, cb->cbarg);
-		return;
+	/* The copy shares the configuration, including the callbacks and
+	 * virtual hosts, and keeps its own connections and counters */
+	if ((copy = mm_malloc(sizeof(*copy))) == NULL) {
+		event_warn("%s: malloc", __func__);
+		goto error;
+	}
+	memcpy(copy, http, sizeof(*copy));
+	TAILQ_INIT(&copy->sockets);
+	TAILQ_INIT(&copy->connections);
+	TAILQ_INIT(&copy->workers);
+	copy->nconnections = 0;
+	/* counted by the server, see evhttp_count_connections_() */
+	copy->max_connections = 0;
+	copy->accept_paused = 0;
+	copy->accept_resume = NULL;
+	copy->ninflight = 0;
+	copy->lag_prepare = copy->lag_check = NULL;
+	copy->stats = NULL;
+	copy->next_worker = NULL;
+	copy->worker = worker;
+	copy->date_len = 0;
+	copy->base = base;
+	worker->http = copy;
+
+	if (http->lag_prepare != NULL) {
+		struct timeval tv;
+		tv.tv_sec = (long)(http->max_lag_usec / 1000000);
+		tv.tv_usec = (long)(http->max_lag_usec % 1000000);
+		if (evhttp_set_max_loop_lag(copy, &tv) == -1)
+			goto error;
 	}
 
-	/* Generic call back */
-	if (http->gencb) {
-		(*http->gencb)(req, http->gencbarg);
-		return;
-	} else
-		evhttp_send_notfound(req, NULL);
+	TAILQ_INSERT_TAIL(&http->workers, worker, next);
+	return (0);
+
+error:
+	evhttp_worker_free_(worker);
+	return (-1);
 }
 
 /* Listener callback when a connection arrives at a server. */
@@ -3841,6 +7212,8 @@ evhttp_bind_listener(struct evhttp *http, struct evconnlistener *listener)
 
 	bound->listener = listener;
 	TAILQ_INSERT_TAIL(&http->sockets, bound, next);
+	if (http->accept_paused)
+		evconnlistener_disable(listener);
 
 	evconnlistener_set_cb(listener, accept_socket_cb, http);
 	return bound;
@@ -3894,6 +7267,8 @@ evhttp_new_object(void)
 	TAILQ_INIT(&http->connections);
 	TAILQ_INIT(&http->virtualhosts);
 	TAILQ_INIT(&http->aliases);
+	TAILQ_INIT(&http->codings);
+	TAILQ_INIT(&http->workers);
 
 	return (http);
 }
@@ -3939,6 +7314,8 @@ evhttp_free(struct evhttp* http)
 	struct evhttp_bound_socket *bound;
 	struct evhttp* vhost;
 	struct evhttp_server_alias *alias;
+	struct evhttp_coding *coding;
+	struct evhttp_worker *worker;
 
 	/* Remove the accepting part */
 	while ((bound = TAILQ_FIRST(&http->sockets)) != NULL) {
@@ -3954,8 +7331,16 @@ evhttp_free(struct evhttp* http)
 		evhttp_connection_free(evcon);
 	}
 
+	while ((worker = TAILQ_FIRST(&http->workers)) != NULL) {
+		TAILQ_REMOVE(&http->workers, worker, next);
+		evhttp_worker_free_(worker);
+	}
+	if (http->accept_resume != NULL)
+		event_free(http->accept_resume);
+
 	while ((http_cb = TAILQ_FIRST(&http->callbacks)) != NULL) {
 		TAILQ_REMOVE(&http->callbacks, http_cb, next);
+		evhttp_stats_release_(http_cb->stats);
 		mm_free(http_cb->what);
 		mm_free(http_cb);
 	}
@@ -3975,6 +7360,15 @@ evhttp_free(struct evhttp* http)
 		mm_free(alias);
 	}
 
+	while ((coding = TAILQ_FIRST(&http->codings)) != NULL) {
+		TAILQ_REMOVE(&http->codings, coding, next);
+		mm_free(coding->name);
+		mm_free(coding);
+	}
+
+	evhttp_set_max_loop_lag(http, NULL);
+	evhttp_stats_release_(http->stats);
+
 	mm_free(http);
 }
 
@@ -4074,6 +7468,9 @@ int evhttp_set_flags(struct evhttp *http, int flags)
 {
 	int avail_flags = 0;
 	avail_flags |= EVHTTP_SERVER_LINGERING_CLOSE;
+	avail_flags |= EVHTTP_SERVER_PARK_IDLE;
+	avail_flags |= EVHTTP_SERVER_STATS;
+	avail_flags |= EVHTTP_SERVER_LEAST_LOADED;
 
 	if (flags & ~avail_flags)
 		return 1;
@@ -4108,6 +7505,32 @@ evhttp_set_default_content_type(struct evhttp *http,
 	http->default_content_type = content_type;
 }
 
+int
+evhttp_add_content_coding(struct evhttp *http, const char *coding,
+    void *(*ctx_new)(void *), evhttp_content_coding_cb encode,
+    void (*ctx_free)(void *), void *arg)
+{
+	struct evhttp_coding *c;
+
+	if ((c = mm_calloc(1, sizeof(struct evhttp_coding))) == NULL) {
+		event_warn("%s: calloc", __func__);
+		return (-1);
+	}
+	if ((c->name = mm_strdup(coding)) == NULL) {
+		event_warn("%s: strdup", __func__);
+		mm_free(c);
+		return (-1);
+	}
+	c->ctx_new = ctx_new;
+	c->encode = encode;
+	c->ctx_free = ctx_free;
+	c->arg = arg;
+
+	TAILQ_INSERT_TAIL(&http->codings, c, next);
+
+	return (0);
+}
+
 void
 evhttp_set_allowed_methods(struct evhttp* http, ev_uint32_t methods)
 {
@@ -4150,6 +7573,25 @@ evhttp_set_cb(struct evhttp *http, const char *uri,
 	return (0);
 }
 
+int
+evhttp_set_stream_cb(struct evhttp *http, const char *uri,
+    int (*header_cb)(struct evhttp_request *, void *),
+    void (*chunk_cb)(struct evhttp_request *, void *),
+    void (*cb)(struct evhttp_request *, void *), void *cbarg)
+{
+	struct evhttp_cb *http_cb;
+	int res;
+
+	if ((res = evhttp_set_cb(http, uri, cb, cbarg)) != 0)
+		return (res);
+
+	http_cb = TAILQ_LAST(&http->callbacks, httpcbq);
+	http_cb->header_cb = header_cb;
+	http_cb->chunk_cb = chunk_cb;
+
+	return (0);
+}
+
 int
 evhttp_del_cb(struct evhttp *http, const char *uri)
 {
@@ -4163,6 +7605,7 @@ evhttp_del_cb(struct evhttp *http, const char *uri)
 		return (-1);
 
 	TAILQ_REMOVE(&http->callbacks, http_cb, next);
+	evhttp_stats_release_(http_cb->stats);
 	mm_free(http_cb->what);
 	mm_free(http_cb);
 
@@ -4263,6 +7706,8 @@ evhttp_request_free(struct evhttp_request *req)
 		return;
 	}
 
+	evhttp_request_set_inflight_(req, 0);
+
 	if (req->remote_host != NULL)
 		mm_free(req->remote_host);
 	if (req->uri != NULL)
@@ -4342,6 +7787,21 @@ evhttp_request_set_on_complete_cb(struct evhttp_request *req,
 	req->on_complete_cb_arg = cb_arg;
 }
 
+void
+evhttp_request_set_cancel_cb(struct evhttp_request *req,
+    void (*cb)(struct evhttp_request *, void *), void *cb_arg)
+{
+	struct evhttp_connection *evcon = req->evcon;
+
+	req->cancel_cb = cb;
+	req->cancel_cb_arg = cb_arg;
+
+	/* watch for the client going away while the reply is pending */
+	if (cb != NULL && evcon != NULL && evcon->http_server != NULL &&
+	    evcon->state == EVCON_WRITING)
+		evhttp_connection_start_detectclose(evcon);
+}
+
 /*
  * Allows for inspection of the request URI
  */
@@ -4546,18 +8006,27 @@ evhttp_associate_new_request_with_connection(struct evhttp_connection *evcon)
 	return (0);
 }
 
-static void
+static int
 evhttp_get_request(struct evhttp *http, evutil_socket_t fd,
     struct sockaddr *sa, ev_socklen_t salen)
 {
 	struct evhttp_connection *evcon;
 
+	if (!TAILQ_EMPTY(&http->workers)) {
+		if (evhttp_worker_dispatch_(http, fd, sa, salen) == -1) {
+			evutil_closesocket(fd);
+			return (-1);
+		}
+		evhttp_update_accepting_(http);
+		return (0);
+	}
+
 	evcon = evhttp_get_request_connection(http, fd, sa, salen);
 	if (evcon == NULL) {
 		event_sock_warn(fd, "%s: cannot get connection on "EV_SOCK_FMT,
 		    __func__, EV_SOCK_ARG(fd));
 		evutil_closesocket(fd);
-		return;
+		return (-1);
 	}
 
 	/* the timeout can be used by the server to close idle connections */
@@ -4573,9 +8042,12 @@ evhttp_get_request(struct evhttp *http, evutil_socket_t fd,
 	evcon->http_server = http;
 	evcon->ext_method_cmp = http->ext_method_cmp;
 	TAILQ_INSERT_TAIL(&http->connections, evcon, next);
+	++http->nconnections;
+	evhttp_update_accepting_(http);
 
 	if (evhttp_associate_new_request_with_connection(evcon) == -1)
 		evhttp_connection_free(evcon);
+	return (0);
 }
 
 
@@ -4755,16 +8227,13 @@ scheme_ok(const char *s, const char *eos)
 	return 1;
 }
 
-#define SUBDELIMS "!$&'()*+,;="
-
 /* Return true iff [s..eos) is a valid userinfo */
 static int
 userinfo_ok(const char *s, const char *eos)
 {
 	while (s < eos) {
-		if (CHAR_IS_UNRESERVED(*s) ||
-		    strchr(SUBDELIMS, *s) ||
-		    *s == ':')
+		if (CHAR_IS_URI_CLASS(*s,
+			URI_CHAR_UNRESERVED|URI_CHAR_SUBDELIM|URI_CHAR_COLON))
 			++s;
 		else if (*s == '%' && s+2 < eos &&
 		    EVUTIL_ISXDIGIT_(s[1]) &&
@@ -4780,8 +8249,7 @@ static int
 regname_ok(const char *s, const char *eos)
 {
 	while (s && s<eos) {
-		if (CHAR_IS_UNRESERVED(*s) ||
-		    strchr(SUBDELIMS, *s))
+		if (CHAR_IS_URI_CLASS(*s, URI_CHAR_UNRESERVED|URI_CHAR_SUBDELIM))
 			++s;
 		else if (*s == '%' &&
 		    EVUTIL_ISXDIGIT_(s[1]) &&
@@ -4834,9 +8302,8 @@ bracket_addr_ok(const char *s, const char *eos)
 			return 0;
 		++s;
 		while (s < eos) {
-			if (CHAR_IS_UNRESERVED(*s) ||
-			    strchr(SUBDELIMS, *s) ||
-			    *s == ':')
+			if (CHAR_IS_URI_CLASS(*s, URI_CHAR_UNRESERVED|
+				URI_CHAR_SUBDELIM|URI_CHAR_COLON))
 				++s;
 			else
 				return 0;
@@ -4855,10 +8322,24 @@ bracket_addr_ok(const char *s, const char *eos)
 	}
 }
 
+/* Copies the len bytes at s into a new string */
+static char *
+evhttp_uri_strndup_(const char *s, size_t len)
+{
+	char *res = mm_malloc(len + 1);
+	if (res == NULL) {
+		event_warn("%s: malloc", __func__);
+		return NULL;
+	}
+	memcpy(res, s, len);
+	res[len] = '\0';
+	return res;
+}
+
 static int
-parse_authority(struct evhttp_uri *uri, char *s, char *eos)
+parse_authority(struct evhttp_uri *uri, const char *s, const char *eos)
 {
-	char *cp, *port;
+	const char *cp, *port;
 	EVUTIL_ASSERT(eos);
 	if (eos == s) {
 		uri->host = mm_strdup("");
@@ -4871,16 +8352,14 @@ parse_authority(struct evhttp_uri *uri, char *s, char *eos)
 
 	/* Optionally, we start with "userinfo@" */
 
-	cp = strchr(s, '@');
-	if (cp && cp < eos) {
+	cp = memchr(s, '@', eos - s);
+	if (cp) {
 		if (! userinfo_ok(s,cp))
 			return -1;
-		*cp++ = '\0';
-		uri->userinfo = mm_strdup(s);
-		if (uri->userinfo == NULL) {
-			event_warn("%s: strdup", __func__);
+		uri->userinfo = evhttp_uri_strndup_(s, cp - s);
+		if (uri->userinfo == NULL)
 			return -1;
-		}
+		++cp;
 	} else {
 		cp = s;
 	}
@@ -4907,26 +8386,17 @@ parse_authority(struct evhttp_uri *uri, char *s, char *eos)
 		if (! regname_ok(cp,eos)) /* Match IPv4Address or reg-name */
 			return -1;
 	}
-	uri->host = mm_malloc(eos-cp+1);
-	if (uri->host == NULL) {
-		event_warn("%s: malloc", __func__);
+	uri->host = evhttp_uri_strndup_(cp, eos-cp);
+	if (uri->host == NULL)
 		return -1;
-	}
-	memcpy(uri->host, cp, eos-cp);
-	uri->host[eos-cp] = '\0';
 	return 0;
 
 }
 
-static char *
-end_of_authority(char *cp)
+static const char *
+end_of_authority(const char *cp)
 {
-	while (*cp) {
-		if (*cp == '?' || *cp == '#' || *cp == '/')
-			return cp;
-		++cp;
-	}
-	return cp;
+	return cp + strcspn(cp, "?#/");
 }
 
 enum uri_part {
@@ -4939,8 +8409,8 @@ enum uri_part {
  *   *pchar / "/" if allow_qchars is false, or
  *   *(pchar / "/" / "?") if allow_qchars is true.
  */
-static char *
-end_of_path(char *cp, enum uri_part part, unsigned flags)
+static const char *
+end_of_path(const char *cp, enum uri_part part, unsigned flags)
 {
 	if (flags & EVHTTP_URI_NONCONFORMANT) {
 		/* If NONCONFORMANT:
@@ -4950,12 +8420,10 @@ end_of_path(char *cp, enum uri_part part, unsigned flags)
 		 */
 		switch (part) {
 		case PART_PATH:
-			while (*cp && *cp != '#' && *cp != '?')
-				++cp;
+			cp += strcspn(cp, "#?");
 			break;
 		case PART_QUERY:
-			while (*cp && *cp != '#')
-				++cp;
+			cp += strcspn(cp, "#");
 			break;
 		case PART_FRAGMENT:
 			cp += strlen(cp);
@@ -4965,9 +8433,8 @@ end_of_path(char *cp, enum uri_part part, unsigned flags)
 	}
 
 	while (*cp) {
-		if (CHAR_IS_UNRESERVED(*cp) ||
-		    strchr(SUBDELIMS, *cp) ||
-		    *cp == ':' || *cp == '@' || *cp == '/')
+		if (CHAR_IS_URI_CLASS(*cp, URI_CHAR_UNRESERVED|
+			URI_CHAR_SUBDELIM|URI_CHAR_COLON|URI_CHAR_PATH))
 			++cp;
 		else if (*cp == '%' && EVUTIL_ISXDIGIT_(cp[1]) &&
 		    EVUTIL_ISXDIGIT_(cp[2]))
@@ -4981,9 +8448,9 @@ end_of_path(char *cp, enum uri_part part, unsigned flags)
 }
 
 static int
-path_matches_noscheme(const char *cp)
+path_matches_noscheme(const char *cp, const char *eos)
 {
-	while (*cp) {
+	while (cp < eos) {
 		if (*cp == ':')
 			return 0;
 		else if (*cp == '/')
@@ -5002,8 +8469,9 @@ evhttp_uri_parse(const char *source_uri)
 struct evhttp_uri *
 evhttp_uri_parse_with_flags(const char *source_uri, unsigned flags)
 {
-	char *readbuf = NULL, *readp = NULL, *token = NULL, *query = NULL;
-	char *path = NULL, *fragment = NULL;
+	const char *readp = source_uri, *token;
+	const char *path = NULL, *path_end = NULL, *query = NULL;
+	const char *query_end = NULL, *fragment = NULL, *fragment_end = NULL;
 	int got_authority = 0;
 
 	struct evhttp_uri *uri = mm_calloc(1, sizeof(struct evhttp_uri));
@@ -5014,65 +8482,54 @@ evhttp_uri_parse_with_flags(const char *source_uri, unsigned flags)
 	uri->port = -1;
 	uri->flags = flags;
 
-	readbuf = mm_strdup(source_uri);
-	if (readbuf == NULL) {
-		event_warn("%s: strdup", __func__);
-		goto err;
-	}
-
-	readp = readbuf;
-	token = NULL;
-
 	/* We try to follow RFC3986 here as much as we can, and match
 	   the productions
 
 	      URI = scheme ":" hier-part [ "?" query ] [ "#" fragment ]
 
 	      relative-ref  = relative-part [ "?" query ] [ "#" fragment ]
+
+	   The components are validated in place and copied once each.
 	 */
 
 	/* 1. scheme: */
-	token = strchr(readp, ':');
-	if (token && scheme_ok(readp,token)) {
-		*token = '\0';
-		uri->scheme = mm_strdup(readp);
-		if (uri->scheme == NULL) {
-			event_warn("%s: strdup", __func__);
+	token = readp;
+	while (EVUTIL_ISALNUM_(*token) ||
+	    *token == '+' || *token == '-' || *token == '.')
+		++token;
+	if (*token == ':' && scheme_ok(readp,token)) {
+		uri->scheme = evhttp_uri_strndup_(readp, token - readp);
+		if (uri->scheme == NULL)
 			goto err;
-		}
 		readp = token+1; /* eat : */
 	}
 
 	/* 2. Optionally, "//" then an 'authority' part. */
 	if (readp[0]=='/' && readp[1] == '/') {
-		char *authority;
+		const char *authority;
 		readp += 2;
 		authority = readp;
-		path = end_of_authority(readp);
-		if (parse_authority(uri, authority, path) < 0)
+		readp = end_of_authority(readp);
+		if (parse_authority(uri, authority, readp) < 0)
 			goto err;
-		readp = path;
 		got_authority = 1;
 	}
 
 	/* 3. Query: path-abempty, path-absolute, path-rootless, or path-empty
 	 */
 	path = readp;
-	readp = end_of_path(path, PART_PATH, flags);
+	readp = path_end = end_of_path(path, PART_PATH, flags);
 
 	/* Query */
 	if (*readp == '?') {
-		*readp = '\0';
-		++readp;
-		query = readp;
-		readp = end_of_path(readp, PART_QUERY, flags);
+		query = readp + 1;
+		readp = query_end = end_of_path(query, PART_QUERY, flags);
 	}
 	/* fragment */
 	if (*readp == '#') {
-		*readp = '\0';
-		++readp;
-		fragment = readp;
-		readp = end_of_path(readp, PART_FRAGMENT, flags);
+		fragment = readp + 1;
+		readp = fragment_end = end_of_path(fragment, PART_FRAGMENT,
+		    flags);
 	}
 	if (*readp != '\0') {
 		goto err;
@@ -5081,49 +8538,41 @@ evhttp_uri_parse_with_flags(const char *source_uri, unsigned flags)
 	/* These next two cases may be unreachable; I'm leaving them
 	 * in to be defensive. */
 	/* If you didn't get an authority, the path can't begin with "//" */
-	if (!got_authority && path[0]=='/' && path[1]=='/')
+	if (!got_authority && path_end - path >= 2 &&
+	    path[0]=='/' && path[1]=='/')
 		goto err;
 	/* If you did get an authority, the path must begin with "/" or be
 	 * empty. */
-	if (got_authority && path[0] != '/' && path[0] != '\0')
+	if (got_authority && path_end != path && path[0] != '/')
 		goto err;
 	/* (End of maybe-unreachable cases) */
 
 	/* If there was no scheme, the first part of the path (if any) must
 	 * have no colon in it. */
-	if (! uri->scheme && !path_matches_noscheme(path))
+	if (! uri->scheme && !path_matches_noscheme(path, path_end))
 		goto err;
 
 	EVUTIL_ASSERT(path);
-	uri->path = mm_strdup(path);
-	if (uri->path == NULL) {
-		event_warn("%s: strdup", __func__);
+	uri->path = evhttp_uri_strndup_(path, path_end - path);
+	if (uri->path == NULL)
 		goto err;
-	}
 
 	if (query) {
-		uri->query = mm_strdup(query);
-		if (uri->query == NULL) {
-			event_warn("%s: strdup", __func__);
+		uri->query = evhttp_uri_strndup_(query, query_end - query);
+		if (uri->query == NULL)
 			goto err;
-		}
 	}
 	if (fragment) {
-		uri->fragment = mm_strdup(fragment);
-		if (uri->fragment == NULL) {
-			event_warn("%s: strdup", __func__);
+		uri->fragment = evhttp_uri_strndup_(fragment,
+		    fragment_end - fragment);
+		if (uri->fragment == NULL)
 			goto err;
-		}
 	}
 
-	mm_free(readbuf);
-
 	return uri;
 err:
 	if (uri)
 		evhttp_uri_free(uri);
-	if (readbuf)
-		mm_free(readbuf);
 	return NULL;
 }
 
@@ -5131,7 +8580,7 @@ static struct evhttp_uri *
 evhttp_uri_parse_authority(char *source_uri)
 {
 	struct evhttp_uri *uri = mm_calloc(1, sizeof(struct evhttp_uri));
-	char *end;
+	const char *end;
 
 	if (uri == NULL) {
 		event_warn("%s: calloc", __func__);
@@ -184,6 +184,12 @@ extern "C" {
 #define DNS_IPv6_AAAA 3
 
 #define DNS_QUERY_NO_SEARCH 1
+/** Neither answer this query from the cache nor store its answer there */
+#define DNS_QUERY_NO_CACHE 2
+/** Send this query over TCP rather than UDP */
+#define DNS_QUERY_USEVC 4
+/** Use a truncated reply as it is, rather than asking again over TCP */
+#define DNS_QUERY_IGNTC 8
 
 /* Allow searching */
 #define DNS_OPTION_SEARCH 1
@@ -462,7 +468,57 @@ void evdns_cancel_request(struct evdns_base *base, struct evdns_request *req);
 
     ndots, timeout, max-timeouts, max-inflight, attempts, randomize-case,
     bind-to, initial-probe-timeout, getaddrinfo-allow-skew,
-    so-rcvbuf, so-sndbuf.
+    so-rcvbuf, so-sndbuf, cache-size, cache-min-ttl, cache-max-ttl,
+    cache-prefetch, cache-serve-stale, use-vc, ignore-tc, tcp-idle-timeout,
+    select-fastest, hedge, udp-batch-size, udp-sockets,
+    search-negative-ttl.
+
+  cache-size is the number of answers to keep in the answer cache, which is
+  off while it is 0, the default.  Answers, including NXDOMAIN and NODATA
+  replies, are kept for their TTL raised to at least cache-min-ttl and
+  lowered to at most cache-max-ttl seconds (0 and 86400 by default), and
+  the least recently used ones are dropped when the cache is full.
+
+  With cache-prefetch set to a percentage, an answer that is served during
+  the last part of its TTL is refreshed in the background.  With
+  cache-serve-stale set to a number of seconds, an answer keeps being
+  served for that long after it expired, with a TTL of 30 seconds, while it
+  is refreshed in the background or while no nameserver is up (RFC 8767).
+  Both are off by default.
+
+  Queries go over UDP, and are asked again over TCP when the reply is
+  truncated.  use-vc sends all of them over TCP, as DNS_QUERY_USEVC does
+  for one query, and ignore-tc keeps truncated replies, as DNS_QUERY_IGNTC
+  does; both are off unless set to a value other than 0, or given without
+  a value in resolv.conf.  Each nameserver has one TCP connection, which
+  carries any number of queries at a time and is closed once it has been
+  idle for tcp-idle-timeout seconds, 10 by default.
+
+  Nameservers are used in turn, skipping the ones that seem to be down.
+  With select-fastest set to 1, the one with the lowest smoothed round-trip
+  time is used instead, and the others are tried again now and then.  With
+  hedge set to 1, a query that got no reply after the usual round-trip time
+  of its nameserver plus four times its variation (at least 10 msec) is sent
+  to another nameserver as well, and the first reply wins.  Both are off by
+  default.
+
+  udp-batch-size is the number of datagrams read from a nameserver or sent
+  to it with one system call, from 1, the default, to 64.  Above 1, the
+  queries made during one run of the event loop are sent together once it
+  is done with its callbacks.  It needs recvmmsg() and sendmmsg(); elsewhere
+  it has no effect.
+
+  udp-sockets is the number of UDP sockets, from 1, the default, to 64, of
+  each nameserver added after it is set.  Each has a port of its own, picked
+  by the system, or the port of bind-to for the first one.  A query goes out
+  on one of them at random, and a reply is only taken from the socket that
+  its query went out on, so a forged one has to guess the port as well as
+  the transaction id.
+
+  With search-negative-ttl set to a number of seconds, a name that got
+  NXDOMAIN with every search domain is looked up without them for that long
+  afterwards.  It is off while it is 0, the default, and changing the search
+  domains forgets these names.
 
   In versions before Libevent 2.0.3-alpha, the option name needed to end with
   a colon.
@@ -611,6 +667,7 @@ void evdns_set_random_bytes_fn(void (*fn)(char *, size_t));
 
 struct evdns_server_request;
 struct evdns_server_question;
+struct evconnlistener;
 
 /**
    A callback to implement a DNS server.  The callback function receives a DNS
@@ -659,10 +716,108 @@ typedef void (*evdns_request_callback_fn_type)(struct evdns_server_request *, vo
  */
 EVENT2_EXPORT_SYMBOL
 struct evdns_server_port *evdns_add_server_port_with_base(struct event_base *base, evutil_socket_t socket, int flags, evdns_request_callback_fn_type callback, void *user_data);
+/** Create a new DNS server port that takes DNS requests over TCP.
+
+    Each connection accepted by the listener can carry any number of
+    requests, answered in any order, and is closed once it has been idle
+    for 10 seconds, or as set with EVDNS_SOPT_TCP_IDLE_TIMEOUT.  Replies are
+    not truncated to 512 bytes.
+
+    @param base The event base to handle events for the server port, or
+      NULL to use the one of the listener.
+    @param listener A listener to accept connections from DNS clients; it
+      is freed when the port is closed.
+    @param flags Always 0 for now.
+    @param callback A function to invoke whenever we get a DNS request
+      on a connection.
+    @param user_data Data to pass to the callback.
+    @return an evdns_server_port structure for this server port or NULL if
+      an error occurred.
+ */
+EVENT2_EXPORT_SYMBOL
+struct evdns_server_port *evdns_add_server_port_with_listener(struct event_base *base, struct evconnlistener *listener, int flags, evdns_request_callback_fn_type callback, void *user_data);
 /** Close down a DNS server port, and free associated structures. */
 EVENT2_EXPORT_SYMBOL
 void evdns_close_server_port(struct evdns_server_port *port);
 
+/** Options for evdns_server_port_set_option(). */
+enum evdns_server_option {
+	/** Seconds before a TCP connection that carries no request is
+	    closed, or 0 to keep it open.  10 by default; it applies to the
+	    connections accepted from then on. */
+	EVDNS_SOPT_TCP_IDLE_TIMEOUT,
+	/** Datagrams read or written per system call on a UDP port, from 1,
+	    the default, to 64.  The replies given while handling the
+	    requests read together are sent together too.  It needs
+	    recvmmsg() and sendmmsg(); elsewhere it has no effect. */
+	EVDNS_SOPT_UDP_BATCH_SIZE
+};
+
+/**
+  Set an option on a DNS server port.
+
+  @param port the port to configure
+  @param option the option to set
+  @param value the value to set it to
+  @return 0 on success, or -1 if the option does not apply to this port or
+    the value is out of range.
+ */
+EVENT2_EXPORT_SYMBOL
+int evdns_server_port_set_option(struct evdns_server_port *port, enum evdns_server_option option, size_t value);
+
+struct evdns_zone;
+
+/**
+   Create an empty zone: a set of records that server ports can answer
+   requests from by themselves.
+
+   @return a new evdns_zone, or NULL if an error occurred.
+   @see evdns_server_port_set_zone()
+ */
+EVENT2_EXPORT_SYMBOL
+struct evdns_zone *evdns_zone_new(void);
+
+/**
+   Free a zone and all of its records.  It must not be in use by any server
+   port any more.
+ */
+EVENT2_EXPORT_SYMBOL
+void evdns_zone_free(struct evdns_zone *zone);
+
+/**
+   Add a record to a zone.
+
+   The arguments are those of evdns_server_request_add_reply(): the record
+   of the given type and class for name has data as its content, datalen
+   bytes of it, or, if is_name is set, the name that data spells.  The
+   records with the same name, type and class form an RRset, and are
+   given in the order in which they were added.
+
+   @return 0 on success, or -1 if a name is too long, or the RRset would
+     no longer fit in a reply.
+ */
+EVENT2_EXPORT_SYMBOL
+int evdns_zone_add_record(struct evdns_zone *zone, const char *name, int type, int dns_class, int ttl, int datalen, int is_name, const char *data);
+
+/**
+   Answer the requests made to a server port from a zone.
+
+   A standard query with one question about a name that is in the zone is
+   answered with the RRset of that type and class, or else with the CNAME
+   RRset of the name, or else with no records, without calling the
+   callback of the port, which gets the other requests as before.  These
+   replies have the AA flag set, and over UDP they are truncated to the
+   question when they would be longer than 512 bytes.
+
+   A zone can be used by several ports, and records can be added to it
+   while it is in use; it is not freed with the port.
+
+   @param port the port to answer from the zone
+   @param zone the zone, or NULL to stop using one
+ */
+EVENT2_EXPORT_SYMBOL
+void evdns_server_port_set_zone(struct evdns_server_port *port, struct evdns_zone *zone);
+
 /** Sets some flags in a reply we're building.
     Allows setting of the AA or RD flags
  */
@@ -734,6 +889,49 @@ struct evdns_getaddrinfo_request *evdns_getaddrinfo(
 EVENT2_EXPORT_SYMBOL
 void evdns_getaddrinfo_cancel(struct evdns_getaddrinfo_request *req);
 
+/**
+   Counters of the answer cache of an evdns_base.
+
+   @see evdns_base_get_cache_stats()
+ */
+struct evdns_cache_stats {
+	/** queries answered from the cache */
+	ev_uint64_t hits;
+	/** hits on NXDOMAIN or NODATA answers, included in hits */
+	ev_uint64_t negative_hits;
+	/** hits on expired answers, included in hits */
+	ev_uint64_t stale_hits;
+	/** queries sent to refresh an answer */
+	ev_uint64_t refreshes;
+	/** queries that had to be sent */
+	ev_uint64_t misses;
+	/** answers dropped to make room for newer ones */
+	ev_uint64_t evictions;
+	/** answers in the cache, including expired ones not dropped yet */
+	ev_uint64_t entries;
+};
+
+/**
+   Retrieve the counters of the answer cache.
+
+   Queries that hit the cache are answered from a deferred callback, without
+   sending anything.  See the cache-size option of evdns_base_set_option().
+
+   @param base The evdns_base to examine.
+   @param stats A location to receive the counters.
+ */
+EVENT2_EXPORT_SYMBOL
+void evdns_base_get_cache_stats(struct evdns_base *base,
+    struct evdns_cache_stats *stats);
+
+/**
+   Remove all answers from the answer cache.
+
+   @param base The evdns_base whose cache to clear.
+ */
+EVENT2_EXPORT_SYMBOL
+void evdns_base_clear_cache(struct evdns_base *base);
+
 /**
    Retrieve the address of the 'idx'th configured nameserver.
 
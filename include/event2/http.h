@@ -53,8 +53,10 @@ struct evhttp_connection;
  */
 
 /* Response codes */
+#define HTTP_EARLYHINTS		103	/**< headers ahead of the reply */
 #define HTTP_OK			200	/**< request completed ok */
 #define HTTP_NOCONTENT		204	/**< request does not have content */
+#define HTTP_PARTIAL		206	/**< only the requested range is sent */
 #define HTTP_MOVEPERM		301	/**< the uri moved permanently */
 #define HTTP_MOVETEMP		302	/**< the uri moved temporarily */
 #define HTTP_NOTMODIFIED	304	/**< page was not modified from last */
@@ -62,9 +64,11 @@ struct evhttp_connection;
 #define HTTP_NOTFOUND		404	/**< could not find content for uri */
 #define HTTP_BADMETHOD		405 	/**< method not allowed for this uri */
 #define HTTP_ENTITYTOOLARGE	413	/**<  */
+#define HTTP_BADRANGE		416	/**< requested range is not satisfiable */
 #define HTTP_EXPECTATIONFAILED	417	/**< we can't handle this expectation */
 #define HTTP_INTERNAL           500     /**< internal error */
 #define HTTP_NOTIMPLEMENTED     501     /**< not implemented */
+#define HTTP_BADGATEWAY		502	/**< no valid response from upstream */
 #define HTTP_SERVUNAVAIL	503	/**< the server is not available */
 
 struct evhttp;
@@ -223,6 +227,79 @@ void evhttp_set_max_headers_size(struct evhttp* http, ev_ssize_t max_headers_siz
 EVENT2_EXPORT_SYMBOL
 void evhttp_set_max_body_size(struct evhttp* http, ev_ssize_t max_body_size);
 
+/**
+  Limit the number of connections the server keeps open at once.
+
+  Once the limit is reached, the server stops accepting new connections,
+  leaving them in the listen backlog of the operating system, until some
+  of the open connections have been closed.
+
+  @param http the http server on which to set the limit
+  @param max_connections the maximum number of open connections, or 0 for
+    no limit (the default)
+*/
+EVENT2_EXPORT_SYMBOL
+void evhttp_set_max_connections(struct evhttp *http, int max_connections);
+
+/**
+  Limit the number of requests that are being processed at once.
+
+  A request counts as being processed from the moment it is passed to a
+  callback until its reply has been sent.  Requests beyond the limit are
+  answered right away with a preformatted "503 Service Unavailable"
+  reply, and their connections are closed.
+
+  @param http the http server on which to set the limit
+  @param max_requests the maximum number of requests being processed, or 0
+    for no limit (the default)
+*/
+EVENT2_EXPORT_SYMBOL
+void evhttp_set_max_inflight_requests(struct evhttp *http, int max_requests);
+
+/**
+  Shed load when the event loop falls behind.
+
+  The lag of the event loop is measured as the time it took to run the
+  callbacks of its last iteration, or, if that is longer, the time since
+  the current iteration started running callbacks.  While it exceeds
+  max_lag, new requests are answered with "503 Service Unavailable" as if
+  the limit of evhttp_set_max_inflight_requests() had been reached.
+
+  @param http the http server on which to set the limit
+  @param max_lag the maximum lag, or NULL to stop measuring it
+  @return 0 on success, -1 on failure
+*/
+EVENT2_EXPORT_SYMBOL
+int evhttp_set_max_loop_lag(struct evhttp *http, const struct timeval *max_lag);
+
+/**
+  Add a worker event base that serves connections accepted by http.
+
+  Once a server has workers, the connections it accepts are handed to
+  them in turn, or to the one with the fewest connections with
+  EVHTTP_SERVER_LEAST_LOADED, and all requests on a connection are
+  processed on its worker base.  Each worker base is meant to run its own
+  event loop on its own thread, so Libevent has to be set up for threads
+  with evthread_use_pthreads() or evthread_use_windows_threads() before
+  the bases are created.
+
+  The workers share the configuration of http, including its callbacks
+  and virtual hosts, without locking it: it has to be complete before the
+  first worker is added and must not change afterwards.  The connection
+  limit counts the connections of all workers together, while the
+  in-flight limit applies to each worker separately.  With
+  EVHTTP_SERVER_STATS each worker only keeps its totals, which
+  evhttp_get_stats() adds to those of http when no path is given.  The
+  workers are freed with http, which must only happen once their event
+  loops have stopped.
+
+  @param http the server that accepts the connections
+  @param base the event base of the worker
+  @return 0 on success, -1 on failure
+*/
+EVENT2_EXPORT_SYMBOL
+int evhttp_add_worker_base(struct evhttp *http, struct event_base *base);
+
 /**
   Set the value to use for the Content-Type header when none was provided. If
   the content type string is NULL, the Content-Type header will not be
@@ -235,6 +312,51 @@ EVENT2_EXPORT_SYMBOL
 void evhttp_set_default_content_type(struct evhttp *http,
 	const char *content_type);
 
+/**
+   Callback that encodes response bodies for a content coding.
+
+   @param src the data to encode; it has to be drained completely
+   @param dst the buffer to append the encoded data to
+   @param finish nonzero for the last call for a response; otherwise more
+     data may follow, but everything consumed so far still has to be
+     written to dst so that streamed replies are not held back
+   @param ctx the encoder state returned by the ctx_new callback
+   @return 0 on success, -1 on failure
+   @see evhttp_add_content_coding()
+*/
+typedef int (*evhttp_content_coding_cb)(struct evbuffer *src,
+    struct evbuffer *dst, int finish, void *ctx);
+
+/**
+  Add a content coding, e.g. "gzip", used to compress responses.
+
+  A response is encoded with the first of the codings added to the server
+  that the "Accept-Encoding" header of the request accepts.  This applies
+  to complete replies as well as to replies sent in chunks with
+  evhttp_send_reply_start(), which are encoded incrementally; the
+  "Content-Encoding" and "Vary" headers are added and the "Content-Length"
+  header is adjusted.  Responses that have a "Content-Encoding" header
+  already, partial content and responses without a body are not encoded.
+
+  For every response ctx_new is invoked with arg to create the state of
+  the encoder, e.g. a zlib stream set up with the compression level and
+  preset dictionary kept in arg, and ctx_free releases it again once the
+  response has been encoded.  Adding the same coding with different
+  names allows offering several levels or dictionaries.
+
+  @param http the http server on which to add the coding
+  @param coding the name of the coding as used in "Content-Encoding"
+  @param ctx_new creates the encoder state; if NULL, arg is used instead
+  @param encode the callback encoding the data
+  @param ctx_free frees the encoder state; may be NULL
+  @param arg argument for ctx_new
+  @return 0 on success, -1 on failure
+*/
+EVENT2_EXPORT_SYMBOL
+int evhttp_add_content_coding(struct evhttp *http, const char *coding,
+    void *(*ctx_new)(void *), evhttp_content_coding_cb encode,
+    void (*ctx_free)(void *), void *arg);
+
 /**
   Sets the what HTTP methods are supported in requests accepted by this
   server, and passed to user callbacks.
@@ -282,6 +404,43 @@ EVENT2_EXPORT_SYMBOL
 int evhttp_set_cb(struct evhttp *http, const char *path,
     void (*cb)(struct evhttp_request *, void *), void *cb_arg);
 
+/**
+   Set a callback for a specified URI that streams the request body
+
+   In contrast to evhttp_set_cb(), the request body is not accumulated in
+   the input buffer of the request before the callback is invoked.
+   Instead, header_cb is invoked as soon as the request headers have been
+   read, and chunk_cb whenever body data has been appended to the input
+   buffer of the request.  Once the body has been read completely, cb is
+   invoked and is expected to send the reply, like a regular callback.
+
+   chunk_cb is expected to drain whatever data it consumed from the input
+   buffer.  As long as data remains in the input buffer, no more data is
+   read from the connection; reading resumes once the buffer has been
+   drained, e.g. after the data was written out asynchronously.  Any data
+   that was not drained by the time the body is complete is left in the
+   input buffer for cb.
+
+   Requests without a body only invoke header_cb and cb.  The limit
+   set with evhttp_set_max_body_size() still applies.
+
+   @param http the http sever on which to set the callback
+   @param path the path for which to invoke the callbacks
+   @param header_cb optional callback invoked once the request headers
+     have been read; if it returns a negative value, the connection is
+     closed without a reply
+   @param chunk_cb the callback invoked for each piece of body data
+   @param cb the callback invoked once the request body has been read
+   @param cb_arg an additional context argument for the callbacks
+   @return 0 on success, -1 if the callback existed already, -2 on failure
+   @see evhttp_set_cb()
+*/
+EVENT2_EXPORT_SYMBOL
+int evhttp_set_stream_cb(struct evhttp *http, const char *path,
+    int (*header_cb)(struct evhttp_request *, void *),
+    void (*chunk_cb)(struct evhttp_request *, void *),
+    void (*cb)(struct evhttp_request *, void *), void *cb_arg);
+
 /** Removes the callback for a specified URI */
 EVENT2_EXPORT_SYMBOL
 int evhttp_del_cb(struct evhttp *, const char *);
@@ -466,6 +625,18 @@ void evhttp_set_write_timeout_tv(struct evhttp *http, const struct timeval* tv);
 /* Read all the clients body, and only after this respond with an error if the
  * clients body exceed max_body_size */
 #define EVHTTP_SERVER_LINGERING_CLOSE	0x0001
+/* Park idle keep-alive connections: their bufferevent and request are
+ * freed, leaving only the socket and a single read event, until the next
+ * request arrives.  evhttp_connection_get_bufferevent() returns NULL for a
+ * parked connection.  Connections with a bufferevent from evhttp_set_bevcb()
+ * or with rate limits are never parked. */
+#define EVHTTP_SERVER_PARK_IDLE		0x0002
+/* Keep statistics of the requests per server, virtual host and callback,
+ * see evhttp_get_stats() */
+#define EVHTTP_SERVER_STATS		0x0004
+/* Hand accepted connections to the worker base with the fewest
+ * connections instead of in turn, see evhttp_add_worker_base() */
+#define EVHTTP_SERVER_LEAST_LOADED	0x0008
 /**
  * Set connection flags for HTTP server.
  *
@@ -476,6 +647,91 @@ void evhttp_set_write_timeout_tv(struct evhttp *http, const struct timeval* tv);
 EVENT2_EXPORT_SYMBOL
 int evhttp_set_flags(struct evhttp *http, int flags);
 
+/** Number of buckets of struct evhttp_histogram */
+#define EVHTTP_HISTOGRAM_BUCKETS	160
+
+/**
+ * A histogram of latencies in microseconds.
+ *
+ * Every power of two is split into four buckets, so that each bucket is
+ * accurate to 25%.  Use evhttp_histogram_percentile() to read it.
+ */
+struct evhttp_histogram {
+	ev_uint64_t count;
+	ev_uint64_t sum;	/**< in microseconds */
+	ev_uint64_t max;	/**< in microseconds */
+	ev_uint64_t buckets[EVHTTP_HISTOGRAM_BUCKETS];
+};
+
+/**
+ * Statistics of the requests of a server, virtual host or callback.
+ *
+ * Requests are accounted for once their reply has been written.
+ */
+struct evhttp_stats {
+	ev_uint64_t requests;
+	ev_uint64_t status[5];	/**< replies by class, 1xx to 5xx */
+	ev_uint64_t bytes_in;	/**< request headers and bodies */
+	ev_uint64_t bytes_out;	/**< reply headers and bodies */
+
+	/** from the first byte of the request until its headers are read */
+	struct evhttp_histogram parse;
+	/** from invoking the callback until it starts to reply */
+	struct evhttp_histogram handler;
+	/** from starting to reply until the reply has been written */
+	struct evhttp_histogram write;
+};
+
+/**
+ * Get the statistics of a server or of one of its callbacks.
+ *
+ * Statistics are only kept with EVHTTP_SERVER_STATS set on the server
+ * that accepts the connections.  The statistics of a virtual host cover
+ * the requests that were dispatched to it; those of the server cover the
+ * rest.  No locks are taken: the statistics have to be read from the
+ * thread of the event base of the server, and can be merged with
+ * evhttp_stats_merge() across servers.
+ *
+ * @param http the server or virtual host
+ * @param path the path of a callback, or NULL for all requests of http
+ * @param stats set to the statistics
+ * @return 0 on success, -1 if there is no callback for path
+ */
+EVENT2_EXPORT_SYMBOL
+int evhttp_get_stats(struct evhttp *http, const char *path,
+    struct evhttp_stats *stats);
+
+/** Add the statistics in src to dst. */
+EVENT2_EXPORT_SYMBOL
+void evhttp_stats_merge(struct evhttp_stats *dst,
+    const struct evhttp_stats *src);
+
+/**
+ * Get a percentile of a histogram.
+ *
+ * @param h the histogram
+ * @param percentile the percentile, between 0 and 100
+ * @return the upper bound of the latency in microseconds, or 0 if the
+ *     histogram is empty
+ */
+EVENT2_EXPORT_SYMBOL
+ev_uint64_t evhttp_histogram_percentile(const struct evhttp_histogram *h,
+    double percentile);
+
+/**
+ * A callback that replies with the statistics of a server as JSON.
+ *
+ * The reply covers the server, each of its callbacks and each of its
+ * virtual hosts, e.g. with
+ * evhttp_set_cb(http, "/stats", evhttp_stats_handler, NULL).
+ *
+ * @param req the request
+ * @param arg the server to report on, or NULL for the server that
+ *     accepted the request
+ */
+EVENT2_EXPORT_SYMBOL
+void evhttp_stats_handler(struct evhttp_request *req, void *arg);
+
 /* Request/Response functionality */
 
 /**
@@ -567,6 +823,111 @@ void evhttp_send_reply_chunk_with_cb(struct evhttp_request *req, struct evbuffer
 EVENT2_EXPORT_SYMBOL
 void evhttp_send_reply_end(struct evhttp_request *req);
 
+/**
+   Complete a chunked reply with trailer fields.
+
+   The trailers are sent after the last chunk, e.g. for a checksum that
+   is only known once the body has been generated.  They are dropped if
+   the reply is not chunked, i.e. if it has a Content-Length or the
+   client does not speak HTTP/1.1.
+
+   @param req a request object
+   @param trailers the trailer fields, or NULL
+*/
+EVENT2_EXPORT_SYMBOL
+void evhttp_send_reply_end_with_trailers(struct evhttp_request *req,
+    const struct evkeyvalq *trailers);
+
+/**
+   Send a 103 Early Hints interim response.
+
+   Lets the client act on some headers of the reply, e.g. Link headers
+   to preload resources, while the reply itself is still being
+   generated.  May be called any number of times before the reply is
+   started.
+
+   @param req a request object
+   @param headers the headers to send
+   @return 0 on success, -1 if the reply has already been started or the
+     client does not speak HTTP/1.1
+*/
+EVENT2_EXPORT_SYMBOL
+int evhttp_send_early_hints(struct evhttp_request *req,
+    const struct evkeyvalq *headers);
+
+/*
+ * Static file serving
+ */
+
+struct evhttp_static;
+
+/**
+   Create a handler for serving the files below a directory.
+
+   The handler keeps up to max_files files open, along with the
+   evbuffer_file_segment used to send them and their preformatted
+   headers, and closes the least recently used ones once the limit is
+   reached.  Cached files are checked for modifications at most once per
+   second; serving a cached file does not need any system calls besides
+   writing it out, with sendfile where available.
+
+   GET and HEAD requests are supported, as are single byte ranges
+   ("Range" and "If-Range") and conditional requests ("If-None-Match" and
+   "If-Modified-Since").  A request for a path ending in '/' serves
+   "index.html" from that directory.
+
+   @param base the event base whose cached time is used for revalidation
+   @param root the directory to serve files from
+   @param max_files the maximum number of files to keep open
+   @param flags any number of the EVBUF_FS_* flags used for the file
+     segments; pass EVBUF_FS_DISABLE_SENDFILE when the files are sent over
+     a filtering bufferevent, e.g. for SSL
+   @return a new handler, or NULL on error
+   @see evhttp_static_handler(), evhttp_static_free()
+*/
+EVENT2_EXPORT_SYMBOL
+struct evhttp_static *evhttp_static_new(struct event_base *base,
+    const char *root, int max_files, unsigned flags);
+
+/**
+   Free a handler created by evhttp_static_new(), closing all cached files
+   once they are not being sent anymore.
+*/
+EVENT2_EXPORT_SYMBOL
+void evhttp_static_free(struct evhttp_static *st);
+
+/**
+   Serve precompressed variants of files.
+
+   If the "Accept-Encoding" header of a request accepts coding and a file
+   named like the requested one with suffix appended exists, e.g.
+   "index.html.gz" for "index.html", that file is served instead, with a
+   "Content-Encoding" header.  Variants are tried in the order they have
+   been added, and are cached like any other file.
+
+   @param st the handler returned by evhttp_static_new()
+   @param coding the content coding of the variant, e.g. "gzip"
+   @param suffix the suffix of the variant files, e.g. ".gz"
+   @return 0 on success, -1 on failure
+*/
+EVENT2_EXPORT_SYMBOL
+int evhttp_static_add_precompressed(struct evhttp_static *st,
+    const char *coding, const char *suffix);
+
+/**
+   Serve the file a request asks for.
+
+   To be used as callback with evhttp_set_cb() or evhttp_set_gencb(), with
+   the handler returned by evhttp_static_new() as argument.  The path of
+   the request is looked up below the root directory of the handler; paths
+   that would escape it are rejected.
+
+   @param req the request to reply to
+   @param arg the struct evhttp_static handler
+*/
+EVENT2_EXPORT_SYMBOL
+void evhttp_static_handler(struct evhttp_request *req, void *arg);
+
 /*
  * Interfaces for making requests
  */
@@ -745,6 +1106,27 @@ EVENT2_EXPORT_SYMBOL
 void evhttp_request_set_on_complete_cb(struct evhttp_request *req,
     void (*cb)(struct evhttp_request *, void *), void *cb_arg);
 
+/**
+ * Set a callback for when the client of an incoming request goes away.
+ *
+ * While the callback is set, the connection is watched for the client
+ * closing it, so that the callback runs as soon as that happens rather
+ * than once writing the reply fails.  This allows work on behalf of the
+ * request, e.g. on a backend, to be aborted early.
+ *
+ * The request is detached from its connection before the callback runs,
+ * but is not freed: it still has to be completed as usual, e.g. with
+ * evhttp_send_error(), which then only frees it.
+ *
+ * @param req a request object that has been passed to a callback of
+ *     the server
+ * @param cb callback function, or NULL
+ * @param cb_arg an additional context argument for the callback
+ */
+EVENT2_EXPORT_SYMBOL
+void evhttp_request_set_cancel_cb(struct evhttp_request *req,
+    void (*cb)(struct evhttp_request *, void *), void *cb_arg);
+
 /** Frees the request object and removes associated events. */
 EVENT2_EXPORT_SYMBOL
 void evhttp_request_free(struct evhttp_request *req);
@@ -987,6 +1369,233 @@ int evhttp_make_request(struct evhttp_connection *evcon,
 EVENT2_EXPORT_SYMBOL
 void evhttp_cancel_request(struct evhttp_request *req);
 
+/*
+ * Client connection pool
+ */
+
+/**
+ * A pool of outgoing keep-alive connections, keyed by host and port.
+ */
+struct evhttp_client_pool;
+
+/**
+ * Create a new pool of client connections.
+ *
+ * Requests made through the pool are spread across idle keep-alive
+ * connections to the same host.  If no idle connection is available, a new
+ * one is opened as long as the per-host limit is not reached; otherwise the
+ * request is queued until a connection becomes free.
+ *
+ * Connections that are closed by the peer or that failed a request are
+ * evicted from the pool, idle connections are closed after the idle
+ * timeout.
+ *
+ * @param base the event_base to use for the connections
+ * @param dnsbase the dns_base to use for resolving host names, or NULL
+ * @return a new pool, or NULL on error
+ * @see evhttp_client_pool_free(), evhttp_client_pool_make_request()
+ */
+EVENT2_EXPORT_SYMBOL
+struct evhttp_client_pool *evhttp_client_pool_new(struct event_base *base,
+    struct evdns_base *dnsbase);
+
+/**
+ * Free a pool and all of its connections.
+ *
+ * Requests that are still waiting for a connection are freed without
+ * invoking their callbacks, the same as evhttp_connection_free() does for
+ * pending requests.
+ */
+EVENT2_EXPORT_SYMBOL
+void evhttp_client_pool_free(struct evhttp_client_pool *pool);
+
+/**
+ * Set the maximum number of connections the pool opens to one host:port.
+ *
+ * The default is 8.
+ */
+EVENT2_EXPORT_SYMBOL
+void evhttp_client_pool_set_max_per_host(struct evhttp_client_pool *pool,
+    int max_per_host);
+
+/**
+ * Set the maximum number of requests that may wait for a connection to one
+ * host:port, -1 (the default) means no limit.
+ */
+EVENT2_EXPORT_SYMBOL
+void evhttp_client_pool_set_max_queue(struct evhttp_client_pool *pool,
+    int max_queue);
+
+/**
+ * Set how long an idle connection is kept open.
+ *
+ * @param tv the timeout, or NULL for the default of 30 seconds
+ */
+EVENT2_EXPORT_SYMBOL
+void evhttp_client_pool_set_idle_timeout_tv(struct evhttp_client_pool *pool,
+    const struct timeval *tv);
+
+/**
+ * Set the retry limit of new connections.
+ *
+ * @see evhttp_connection_set_retries()
+ */
+EVENT2_EXPORT_SYMBOL
+void evhttp_client_pool_set_retries(struct evhttp_client_pool *pool,
+    int retry_max);
+
+/**
+ * Set a callback that is invoked for every new connection of the pool.
+ *
+ * It can be used to adjust timeouts, flags or limits of the connection.
+ * The callback must not replace the close callback of the connection, the
+ * pool uses it to detect closed idle connections.
+ */
+EVENT2_EXPORT_SYMBOL
+void evhttp_client_pool_set_conncb(struct evhttp_client_pool *pool,
+    void (*cb)(struct evhttp_connection *, void *), void *cbarg);
+
+/**
+ * Coalesce identical requests that are made through the pool.
+ *
+ * While a GET or HEAD request is outstanding, further requests of the same
+ * type for the same host, port and URI are not sent.  They are completed
+ * with the response of the outstanding request instead; its headers are
+ * copied and its body is shared by reference.  Requests that have a chunked
+ * callback or a body are never coalesced.
+ *
+ * evhttp_client_pool_cancel_request() has to be used to cancel coalesced
+ * requests.
+ *
+ * @param pool the pool
+ * @param enable 1 to coalesce identical requests, 0 to disable it
+ * @param vary a comma separated list of request headers whose values have
+ *     to be identical as well, e.g. "Accept-Encoding, Authorization", or NULL
+ * @return 0 on success, -1 on failure
+ */
+EVENT2_EXPORT_SYMBOL
+int evhttp_client_pool_set_coalescing(struct evhttp_client_pool *pool,
+    int enable, const char *vary);
+
+/**
+ * Make an HTTP request to address:port over a pooled connection.
+ *
+ * A "Host" header is added if the request does not have one.  The
+ * semantics are the same as evhttp_make_request(): the pool gets ownership
+ * of the request, and on failure the request is freed.
+ *
+ * @param pool the pool to use
+ * @param address the address to which to connect
+ * @param port the port to connect to
+ * @param req the previously created and configured request object
+ * @param type the request type EVHTTP_REQ_GET, EVHTTP_REQ_POST, etc.
+ * @param uri the URI associated with the request
+ * @return 0 on success, -1 on failure (for example if the queue is full)
+ * @see evhttp_client_pool_cancel_request()
+ */
+EVENT2_EXPORT_SYMBOL
+int evhttp_client_pool_make_request(struct evhttp_client_pool *pool,
+    const char *address, ev_uint16_t port, struct evhttp_request *req,
+    enum evhttp_cmd_type type, const char *uri);
+
+/**
+ * Cancel a request that was made with evhttp_client_pool_make_request().
+ *
+ * Unlike evhttp_cancel_request(), this also works for requests that are
+ * still waiting for a free connection.  The callback of the request is not
+ * executed and the request object is freed.
+ */
+EVENT2_EXPORT_SYMBOL
+void evhttp_client_pool_cancel_request(struct evhttp_client_pool *pool,
+    struct evhttp_request *req);
+
+/**
+ * Get the number of connections to address:port.
+ *
+ * @param nconns if not NULL, set to the number of open connections
+ * @param nidle if not NULL, set to the number of idle connections
+ * @param nwaiting if not NULL, set to the number of queued requests
+ * @return 0 on success, -1 if the pool has no connections to this host
+ */
+EVENT2_EXPORT_SYMBOL
+int evhttp_client_pool_get_host_stats(struct evhttp_client_pool *pool,
+    const char *address, ev_uint16_t port,
+    int *nconns, int *nidle, int *nwaiting);
+
+/*
+ * Reverse proxy
+ */
+
+/**
+ * A reverse proxy that passes requests on to an upstream server.
+ */
+struct evhttp_proxy;
+
+/**
+ * Create a reverse proxy for address:port.
+ *
+ * Requests are sent upstream over connections of pool.  Bodies are passed
+ * on as they arrive in both directions: the request body is sent upstream
+ * chunked, and the response body is passed back as it is read.  At most
+ * the window (see evhttp_proxy_set_window()) is buffered in each
+ * direction; reading stops while the other side has not caught up.
+ *
+ * Hop-by-hop headers are not passed on, and X-Forwarded-For is added to
+ * the requests.  A response that cannot be obtained is answered with
+ * 502 Bad Gateway.
+ *
+ * @param pool the pool for the upstream connections
+ * @param address the address of the upstream server
+ * @param port the port of the upstream server
+ * @return a new proxy, or NULL on error
+ * @see evhttp_set_proxy_cb(), evhttp_proxy_free()
+ */
+EVENT2_EXPORT_SYMBOL
+struct evhttp_proxy *evhttp_proxy_new(struct evhttp_client_pool *pool,
+    const char *address, ev_uint16_t port);
+
+/**
+ * Free a proxy.
+ *
+ * Requests that are still being passed on are aborted, and the
+ * connections of their clients are closed.  The pool is not freed.
+ */
+EVENT2_EXPORT_SYMBOL
+void evhttp_proxy_free(struct evhttp_proxy *proxy);
+
+/**
+ * Set how much body data is buffered in each direction of a request.
+ *
+ * The default is 64 KiB.
+ */
+EVENT2_EXPORT_SYMBOL
+void evhttp_proxy_set_window(struct evhttp_proxy *proxy, size_t window);
+
+/**
+ * Set a callback that rewrites the headers that are passed on.
+ *
+ * The callback is invoked with kind EVHTTP_REQUEST and the headers that
+ * are going to be sent upstream, and with kind EVHTTP_RESPONSE and the
+ * headers of the reply to the client.  req is the request of the client.
+ */
+EVENT2_EXPORT_SYMBOL
+void evhttp_proxy_set_header_cb(struct evhttp_proxy *proxy,
+    void (*cb)(struct evhttp_request *req, enum evhttp_request_kind kind,
+	struct evkeyvalq *headers, void *arg), void *arg);
+
+/**
+ * Pass requests for path on to proxy.
+ *
+ * @param http the http server
+ * @param path the path for which to pass requests on, see evhttp_set_cb()
+ * @param proxy the proxy to use
+ * @return 0 on success, -1 if the callback existed already, -2 on failure
+ * @see evhttp_set_stream_cb()
+ */
+EVENT2_EXPORT_SYMBOL
+int evhttp_set_proxy_cb(struct evhttp *http, const char *path,
+    struct evhttp_proxy *proxy);
+
 /**
  * A structure to hold a parsed URI or Relative-Ref conforming to RFC3986.
  */
@@ -1212,6 +1821,43 @@ int evhttp_parse_query_str(const char *uri, struct evkeyvalq *headers);
 EVENT2_EXPORT_SYMBOL
 int evhttp_parse_query_str_flags(const char *uri, struct evkeyvalq *headers, unsigned flags);
 
+/**
+   Iterate over the arguments of a query without copying it.
+
+   Each call finds the next "key=value" argument of the query at *query
+   and advances *query past it.  The key and the value point into the
+   query and are neither terminated nor decoded, so that only the
+   arguments that are needed have to be decoded, with
+   evhttp_query_decode().
+
+   @param query the query, e.g. from evhttp_uri_get_query(); advanced to
+     the next argument
+   @param key set to the key of the argument
+   @param key_len set to the length of the key
+   @param value set to the value of the argument, or NULL if the
+     argument has no "="
+   @param value_len set to the length of the value
+   @return 1 if an argument was found, 0 at the end of the query
+ */
+EVENT2_EXPORT_SYMBOL
+int evhttp_query_next(const char **query, const char **key, size_t *key_len,
+    const char **value, size_t *value_len);
+
+/**
+   Decode a key or value from evhttp_query_next().
+
+   Plus characters are converted to spaces, like evhttp_parse_query_str()
+   does.
+
+   @param s the string to decode
+   @param len the length of s
+   @param out the buffer for the result, of at least len + 1 bytes; it is
+     NUL-terminated
+   @return the length of the decoded string
+ */
+EVENT2_EXPORT_SYMBOL
+size_t evhttp_query_decode(const char *s, size_t len, char *out);
+
 /**
  * Escape HTML character entities in a string.
  *
@@ -77,6 +77,16 @@ struct {
 #define EVHTTP_REQ_DEFER_FREE		0x0008
 /** The request should be freed upstack */
 #define EVHTTP_REQ_NEEDS_FREE		0x0010
+/** The request body is passed on to the chunk callback as it arrives */
+#define EVHTTP_REQ_STREAM_BODY		0x0020
+/** Reading the streamed body waits for the input buffer to be drained */
+#define EVHTTP_REQ_STREAM_PAUSED	0x0040
+/** The response is sent as is, without applying a content coding */
+#define EVHTTP_REQ_NO_CONTENT_CODING	0x0080
+/** The request counts towards the requests in flight of the server */
+#define EVHTTP_REQ_INFLIGHT		0x0100
+/** The request body is still being sent in chunks as it becomes available */
+#define EVHTTP_REQ_STREAM_UPLOAD	0x0200
 
 	struct evkeyvalq *input_headers;
 	struct evkeyvalq *output_headers;
@@ -142,6 +152,21 @@ struct {
 	 */
 	void (*on_complete_cb)(struct evhttp_request *, void *);
 	void *on_complete_cb_arg;
+
+	/*
+	 * Upload callback - called when the body of a streamed request has
+	 * been written and more of it can be sent.
+	 */
+	void (*upload_cb)(struct evhttp_request *, void *);
+
+	/*
+	 * Cancel callback - called when the client of an incoming request
+	 * goes away before the reply has been sent.
+	 *
+	 * @see evhttp_request_set_cancel_cb()
+	 */
+	void (*cancel_cb)(struct evhttp_request *, void *);
+	void *cancel_cb_arg;
 };
 
 #ifdef __cplusplus
@@ -0,0 +1,539 @@
+/*
+ * Copyright 2007-2012 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "event2/event-config.h"
+
+#include <sys/types.h>
+#ifdef EVENT__HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <getopt.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef EVENT__HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "event2/event.h"
+#include "event2/dns.h"
+#include "event2/dns_struct.h"
+#include "event2/util.h"
+
+/*
+ * This benchmark makes lookups with an evdns_base against stub
+ * nameservers on evdns server ports in the same process, so that it needs
+ * no network.  It keeps a number of lookups outstanding, optionally no
+ * more than so many per second, and reports the throughput, the latency
+ * of the lookups, the queries the nameservers saw more than once, and how
+ * long the queries took to reach them.
+ *
+ * The nameservers can be made slow, and made to lose queries, and any
+ * option of the evdns_base can be set, to measure caching, batching and
+ * nameserver selection.
+ */
+
+#define MAX_SERVERS 16
+
+struct server {
+	struct evdns_server_port *port;
+	int index;
+	int n_requests;
+};
+
+/* a lookup that is outstanding */
+struct lookup {
+	struct timeval started;
+	int name;
+};
+
+/* a reply that a slow nameserver holds back */
+struct delayed_reply {
+	struct evdns_server_request *req;
+	struct event *ev;
+};
+
+static struct event_base *base;
+static struct evdns_base *dns;
+static struct evdns_zone *zone;
+static struct server servers[MAX_SERVERS];
+
+/* settings */
+static int n_lookups = 100000;
+static int concurrency = 100;
+static int qps = 0;
+static int n_names = 0;
+static int n_servers = 1;
+static int delay_msec = 0;
+static int loss_percent = 0;
+static int server_batch = 1;
+static int use_zone = 0;
+
+/* progress */
+static int n_launched, n_done, n_outstanding, n_errors;
+static struct timeval bench_start, bench_end;
+
+/* usec each lookup took, and each first query took to reach a server */
+static ev_uint32_t *latencies;
+static int n_latencies;
+static ev_uint32_t *send_delays;
+static int n_send_delays;
+
+/* per name: when a lookup of it was last made, and the queries for it */
+/* since then; as lookups of a name that is being looked up already wait */
+/* for the query that was sent, any other query is a retransmission */
+static struct timeval *name_started;
+static int *name_queries;
+static int n_queries, n_retransmits, n_dropped;
+
+static void launch_lookups(void);
+
+static long
+usec_diff(const struct timeval *start, const struct timeval *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000L +
+	    (end->tv_usec - start->tv_usec);
+}
+
+static int
+name_of_lookup(int i)
+{
+	return n_names ? i % n_names : i;
+}
+
+static void
+format_name(char *buf, size_t len, int name)
+{
+	evutil_snprintf(buf, len, "h%d.bench.example", name);
+}
+
+/* evdns logs every nameserver that is lost and found, which a lossy */
+/* run does all the time */
+static void
+quiet_log_fn(int is_warning, const char *msg)
+{
+}
+
+static void
+lookup_cb(int result, char type, int count, int ttl, void *addresses,
+    void *arg)
+{
+	struct lookup *l = arg;
+	struct timeval now;
+	long usec;
+
+	evutil_gettimeofday(&now, NULL);
+	usec = usec_diff(&l->started, &now);
+	latencies[n_latencies++] = (ev_uint32_t)(usec < 0 ? 0 : usec);
+	if (result != DNS_ERR_NONE)
+		++n_errors;
+	free(l);
+
+	--n_outstanding;
+	if (++n_done == n_lookups) {
+		bench_end = now;
+		event_base_loopbreak(base);
+		return;
+	}
+	launch_lookups();
+}
+
+static int
+launch_lookup(void)
+{
+	struct lookup *l;
+	char name[64];
+
+	if (!(l = malloc(sizeof(*l))))
+		return -1;
+	l->name = name_of_lookup(n_launched);
+	format_name(name, sizeof(name), l->name);
+	evutil_gettimeofday(&l->started, NULL);
+	name_started[l->name] = l->started;
+	name_queries[l->name] = 0;
+	++n_launched;
+	++n_outstanding;
+	/* answers from the cache come back from a deferred callback */
+	if (!evdns_base_resolve_ipv4(dns, name, DNS_QUERY_NO_SEARCH,
+		lookup_cb, l)) {
+		fprintf(stderr, "Can't launch lookup of %s\n", name);
+		--n_outstanding;
+		free(l);
+		return -1;
+	}
+	return 0;
+}
+
+/* make the lookups that are due, as far as concurrency allows; with a */
+/* rate set, the ones that fell behind are made as soon as they can be */
+static void
+launch_lookups(void)
+{
+	struct timeval now;
+	ev_int64_t due = n_lookups;
+
+	if (qps) {
+		evutil_gettimeofday(&now, NULL);
+		due = (ev_int64_t)qps * usec_diff(&bench_start, &now) / 1000000;
+	}
+	while (n_launched < n_lookups && n_launched < due &&
+	    n_outstanding < concurrency) {
+		if (launch_lookup() < 0)
+			break;
+	}
+}
+
+static void
+pace_cb(evutil_socket_t fd, short what, void *arg)
+{
+	launch_lookups();
+}
+
+static void
+delayed_reply_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct delayed_reply *d = arg;
+
+	evdns_server_request_respond(d->req, 0);
+	event_free(d->ev);
+	free(d);
+}
+
+static void
+server_cb(struct evdns_server_request *req, void *arg)
+{
+	struct server *s = arg;
+	struct evdns_server_question *q;
+	struct timeval now;
+	ev_uint32_t addr;
+	int name;
+
+	++s->n_requests;
+	if (req->nquestions != 1 || !(q = req->questions[0]) ||
+	    (q->name[0] != 'h' && q->name[0] != 'H')) {
+		evdns_server_request_respond(req, DNS_ERR_NOTEXIST);
+		return;
+	}
+	name = atoi(q->name + 1);
+	if (name < 0 || name >= (n_names ? n_names : n_lookups)) {
+		evdns_server_request_respond(req, DNS_ERR_NOTEXIST);
+		return;
+	}
+
+	++n_queries;
+	if (name_queries[name]++) {
+		++n_retransmits;
+	} else if (n_send_delays < n_lookups) {
+		evutil_gettimeofday(&now, NULL);
+		send_delays[n_send_delays++] = (ev_uint32_t)
+		    usec_diff(&name_started[name], &now);
+	}
+
+	if (loss_percent && rand() % 100 < loss_percent) {
+		++n_dropped;
+		evdns_server_request_drop(req);
+		return;
+	}
+
+	addr = htonl(0x0a000000 + name);
+	evdns_server_request_add_a_reply(req, q->name, 1, &addr, 3600);
+	if (delay_msec) {
+		struct timeval tv;
+		struct delayed_reply *d = malloc(sizeof(*d));
+		long msec = (long)delay_msec * (s->index + 1);
+		if (!d) {
+			evdns_server_request_drop(req);
+			return;
+		}
+		d->req = req;
+		d->ev = evtimer_new(base, delayed_reply_cb, d);
+		tv.tv_sec = msec / 1000;
+		tv.tv_usec = (msec % 1000) * 1000;
+		evtimer_add(d->ev, &tv);
+		return;
+	}
+	evdns_server_request_respond(req, 0);
+}
+
+static int
+cmp_u32(const void *a, const void *b)
+{
+	ev_uint32_t x = *(const ev_uint32_t *)a, y = *(const ev_uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void
+print_percentiles(const char *what, ev_uint32_t *v, int n)
+{
+	if (!n) {
+		printf("%-14s -\n", what);
+		return;
+	}
+	qsort(v, n, sizeof(*v), cmp_u32);
+	printf("%-14s p50 %u usec, p99 %u usec, p999 %u usec, max %u usec\n",
+	    what, (unsigned)v[(n - 1) * 50 / 100],
+	    (unsigned)v[(n - 1) * 99 / 100],
+	    (unsigned)v[(int)((ev_int64_t)(n - 1) * 999 / 1000)],
+	    (unsigned)v[n - 1]);
+}
+
+static int
+add_server(struct server *s, int index)
+{
+	struct sockaddr_in sin;
+	ev_socklen_t slen = sizeof(sin);
+	evutil_socket_t sock;
+	char addr[64];
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001);
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock < 0) {
+		perror("socket");
+		return -1;
+	}
+	evutil_make_socket_nonblocking(sock);
+	if (bind(sock, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+	    getsockname(sock, (struct sockaddr *)&sin, &slen) < 0) {
+		perror("bind");
+		evutil_closesocket(sock);
+		return -1;
+	}
+	s->index = index;
+	s->port = evdns_add_server_port_with_base(base, sock, 0, server_cb, s);
+	if (!s->port) {
+		evutil_closesocket(sock);
+		return -1;
+	}
+	if (server_batch > 1 && evdns_server_port_set_option(s->port,
+		EVDNS_SOPT_UDP_BATCH_SIZE, server_batch) < 0) {
+		fprintf(stderr, "Bad server batch size %d\n", server_batch);
+		return -1;
+	}
+	if (zone)
+		evdns_server_port_set_zone(s->port, zone);
+
+	evutil_snprintf(addr, sizeof(addr), "127.0.0.1:%d",
+	    (int)ntohs(sin.sin_port));
+	return evdns_base_nameserver_ip_add(dns, addr);
+}
+
+static int
+fill_zone(void)
+{
+	char name[64];
+	ev_uint32_t addr;
+	int i, n = n_names ? n_names : n_lookups;
+
+	if (!(zone = evdns_zone_new()))
+		return -1;
+	for (i = 0; i < n; ++i) {
+		format_name(name, sizeof(name), i);
+		addr = htonl(0x0a000000 + i);
+		if (evdns_zone_add_record(zone, name, EVDNS_TYPE_A,
+			EVDNS_CLASS_INET, 3600, 4, 0, (const char *)&addr) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr,
+	    "Usage: %s [options]\n"
+	    "  -n N        lookups to make (100000)\n"
+	    "  -c N        lookups outstanding at a time (100)\n"
+	    "  -r QPS      most lookups made per second (no limit)\n"
+	    "  -k N        look up N names over and over (a new name each time)\n"
+	    "  -s N        nameservers (1), up to %d\n"
+	    "  -d MSEC     nameserver i delays its replies by (i+1)*MSEC (0)\n"
+	    "  -l PERCENT  queries the nameservers drop (0)\n"
+	    "  -b N        datagrams per system call on the nameservers (1)\n"
+	    "  -z          answer from an evdns_zone instead of the callback\n"
+	    "  -o NAME=VAL set an option of the evdns_base, such as\n"
+	    "              cache-size=1000 or udp-batch-size=16\n",
+	    prog, MAX_SERVERS);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct evdns_cache_stats cache;
+	struct event *pace = NULL;
+	struct timeval one_msec = { 0, 1000 };
+	char *options[32];
+	int n_options = 0;
+	int i, c, n;
+	double secs;
+
+#ifdef _WIN32
+	WSADATA WSAData;
+	WSAStartup(0x101, &WSAData);
+#endif
+
+	while ((c = getopt(argc, argv, "n:c:r:k:s:d:l:b:zo:")) != -1) {
+		switch (c) {
+		case 'n':
+			n_lookups = atoi(optarg);
+			break;
+		case 'c':
+			concurrency = atoi(optarg);
+			break;
+		case 'r':
+			qps = atoi(optarg);
+			break;
+		case 'k':
+			n_names = atoi(optarg);
+			break;
+		case 's':
+			n_servers = atoi(optarg);
+			break;
+		case 'd':
+			delay_msec = atoi(optarg);
+			break;
+		case 'l':
+			loss_percent = atoi(optarg);
+			break;
+		case 'b':
+			server_batch = atoi(optarg);
+			break;
+		case 'z':
+			use_zone = 1;
+			break;
+		case 'o':
+			if (n_options == (int)(sizeof(options)/sizeof(options[0]))
+			    || !strchr(optarg, '=')) {
+				usage(argv[0]);
+				exit(1);
+			}
+			options[n_options++] = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			exit(1);
+		}
+	}
+	if (n_lookups < 1 || concurrency < 1 || qps < 0 || n_names < 0 ||
+	    n_servers < 1 || n_servers > MAX_SERVERS || delay_msec < 0 ||
+	    loss_percent < 0 || loss_percent > 100) {
+		usage(argv[0]);
+		exit(1);
+	}
+	n = n_names ? n_names : n_lookups;
+
+	latencies = calloc(n_lookups, sizeof(*latencies));
+	send_delays = calloc(n_lookups, sizeof(*send_delays));
+	name_started = calloc(n, sizeof(*name_started));
+	name_queries = calloc(n, sizeof(*name_queries));
+	if (!latencies || !send_delays || !name_started || !name_queries) {
+		perror("calloc");
+		exit(1);
+	}
+
+	base = event_base_new();
+	evdns_set_log_fn(quiet_log_fn);
+	dns = evdns_base_new(base, 0);
+	if (!base || !dns)
+		exit(1);
+	for (i = 0; i < n_options; ++i) {
+		char *val = strchr(options[i], '=');
+		*val++ = '\0';
+		if (evdns_base_set_option(dns, options[i], val) < 0) {
+			fprintf(stderr, "Can't set option %s to %s\n",
+			    options[i], val);
+			exit(1);
+		}
+	}
+	if (use_zone && fill_zone() < 0) {
+		fprintf(stderr, "Can't fill the zone\n");
+		exit(1);
+	}
+	for (i = 0; i < n_servers; ++i) {
+		if (add_server(&servers[i], i) < 0) {
+			fprintf(stderr, "Can't add nameserver %d\n", i);
+			exit(1);
+		}
+	}
+
+	evutil_gettimeofday(&bench_start, NULL);
+	if (qps) {
+		pace = event_new(base, -1, EV_PERSIST, pace_cb, NULL);
+		event_add(pace, &one_msec);
+	}
+	launch_lookups();
+	if (!n_launched && !qps)
+		exit(1);
+	event_base_dispatch(base);
+
+	secs = usec_diff(&bench_start, &bench_end) / 1e6;
+	printf("%d lookups in %.3f sec: %.0f lookups/sec, %d errors\n",
+	    n_done, secs, secs > 0 ? n_done / secs : 0.0, n_errors);
+	print_percentiles("latency", latencies, n_latencies);
+	if (use_zone) {
+		printf("queries        answered from the zone\n");
+	} else {
+		printf("queries        %d, %d sent again, %d dropped\n",
+		    n_queries, n_retransmits, n_dropped);
+		print_percentiles("time to server", send_delays,
+		    n_send_delays);
+	}
+	for (i = 0; i < n_servers && n_servers > 1; ++i)
+		printf("nameserver %-3d %d queries\n", i,
+		    servers[i].n_requests);
+	evdns_base_get_cache_stats(dns, &cache);
+	if (cache.hits || cache.misses)
+		printf("cache          %lu hits, %lu misses\n",
+		    (unsigned long)cache.hits, (unsigned long)cache.misses);
+
+	if (pace)
+		event_free(pace);
+	evdns_base_free(dns, 0);
+	for (i = 0; i < n_servers; ++i)
+		evdns_close_server_port(servers[i].port);
+	if (zone)
+		evdns_zone_free(zone);
+	event_base_free(base);
+	free(latencies);
+	free(send_delays);
+	free(name_started);
+	free(name_queries);
+
+#ifdef _WIN32
+	WSACleanup();
+#endif
+
+	return 0;
+}
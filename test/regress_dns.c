@@ -619,6 +619,1054 @@ end:
 	if (dns)
 		evdns_base_free(dns, 0);
 }
+static void
+dns_cache_test(void *arg)
+{
+	struct regress_dns_server_table table[ARRAY_SIZE(search_table)];
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_base *dns = NULL;
+	struct evdns_cache_stats stats;
+	ev_uint16_t portnum = 0;
+	char buf[64];
+	struct generic_dns_callback_result r[3];
+	size_t i;
+	int round;
+
+	for (i = 0; i < ARRAY_SIZE(table); ++i)
+		table[i] = search_table[i];
+
+	tt_assert(regress_dnsserver(base, &portnum, table));
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)portnum);
+
+	dns = evdns_base_new(base, 0);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+	tt_assert(!evdns_base_set_option(dns, "cache-size", "16"));
+	tt_assert(!evdns_base_set_option(dns, "cache-max-ttl", "50"));
+
+	evdns_base_search_add(dns, "a.example.com");
+	evdns_base_search_add(dns, "b.example.com");
+	evdns_base_search_add(dns, "c.example.com");
+
+	exit_base = base;
+	for (round = 0; round < 2; ++round) {
+		memset(r, 0, sizeof(r));
+		n_replies_left = ARRAY_SIZE(r);
+		evdns_base_resolve_ipv4(dns, "host2", 0,
+		    generic_dns_callback, &r[0]);
+		evdns_base_resolve_ipv4(dns, "hostn.a.example.com",
+		    DNS_NO_SEARCH, generic_dns_callback, &r[1]);
+		evdns_base_resolve_ipv4(dns, "hostn.b.example.com",
+		    DNS_NO_SEARCH, generic_dns_callback, &r[2]);
+		event_base_dispatch(base);
+
+		tt_int_op(r[0].type, ==, DNS_IPv4_A);
+		tt_int_op(r[0].count, ==, 1);
+		tt_int_op(((ev_uint32_t*)r[0].addrs)[0], ==, htonl(0xc8640064));
+		tt_int_op(r[1].result, ==, DNS_ERR_NODATA);
+		tt_int_op(r[2].result, ==, DNS_ERR_NOTEXIST);
+	}
+	/* hits count down from cache-max-ttl */
+	tt_int_op(r[0].ttl, >, 0);
+	tt_int_op(r[0].ttl, <=, 50);
+	tt_int_op(r[2].ttl, <=, 42);
+
+	/* NXDOMAIN without a SOA has no TTL, and is not kept */
+	tt_int_op(table[5].seen, ==, 2);
+	tt_int_op(table[4].seen, ==, 1);
+	tt_int_op(table[6].seen, ==, 1);
+	tt_int_op(table[7].seen, ==, 1);
+
+	evdns_base_get_cache_stats(dns, &stats);
+	tt_int_op(stats.hits, ==, 3);
+	tt_int_op(stats.negative_hits, ==, 2);
+	tt_int_op(stats.misses, ==, 5);
+	tt_int_op(stats.evictions, ==, 0);
+	tt_int_op(stats.entries, ==, 3);
+
+	/* DNS_QUERY_NO_CACHE goes to the wire */
+	n_replies_left = 1;
+	evdns_base_resolve_ipv4(dns, "hostn.b.example.com",
+	    DNS_NO_SEARCH|DNS_QUERY_NO_CACHE, generic_dns_callback, &r[2]);
+	event_base_dispatch(base);
+	tt_int_op(r[2].result, ==, DNS_ERR_NOTEXIST);
+	tt_int_op(table[7].seen, ==, 2);
+
+	/* shrinking the cache drops the least recently used answers */
+	tt_assert(!evdns_base_set_option(dns, "cache-size", "1"));
+	evdns_base_get_cache_stats(dns, &stats);
+	tt_int_op(stats.evictions, ==, 2);
+	tt_int_op(stats.entries, ==, 1);
+
+	evdns_base_clear_cache(dns);
+	evdns_base_get_cache_stats(dns, &stats);
+	tt_int_op(stats.entries, ==, 0);
+
+	/* with a floor, the whole search is answered from the cache */
+	tt_assert(!evdns_base_set_option(dns, "cache-size", "16"));
+	tt_assert(!evdns_base_set_option(dns, "cache-min-ttl", "10"));
+	for (round = 0; round < 2; ++round) {
+		memset(r, 0, sizeof(r));
+		n_replies_left = 1;
+		evdns_base_resolve_ipv4(dns, "host2", 0,
+		    generic_dns_callback, &r[0]);
+		event_base_dispatch(base);
+		tt_int_op(r[0].type, ==, DNS_IPv4_A);
+		tt_int_op(((ev_uint32_t*)r[0].addrs)[0], ==, htonl(0xc8640064));
+	}
+	tt_int_op(table[5].seen, ==, 3);
+	tt_int_op(table[4].seen, ==, 2);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+
+	regress_clean_dnsserver();
+}
+
+static void
+dns_cache_stale_test(void *arg)
+{
+	struct regress_dns_server_table table[ARRAY_SIZE(search_table)];
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_base *dns = NULL;
+	struct evdns_cache_stats stats;
+	struct timeval tv = { 1, 100000 }, settle = { 0, 200000 };
+	ev_uint16_t portnum = 0;
+	char buf[64];
+	struct generic_dns_callback_result r;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(table); ++i)
+		table[i] = search_table[i];
+
+	tt_assert(regress_dnsserver(base, &portnum, table));
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)portnum);
+
+	dns = evdns_base_new(base, 0);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+	tt_assert(!evdns_base_set_option(dns, "cache-size", "16"));
+	tt_assert(!evdns_base_set_option(dns, "cache-max-ttl", "1"));
+	tt_assert(!evdns_base_set_option(dns, "cache-serve-stale", "60"));
+
+	exit_base = base;
+	n_replies_left = 1;
+	evdns_base_resolve_ipv4(dns, "host2.b.example.com", DNS_NO_SEARCH,
+	    generic_dns_callback, &r);
+	event_base_dispatch(base);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	tt_int_op(table[4].seen, ==, 1);
+
+	/* an expired answer is served while it is refreshed */
+	evutil_usleep_(&tv);
+	memset(&r, 0, sizeof(r));
+	n_replies_left = 1;
+	evdns_base_resolve_ipv4(dns, "host2.b.example.com", DNS_NO_SEARCH,
+	    generic_dns_callback, &r);
+	event_base_dispatch(base);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	tt_int_op(r.ttl, ==, 30);
+	tt_int_op(((ev_uint32_t*)r.addrs)[0], ==, htonl(0xc8640064));
+	event_base_loopexit(base, &settle);
+	event_base_dispatch(base);
+	tt_int_op(table[4].seen, ==, 2);
+
+	evdns_base_get_cache_stats(dns, &stats);
+	tt_int_op(stats.hits, ==, 1);
+	tt_int_op(stats.stale_hits, ==, 1);
+	tt_int_op(stats.refreshes, ==, 1);
+
+	/* the refreshed answer is fresh again */
+	memset(&r, 0, sizeof(r));
+	n_replies_left = 1;
+	evdns_base_resolve_ipv4(dns, "host2.b.example.com", DNS_NO_SEARCH,
+	    generic_dns_callback, &r);
+	event_base_dispatch(base);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	tt_int_op(r.ttl, <=, 1);
+
+	/* answers near their expiry are refreshed once */
+	tt_assert(!evdns_base_set_option(dns, "cache-prefetch", "100"));
+	for (i = 0; i < 2; ++i) {
+		n_replies_left = 1;
+		evdns_base_resolve_ipv4(dns, "host2.b.example.com",
+		    DNS_NO_SEARCH, generic_dns_callback, &r);
+		event_base_dispatch(base);
+		tt_int_op(r.result, ==, DNS_ERR_NONE);
+	}
+	event_base_loopexit(base, &settle);
+	event_base_dispatch(base);
+	tt_int_op(table[4].seen, ==, 3);
+	evdns_base_get_cache_stats(dns, &stats);
+	tt_int_op(stats.refreshes, ==, 2);
+	tt_int_op(stats.misses, ==, 1);
+
+	/* without nameservers, stale answers are served as they are */
+	tt_assert(!evdns_base_set_option(dns, "cache-prefetch", "0"));
+	evdns_base_clear_nameservers_and_suspend(dns);
+	evutil_usleep_(&tv);
+	memset(&r, 0, sizeof(r));
+	n_replies_left = 1;
+	evdns_base_resolve_ipv4(dns, "host2.b.example.com", DNS_NO_SEARCH,
+	    generic_dns_callback, &r);
+	event_base_dispatch(base);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	tt_int_op(r.ttl, ==, 30);
+	evdns_base_get_cache_stats(dns, &stats);
+	tt_int_op(stats.stale_hits, ==, 2);
+	tt_int_op(stats.refreshes, ==, 2);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+
+	regress_clean_dnsserver();
+}
+
+static void
+dns_coalesce_test(void *arg)
+{
+	struct regress_dns_server_table table[ARRAY_SIZE(search_table)];
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_base *dns = NULL;
+	struct evdns_request *req;
+	ev_uint16_t portnum = 0;
+	char buf[64];
+	struct generic_dns_callback_result r[5];
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(table); ++i)
+		table[i] = search_table[i];
+
+	tt_assert(regress_dnsserver(base, &portnum, table));
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)portnum);
+
+	dns = evdns_base_new(base, 0);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+
+	evdns_base_search_add(dns, "a.example.com");
+	evdns_base_search_add(dns, "b.example.com");
+	evdns_base_search_add(dns, "c.example.com");
+
+	memset(r, 0, sizeof(r));
+	exit_base = base;
+	n_replies_left = ARRAY_SIZE(r);
+	req = evdns_base_resolve_ipv4(dns, "host2", 0,
+	    generic_dns_callback, &r[0]);
+	tt_assert(req);
+	for (i = 1; i < 4; ++i)
+		evdns_base_resolve_ipv4(dns, "host2", 0,
+		    generic_dns_callback, &r[i]);
+	evdns_base_resolve_ipv4(dns, "HOST2.b.example.com.", DNS_NO_SEARCH,
+	    generic_dns_callback, &r[4]);
+	/* the others keep waiting for the request that was sent */
+	evdns_cancel_request(dns, req);
+	event_base_dispatch(base);
+
+	tt_int_op(r[0].result, ==, DNS_ERR_CANCEL);
+	for (i = 1; i < ARRAY_SIZE(r); ++i) {
+		tt_int_op(r[i].result, ==, DNS_ERR_NONE);
+		tt_int_op(r[i].type, ==, DNS_IPv4_A);
+		tt_int_op(r[i].count, ==, 1);
+		tt_int_op(((ev_uint32_t*)r[i].addrs)[0], ==,
+		    htonl(0xc8640064));
+	}
+	/* each name went out once */
+	tt_int_op(table[5].seen, ==, 1);
+	tt_int_op(table[4].seen, ==, 1);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+
+	regress_clean_dnsserver();
+}
+
+struct tcp_test_port {
+	int n_requests;
+	ev_uint16_t last_client_port;
+};
+
+static void
+tcp_test_server_cb(struct evdns_server_request *req, void *arg)
+{
+	struct tcp_test_port *p = arg;
+	const char *name = req->questions[0]->name;
+	struct sockaddr_in sin;
+	ev_uint32_t addr;
+	int i, n;
+
+	++p->n_requests;
+	if (evdns_server_request_get_requesting_addr(req,
+		(struct sockaddr *)&sin, sizeof(sin)) > 0)
+		p->last_client_port = ntohs(sin.sin_port);
+
+	/* more than fit in 512 bytes */
+	n = !evutil_ascii_strcasecmp(name, "large.example.com") ? 40 : 1;
+	for (i = 0; i < n; ++i) {
+		addr = htonl(0x0a000000 + i);
+		evdns_server_request_add_a_reply(req, name, 1, &addr, 100);
+	}
+	evdns_server_request_respond(req, 0);
+}
+
+static void
+dns_tcp_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_base *dns = NULL;
+	struct evdns_server_port *udp_port = NULL, *tcp_port = NULL;
+	struct evconnlistener *listener;
+	struct tcp_test_port udp, tcp;
+	struct sockaddr_in sin;
+	struct timeval tv = { 0, 300000 };
+	ev_uint16_t portnum = 0, client_port;
+	char buf[64];
+	struct generic_dns_callback_result r[3];
+	size_t i;
+
+	memset(&udp, 0, sizeof(udp));
+	memset(&tcp, 0, sizeof(tcp));
+	udp_port = regress_get_dnsserver(base, &portnum, NULL,
+	    tcp_test_server_cb, &udp);
+	tt_assert(udp_port);
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(portnum);
+	sin.sin_addr.s_addr = htonl(0x7f000001);
+	listener = evconnlistener_new_bind(base, NULL, NULL,
+	    LEV_OPT_CLOSE_ON_FREE|LEV_OPT_REUSEABLE, -1,
+	    (struct sockaddr *)&sin, sizeof(sin));
+	tt_assert(listener);
+	tcp_port = evdns_add_server_port_with_listener(base, listener, 0,
+	    tcp_test_server_cb, &tcp);
+	tt_assert(tcp_port);
+
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)portnum);
+	dns = evdns_base_new(base, 0);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+	tt_assert(!evdns_base_set_option(dns, "tcp-idle-timeout", "0.1"));
+
+	exit_base = base;
+
+	/* a truncated reply is asked for again over TCP */
+	memset(r, 0, sizeof(r));
+	n_replies_left = 1;
+	evdns_base_resolve_ipv4(dns, "large.example.com", DNS_QUERY_NO_SEARCH,
+	    generic_dns_callback, &r[0]);
+	event_base_dispatch(base);
+	tt_int_op(r[0].result, ==, DNS_ERR_NONE);
+	tt_int_op(r[0].count, ==, 32);
+	tt_int_op(udp.n_requests, ==, 1);
+	tt_int_op(tcp.n_requests, ==, 1);
+	client_port = tcp.last_client_port;
+
+	/* unless it does not matter; those that want the whole answer do
+	 * not wait for such a request */
+	memset(r, 0, sizeof(r));
+	n_replies_left = 2;
+	evdns_base_resolve_ipv4(dns, "large.example.com",
+	    DNS_QUERY_NO_SEARCH|DNS_QUERY_IGNTC, generic_dns_callback, &r[0]);
+	evdns_base_resolve_ipv4(dns, "large.example.com",
+	    DNS_QUERY_NO_SEARCH, generic_dns_callback, &r[1]);
+	event_base_dispatch(base);
+	tt_int_op(r[0].result, ==, DNS_ERR_NONE);
+	tt_int_op(r[0].count, >, 0);
+	tt_int_op(r[0].count, <, 32);
+	tt_int_op(r[1].result, ==, DNS_ERR_NONE);
+	tt_int_op(r[1].count, ==, 32);
+	tt_int_op(udp.n_requests, ==, 3);
+	tt_int_op(tcp.n_requests, ==, 2);
+
+	/* nor is a truncated answer cached */
+	tt_assert(!evdns_base_set_option(dns, "cache-size", "16"));
+	n_replies_left = 1;
+	evdns_base_resolve_ipv4(dns, "large.example.com",
+	    DNS_QUERY_NO_SEARCH|DNS_QUERY_IGNTC, generic_dns_callback, &r[0]);
+	event_base_dispatch(base);
+	tt_int_op(r[0].count, <, 32);
+	n_replies_left = 1;
+	evdns_base_resolve_ipv4(dns, "large.example.com", DNS_QUERY_NO_SEARCH,
+	    generic_dns_callback, &r[1]);
+	event_base_dispatch(base);
+	tt_int_op(r[1].result, ==, DNS_ERR_NONE);
+	tt_int_op(r[1].count, ==, 32);
+	tt_int_op(udp.n_requests, ==, 5);
+	tt_int_op(tcp.n_requests, ==, 3);
+
+	/* requests share the connection */
+	memset(r, 0, sizeof(r));
+	n_replies_left = ARRAY_SIZE(r);
+	for (i = 0; i < ARRAY_SIZE(r); ++i) {
+		evutil_snprintf(buf, sizeof(buf), "small%d.example.com", (int)i);
+		evdns_base_resolve_ipv4(dns, buf,
+		    DNS_QUERY_NO_SEARCH|DNS_QUERY_USEVC,
+		    generic_dns_callback, &r[i]);
+	}
+	event_base_dispatch(base);
+	for (i = 0; i < ARRAY_SIZE(r); ++i) {
+		tt_int_op(r[i].result, ==, DNS_ERR_NONE);
+		tt_int_op(r[i].count, ==, 1);
+	}
+	tt_int_op(udp.n_requests, ==, 5);
+	tt_int_op(tcp.n_requests, ==, 6);
+	tt_int_op(tcp.last_client_port, ==, client_port);
+
+	/* and it is closed once idle */
+	event_base_loopexit(base, &tv);
+	event_base_dispatch(base);
+	tt_assert(!evdns_base_set_option(dns, "use-vc", "1"));
+	n_replies_left = 1;
+	evdns_base_resolve_ipv4(dns, "small.example.com", DNS_QUERY_NO_SEARCH,
+	    generic_dns_callback, &r[0]);
+	event_base_dispatch(base);
+	tt_int_op(r[0].result, ==, DNS_ERR_NONE);
+	tt_int_op(udp.n_requests, ==, 5);
+	tt_int_op(tcp.n_requests, ==, 7);
+	tt_int_op(tcp.last_client_port, !=, client_port);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (tcp_port)
+		evdns_close_server_port(tcp_port);
+	if (udp_port)
+		evdns_close_server_port(udp_port);
+}
+
+struct latency_test_port {
+	struct event_base *base;
+	int n_requests;
+	int delay_msec;
+	int delay_all;  /* or only the names that start with "slow" */
+};
+
+static void
+latency_test_respond(evutil_socket_t fd, short what, void *arg)
+{
+	struct evdns_server_request *req = arg;
+	ev_uint32_t addr = htonl(0x0a000001);
+	(void)fd;
+	(void)what;
+
+	evdns_server_request_add_a_reply(req, req->questions[0]->name, 1,
+	    &addr, 100);
+	evdns_server_request_respond(req, 0);
+}
+
+static void
+latency_test_server_cb(struct evdns_server_request *req, void *arg)
+{
+	struct latency_test_port *p = arg;
+	struct timeval tv;
+
+	++p->n_requests;
+	if (p->delay_all || !evutil_ascii_strncasecmp(req->questions[0]->name, "slow", 4)) {
+		tv.tv_sec = 0;
+		tv.tv_usec = p->delay_msec * 1000;
+		event_base_once(p->base, -1, EV_TIMEOUT, latency_test_respond,
+		    req, &tv);
+	} else {
+		latency_test_respond(-1, 0, req);
+	}
+}
+
+static void
+dns_nameserver_latency_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_base *dns = NULL;
+	struct evdns_server_port *port_a = NULL, *port_b = NULL;
+	struct latency_test_port a, b;
+	struct generic_dns_callback_result r;
+	struct timeval start, end, tv = { 0, 400000 };
+	ev_uint16_t portnum_a = 0, portnum_b = 0;
+	char buf[64];
+	int i;
+
+	memset(&a, 0, sizeof(a));
+	memset(&b, 0, sizeof(b));
+	a.base = b.base = base;
+	a.delay_msec = 50;
+	a.delay_all = 1;
+	port_a = regress_get_dnsserver(base, &portnum_a, NULL,
+	    latency_test_server_cb, &a);
+	port_b = regress_get_dnsserver(base, &portnum_b, NULL,
+	    latency_test_server_cb, &b);
+	tt_assert(port_a);
+	tt_assert(port_b);
+
+	/* the slow nameserver is left alone once it is known to be slow */
+	dns = evdns_base_new(base, 0);
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)portnum_a);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)portnum_b);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+	tt_assert(!evdns_base_set_option(dns, "select-fastest", "1"));
+
+	exit_base = base;
+	for (i = 0; i < 10; ++i) {
+		evutil_snprintf(buf, sizeof(buf), "q%d.example.com", i);
+		n_replies_left = 1;
+		evdns_base_resolve_ipv4(dns, buf, DNS_QUERY_NO_SEARCH,
+		    generic_dns_callback, &r);
+		event_base_dispatch(base);
+		tt_int_op(r.result, ==, DNS_ERR_NONE);
+	}
+	tt_int_op(a.n_requests, <=, 2);
+	tt_int_op(b.n_requests, >=, 8);
+	evdns_base_free(dns, 0);
+
+	/* a slow reply is not waited for */
+	a.n_requests = b.n_requests = 0;
+	a.delay_msec = 300;
+	a.delay_all = 0;
+	dns = evdns_base_new(base, 0);
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)portnum_a);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)portnum_b);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+	tt_assert(!evdns_base_set_option(dns, "hedge", "1"));
+
+	/* one request to each, in turn */
+	for (i = 0; i < 2; ++i) {
+		evutil_snprintf(buf, sizeof(buf), "fast%d.example.com", i);
+		n_replies_left = 1;
+		evdns_base_resolve_ipv4(dns, buf, DNS_QUERY_NO_SEARCH,
+		    generic_dns_callback, &r);
+		event_base_dispatch(base);
+		tt_int_op(r.result, ==, DNS_ERR_NONE);
+	}
+	tt_int_op(a.n_requests, ==, 1);
+	tt_int_op(b.n_requests, ==, 1);
+
+	evutil_gettimeofday(&start, NULL);
+	n_replies_left = 1;
+	evdns_base_resolve_ipv4(dns, "slow.example.com", DNS_QUERY_NO_SEARCH,
+	    generic_dns_callback, &r);
+	event_base_dispatch(base);
+	evutil_gettimeofday(&end, NULL);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	tt_int_op(a.n_requests, ==, 2);
+	tt_int_op(b.n_requests, ==, 2);
+	evutil_timersub(&end, &start, &end);
+	tt_int_op(end.tv_sec, ==, 0);
+	tt_int_op(end.tv_usec, <, 200000);
+
+	/* let the late reply go out */
+	event_base_loopexit(base, &tv);
+	event_base_dispatch(base);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (port_a)
+		evdns_close_server_port(port_a);
+	if (port_b)
+		evdns_close_server_port(port_b);
+}
+
+/* once dropping, only counts the requests that are not probes */
+static int hedge_probe_dropping;
+
+static void
+hedge_probe_server_cb(struct evdns_server_request *req, void *arg)
+{
+	struct latency_test_port *p = arg;
+
+	if (!hedge_probe_dropping) {
+		latency_test_server_cb(req, arg);
+		return;
+	}
+	if (evutil_ascii_strcasecmp(req->questions[0]->name, "google.com"))
+		++p->n_requests;
+	evdns_server_request_drop(req);
+}
+
+static void
+dns_hedge_probe_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_base *dns = NULL;
+	struct evdns_server_port *ports[3] = { NULL, NULL, NULL };
+	struct latency_test_port p[3];
+	struct generic_dns_callback_result r;
+	struct timeval tv = { 1, 0 };
+	ev_uint16_t portnum;
+	char buf[64];
+	int i;
+
+	memset(p, 0, sizeof(p));
+	hedge_probe_dropping = 0;
+	dns = evdns_base_new(base, 0);
+	tt_assert(dns);
+	for (i = 0; i < 3; ++i) {
+		p[i].base = base;
+		portnum = 0;
+		ports[i] = regress_get_dnsserver(base, &portnum, NULL,
+		    i ? latency_test_server_cb : hedge_probe_server_cb, &p[i]);
+		tt_assert(ports[i]);
+		evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)portnum);
+		tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+	}
+	tt_assert(!evdns_base_set_option(dns, "timeout", "0.2"));
+	tt_assert(!evdns_base_set_option(dns, "attempts", "1"));
+	tt_assert(!evdns_base_set_option(dns, "initial-probe-timeout", "0.1"));
+
+	/* the first nameserver is fast, and then goes down */
+	exit_base = base;
+	for (i = 0; i < 6; ++i) {
+		evutil_snprintf(buf, sizeof(buf), "up%d.example.com", i);
+		n_replies_left = 1;
+		evdns_base_resolve_ipv4(dns, buf, DNS_QUERY_NO_SEARCH,
+		    generic_dns_callback, &r);
+		event_base_dispatch(base);
+		tt_int_op(r.result, ==, DNS_ERR_NONE);
+	}
+	tt_int_op(p[0].n_requests, >, 0);
+	hedge_probe_dropping = 1;
+	p[0].n_requests = 0;
+	for (i = 0; i < 3; ++i) {
+		evutil_snprintf(buf, sizeof(buf), "down%d.example.com", i);
+		n_replies_left = 1;
+		evdns_base_resolve_ipv4(dns, buf, DNS_QUERY_NO_SEARCH,
+		    generic_dns_callback, &r);
+		event_base_dispatch(base);
+		if (r.result == DNS_ERR_TIMEOUT)
+			break;
+		tt_int_op(r.result, ==, DNS_ERR_NONE);
+	}
+	tt_int_op(r.result, ==, DNS_ERR_TIMEOUT);
+	tt_int_op(p[0].n_requests, ==, 1);
+
+	/* a probe that is not answered is not hedged to the other two, so
+	 * their replies do not bring the nameserver back */
+	tt_assert(!evdns_base_set_option(dns, "hedge", "1"));
+	tt_assert(!evdns_base_set_option(dns, "timeout", "5"));
+	event_base_loopexit(base, &tv);
+	event_base_dispatch(base);
+
+	p[0].n_requests = 0;
+	for (i = 0; i < 6; ++i) {
+		evutil_snprintf(buf, sizeof(buf), "still%d.example.com", i);
+		n_replies_left = 1;
+		evdns_base_resolve_ipv4(dns, buf, DNS_QUERY_NO_SEARCH,
+		    generic_dns_callback, &r);
+		event_base_dispatch(base);
+		tt_int_op(r.result, ==, DNS_ERR_NONE);
+	}
+	tt_int_op(p[0].n_requests, ==, 0);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+	for (i = 0; i < 3; ++i)
+		if (ports[i])
+			evdns_close_server_port(ports[i]);
+}
+
+static void
+udp_batch_server_cb(struct evdns_server_request *req, void *arg)
+{
+	int *n_requests = arg;
+	ev_uint32_t addr = htonl(0x7f000001UL);
+
+	++*n_requests;
+	evdns_server_request_add_a_reply(req, req->questions[0]->name,
+	    1, &addr, 60);
+	evdns_server_request_respond(req, 0);
+}
+
+static int udp_batch_n_answers;
+
+static void
+udp_batch_dns_callback(int result, char type, int count, int ttl,
+    void *addresses, void *arg)
+{
+	struct event_base *base = arg;
+
+	if (result == DNS_ERR_NONE && type == DNS_IPv4_A && count == 1)
+		++udp_batch_n_answers;
+	if (--n_replies_left == 0)
+		event_base_loopexit(base, NULL);
+}
+
+static void
+dns_udp_batch_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_base *dns = NULL;
+	struct evdns_server_port *port = NULL;
+	ev_uint16_t portnum = 0;
+	int n_requests = 0;
+	char buf[64];
+	int i;
+
+	port = regress_get_dnsserver(base, &portnum, NULL,
+	    udp_batch_server_cb, &n_requests);
+	tt_assert(port);
+	tt_int_op(evdns_server_port_set_option(port,
+		EVDNS_SOPT_UDP_BATCH_SIZE, 0), ==, -1);
+	tt_int_op(evdns_server_port_set_option(port,
+		EVDNS_SOPT_UDP_BATCH_SIZE, 65), ==, -1);
+	tt_int_op(evdns_server_port_set_option(port,
+		EVDNS_SOPT_TCP_IDLE_TIMEOUT, 5), ==, -1);
+	tt_int_op(evdns_server_port_set_option(port,
+		EVDNS_SOPT_UDP_BATCH_SIZE, 16), ==, 0);
+
+	dns = evdns_base_new(base, 0);
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)portnum);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+	tt_assert(!evdns_base_set_option(dns, "udp-batch-size", "8"));
+	tt_assert(!evdns_base_set_option(dns, "max-inflight", "100"));
+
+	/* more queries at once than fit in one batch on either side */
+	n_replies_left = 100;
+	for (i = 0; i < 100; ++i) {
+		evutil_snprintf(buf, sizeof(buf), "q%d.example.com", i);
+		tt_assert(evdns_base_resolve_ipv4(dns, buf, DNS_QUERY_NO_SEARCH,
+		    udp_batch_dns_callback, base));
+	}
+	event_base_dispatch(base);
+	tt_int_op(udp_batch_n_answers, ==, 100);
+	tt_int_op(n_requests, ==, 100);
+
+	/* and back to one at a time */
+	tt_assert(!evdns_base_set_option(dns, "udp-batch-size", "1"));
+	tt_int_op(evdns_server_port_set_option(port,
+		EVDNS_SOPT_UDP_BATCH_SIZE, 1), ==, 0);
+	n_replies_left = 1;
+	tt_assert(evdns_base_resolve_ipv4(dns, "last.example.com",
+	    DNS_QUERY_NO_SEARCH, udp_batch_dns_callback, base));
+	event_base_dispatch(base);
+	tt_int_op(udp_batch_n_answers, ==, 101);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (port)
+		evdns_close_server_port(port);
+}
+
+struct udp_sockets_test_ports {
+	int n;
+	ev_uint16_t ports[8];
+};
+
+static void
+udp_sockets_server_cb(struct evdns_server_request *req, void *arg)
+{
+	struct udp_sockets_test_ports *p = arg;
+	struct sockaddr_in sin;
+	ev_uint32_t addr = htonl(0x7f000001UL);
+	int i;
+
+	if (evdns_server_request_get_requesting_addr(req,
+		(struct sockaddr *)&sin, sizeof(sin)) == (int)sizeof(sin)) {
+		for (i = 0; i < p->n; ++i)
+			if (p->ports[i] == sin.sin_port)
+				break;
+		if (i == p->n && p->n < 8)
+			p->ports[p->n++] = sin.sin_port;
+	}
+	evdns_server_request_add_a_reply(req, req->questions[0]->name,
+	    1, &addr, 60);
+	evdns_server_request_respond(req, 0);
+}
+
+static void
+dns_udp_sockets_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_base *dns = NULL;
+	struct evdns_server_port *port = NULL;
+	struct udp_sockets_test_ports ports;
+	ev_uint16_t portnum = 0;
+	char buf[64];
+	int i;
+
+	memset(&ports, 0, sizeof(ports));
+	port = regress_get_dnsserver(base, &portnum, NULL,
+	    udp_sockets_server_cb, &ports);
+	tt_assert(port);
+
+	dns = evdns_base_new(base, 0);
+	tt_assert(!evdns_base_set_option(dns, "udp-sockets", "4"));
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)portnum);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+
+	/* the queries go out from several ports, and all are answered */
+	udp_batch_n_answers = 0;
+	n_replies_left = 40;
+	for (i = 0; i < 40; ++i) {
+		evutil_snprintf(buf, sizeof(buf), "q%d.example.com", i);
+		tt_assert(evdns_base_resolve_ipv4(dns, buf, DNS_QUERY_NO_SEARCH,
+		    udp_batch_dns_callback, base));
+	}
+	event_base_dispatch(base);
+	tt_int_op(udp_batch_n_answers, ==, 40);
+	tt_int_op(ports.n, ==, 4);
+
+	/* the same, with the queries to each socket sent together */
+	tt_assert(!evdns_base_set_option(dns, "udp-batch-size", "8"));
+	udp_batch_n_answers = 0;
+	n_replies_left = 40;
+	for (i = 0; i < 40; ++i) {
+		evutil_snprintf(buf, sizeof(buf), "b%d.example.com", i);
+		tt_assert(evdns_base_resolve_ipv4(dns, buf, DNS_QUERY_NO_SEARCH,
+		    udp_batch_dns_callback, base));
+	}
+	event_base_dispatch(base);
+	tt_int_op(udp_batch_n_answers, ==, 40);
+	tt_int_op(ports.n, ==, 4);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (port)
+		evdns_close_server_port(port);
+}
+
+static int search_negative_n_requests = 0;
+
+static void
+search_negative_server_cb(struct evdns_server_request *req, void *arg)
+{
+	const char *name = req->questions[0]->name;
+	const char *suffix = ".a.example.com";
+	size_t len = strlen(name), slen = strlen(suffix);
+	ev_uint32_t addr = htonl(0x7f000001UL);
+
+	++search_negative_n_requests;
+	if (len > slen && !evutil_ascii_strcasecmp(name + len - slen, suffix)) {
+		evdns_server_request_respond(req, DNS_ERR_NOTEXIST);
+		return;
+	}
+	evdns_server_request_add_a_reply(req, name, 1, &addr, 60);
+	evdns_server_request_respond(req, 0);
+}
+
+static void
+dns_search_negative_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_base *dns = NULL;
+	struct evdns_server_port *port = NULL;
+	ev_uint16_t portnum = 0;
+	char buf[64];
+	/* the second one is longer than HOST_NAME_MAX on some systems */
+	static const char *names[] = {
+		"host",
+		"a-host-with-a-name-that-is-as-long-as-a-label-may-get-to-be"
+		".example"
+	};
+	size_t j;
+	int i;
+
+	port = regress_get_dnsserver(base, &portnum, NULL,
+	    search_negative_server_cb, NULL);
+	tt_assert(port);
+
+	dns = evdns_base_new(base, 0);
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)portnum);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+	evdns_base_search_add(dns, "a.example.com");
+	tt_assert(!evdns_base_set_option(dns, "search-negative-ttl", "60"));
+	tt_assert(!evdns_base_set_option(dns, "ndots", "2"));
+
+	/* the first lookup tries the search domain, later ones skip it */
+	for (j = 0; j < ARRAY_SIZE(names); ++j) {
+		for (i = 0; i < 3; ++i) {
+			search_negative_n_requests = 0;
+			udp_batch_n_answers = 0;
+			n_replies_left = 1;
+			tt_assert(evdns_base_resolve_ipv4(dns, names[j], 0,
+			    udp_batch_dns_callback, base));
+			event_base_dispatch(base);
+			tt_int_op(udp_batch_n_answers, ==, 1);
+			tt_int_op(search_negative_n_requests, ==, i ? 1 : 2);
+		}
+	}
+
+	/* changing the search list forgets the misses */
+	evdns_base_search_clear(dns);
+	evdns_base_search_add(dns, "a.example.com");
+	search_negative_n_requests = 0;
+	udp_batch_n_answers = 0;
+	n_replies_left = 1;
+	tt_assert(evdns_base_resolve_ipv4(dns, "HOST", 0,
+	    udp_batch_dns_callback, base));
+	event_base_dispatch(base);
+	tt_int_op(udp_batch_n_answers, ==, 1);
+	tt_int_op(search_negative_n_requests, ==, 2);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (port)
+		evdns_close_server_port(port);
+}
+
+static void
+dns_server_zone_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_base *dns = NULL;
+	struct evdns_server_port *udp_port = NULL, *tcp_port = NULL;
+	struct evdns_zone *zone = NULL;
+	struct evconnlistener *listener;
+	struct tcp_test_port udp, tcp;
+	struct sockaddr_in sin;
+	ev_uint16_t portnum = 0;
+	ev_uint32_t addr;
+	char buf[64];
+	struct generic_dns_callback_result r;
+	int i;
+
+	memset(&udp, 0, sizeof(udp));
+	memset(&tcp, 0, sizeof(tcp));
+	udp_port = regress_get_dnsserver(base, &portnum, NULL,
+	    tcp_test_server_cb, &udp);
+	tt_assert(udp_port);
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(portnum);
+	sin.sin_addr.s_addr = htonl(0x7f000001);
+	listener = evconnlistener_new_bind(base, NULL, NULL,
+	    LEV_OPT_CLOSE_ON_FREE|LEV_OPT_REUSEABLE, -1,
+	    (struct sockaddr *)&sin, sizeof(sin));
+	tt_assert(listener);
+	tcp_port = evdns_add_server_port_with_listener(base, listener, 0,
+	    tcp_test_server_cb, &tcp);
+	tt_assert(tcp_port);
+
+	zone = evdns_zone_new();
+	tt_assert(zone);
+	for (i = 1; i <= 2; ++i) {
+		addr = htonl(0x0a000000 + i);
+		tt_assert(!evdns_zone_add_record(zone, "www.Example.com",
+			EVDNS_TYPE_A, EVDNS_CLASS_INET, 300, 4, 0,
+			(const char *)&addr));
+	}
+	tt_assert(!evdns_zone_add_record(zone, "alias.example.com",
+		EVDNS_TYPE_CNAME, EVDNS_CLASS_INET, 300, -1, 1,
+		"www.example.com"));
+	for (i = 0; i < 10; ++i) {
+		evutil_snprintf(buf, sizeof(buf), "b%d.example.com", i);
+		addr = htonl(0x0c000000 + i);
+		tt_assert(!evdns_zone_add_record(zone, buf, EVDNS_TYPE_A,
+			EVDNS_CLASS_INET, 300, 4, 0, (const char *)&addr));
+	}
+	/* more than fit in 512 bytes */
+	for (i = 0; i < 40; ++i) {
+		addr = htonl(0x0b000000 + i);
+		tt_assert(!evdns_zone_add_record(zone, "large.example.com.",
+			EVDNS_TYPE_A, EVDNS_CLASS_INET, 300, 4, 0,
+			(const char *)&addr));
+	}
+	evdns_server_port_set_zone(udp_port, zone);
+	evdns_server_port_set_zone(tcp_port, zone);
+
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)portnum);
+	dns = evdns_base_new(base, 0);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+	exit_base = base;
+
+	/* the records of the zone, in order, without the callback */
+	memset(&r, 0, sizeof(r));
+	n_replies_left = 1;
+	evdns_base_resolve_ipv4(dns, "WWW.example.COM", DNS_QUERY_NO_SEARCH,
+	    generic_dns_callback, &r);
+	event_base_dispatch(base);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	tt_int_op(r.count, ==, 2);
+	tt_int_op(r.ttl, ==, 300);
+	tt_int_op(((ev_uint32_t *)r.addrs)[0], ==, htonl(0x0a000001));
+	tt_int_op(((ev_uint32_t *)r.addrs)[1], ==, htonl(0x0a000002));
+
+	/* names of the zone without the type asked for */
+	memset(&r, 0, sizeof(r));
+	n_replies_left = 1;
+	evdns_base_resolve_ipv6(dns, "www.example.com", DNS_QUERY_NO_SEARCH,
+	    generic_dns_callback, &r);
+	event_base_dispatch(base);
+	tt_int_op(r.result, ==, DNS_ERR_NODATA);
+	memset(&r, 0, sizeof(r));
+	n_replies_left = 1;
+	evdns_base_resolve_ipv4(dns, "alias.example.com", DNS_QUERY_NO_SEARCH,
+	    generic_dns_callback, &r);
+	event_base_dispatch(base);
+	tt_int_op(r.result, ==, DNS_ERR_NODATA);
+	tt_int_op(udp.n_requests, ==, 0);
+
+	/* a truncated reply, and the whole of it over TCP */
+	memset(&r, 0, sizeof(r));
+	n_replies_left = 1;
+	evdns_base_resolve_ipv4(dns, "large.example.com", DNS_QUERY_NO_SEARCH,
+	    generic_dns_callback, &r);
+	event_base_dispatch(base);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	tt_int_op(r.count, ==, 32);
+	tt_int_op(udp.n_requests, ==, 0);
+	tt_int_op(tcp.n_requests, ==, 0);
+
+	/* the other names go to the callback */
+	memset(&r, 0, sizeof(r));
+	n_replies_left = 1;
+	evdns_base_resolve_ipv4(dns, "other.example.com", DNS_QUERY_NO_SEARCH,
+	    generic_dns_callback, &r);
+	event_base_dispatch(base);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	tt_int_op(r.count, ==, 1);
+	tt_int_op(udp.n_requests, ==, 1);
+
+	/* replies to requests read together go out together */
+	tt_assert(!evdns_server_port_set_option(udp_port,
+		EVDNS_SOPT_UDP_BATCH_SIZE, 8));
+	udp_batch_n_answers = 0;
+	n_replies_left = 10;
+	for (i = 0; i < 10; ++i) {
+		evutil_snprintf(buf, sizeof(buf), "b%d.example.com", i);
+		tt_assert(evdns_base_resolve_ipv4(dns, buf, DNS_QUERY_NO_SEARCH,
+		    udp_batch_dns_callback, base));
+	}
+	event_base_dispatch(base);
+	tt_int_op(udp_batch_n_answers, ==, 10);
+	tt_int_op(udp.n_requests, ==, 1);
+
+	/* and all of them without the zone */
+	evdns_server_port_set_zone(udp_port, NULL);
+	memset(&r, 0, sizeof(r));
+	n_replies_left = 1;
+	evdns_base_resolve_ipv4(dns, "www.example.com", DNS_QUERY_NO_SEARCH,
+	    generic_dns_callback, &r);
+	event_base_dispatch(base);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	tt_int_op(r.count, ==, 1);
+	tt_int_op(udp.n_requests, ==, 2);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (tcp_port)
+		evdns_close_server_port(tcp_port);
+	if (udp_port)
+		evdns_close_server_port(udp_port);
+	if (zone)
+		evdns_zone_free(zone);
+}
+
 static void dns_search_test(void *arg) { dns_search_test_impl(arg, 0); }
 static void dns_search_lower_test(void *arg) { dns_search_test_impl(arg, 1); }
 
@@ -1439,6 +2487,124 @@ cancel_gai_cb(evutil_socket_t fd, short what, void *ptr)
 	evdns_getaddrinfo_cancel(r);
 }
 
+static void
+test_getaddrinfo_cache(void *arg)
+{
+	struct regress_dns_server_table table[ARRAY_SIZE(search_table)];
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_base *dns = NULL;
+	struct evutil_addrinfo hints;
+	struct gai_outcome out;
+	ev_uint16_t portnum = 0;
+	char buf[64];
+	size_t i;
+	int round;
+
+	memset(&out, 0, sizeof(out));
+	for (i = 0; i < ARRAY_SIZE(table); ++i)
+		table[i] = search_table[i];
+
+	tt_assert(regress_dnsserver(base, &portnum, table));
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)portnum);
+
+	dns = evdns_base_new(base, 0);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+	tt_assert(!evdns_base_set_option(dns, "cache-size", "16"));
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = EVUTIL_AI_CANONNAME;
+	exit_base_on_no_pending_results = base;
+	for (round = 0; round < 2; ++round) {
+		n_gai_results_pending = 1;
+		tt_assert(evdns_getaddrinfo(dns, "host2.b.example.com", "80",
+			&hints, gai_cb, &out));
+		event_base_dispatch(base);
+		tt_int_op(out.err, ==, 0);
+		tt_assert(out.ai);
+		test_ai_eq(out.ai, "200.100.0.100:80", SOCK_STREAM, IPPROTO_TCP);
+		evutil_freeaddrinfo(out.ai);
+		out.ai = NULL;
+	}
+	tt_int_op(table[4].seen, ==, 1);
+
+end:
+	if (out.ai)
+		evutil_freeaddrinfo(out.ai);
+	if (dns)
+		evdns_base_free(dns, 0);
+	exit_base_on_no_pending_results = NULL;
+	regress_clean_dnsserver();
+}
+
+static void
+test_getaddrinfo_coalesce_cname(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_base *dns = NULL;
+	struct evdns_server_port *port = NULL;
+	struct evdns_getaddrinfo_request *r;
+	struct evutil_addrinfo hints;
+	struct gai_outcome out[3];
+	ev_uint16_t portnum = 0;
+	int n_dns_questions = 0;
+	char buf[64];
+	size_t i;
+
+	memset(out, 0, sizeof(out));
+	port = regress_get_dnsserver(base, &portnum, NULL,
+	    be_getaddrinfo_server_cb, &n_dns_questions);
+	tt_assert(port);
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)portnum);
+
+	dns = evdns_base_new(base, 0);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = EVUTIL_AI_CANONNAME;
+	r = evdns_getaddrinfo(dns, "both.example.com", "80",
+	    &hints, gai_cb, &out[0]);
+	tt_assert(r);
+	tt_assert(evdns_getaddrinfo(dns, "both.example.com", "80",
+		&hints, gai_cb, &out[1]));
+	/* the first waiter, which takes over the request, does not want
+	 * the canonical name */
+	hints.ai_flags = 0;
+	tt_assert(evdns_getaddrinfo(dns, "both.example.com", "80",
+		&hints, gai_cb, &out[2]));
+	evdns_getaddrinfo_cancel(r);
+
+	n_gai_results_pending = 3;
+	exit_base_on_no_pending_results = base;
+	event_base_dispatch(base);
+
+	tt_int_op(out[0].err, ==, EVUTIL_EAI_CANCEL);
+	tt_int_op(out[1].err, ==, 0);
+	tt_assert(out[1].ai);
+	test_ai_eq(out[1].ai, "80.80.32.32:80", SOCK_STREAM, IPPROTO_TCP);
+	tt_str_op(out[1].ai->ai_canonname, ==, "both-canonical.example.com");
+	tt_int_op(out[2].err, ==, 0);
+	tt_assert(out[2].ai);
+	tt_assert(out[2].ai->ai_canonname == NULL);
+	tt_int_op(n_dns_questions, ==, 1);
+
+end:
+	for (i = 0; i < ARRAY_SIZE(out); ++i) {
+		if (out[i].ai)
+			evutil_freeaddrinfo(out[i].ai);
+	}
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (port)
+		evdns_close_server_port(port);
+	exit_base_on_no_pending_results = NULL;
+}
+
 static void
 test_getaddrinfo_async(void *arg)
 {
@@ -2375,6 +3541,103 @@ end:
 		evdns_base_free(dns_base, 0);
 }
 
+#ifndef _WIN32
+static void
+dns_hosts_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evdns_base *dns = NULL;
+	struct evutil_addrinfo hints, *ai;
+	struct gai_outcome outcome;
+	char fname[32];
+	char line[64];
+	FILE *f = NULL;
+	int fd = -1;
+	int i;
+
+	strcpy(fname, "/tmp/eventhosts.XXXXXX");
+	fd = mkstemp(fname);
+	tt_int_op(fd, >=, 0);
+	f = fdopen(fd, "w");
+	tt_assert(f);
+	fputs("10.0.0.1 Foo foo-alias # comment\n", f);
+	for (i = 0; i < 2000; ++i) {
+		evutil_snprintf(line, sizeof(line), "10.1.%d.%d host%d\n",
+		    i / 256, i % 256, i);
+		fputs(line, f);
+	}
+	fputs("10.0.0.2 foo\n::2 FOO\n", f);
+	/* longer than HOST_NAME_MAX on some platforms */
+	fputs("10.0.0.3 a-rather-long-host-name-that-is-still-valid."
+	    "Some-Subdomain.Of-Department.Example.com\n", f);
+	i = fclose(f);
+	f = NULL;
+	tt_int_op(i, ==, 0);
+
+	dns = evdns_base_new(data->base, 0);
+	tt_assert(dns);
+	tt_int_op(evdns_base_load_hosts(dns, fname), ==, 0);
+
+	n_gai_results_pending = 10000;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	/* every entry for a name, in file order, whatever the case */
+	memset(&outcome, 0, sizeof(outcome));
+	tt_ptr_op(evdns_getaddrinfo(dns, "fOo", "80", &hints, gai_cb,
+		&outcome), ==, NULL);
+	tt_int_op(outcome.err, ==, 0);
+	ai = outcome.ai;
+	tt_assert(ai);
+	test_ai_eq(ai, "10.0.0.1:80", SOCK_STREAM, IPPROTO_TCP);
+	tt_assert(ai = ai->ai_next);
+	test_ai_eq(ai, "10.0.0.2:80", SOCK_STREAM, IPPROTO_TCP);
+	tt_assert(ai = ai->ai_next);
+	test_ai_eq(ai, "[::2]:80", SOCK_STREAM, IPPROTO_TCP);
+	tt_ptr_op(ai->ai_next, ==, NULL);
+	evutil_freeaddrinfo(outcome.ai);
+
+	memset(&outcome, 0, sizeof(outcome));
+	tt_ptr_op(evdns_getaddrinfo(dns, "host1999", "80", &hints, gai_cb,
+		&outcome), ==, NULL);
+	tt_int_op(outcome.err, ==, 0);
+	tt_assert(outcome.ai);
+	test_ai_eq(outcome.ai, "10.1.7.207:80", SOCK_STREAM, IPPROTO_TCP);
+	tt_ptr_op(outcome.ai->ai_next, ==, NULL);
+	evutil_freeaddrinfo(outcome.ai);
+
+	memset(&outcome, 0, sizeof(outcome));
+	tt_ptr_op(evdns_getaddrinfo(dns, "foo-alias", "80", &hints, gai_cb,
+		&outcome), ==, NULL);
+	tt_int_op(outcome.err, ==, 0);
+	tt_assert(outcome.ai);
+	test_ai_eq(outcome.ai, "10.0.0.1:80", SOCK_STREAM, IPPROTO_TCP);
+	tt_ptr_op(outcome.ai->ai_next, ==, NULL);
+	evutil_freeaddrinfo(outcome.ai);
+	outcome.ai = NULL;
+
+	memset(&outcome, 0, sizeof(outcome));
+	tt_ptr_op(evdns_getaddrinfo(dns, "A-RATHER-LONG-HOST-NAME-THAT-IS-"
+		"still-valid.some-subdomain.of-department.example.com", "80",
+		&hints, gai_cb, &outcome), ==, NULL);
+	tt_int_op(outcome.err, ==, 0);
+	tt_assert(outcome.ai);
+	test_ai_eq(outcome.ai, "10.0.0.3:80", SOCK_STREAM, IPPROTO_TCP);
+	tt_ptr_op(outcome.ai->ai_next, ==, NULL);
+	evutil_freeaddrinfo(outcome.ai);
+	outcome.ai = NULL;
+
+end:
+	if (f)
+		fclose(f);
+	if (fd >= 0)
+		unlink(fname);
+	if (dns)
+		evdns_base_free(dns, 0);
+}
+#endif
+
 #define DNS_LEGACY(name, flags)					       \
 	{ #name, run_legacy_test_fn, flags|TT_LEGACY, &legacy_setup,   \
 		    dns_##name }
@@ -2388,6 +3651,21 @@ struct testcase_t dns_testcases[] = {
 	{ "search_empty", dns_search_empty_test, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
 	{ "search", dns_search_test, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
 	{ "search_lower", dns_search_lower_test, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "cache", dns_cache_test, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "cache_stale", dns_cache_stale_test, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "coalesce", dns_coalesce_test, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "tcp", dns_tcp_test, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "nameserver_latency", dns_nameserver_latency_test,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "hedge_probe", dns_hedge_probe_test,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "udp_batch", dns_udp_batch_test, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "udp_sockets", dns_udp_sockets_test, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "search_negative", dns_search_negative_test, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+#ifndef _WIN32
+	{ "hosts", dns_hosts_test, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+#endif
+	{ "server_zone", dns_server_zone_test, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
 	{ "search_cancel", dns_search_cancel_test,
 	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
 	{ "retry", dns_retry_test, TT_FORK|TT_NEED_BASE|TT_NO_LOGS, &basic_setup, NULL },
@@ -2419,6 +3697,10 @@ struct testcase_t dns_testcases[] = {
 
 	{ "getaddrinfo_async", test_getaddrinfo_async,
 	  TT_FORK|TT_NEED_BASE, &basic_setup, (char*)"" },
+	{ "getaddrinfo_cache", test_getaddrinfo_cache,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "getaddrinfo_coalesce_cname", test_getaddrinfo_coalesce_cname,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
 	{ "getaddrinfo_cancel_stress", test_getaddrinfo_async_cancel_stress,
 	  TT_FORK, NULL, NULL },
 
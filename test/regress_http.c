@@ -51,6 +51,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <stdarg.h>
 
 #include "event2/dns.h"
 
@@ -61,10 +62,12 @@
 #include "event2/bufferevent_ssl.h"
 #include "event2/util.h"
 #include "event2/listener.h"
+#include "event2/thread.h"
 #include "log-internal.h"
 #include "http-internal.h"
 #include "regress.h"
 #include "regress_testutils.h"
+#include "regress_thread.h"
 
 /* set if a test needs to call loopexit on a base */
 static struct event_base *exit_base;
@@ -2041,6 +2044,89 @@ http_virtual_host_test(void *arg)
 }
 
 
+static void
+http_date_header_cb(struct evhttp_request *req, void *arg)
+{
+	evhttp_add_header(evhttp_request_get_output_headers(req),
+	    "Date", "Thu, 01 Jan 1970 00:00:00 GMT");
+	evhttp_send_reply(req, HTTP_OK, "Everything is fine", NULL);
+}
+
+static char *date_header_value = NULL;
+
+static void
+http_date_header_done(struct evhttp_request *req, void *arg)
+{
+	struct evkeyvalq *headers;
+	struct evkeyval *header;
+	int ndates = 0;
+
+	tt_assert(req);
+	tt_int_op(evhttp_request_get_response_code(req), ==, HTTP_OK);
+
+	headers = evhttp_request_get_input_headers(req);
+	TAILQ_FOREACH(header, headers, next) {
+		if (!evutil_ascii_strcasecmp(header->key, "Date")) {
+			tt_want(date_header_value == NULL);
+			date_header_value = strdup(header->value);
+			++ndates;
+		}
+	}
+	tt_int_op(ndates, ==, 1);
+
+ end:
+	event_base_loopexit(arg, NULL);
+}
+
+static void
+http_date_header_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp_connection *evcon = NULL;
+	struct evhttp_request *req;
+	ev_uint16_t port = 0;
+	struct evhttp *http = http_setup(&port, data->base, 0);
+
+	evhttp_set_cb(http, "/date", http_date_header_cb, NULL);
+
+	evcon = evhttp_connection_base_new(data->base, NULL, "127.0.0.1", port);
+	tt_assert(evcon);
+
+	/* the server adds the current date */
+	req = evhttp_request_new(http_date_header_done, data->base);
+	evhttp_add_header(evhttp_request_get_output_headers(req),
+	    "Host", "somehost");
+	tt_int_op(evhttp_make_request(evcon, req, EVHTTP_REQ_GET, "/test"),
+	    ==, 0);
+	event_base_dispatch(data->base);
+
+	tt_assert(date_header_value);
+	tt_int_op(strlen(date_header_value), ==, 29);
+	tt_str_op(date_header_value + 25, ==, " GMT");
+	free(date_header_value);
+	date_header_value = NULL;
+
+	/* but keeps the one set by the handler */
+	req = evhttp_request_new(http_date_header_done, data->base);
+	evhttp_add_header(evhttp_request_get_output_headers(req),
+	    "Host", "somehost");
+	tt_int_op(evhttp_make_request(evcon, req, EVHTTP_REQ_GET, "/date"),
+	    ==, 0);
+	event_base_dispatch(data->base);
+
+	tt_str_op(date_header_value, ==, "Thu, 01 Jan 1970 00:00:00 GMT");
+
+	test_ok = 1;
+
+ end:
+	free(date_header_value);
+	date_header_value = NULL;
+	if (evcon)
+		evhttp_connection_free(evcon);
+	if (http)
+		evhttp_free(http);
+}
+
 /* test date header and content length */
 
 static void
@@ -2742,6 +2828,84 @@ end:
 	evhttp_clear_headers(&headers);
 }
 static void
+http_parse_headers_inplace_test(void *ptr)
+{
+	static const char response[] =
+	    "HTTP/1.1 200 OK\r\n"
+	    "Content-Type: text/plain\r\n"
+	    "X-Folded: a\r\n"
+	    "\tb\r\n"
+	    "\r\n"
+	    "body";
+	const size_t len = sizeof(response) - 1;
+	struct evhttp_request *req = NULL;
+	struct evbuffer *buf = NULL, *tmp = NULL;
+	struct evkeyvalq headers;
+	struct evkeyval *kv;
+	size_t split;
+
+	TAILQ_INIT(&headers);
+
+	/* lines are parsed in place, across chains and in read-only chains */
+	for (split = 0; split < len; ++split) {
+		buf = evbuffer_new();
+		tmp = evbuffer_new();
+		tt_assert(buf && tmp);
+		if (split == 0) {
+			evbuffer_add_reference(buf, response, len, NULL, NULL);
+		} else {
+			evbuffer_add(buf, response, split);
+			evbuffer_add(tmp, response + split, len - split);
+			evbuffer_add_buffer(buf, tmp);
+		}
+
+		req = evhttp_request_new(NULL, NULL);
+		tt_assert(req);
+		tt_int_op(evhttp_parse_firstline_(req, buf), ==, ALL_DATA_READ);
+		tt_int_op(evhttp_parse_headers_(req, buf), ==, ALL_DATA_READ);
+		tt_int_op(evhttp_request_get_response_code(req), ==, 200);
+		tt_str_op(evhttp_request_get_response_code_line(req), ==, "OK");
+		tt_want(validate_header(evhttp_request_get_input_headers(req),
+			"Content-Type", "text/plain") == 0);
+		tt_want(validate_header(evhttp_request_get_input_headers(req),
+			"X-Folded", "a b") == 0);
+		tt_int_op(evbuffer_get_length(buf), ==, 4);
+		tt_int_op(evbuffer_datacmp(buf, "body"), ==, 0);
+
+		evhttp_request_free(req);
+		req = NULL;
+		evbuffer_free(tmp);
+		tmp = NULL;
+		evbuffer_free(buf);
+		buf = NULL;
+	}
+
+	/* the key and value of a header are allocated on their own, so
+	 * headers filled in by the caller mix with the others */
+	kv = calloc(1, sizeof(*kv));
+	tt_assert(kv);
+	kv->key = strdup("X-Own");
+	kv->value = strdup("a");
+	TAILQ_INSERT_TAIL(&headers, kv, next);
+	tt_int_op(evhttp_add_header(&headers, "X-Added", "b"), ==, 0);
+	kv = TAILQ_LAST(&headers, evkeyvalq);
+	tt_str_op(kv->key, ==, "X-Added");
+	TAILQ_REMOVE(&headers, kv, next);
+	free(kv->key);
+	free(kv->value);
+	free(kv);
+	tt_str_op(evhttp_find_header(&headers, "X-Own"), ==, "a");
+
+end:
+	evhttp_clear_headers(&headers);
+	if (req)
+		evhttp_request_free(req);
+	if (tmp)
+		evbuffer_free(tmp);
+	if (buf)
+		evbuffer_free(buf);
+}
+static void
 http_parse_query_str_flags_test(void *ptr)
 {
 	struct evkeyvalq headers;
@@ -2798,6 +2962,47 @@ end:
 	evhttp_clear_headers(&headers);
 }
 
+static void
+http_query_next_test(void *ptr)
+{
+	const char *query = "q=a%20b+c&flag&=1&k=v=w&";
+	const char *key, *value;
+	size_t key_len, value_len;
+	char buf[32];
+
+	tt_int_op(evhttp_query_next(&query, &key, &key_len,
+		&value, &value_len), ==, 1);
+	tt_int_op(key_len, ==, 1);
+	tt_assert(!strncmp(key, "q", key_len));
+	tt_int_op(value_len, ==, 7);
+	tt_int_op(evhttp_query_decode(value, value_len, buf), ==, 5);
+	tt_str_op(buf, ==, "a b c");
+
+	tt_int_op(evhttp_query_next(&query, &key, &key_len,
+		&value, &value_len), ==, 1);
+	tt_assert(!strncmp(key, "flag", key_len));
+	tt_assert(value == NULL);
+
+	tt_int_op(evhttp_query_next(&query, &key, &key_len,
+		&value, &value_len), ==, 1);
+	tt_int_op(key_len, ==, 0);
+	tt_int_op(value_len, ==, 1);
+
+	tt_int_op(evhttp_query_next(&query, &key, &key_len,
+		&value, &value_len), ==, 1);
+	tt_assert(!strncmp(key, "k", key_len));
+	tt_int_op(value_len, ==, 3);
+	tt_assert(!strncmp(value, "v=w", value_len));
+
+	/* a trailing "&" ends the query */
+	tt_int_op(evhttp_query_next(&query, &key, &key_len,
+		&value, &value_len), ==, 0);
+	tt_str_op(query, ==, "");
+
+end:
+	;
+}
+
 static void
 http_parse_uri_test(void *ptr)
 {
@@ -3849,6 +4054,167 @@ http_stream_in_cancel_test(void *arg)
 
 }
 
+struct stream_body_state {
+	struct event_base *base;
+	struct evhttp_request *req;
+	size_t nread;
+	size_t max_buffered;
+	int nheaders;
+	int nchunks;
+	int npaused;
+	int done;
+};
+
+static int
+http_stream_body_header_cb(struct evhttp_request *req, void *arg)
+{
+	struct stream_body_state *state = arg;
+
+	++state->nheaders;
+	tt_int_op(state->nchunks, ==, 0);
+	tt_int_op(evbuffer_get_length(evhttp_request_get_input_buffer(req)),
+	    ==, 0);
+
+ end:
+	return (0);
+}
+
+static void
+http_stream_body_drain(evutil_socket_t fd, short what, void *arg)
+{
+	struct stream_body_state *state = arg;
+	struct evbuffer *buf;
+
+	/* the body may have been completed in the meantime */
+	if (state->req == NULL)
+		return;
+
+	buf = evhttp_request_get_input_buffer(state->req);
+	++state->npaused;
+	state->nread += evbuffer_get_length(buf);
+	evbuffer_drain(buf, evbuffer_get_length(buf));
+}
+
+static void
+http_stream_body_chunk_cb(struct evhttp_request *req, void *arg)
+{
+	struct stream_body_state *state = arg;
+	struct evbuffer *buf = evhttp_request_get_input_buffer(req);
+	size_t len = evbuffer_get_length(buf);
+	struct timeval tv = { 0, 10000 };
+
+	++state->nchunks;
+	if (len > state->max_buffered)
+		state->max_buffered = len;
+
+	/* consume every other piece asynchronously, which pauses reading */
+	if (state->nchunks % 2 == 0) {
+		state->req = req;
+		event_base_once(state->base, -1, EV_TIMEOUT,
+		    http_stream_body_drain, state, &tv);
+		return;
+	}
+
+	state->nread += len;
+	evbuffer_drain(buf, len);
+}
+
+static void
+http_stream_body_cb(struct evhttp_request *req, void *arg)
+{
+	struct stream_body_state *state = arg;
+	struct evbuffer *buf = evhttp_request_get_input_buffer(req);
+
+	state->nread += evbuffer_get_length(buf);
+	evbuffer_drain(buf, evbuffer_get_length(buf));
+	state->req = NULL;
+	state->done = 1;
+
+	evhttp_send_reply(req, HTTP_OK, "Everything is fine", NULL);
+}
+
+static void
+http_stream_body_done(struct evhttp_request *req, void *arg)
+{
+	tt_assert(req);
+	tt_int_op(evhttp_request_get_response_code(req), ==, HTTP_OK);
+	test_ok = 1;
+
+ end:
+	event_base_loopexit(arg, NULL);
+}
+
+static void
+http_stream_body_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	int chunked = data->setup_data != NULL;
+	struct evhttp_connection *evcon = NULL;
+	struct evhttp_request *req;
+	struct stream_body_state state;
+	struct evbuffer *out;
+	ev_uint16_t port = 0;
+	struct evhttp *http = http_setup(&port, data->base, 0);
+	const size_t size = 1024 * 1024, piece = 64 * 1024;
+	char *body = NULL;
+	size_t n;
+
+	memset(&state, 0, sizeof(state));
+	state.base = data->base;
+
+	tt_int_op(evhttp_set_stream_cb(http, "/upload",
+		    http_stream_body_header_cb, http_stream_body_chunk_cb,
+		    http_stream_body_cb, &state), ==, 0);
+	tt_int_op(evhttp_set_stream_cb(http, "/upload", NULL,
+		    http_stream_body_chunk_cb, http_stream_body_cb, &state), ==, -1);
+
+	evcon = evhttp_connection_base_new(data->base, NULL, "127.0.0.1", port);
+	tt_assert(evcon);
+
+	req = evhttp_request_new(http_stream_body_done, data->base);
+	tt_assert(req);
+	evhttp_add_header(evhttp_request_get_output_headers(req),
+	    "Host", "somehost");
+
+	body = malloc(piece);
+	tt_assert(body);
+	memset(body, 'a', piece);
+	out = evhttp_request_get_output_buffer(req);
+	if (chunked) {
+		evhttp_add_header(evhttp_request_get_output_headers(req),
+		    "Transfer-Encoding", "chunked");
+		/* the server ignores the content length that gets added */
+	}
+	for (n = 0; n < size; n += piece) {
+		if (chunked)
+			evbuffer_add_printf(out, "%x\r\n", (unsigned)piece);
+		evbuffer_add(out, body, piece);
+		if (chunked)
+			evbuffer_add(out, "\r\n", 2);
+	}
+	if (chunked)
+		evbuffer_add(out, "0\r\n\r\n", 5);
+
+	tt_int_op(evhttp_make_request(evcon, req, EVHTTP_REQ_POST, "/upload"),
+	    ==, 0);
+	event_base_dispatch(data->base);
+
+	tt_int_op(test_ok, ==, 1);
+	tt_int_op(state.nheaders, ==, 1);
+	tt_int_op(state.done, ==, 1);
+	tt_int_op(state.nread, ==, size);
+	tt_int_op(state.npaused, >, 0);
+	/* the body never piled up in the request */
+	tt_int_op(state.max_buffered, <, size / 2);
+
+ end:
+	free(body);
+	if (evcon)
+		evhttp_connection_free(evcon);
+	if (http)
+		evhttp_free(http);
+}
+
 static void
 http_connection_fail_done(struct evhttp_request *req, void *arg)
 {
@@ -5270,95 +5636,1821 @@ end:
 		evhttp_free(http);
 }
 
-static void http_add_output_buffer(int fd, short events, void *arg)
+struct client_pool_state {
+	struct event_base *base;
+	int ndone;
+	int nexpected;
+	int nconnections;
+};
+
+static void
+http_client_pool_conncb(struct evhttp_connection *evcon, void *arg)
 {
-	evbuffer_add(arg, POST_DATA, strlen(POST_DATA));
+	struct client_pool_state *state = arg;
+	++state->nconnections;
 }
+
 static void
-http_timeout_read_server_test(void *arg)
+http_client_pool_done(struct evhttp_request *req, void *arg)
+{
+	struct client_pool_state *state = arg;
+
+	tt_assert(req);
+	tt_int_op(evhttp_request_get_response_code(req), ==, HTTP_OK);
+	tt_assert(!evbuffer_datacmp(evhttp_request_get_input_buffer(req),
+		BASIC_REQUEST_BODY));
+
+ end:
+	if (++state->ndone == state->nexpected)
+		event_base_loopexit(state->base, NULL);
+}
+
+static void
+http_client_pool_test(void *arg)
 {
 	struct basic_test_data *data = arg;
-	struct timeval tv;
-	struct bufferevent *bev;
-	struct evbuffer *out;
-	int fd = -1;
+	struct evhttp *http = NULL;
+	struct evhttp_client_pool *pool = NULL;
+	struct evhttp_request *req;
+	struct client_pool_state state;
+	struct timeval tv = { 0, 100000 };
 	ev_uint16_t port = 0;
-	struct evhttp *http = http_setup(&port, data->base, 0);
+	int nconns, nidle, nwaiting;
+	int i;
 
-	test_ok = 0;
+	memset(&state, 0, sizeof(state));
+	state.base = data->base;
 
-	tv.tv_sec = 0;
-	tv.tv_usec = 100000;
-	evhttp_set_write_timeout_tv(http, &tv);
-	tv.tv_usec = 500000;
-	evhttp_set_read_timeout_tv(http, &tv);
+	http = http_setup(&port, data->base, 0);
+	pool = evhttp_client_pool_new(data->base, NULL);
+	tt_assert(pool);
+	evhttp_client_pool_set_max_per_host(pool, 1);
+	evhttp_client_pool_set_max_queue(pool, 2);
+	evhttp_client_pool_set_idle_timeout_tv(pool, &tv);
+	evhttp_client_pool_set_conncb(pool, http_client_pool_conncb, &state);
+
+	tt_int_op(evhttp_client_pool_get_host_stats(pool, "127.0.0.1", port,
+		    NULL, NULL, NULL), ==, -1);
+
+	/* one request goes out, two are queued, the fourth is rejected */
+	state.nexpected = 3;
+	for (i = 0; i < 4; ++i) {
+		req = evhttp_request_new(http_client_pool_done, &state);
+		tt_assert(req);
+		tt_int_op(evhttp_client_pool_make_request(pool, "127.0.0.1", port,
+			    req, EVHTTP_REQ_GET, "/test"), ==, i < 3 ? 0 : -1);
+	}
 
-	fd = http_connect("127.0.0.1", port);
-	bev = create_bev(data->base, fd, 0);
-	bufferevent_setcb(bev, http_readcb, http_writecb, http_errorcb, data->base);
-	out = bufferevent_get_output(bev);
+	tt_int_op(evhttp_client_pool_get_host_stats(pool, "127.0.0.1", port,
+		    &nconns, &nidle, &nwaiting), ==, 0);
+	tt_int_op(nconns, ==, 1);
+	tt_int_op(nidle, ==, 0);
+	tt_int_op(nwaiting, ==, 2);
 
-	evbuffer_add_printf(out,
-	    "POST /postit HTTP/1.1\r\n"
-	    "Host: somehost\r\n"
-	    "Content-Length: " EV_SIZE_FMT "\r\n"
-	    "\r\n", strlen(POST_DATA));
+	event_base_dispatch(data->base);
 
-	tv.tv_usec = 200000;
-	event_base_once(data->base, -1, EV_TIMEOUT, http_add_output_buffer, out, &tv);
+	tt_int_op(state.ndone, ==, 3);
+	tt_int_op(state.nconnections, ==, 1);
 
+	/* the connection is parked until the idle timeout expires */
+	tt_int_op(evhttp_client_pool_get_host_stats(pool, "127.0.0.1", port,
+		    &nconns, &nidle, &nwaiting), ==, 0);
+	tt_int_op(nconns, ==, 1);
+	tt_int_op(nidle, ==, 1);
+	tt_int_op(nwaiting, ==, 0);
+
+	tv.tv_usec = 300000;
+	event_base_loopexit(data->base, &tv);
 	event_base_dispatch(data->base);
-	tt_int_op(test_ok, ==, 3);
+
+	tt_int_op(evhttp_client_pool_get_host_stats(pool, "127.0.0.1", port,
+		    NULL, NULL, NULL), ==, -1);
+
+	test_ok = 1;
 
  end:
-	if (bev)
-		bufferevent_free(bev);
-	if (fd != -1)
-		evutil_closesocket(fd);
+	if (pool)
+		evhttp_client_pool_free(pool);
 	if (http)
 		evhttp_free(http);
 }
 
+static void
+http_client_pool_badbind_conncb(struct evhttp_connection *evcon, void *arg)
+{
+	struct client_pool_state *state = arg;
 
+	/* the second connection cannot be set up */
+	if (++state->nconnections == 2)
+		evhttp_connection_set_local_address(evcon, "192.0.2.1");
+}
 
+static void
+http_client_pool_failed(struct evhttp_request *req, void *arg)
+{
+	struct client_pool_state *state = arg;
 
-#define HTTP_LEGACY(name)						\
-	{ #name, run_legacy_test_fn, TT_ISOLATED|TT_LEGACY, &legacy_setup, \
-		    http_##name##_test }
+	tt_assert(!req);
 
-#define HTTP_CAST_ARG(a) ((void *)(a))
-#define HTTP_OFF_N(title, name, arg) \
-	{ #title, http_##name##_test, TT_ISOLATED|TT_OFF_BY_DEFAULT, &basic_setup, HTTP_CAST_ARG(arg) }
-#define HTTP_RET_N(title, name, test_opts, arg) \
-	{ #title, http_##name##_test, TT_ISOLATED|TT_RETRIABLE|test_opts, &basic_setup, HTTP_CAST_ARG(arg) }
-#define HTTP_N(title, name, test_opts, arg) \
-	{ #title, http_##name##_test, TT_ISOLATED|test_opts, &basic_setup, HTTP_CAST_ARG(arg) }
-#define HTTP(name) HTTP_N(name, name, 0, NULL)
-#define HTTPS(name) \
-	{ "https_" #name, https_##name##_test, TT_ISOLATED, &basic_setup, NULL }
+ end:
+	if (++state->ndone == state->nexpected)
+		event_base_loopexit(state->base, NULL);
+}
 
-#ifdef EVENT__HAVE_OPENSSL
-static void https_basic_test(void *arg)
-{ http_basic_test_impl(arg, 1, "GET /test HTTP/1.1"); }
-static void https_filter_basic_test(void *arg)
-{ http_basic_test_impl(arg, 1 | HTTP_SSL_FILTER, "GET /test HTTP/1.1"); }
-static void https_incomplete_test(void *arg)
-{ http_incomplete_test_(arg, 0, 1); }
-static void https_incomplete_timeout_test(void *arg)
-{ http_incomplete_test_(arg, 1, 1); }
-static void https_simple_test(void *arg)
-{ http_simple_test_impl(arg, 1, 0, "/test"); }
-static void https_simple_dirty_test(void *arg)
-{ http_simple_test_impl(arg, 1, 1, "/test"); }
-static void https_connection_retry_conn_address_test(void *arg)
-{ http_connection_retry_conn_address_test_impl(arg, 1); }
-static void https_connection_retry_test(void *arg)
-{ http_connection_retry_test_impl(arg, 1); }
-static void https_chunk_out_test(void *arg)
-{ http_chunk_out_test_impl(arg, 1); }
-static void https_filter_chunk_out_test(void *arg)
-{ http_chunk_out_test_impl(arg, 1 | HTTP_SSL_FILTER); }
-static void https_stream_out_test(void *arg)
+static void
+http_client_pool_connect_fail_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp *http = NULL;
+	struct evhttp_client_pool *pool = NULL;
+	struct evhttp_request *req;
+	struct client_pool_state state;
+	ev_uint16_t port = 0;
+
+	memset(&state, 0, sizeof(state));
+	state.base = data->base;
+
+	http = http_setup(&port, data->base, 0);
+	pool = evhttp_client_pool_new(data->base, NULL);
+	tt_assert(pool);
+	evhttp_client_pool_set_max_per_host(pool, 1);
+	evhttp_client_pool_set_conncb(pool,
+	    http_client_pool_badbind_conncb, &state);
+
+	/* the first request closes its connection, so the queued one needs
+	 * a new connection, which fails to bind */
+	req = evhttp_request_new(http_client_pool_done, &state);
+	tt_assert(req);
+	evhttp_add_header(evhttp_request_get_output_headers(req),
+	    "Connection", "close");
+	tt_int_op(evhttp_client_pool_make_request(pool, "127.0.0.1", port,
+		    req, EVHTTP_REQ_GET, "/test"), ==, 0);
+	req = evhttp_request_new(http_client_pool_failed, &state);
+	tt_assert(req);
+	tt_int_op(evhttp_client_pool_make_request(pool, "127.0.0.1", port,
+		    req, EVHTTP_REQ_GET, "/test"), ==, 0);
+
+	state.nexpected = 2;
+	event_base_dispatch(data->base);
+
+	tt_int_op(state.ndone, ==, 2);
+	tt_int_op(state.nconnections, ==, 2);
+
+	test_ok = 1;
+
+ end:
+	if (pool)
+		evhttp_client_pool_free(pool);
+	if (http)
+		evhttp_free(http);
+}
+
+static void
+http_client_pool_peer_close_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp *http = NULL;
+	struct evhttp_client_pool *pool = NULL;
+	struct evhttp_request *req;
+	struct client_pool_state state;
+	struct timeval tv = { 0, 100000 };
+	ev_uint16_t port = 0;
+	int nconns, nidle, nwaiting;
+
+	memset(&state, 0, sizeof(state));
+	state.base = data->base;
+
+	http = http_setup(&port, data->base, 0);
+	/* the server drops idle connections quickly */
+	evhttp_set_timeout_tv(http, &tv);
+	pool = evhttp_client_pool_new(data->base, NULL);
+	tt_assert(pool);
+	evhttp_client_pool_set_conncb(pool, http_client_pool_conncb, &state);
+
+	req = evhttp_request_new(http_client_pool_done, &state);
+	tt_assert(req);
+	tt_int_op(evhttp_client_pool_make_request(pool, "127.0.0.1", port,
+		    req, EVHTTP_REQ_GET, "/test"), ==, 0);
+	state.nexpected = 1;
+	event_base_dispatch(data->base);
+	tt_int_op(state.ndone, ==, 1);
+
+	tt_int_op(evhttp_client_pool_get_host_stats(pool, "127.0.0.1", port,
+		    &nconns, &nidle, &nwaiting), ==, 0);
+	tt_int_op(nconns, ==, 1);
+	tt_int_op(nidle, ==, 1);
+
+	/* the closed connection is evicted long before the pool's own idle
+	 * timeout */
+	tv.tv_usec = 500000;
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+
+	tt_int_op(evhttp_client_pool_get_host_stats(pool, "127.0.0.1", port,
+		    NULL, NULL, NULL), ==, -1);
+
+	/* and the next request gets a fresh one */
+	req = evhttp_request_new(http_client_pool_done, &state);
+	tt_assert(req);
+	tt_int_op(evhttp_client_pool_make_request(pool, "127.0.0.1", port,
+		    req, EVHTTP_REQ_GET, "/test"), ==, 0);
+	state.nexpected = 2;
+	event_base_dispatch(data->base);
+
+	tt_int_op(state.ndone, ==, 2);
+	tt_int_op(state.nconnections, ==, 2);
+
+	test_ok = 1;
+
+ end:
+	if (pool)
+		evhttp_client_pool_free(pool);
+	if (http)
+		evhttp_free(http);
+}
+
+static void
+http_client_pool_coalesce_cb(struct evhttp_request *req, void *arg)
+{
+	struct evbuffer *evb = evbuffer_new();
+	int *nhits = arg;
+
+	++*nhits;
+	evbuffer_add_printf(evb, BASIC_REQUEST_BODY);
+	evhttp_send_reply(req, HTTP_OK, "Everything is fine", evb);
+	evbuffer_free(evb);
+}
+
+static void
+http_client_pool_coalesce_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp *http = NULL;
+	struct evhttp_client_pool *pool = NULL;
+	struct evhttp_request *req, *reqs[7];
+	struct client_pool_state state;
+	static const char *uris[7] = {
+		"/coalesce", "/coalesce", "/coalesce", "/coalesce",
+		"/coalesce", "/coalesce?b", "/coalesce?b"
+	};
+	ev_uint16_t port = 0;
+	int nhits = 0;
+	int i;
+
+	memset(&state, 0, sizeof(state));
+	state.base = data->base;
+
+	http = http_setup(&port, data->base, 0);
+	evhttp_set_cb(http, "/coalesce", http_client_pool_coalesce_cb, &nhits);
+	pool = evhttp_client_pool_new(data->base, NULL);
+	tt_assert(pool);
+	tt_int_op(evhttp_client_pool_set_coalescing(pool, 1,
+		    " Accept-Encoding ,"), ==, 0);
+
+	for (i = 0; i < 7; ++i) {
+		req = reqs[i] = evhttp_request_new(http_client_pool_done, &state);
+		tt_assert(req);
+		/* differs in a vary header, so it is not coalesced */
+		if (i == 4)
+			evhttp_add_header(evhttp_request_get_output_headers(req),
+			    "Accept-Encoding", "gzip");
+		tt_int_op(evhttp_client_pool_make_request(pool, "127.0.0.1", port,
+			    req, EVHTTP_REQ_GET, uris[i]), ==, 0);
+	}
+
+	/* a follower goes away, and a follower takes over for its leader */
+	evhttp_client_pool_cancel_request(pool, reqs[3]);
+	evhttp_client_pool_cancel_request(pool, reqs[5]);
+
+	state.nexpected = 5;
+	event_base_dispatch(data->base);
+
+	tt_int_op(state.ndone, ==, 5);
+	tt_int_op(nhits, ==, 3);
+
+	test_ok = 1;
+
+ end:
+	if (pool)
+		evhttp_client_pool_free(pool);
+	if (http)
+		evhttp_free(http);
+}
+
+static void
+http_client_pool_coalesce_fail_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp *http = NULL;
+	struct evhttp_client_pool *pool = NULL;
+	struct evhttp_request *req, *leader;
+	struct client_pool_state state;
+	struct timeval tv = { 0, 100000 };
+	ev_uint16_t port = 0;
+	int nhits = 0;
+
+	memset(&state, 0, sizeof(state));
+	state.base = data->base;
+
+	http = http_setup(&port, data->base, 0);
+	evhttp_set_cb(http, "/coalesce", http_client_pool_coalesce_cb, &nhits);
+
+	/* the follower that takes over for a canceled leader cannot be
+	 * queued either */
+	pool = evhttp_client_pool_new(data->base, NULL);
+	tt_assert(pool);
+	tt_int_op(evhttp_client_pool_set_coalescing(pool, 1, NULL), ==, 0);
+	evhttp_client_pool_set_max_per_host(pool, 1);
+	evhttp_client_pool_set_max_queue(pool, 1);
+
+	req = evhttp_request_new(http_client_pool_done, &state);
+	tt_assert(req);
+	tt_int_op(evhttp_client_pool_make_request(pool, "127.0.0.1", port,
+		    req, EVHTTP_REQ_GET, "/test"), ==, 0);
+	leader = evhttp_request_new(http_client_pool_failed, &state);
+	tt_assert(leader);
+	tt_int_op(evhttp_client_pool_make_request(pool, "127.0.0.1", port,
+		    leader, EVHTTP_REQ_GET, "/coalesce"), ==, 0);
+	req = evhttp_request_new(http_client_pool_failed, &state);
+	tt_assert(req);
+	tt_int_op(evhttp_client_pool_make_request(pool, "127.0.0.1", port,
+		    req, EVHTTP_REQ_GET, "/coalesce"), ==, 0);
+
+	state.nexpected = 2;
+	evhttp_client_pool_cancel_request(pool, leader);
+	tt_int_op(state.ndone, ==, 1);
+	event_base_dispatch(data->base);
+	tt_int_op(state.ndone, ==, 2);
+	evhttp_client_pool_free(pool);
+
+	/* a queued leader that cannot get a connection fails its followers,
+	 * and its flight does not keep the host around */
+	memset(&state, 0, sizeof(state));
+	state.base = data->base;
+	pool = evhttp_client_pool_new(data->base, NULL);
+	tt_assert(pool);
+	tt_int_op(evhttp_client_pool_set_coalescing(pool, 1, NULL), ==, 0);
+	evhttp_client_pool_set_max_per_host(pool, 1);
+	evhttp_client_pool_set_conncb(pool,
+	    http_client_pool_badbind_conncb, &state);
+
+	req = evhttp_request_new(http_client_pool_done, &state);
+	tt_assert(req);
+	evhttp_add_header(evhttp_request_get_output_headers(req),
+	    "Connection", "close");
+	tt_int_op(evhttp_client_pool_make_request(pool, "127.0.0.1", port,
+		    req, EVHTTP_REQ_GET, "/test"), ==, 0);
+	req = evhttp_request_new(http_client_pool_failed, &state);
+	tt_assert(req);
+	tt_int_op(evhttp_client_pool_make_request(pool, "127.0.0.1", port,
+		    req, EVHTTP_REQ_GET, "/coalesce"), ==, 0);
+	req = evhttp_request_new(http_client_pool_failed, &state);
+	tt_assert(req);
+	tt_int_op(evhttp_client_pool_make_request(pool, "127.0.0.1", port,
+		    req, EVHTTP_REQ_GET, "/coalesce"), ==, 0);
+
+	state.nexpected = 3;
+	event_base_dispatch(data->base);
+	tt_int_op(state.ndone, ==, 3);
+	tt_int_op(nhits, ==, 0);
+
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+	tt_int_op(evhttp_client_pool_get_host_stats(pool, "127.0.0.1", port,
+		    NULL, NULL, NULL), ==, -1);
+
+	test_ok = 1;
+
+ end:
+	if (pool)
+		evhttp_client_pool_free(pool);
+	if (http)
+		evhttp_free(http);
+}
+
+struct static_response {
+	struct event_base *base;
+	int code;
+	char *body;
+	char *etag;
+	char *last_modified;
+	char *content_range;
+	char *content_length;
+	char *content_encoding;
+	char *vary;
+	int nvary;
+};
+
+static char *
+http_static_header(struct evhttp_request *req, const char *key)
+{
+	const char *value =
+	    evhttp_find_header(evhttp_request_get_input_headers(req), key);
+	return (value != NULL ? strdup(value) : NULL);
+}
+
+static void
+http_static_done(struct evhttp_request *req, void *arg)
+{
+	struct static_response *resp = arg;
+	struct evkeyval *header;
+	struct evbuffer *buf;
+
+	tt_assert(req);
+	buf = evhttp_request_get_input_buffer(req);
+	resp->code = evhttp_request_get_response_code(req);
+	resp->body = calloc(1, evbuffer_get_length(buf) + 1);
+	evbuffer_remove(buf, resp->body, evbuffer_get_length(buf));
+	resp->etag = http_static_header(req, "ETag");
+	resp->last_modified = http_static_header(req, "Last-Modified");
+	resp->content_range = http_static_header(req, "Content-Range");
+	resp->content_length = http_static_header(req, "Content-Length");
+	resp->content_encoding = http_static_header(req, "Content-Encoding");
+	resp->vary = http_static_header(req, "Vary");
+	TAILQ_FOREACH(header, evhttp_request_get_input_headers(req), next)
+		resp->nvary += !evutil_ascii_strcasecmp(header->key, "Vary");
+
+ end:
+	event_base_loopexit(resp->base, NULL);
+}
+
+static void
+http_static_response_clear(struct static_response *resp)
+{
+	free(resp->body);
+	free(resp->etag);
+	free(resp->last_modified);
+	free(resp->content_range);
+	free(resp->content_length);
+	free(resp->content_encoding);
+	free(resp->vary);
+	memset(resp, 0, sizeof(*resp));
+}
+
+/* Make a request and wait for its response; the headers are key, value
+ * pairs terminated by NULL. */
+static void
+http_static_request(struct evhttp_connection *evcon,
+    struct static_response *resp, enum evhttp_cmd_type type,
+    const char *uri, ...)
+{
+	struct event_base *base = evhttp_connection_get_base(evcon);
+	struct evhttp_request *req;
+	const char *key;
+	va_list ap;
+
+	http_static_response_clear(resp);
+	resp->base = base;
+
+	req = evhttp_request_new(http_static_done, resp);
+	evhttp_add_header(evhttp_request_get_output_headers(req),
+	    "Host", "somehost");
+	va_start(ap, uri);
+	while ((key = va_arg(ap, const char *)) != NULL)
+		evhttp_add_header(evhttp_request_get_output_headers(req),
+		    key, va_arg(ap, const char *));
+	va_end(ap);
+
+	if (evhttp_make_request(evcon, req, type, uri) == 0)
+		event_base_dispatch(base);
+}
+
+/* A content coding that turns letters into upper case, and appends a '!'
+ * at the end of the response */
+static int content_coding_states;
+
+static void *
+http_upper_coding_new(void *arg)
+{
+	++content_coding_states;
+	return (arg);
+}
+
+static int
+http_upper_coding_encode(struct evbuffer *src, struct evbuffer *dst,
+    int finish, void *ctx)
+{
+	char buf[64];
+	int i, n;
+
+	while ((n = evbuffer_remove(src, buf, sizeof(buf))) > 0) {
+		for (i = 0; i < n; ++i)
+			buf[i] = EVUTIL_TOUPPER_(buf[i]);
+		evbuffer_add(dst, buf, n);
+	}
+	if (finish)
+		evbuffer_add(dst, "!", 1);
+	return (0);
+}
+
+static void
+http_upper_coding_free(void *ctx)
+{
+	--content_coding_states;
+}
+
+/* A content coding that keeps everything until the end of the response */
+static void *
+http_hold_coding_new(void *arg)
+{
+	return (evbuffer_new());
+}
+
+static int
+http_hold_coding_encode(struct evbuffer *src, struct evbuffer *dst,
+    int finish, void *ctx)
+{
+	evbuffer_add_buffer(ctx, src);
+	if (finish)
+		evbuffer_add_buffer(dst, ctx);
+	return (0);
+}
+
+static void
+http_hold_coding_free(void *ctx)
+{
+	evbuffer_free(ctx);
+}
+
+static int content_coding_paced;
+
+/* sends the next chunk only once the previous one has been written */
+static void
+http_content_coding_paced_next(struct evhttp_connection *evcon, void *arg)
+{
+	struct evhttp_request *req = arg;
+	struct evbuffer *evb;
+
+	if (++content_coding_paced > 3) {
+		evhttp_send_reply_end(req);
+		return;
+	}
+	evb = evbuffer_new();
+	evbuffer_add_printf(evb, "%d", content_coding_paced);
+	evhttp_send_reply_chunk_with_cb(req, evb,
+	    http_content_coding_paced_next, req);
+	evbuffer_free(evb);
+}
+
+static void
+http_content_coding_paced_cb(struct evhttp_request *req, void *arg)
+{
+	content_coding_paced = 0;
+	evhttp_send_reply_start(req, HTTP_OK, "Everything is fine");
+	http_content_coding_paced_next(NULL, req);
+}
+
+static void
+http_content_coding_chunked_cb(struct evhttp_request *req, void *arg)
+{
+	struct evbuffer *evb = evbuffer_new();
+
+	evhttp_send_reply_start(req, HTTP_OK, "Everything is fine");
+	evbuffer_add_printf(evb, "abc");
+	evhttp_send_reply_chunk(req, evb);
+	evbuffer_add_printf(evb, "def");
+	evhttp_send_reply_chunk(req, evb);
+	evhttp_send_reply_end(req);
+	evbuffer_free(evb);
+}
+
+static void
+http_content_coding_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp_connection *evcon = NULL;
+	struct static_response resp;
+	ev_uint16_t port = 0;
+	struct evhttp *http = http_setup(&port, data->base, 0);
+
+	memset(&resp, 0, sizeof(resp));
+	content_coding_states = 0;
+
+	tt_int_op(evhttp_add_content_coding(http, "x-upper",
+		http_upper_coding_new, http_upper_coding_encode,
+		http_upper_coding_free, &content_coding_states), ==, 0);
+	evhttp_set_cb(http, "/coding_chunked",
+	    http_content_coding_chunked_cb, NULL);
+	evhttp_set_cb(http, "/coding_paced",
+	    http_content_coding_paced_cb, NULL);
+
+	evcon = evhttp_connection_base_new(data->base, NULL, "127.0.0.1", port);
+	tt_assert(evcon);
+
+	http_static_request(evcon, &resp, EVHTTP_REQ_GET, "/test",
+	    "Accept-Encoding", "gzip, x-upper", NULL);
+	tt_int_op(resp.code, ==, HTTP_OK);
+	tt_str_op(resp.body, ==, "THIS IS FUNNY!");
+	tt_str_op(resp.content_encoding, ==, "x-upper");
+	tt_str_op(resp.content_length, ==, "14");
+	tt_str_op(resp.vary, ==, "Accept-Encoding");
+
+	http_static_request(evcon, &resp, EVHTTP_REQ_GET, "/test", NULL);
+	tt_int_op(resp.code, ==, HTTP_OK);
+	tt_str_op(resp.body, ==, BASIC_REQUEST_BODY);
+	tt_assert(resp.content_encoding == NULL);
+	tt_str_op(resp.vary, ==, "Accept-Encoding");
+
+	/* rejected explicitly, even though the wildcard accepts it */
+	http_static_request(evcon, &resp, EVHTTP_REQ_GET, "/test",
+	    "Accept-Encoding", "X-Upper;q=0.0, *", NULL);
+	tt_str_op(resp.body, ==, BASIC_REQUEST_BODY);
+	tt_assert(resp.content_encoding == NULL);
+
+	http_static_request(evcon, &resp, EVHTTP_REQ_GET, "/test",
+	    "Accept-Encoding", "*;q=0.5", NULL);
+	tt_str_op(resp.body, ==, "THIS IS FUNNY!");
+
+	http_static_request(evcon, &resp, EVHTTP_REQ_GET, "/coding_chunked",
+	    "Accept-Encoding", "x-upper", NULL);
+	tt_int_op(resp.code, ==, HTTP_OK);
+	tt_str_op(resp.body, ==, "ABCDEF!");
+	tt_str_op(resp.content_encoding, ==, "x-upper");
+	tt_assert(resp.content_length == NULL);
+
+	/* the coding writes nothing until the end, but the sender still
+	 * learns when it may go on */
+	tt_int_op(evhttp_add_content_coding(http, "x-hold",
+		http_hold_coding_new, http_hold_coding_encode,
+		http_hold_coding_free, NULL), ==, 0);
+	evhttp_connection_set_timeout(evcon, 5);
+	http_static_request(evcon, &resp, EVHTTP_REQ_GET, "/coding_paced",
+	    "Accept-Encoding", "x-hold", NULL);
+	tt_int_op(resp.code, ==, HTTP_OK);
+	tt_str_op(resp.body, ==, "123");
+	tt_str_op(resp.content_encoding, ==, "x-hold");
+
+	tt_int_op(content_coding_states, ==, 0);
+
+	test_ok = 1;
+
+ end:
+	http_static_response_clear(&resp);
+	if (evcon)
+		evhttp_connection_free(evcon);
+	if (http)
+		evhttp_free(http);
+}
+
+static struct evhttp_request *admission_held;
+
+static void
+http_admission_hold_cb(struct evhttp_request *req, void *arg)
+{
+	admission_held = req;
+	event_base_loopexit(arg, NULL);
+}
+
+/* keeps every iteration of the event loop busy */
+static void
+http_admission_busy_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct timeval tv = { 0, 20 * 1000 };
+	evutil_usleep_(&tv);
+}
+
+static void
+http_admission_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp_connection *evcon = NULL, *evcon2 = NULL;
+	struct evhttp_request *req;
+	struct static_response resp, resp2;
+	struct event *busy = NULL;
+	struct timeval tv = { 0, 200 * 1000 };
+	ev_uint16_t port = 0;
+	struct evhttp *http = http_setup(&port, data->base, 0);
+
+	memset(&resp, 0, sizeof(resp));
+	memset(&resp2, 0, sizeof(resp2));
+	admission_held = NULL;
+	evhttp_set_cb(http, "/hold", http_admission_hold_cb, data->base);
+
+	evcon = evhttp_connection_base_new(data->base, NULL, "127.0.0.1", port);
+	evcon2 = evhttp_connection_base_new(data->base, NULL, "127.0.0.1", port);
+	tt_assert(evcon && evcon2);
+
+	/* a second connection is not accepted while the first is open */
+	evhttp_set_max_connections(http, 1);
+	http_static_request(evcon, &resp, EVHTTP_REQ_GET, "/test", NULL);
+	tt_int_op(resp.code, ==, HTTP_OK);
+
+	resp2.base = data->base;
+	req = evhttp_request_new(http_static_done, &resp2);
+	tt_assert(req);
+	tt_int_op(evhttp_make_request(evcon2, req, EVHTTP_REQ_GET, "/test"),
+	    ==, 0);
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+	tt_int_op(resp2.code, ==, 0);
+
+	evhttp_connection_free(evcon);
+	evcon = NULL;
+	event_base_dispatch(data->base);
+	tt_int_op(resp2.code, ==, HTTP_OK);
+	evhttp_set_max_connections(http, 0);
+
+	/* requests beyond the limit are rejected */
+	evhttp_set_max_inflight_requests(http, 1);
+	evcon = evhttp_connection_base_new(data->base, NULL, "127.0.0.1", port);
+	tt_assert(evcon);
+	http_static_response_clear(&resp);
+	resp.base = data->base;
+	req = evhttp_request_new(http_static_done, &resp);
+	tt_assert(req);
+	tt_int_op(evhttp_make_request(evcon, req, EVHTTP_REQ_GET, "/hold"),
+	    ==, 0);
+	event_base_dispatch(data->base);
+	tt_assert(admission_held);
+
+	http_static_request(evcon2, &resp2, EVHTTP_REQ_GET, "/test", NULL);
+	tt_int_op(resp2.code, ==, HTTP_SERVUNAVAIL);
+
+	evhttp_send_reply(admission_held, HTTP_OK, "OK", NULL);
+	admission_held = NULL;
+	event_base_dispatch(data->base);
+	tt_int_op(resp.code, ==, HTTP_OK);
+
+	http_static_request(evcon2, &resp2, EVHTTP_REQ_GET, "/test", NULL);
+	tt_int_op(resp2.code, ==, HTTP_OK);
+	evhttp_set_max_inflight_requests(http, 0);
+
+	/* and so are requests while the event loop lags behind */
+	tv.tv_usec = 10 * 1000;
+	tt_int_op(evhttp_set_max_loop_lag(http, &tv), ==, 0);
+	busy = event_new(data->base, -1, EV_PERSIST,
+	    http_admission_busy_cb, NULL);
+	tt_assert(busy);
+	evutil_timerclear(&tv);
+	event_add(busy, &tv);
+	http_static_request(evcon2, &resp2, EVHTTP_REQ_GET, "/test", NULL);
+	tt_int_op(resp2.code, ==, HTTP_SERVUNAVAIL);
+
+	event_del(busy);
+	http_static_request(evcon2, &resp2, EVHTTP_REQ_GET, "/test", NULL);
+	tt_int_op(resp2.code, ==, HTTP_OK);
+
+	test_ok = 1;
+
+ end:
+	http_static_response_clear(&resp);
+	http_static_response_clear(&resp2);
+	if (busy)
+		event_free(busy);
+	if (evcon)
+		evhttp_connection_free(evcon);
+	if (evcon2)
+		evhttp_connection_free(evcon2);
+	if (http)
+		evhttp_free(http);
+}
+
+static void
+http_park_idle_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp_connection *evcon = NULL, *server_evcon;
+	struct static_response resp;
+	struct timeval tv = { 0, 100 * 1000 };
+	ev_uint16_t port = 0;
+	struct evhttp *http = http_setup(&port, data->base, 0);
+
+	memset(&resp, 0, sizeof(resp));
+	tt_int_op(evhttp_set_flags(http, EVHTTP_SERVER_PARK_IDLE), ==, 0);
+
+	evcon = evhttp_connection_base_new(data->base, NULL, "127.0.0.1", port);
+	tt_assert(evcon);
+
+	http_static_request(evcon, &resp, EVHTTP_REQ_GET, "/test", NULL);
+	tt_int_op(resp.code, ==, HTTP_OK);
+	tt_int_op(http->nconnections, ==, 1);
+	server_evcon = TAILQ_FIRST(&http->connections);
+	tt_int_op(server_evcon->state, ==, EVCON_PARKED);
+	tt_assert(evhttp_connection_get_bufferevent(server_evcon) == NULL);
+	tt_assert(TAILQ_EMPTY(&server_evcon->requests));
+
+	/* the next request rehydrates the same connection */
+	http_static_request(evcon, &resp, EVHTTP_REQ_GET, "/test", NULL);
+	tt_int_op(resp.code, ==, HTTP_OK);
+	tt_str_op(resp.body, ==, BASIC_REQUEST_BODY);
+	tt_int_op(http->nconnections, ==, 1);
+	tt_assert(TAILQ_FIRST(&http->connections) == server_evcon);
+	tt_int_op(server_evcon->state, ==, EVCON_PARKED);
+
+	/* parked connections still time out */
+	evhttp_connection_set_read_timeout_tv(server_evcon, &tv);
+	http_static_request(evcon, &resp, EVHTTP_REQ_GET, "/test", NULL);
+	tt_int_op(resp.code, ==, HTTP_OK);
+	tv.tv_usec = 300 * 1000;
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+	tt_int_op(http->nconnections, ==, 0);
+
+	test_ok = 1;
+
+ end:
+	http_static_response_clear(&resp);
+	if (evcon)
+		evhttp_connection_free(evcon);
+	if (http)
+		evhttp_free(http);
+}
+
+static void
+http_chunked_echo_cb(struct evhttp_request *req, void *arg)
+{
+	struct evbuffer *body = evhttp_request_get_input_buffer(req);
+	struct evbuffer *chunk = evbuffer_new();
+
+	evhttp_add_header(evhttp_request_get_output_headers(req),
+	    "Connection", "close");
+	evhttp_send_reply_start(req, HTTP_OK, "OK");
+	evbuffer_remove_buffer(body, chunk, 16);
+	evhttp_send_reply_chunk(req, chunk);
+	evhttp_send_reply_chunk(req, body);
+	evhttp_send_reply_end(req);
+	evbuffer_free(chunk);
+}
+
+static void
+http_chunked_fast_readcb(struct bufferevent *bev, void *arg)
+{
+	evbuffer_add_buffer(arg, bufferevent_get_input(bev));
+}
+
+static void
+http_chunked_fast_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR))
+		event_base_loopexit(bufferevent_get_base(bev), NULL);
+}
+
+static void
+http_chunked_fast_test(void *arg)
+{
+	static const char request[] =
+	    "POST /echo HTTP/1.1\r\n"
+	    "Host: somehost\r\n"
+	    "Transfer-Encoding: chunked\r\n"
+	    "\r\n"
+	    "1A\r\n"
+	    "abcdefghijklmnopqrstuvwxyz\r\n"
+	    " \t3 ext\r\n"
+	    "ABC\r\n"
+	    "0\r\n"
+	    "\r\n";
+	static const char reply[] =
+	    "10\r\n"
+	    "abcdefghijklmnop\r\n"
+	    "d\r\n"
+	    "qrstuvwxyzABC\r\n"
+	    "0\r\n"
+	    "\r\n";
+	struct basic_test_data *data = arg;
+	struct bufferevent *bev = NULL;
+	struct evbuffer *in = NULL;
+	struct evbuffer_ptr pos;
+	evutil_socket_t fd;
+	ev_uint16_t port = 0;
+	size_t i;
+	struct evhttp *http = http_setup(&port, data->base, 0);
+
+	evhttp_set_cb(http, "/echo", http_chunked_echo_cb, NULL);
+	in = evbuffer_new();
+	tt_assert(in);
+
+	fd = http_connect("127.0.0.1", port);
+	tt_assert(fd != EVUTIL_INVALID_SOCKET);
+	bev = bufferevent_socket_new(data->base, fd, BEV_OPT_CLOSE_ON_FREE);
+	tt_assert(bev);
+	bufferevent_setcb(bev, http_chunked_fast_readcb, NULL,
+	    http_chunked_fast_eventcb, in);
+	bufferevent_enable(bev, EV_READ);
+
+	/* chunk size lines may be split across chains */
+	for (i = 0; i < sizeof(request) - 1; i += 3)
+		bufferevent_write(bev, request + i,
+		    sizeof(request) - 1 - i < 3 ? sizeof(request) - 1 - i : 3);
+
+	event_base_dispatch(data->base);
+
+	pos = evbuffer_search(in, "\r\n\r\n", 4, NULL);
+	tt_int_op(pos.pos, >=, 0);
+	evbuffer_drain(in, pos.pos + 4);
+	tt_int_op(evbuffer_get_length(in), ==, sizeof(reply) - 1);
+	tt_int_op(evbuffer_datacmp(in, reply), ==, 0);
+
+	test_ok = 1;
+
+ end:
+	if (bev)
+		bufferevent_free(bev);
+	if (in)
+		evbuffer_free(in);
+	if (http)
+		evhttp_free(http);
+}
+
+static void
+http_proxy_echo_cb(struct evhttp_request *req, void *arg)
+{
+	struct evkeyvalq *in = evhttp_request_get_input_headers(req);
+	struct evkeyvalq *out = evhttp_request_get_output_headers(req);
+	const char *value;
+
+	if ((value = evhttp_find_header(in, "X-Forwarded-For")) != NULL)
+		evhttp_add_header(out, "X-Seen-For", value);
+	/* hop-by-hop headers are not passed on */
+	if (evhttp_find_header(in, "X-Hop") == NULL)
+		evhttp_add_header(out, "X-Hop", "dropped");
+	evhttp_add_header(out, "Connection", "x-private");
+	evhttp_add_header(out, "X-Private", "leaked");
+	evhttp_send_reply(req, HTTP_OK, "Echo", evhttp_request_get_input_buffer(req));
+}
+
+static void
+http_proxy_header_cb(struct evhttp_request *req,
+    enum evhttp_request_kind kind, struct evkeyvalq *headers, void *arg)
+{
+	evhttp_add_header(headers, "X-Proxied",
+	    kind == EVHTTP_REQUEST ? "request" : "response");
+}
+
+struct proxy_response {
+	struct event_base *base;
+	int code;
+	struct evbuffer *body;
+	char *seen_for;
+	char *hop;
+	char *private;
+	char *proxied;
+};
+
+static void
+http_proxy_done(struct evhttp_request *req, void *arg)
+{
+	struct proxy_response *resp = arg;
+
+	tt_assert(req);
+	resp->code = evhttp_request_get_response_code(req);
+	evbuffer_add_buffer(resp->body, evhttp_request_get_input_buffer(req));
+	resp->seen_for = http_static_header(req, "X-Seen-For");
+	resp->hop = http_static_header(req, "X-Hop");
+	resp->private = http_static_header(req, "X-Private");
+	resp->proxied = http_static_header(req, "X-Proxied");
+
+ end:
+	event_base_loopexit(resp->base, NULL);
+}
+
+static void
+http_proxy_response_clear(struct proxy_response *resp)
+{
+	evbuffer_drain(resp->body, evbuffer_get_length(resp->body));
+	free(resp->seen_for);
+	free(resp->hop);
+	free(resp->private);
+	free(resp->proxied);
+	resp->seen_for = resp->hop = resp->private = resp->proxied = NULL;
+	resp->code = 0;
+}
+
+static void
+http_proxy_request(struct evhttp_connection *evcon,
+    struct proxy_response *resp, enum evhttp_cmd_type type, const char *uri,
+    const char *body, size_t len)
+{
+	struct evhttp_request *req;
+
+	http_proxy_response_clear(resp);
+	req = evhttp_request_new(http_proxy_done, resp);
+	evhttp_add_header(evhttp_request_get_output_headers(req),
+	    "Host", "somehost");
+	evhttp_add_header(evhttp_request_get_output_headers(req),
+	    "Connection", "X-Hop");
+	evhttp_add_header(evhttp_request_get_output_headers(req),
+	    "X-Hop", "yes");
+	if (body != NULL)
+		evbuffer_add(evhttp_request_get_output_buffer(req), body, len);
+	evhttp_make_request(evcon, req, type, uri);
+	event_base_dispatch(resp->base);
+}
+
+static void
+http_proxy_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp *http = NULL, *front = NULL;
+	struct evhttp_client_pool *pool = NULL;
+	struct evhttp_proxy *proxy = NULL, *dead = NULL;
+	struct evhttp_connection *evcon = NULL;
+	struct proxy_response resp;
+	ev_uint16_t port = 0, front_port = 0;
+	char *body = NULL;
+	const size_t len = 1024 * 1024;
+	size_t i;
+
+	memset(&resp, 0, sizeof(resp));
+	resp.base = data->base;
+	resp.body = evbuffer_new();
+	tt_assert(resp.body);
+
+	http = http_setup(&port, data->base, 0);
+	evhttp_set_cb(http, "/echo", http_proxy_echo_cb, NULL);
+
+	pool = evhttp_client_pool_new(data->base, NULL);
+	tt_assert(pool);
+	proxy = evhttp_proxy_new(pool, "127.0.0.1", port);
+	tt_assert(proxy);
+	evhttp_proxy_set_window(proxy, 4096);
+	evhttp_proxy_set_header_cb(proxy, http_proxy_header_cb, NULL);
+	/* nothing listens on port 1 */
+	dead = evhttp_proxy_new(pool, "127.0.0.1", 1);
+	tt_assert(dead);
+
+	front = evhttp_new(data->base);
+	tt_assert(front);
+	tt_int_op(http_bind(front, &front_port, 0), ==, 0);
+	tt_int_op(evhttp_set_proxy_cb(front, "/test", proxy), ==, 0);
+	tt_int_op(evhttp_set_proxy_cb(front, "/chunked", proxy), ==, 0);
+	tt_int_op(evhttp_set_proxy_cb(front, "/echo", proxy), ==, 0);
+	tt_int_op(evhttp_set_proxy_cb(front, "/dead", dead), ==, 0);
+
+	evcon = evhttp_connection_base_new(data->base, NULL,
+	    "127.0.0.1", front_port);
+	tt_assert(evcon);
+
+	http_proxy_request(evcon, &resp, EVHTTP_REQ_GET, "/test", NULL, 0);
+	tt_int_op(resp.code, ==, HTTP_OK);
+	tt_int_op(evbuffer_datacmp(resp.body, BASIC_REQUEST_BODY), ==, 0);
+	tt_str_op(resp.proxied, ==, "response");
+
+	/* a chunked response is passed on as it arrives */
+	http_proxy_request(evcon, &resp, EVHTTP_REQ_GET, "/chunked", NULL, 0);
+	tt_int_op(resp.code, ==, HTTP_OK);
+	tt_int_op(evbuffer_datacmp(resp.body,
+		    "This is funnybut not hilarious.bwv 1052"), ==, 0);
+
+	/* bodies much larger than the window pass in both directions */
+	body = malloc(len);
+	tt_assert(body);
+	for (i = 0; i < len; ++i)
+		body[i] = 'a' + i % 26;
+	http_proxy_request(evcon, &resp, EVHTTP_REQ_POST, "/echo", body, len);
+	tt_int_op(resp.code, ==, HTTP_OK);
+	tt_int_op(evbuffer_get_length(resp.body), ==, len);
+	tt_assert(!memcmp(evbuffer_pullup(resp.body, -1), body, len));
+	tt_str_op(resp.seen_for, ==, "127.0.0.1");
+	tt_str_op(resp.hop, ==, "dropped");
+	tt_assert(resp.private == NULL);
+
+	http_proxy_request(evcon, &resp, EVHTTP_REQ_POST, "/dead", "x", 1);
+	tt_int_op(resp.code, ==, HTTP_BADGATEWAY);
+
+	test_ok = 1;
+
+ end:
+	http_proxy_response_clear(&resp);
+	if (resp.body)
+		evbuffer_free(resp.body);
+	free(body);
+	if (evcon)
+		evhttp_connection_free(evcon);
+	if (front)
+		evhttp_free(front);
+	if (proxy)
+		evhttp_proxy_free(proxy);
+	if (dead)
+		evhttp_proxy_free(dead);
+	if (pool)
+		evhttp_client_pool_free(pool);
+	if (http)
+		evhttp_free(http);
+}
+
+static void
+http_stats_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp_connection *evcon = NULL;
+	struct static_response resp;
+	struct evhttp_stats stats, merged;
+	ev_uint16_t port = 0;
+	struct evhttp *http = http_setup(&port, data->base, 0);
+
+	memset(&resp, 0, sizeof(resp));
+	tt_int_op(evhttp_set_flags(http, EVHTTP_SERVER_STATS), ==, 0);
+	tt_int_op(evhttp_set_cb(http, "/stats", evhttp_stats_handler, NULL),
+	    ==, 0);
+
+	evcon = evhttp_connection_base_new(data->base, NULL, "127.0.0.1", port);
+	tt_assert(evcon);
+
+	http_static_request(evcon, &resp, EVHTTP_REQ_GET, "/test", NULL);
+	tt_int_op(resp.code, ==, HTTP_OK);
+	http_static_request(evcon, &resp, EVHTTP_REQ_GET, "/test", NULL);
+	tt_int_op(resp.code, ==, HTTP_OK);
+	http_static_request(evcon, &resp, EVHTTP_REQ_GET, "/nothere", NULL);
+	tt_int_op(resp.code, ==, HTTP_NOTFOUND);
+
+	tt_int_op(evhttp_get_stats(http, "/test", &stats), ==, 0);
+	tt_int_op(stats.requests, ==, 2);
+	tt_int_op(stats.status[1], ==, 2);
+	tt_int_op(stats.status[3], ==, 0);
+	tt_int_op(stats.bytes_in, >, 0);
+	tt_int_op(stats.bytes_out, >, 2 * strlen(BASIC_REQUEST_BODY));
+	tt_int_op(stats.parse.count, ==, 2);
+	tt_int_op(stats.handler.count, ==, 2);
+	tt_int_op(stats.write.count, ==, 2);
+
+	tt_int_op(evhttp_get_stats(http, NULL, &stats), ==, 0);
+	tt_int_op(stats.requests, ==, 3);
+	tt_int_op(stats.status[1], ==, 2);
+	tt_int_op(stats.status[3], ==, 1);
+
+	tt_int_op(evhttp_get_stats(http, "/stats", &stats), ==, 0);
+	tt_int_op(stats.requests, ==, 0);
+	tt_int_op(evhttp_get_stats(http, "/nothere", &stats), ==, -1);
+
+	http_static_request(evcon, &resp, EVHTTP_REQ_GET, "/stats", NULL);
+	tt_int_op(resp.code, ==, HTTP_OK);
+	tt_assert(strstr(resp.body, "{\"requests\":3,"));
+	tt_assert(strstr(resp.body, "\"/test\":{\"requests\":2,"));
+	tt_assert(strstr(resp.body, "\"4xx\":1"));
+
+	/* statistics of several servers add up */
+	memset(&merged, 0, sizeof(merged));
+	tt_int_op(evhttp_histogram_percentile(&merged.handler, 50), ==, 0);
+	tt_int_op(evhttp_get_stats(http, NULL, &stats), ==, 0);
+	evhttp_stats_merge(&merged, &stats);
+	evhttp_stats_merge(&merged, &stats);
+	tt_int_op(merged.requests, ==, 2 * stats.requests);
+	tt_int_op(merged.bytes_out, ==, 2 * stats.bytes_out);
+	tt_int_op(merged.handler.count, ==, 2 * stats.handler.count);
+	tt_int_op(merged.handler.max, ==, stats.handler.max);
+	tt_int_op(evhttp_histogram_percentile(&merged.handler, 100), ==,
+	    stats.handler.max);
+	tt_int_op(evhttp_histogram_percentile(&merged.handler, 50), <=,
+	    evhttp_histogram_percentile(&merged.handler, 99));
+
+	test_ok = 1;
+
+ end:
+	http_static_response_clear(&resp);
+	if (evcon)
+		evhttp_connection_free(evcon);
+	if (http)
+		evhttp_free(http);
+}
+
+struct http_request_cancel_state {
+	struct event_base *base;
+	struct bufferevent *client;
+	int closed;
+	int canceled;
+};
+
+static void
+http_request_cancel_close_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct http_request_cancel_state *state = arg;
+
+	bufferevent_free(state->client);
+	state->client = NULL;
+	state->closed = 1;
+}
+
+static void
+http_request_cancel_cb(struct evhttp_request *req, void *arg)
+{
+	struct http_request_cancel_state *state = arg;
+
+	/* only the client going away cancels the request */
+	state->canceled = state->closed &&
+	    evhttp_request_get_connection(req) == NULL ? 1 : -1;
+	evhttp_send_error(req, HTTP_INTERNAL, NULL);
+	event_base_loopexit(state->base, NULL);
+}
+
+static void
+http_request_cancel_slow_cb(struct evhttp_request *req, void *arg)
+{
+	struct http_request_cancel_state *state = arg;
+	struct timeval tv = { 0, 200 * 1000 };
+
+	/* never replies; the client gives up meanwhile */
+	evhttp_request_set_cancel_cb(req, http_request_cancel_cb, state);
+	event_base_once(state->base, -1, EV_TIMEOUT,
+	    http_request_cancel_close_cb, state, &tv);
+}
+
+static void
+http_request_cancel_test(void *arg)
+{
+	static const char request[] =
+	    "GET /slow HTTP/1.1\r\n"
+	    "Host: somehost\r\n"
+	    "\r\n";
+	struct basic_test_data *data = arg;
+	struct http_request_cancel_state state;
+	struct timeval tv = { 0, 50 * 1000 };
+	evutil_socket_t fd;
+	ev_uint16_t port = 0;
+	struct evhttp *http = http_setup(&port, data->base, 0);
+
+	memset(&state, 0, sizeof(state));
+	state.base = data->base;
+	evhttp_set_cb(http, "/slow", http_request_cancel_slow_cb, &state);
+	/* a read timeout must not cancel a pending request */
+	evhttp_set_read_timeout_tv(http, &tv);
+
+	fd = http_connect("127.0.0.1", port);
+	tt_assert(fd != EVUTIL_INVALID_SOCKET);
+	state.client = bufferevent_socket_new(data->base, fd,
+	    BEV_OPT_CLOSE_ON_FREE);
+	tt_assert(state.client);
+	bufferevent_write(state.client, request, sizeof(request) - 1);
+
+	tv.tv_sec = 5;
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+
+	tt_int_op(state.canceled, ==, 1);
+	tt_int_op(http->nconnections, ==, 0);
+
+	test_ok = 1;
+
+ end:
+	if (state.client)
+		bufferevent_free(state.client);
+	if (http)
+		evhttp_free(http);
+}
+
+static void
+http_early_hints_cb(struct evhttp_request *req, void *arg)
+{
+	int *results = arg;
+	struct evkeyvalq headers;
+	struct evbuffer *buf = evbuffer_new();
+
+	TAILQ_INIT(&headers);
+	evhttp_add_header(&headers, "Link", "</style.css>; rel=preload");
+	results[0] = evhttp_send_early_hints(req, &headers);
+	evhttp_clear_headers(&headers);
+
+	evhttp_add_header(evhttp_request_get_output_headers(req),
+	    "Trailer", "X-Checksum");
+	evhttp_send_reply_start(req, HTTP_OK, "OK");
+	results[1] = evhttp_send_early_hints(req, &headers);
+	evbuffer_add(buf, "hello", 5);
+	evhttp_send_reply_chunk(req, buf);
+	evhttp_add_header(&headers, "X-Checksum", "abc");
+	evhttp_send_reply_end_with_trailers(req, &headers);
+	evhttp_clear_headers(&headers);
+	evbuffer_free(buf);
+}
+
+static void
+http_early_hints_reply_cb(struct evhttp_request *req, void *arg)
+{
+	int *results = arg;
+	struct evkeyvalq headers;
+
+	TAILQ_INIT(&headers);
+	evhttp_add_header(&headers, "Link", "</style.css>; rel=preload");
+	evhttp_send_reply(req, HTTP_OK, "OK", NULL);
+	/* req is only freed once the reply has been written */
+	results[2] = evhttp_send_early_hints(req, &headers);
+	evhttp_clear_headers(&headers);
+}
+
+static void
+http_early_hints_test(void *arg)
+{
+	static const char request[] =
+	    "GET /hints HTTP/1.1\r\n"
+	    "Host: somehost\r\n"
+	    "Connection: close\r\n"
+	    "\r\n";
+	static const char hints[] =
+	    "HTTP/1.1 103 Early Hints\r\n"
+	    "Link: </style.css>; rel=preload\r\n"
+	    "\r\n"
+	    "HTTP/1.1 200 OK\r\n";
+	static const char body[] =
+	    "5\r\n"
+	    "hello\r\n"
+	    "0\r\n"
+	    "X-Checksum: abc\r\n"
+	    "\r\n";
+	struct basic_test_data *data = arg;
+	struct bufferevent *bev = NULL;
+	struct evhttp_connection *evcon = NULL;
+	struct static_response resp;
+	struct evbuffer *in = NULL;
+	struct evbuffer_ptr pos;
+	int results[3] = { -2, -2, -2 };
+	int i;
+	evutil_socket_t fd;
+	ev_uint16_t port = 0;
+	struct evhttp *http = http_setup(&port, data->base, 0);
+
+	memset(&resp, 0, sizeof(resp));
+	evhttp_set_cb(http, "/hints", http_early_hints_cb, results);
+	evhttp_set_cb(http, "/hints_reply", http_early_hints_reply_cb, results);
+	in = evbuffer_new();
+	tt_assert(in);
+
+	fd = http_connect("127.0.0.1", port);
+	tt_assert(fd != EVUTIL_INVALID_SOCKET);
+	bev = bufferevent_socket_new(data->base, fd, BEV_OPT_CLOSE_ON_FREE);
+	tt_assert(bev);
+	bufferevent_setcb(bev, http_chunked_fast_readcb, NULL,
+	    http_chunked_fast_eventcb, in);
+	bufferevent_enable(bev, EV_READ);
+	bufferevent_write(bev, request, sizeof(request) - 1);
+
+	event_base_dispatch(data->base);
+
+	tt_int_op(results[0], ==, 0);
+	tt_int_op(results[1], ==, -1);
+	tt_int_op(evbuffer_get_length(in), >, sizeof(hints) - 1);
+	tt_assert(!memcmp(evbuffer_pullup(in, sizeof(hints) - 1), hints,
+		sizeof(hints) - 1));
+	/* skip the interim response and the headers of the reply */
+	for (i = 0; i < 2; ++i) {
+		pos = evbuffer_search(in, "\r\n\r\n", 4, NULL);
+		tt_int_op(pos.pos, >=, 0);
+		evbuffer_drain(in, pos.pos + 4);
+	}
+	tt_int_op(evbuffer_datacmp(in, body), ==, 0);
+	tt_int_op(evbuffer_get_length(in), ==, sizeof(body) - 1);
+
+	/* nor once the whole reply has been sent */
+	evcon = evhttp_connection_base_new(data->base, NULL, "127.0.0.1", port);
+	tt_assert(evcon);
+	http_static_request(evcon, &resp, EVHTTP_REQ_GET, "/hints_reply", NULL);
+	tt_int_op(resp.code, ==, HTTP_OK);
+	tt_int_op(results[2], ==, -1);
+
+	test_ok = 1;
+
+ end:
+	http_static_response_clear(&resp);
+	if (evcon)
+		evhttp_connection_free(evcon);
+	if (bev)
+		bufferevent_free(bev);
+	if (in)
+		evbuffer_free(in);
+	if (http)
+		evhttp_free(http);
+}
+
+#ifdef EVTHREAD_USE_PTHREADS_IMPLEMENTED
+struct http_worker_data {
+	struct event_base *base;
+	int served;
+};
+
+static THREAD_FN
+http_worker_thread(void *arg)
+{
+	struct http_worker_data *w = arg;
+	event_base_loop(w->base, EVLOOP_NO_EXIT_ON_EMPTY);
+	THREAD_RETURN();
+}
+
+static void
+http_worker_cb(struct evhttp_request *req, void *arg)
+{
+	struct http_worker_data *w = arg;
+	struct event_base *base =
+	    evhttp_connection_get_base(evhttp_request_get_connection(req));
+	struct evbuffer *evb = evbuffer_new();
+	int i;
+
+	/* each worker only counts the requests on its own thread */
+	for (i = 0; i < 2; ++i)
+		if (w[i].base == base)
+			++w[i].served;
+	evbuffer_add_printf(evb, "%d", base == w[0].base || base == w[1].base);
+	evhttp_send_reply(req, HTTP_OK, "Everything is fine", evb);
+	evbuffer_free(evb);
+}
+
+struct http_worker_client {
+	struct event_base *base;
+	int ok;
+	int done;
+};
+
+static void
+http_worker_request_done(struct evhttp_request *req, void *arg)
+{
+	struct http_worker_client *client = arg;
+
+	if (req != NULL && evhttp_request_get_response_code(req) == HTTP_OK &&
+	    evbuffer_datacmp(evhttp_request_get_input_buffer(req), "1") == 0)
+		++client->ok;
+	if (++client->done == 4)
+		event_base_loopexit(client->base, NULL);
+}
+
+static void
+http_workers_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct http_worker_data w[2];
+	struct evhttp_connection *evcon[4];
+	struct evhttp_request *req;
+	struct evhttp_stats stats;
+	struct http_worker_client client = { NULL, 0, 0 };
+	struct timeval tv = { 0, 100000 };
+	THREAD_T threads[2];
+	int i, started = 0;
+	ev_uint16_t port = 0;
+	struct evhttp *http = http_setup(&port, data->base, 0);
+
+	memset(w, 0, sizeof(w));
+	memset(evcon, 0, sizeof(evcon));
+	client.base = data->base;
+	tt_int_op(evhttp_set_flags(http, EVHTTP_SERVER_STATS), ==, 0);
+	tt_int_op(evhttp_set_cb(http, "/worker", http_worker_cb, w), ==, 0);
+	for (i = 0; i < 2; ++i) {
+		w[i].base = event_base_new();
+		tt_assert(w[i].base);
+		tt_int_op(evhttp_add_worker_base(http, w[i].base), ==, 0);
+	}
+	for (i = 0; i < 2; ++i)
+		THREAD_START(threads[i], http_worker_thread, &w[i]);
+	started = 1;
+
+	/* one connection each, so that they are handed out in turn */
+	for (i = 0; i < 4; ++i) {
+		evcon[i] = evhttp_connection_base_new(data->base, NULL,
+		    "127.0.0.1", port);
+		tt_assert(evcon[i]);
+		req = evhttp_request_new(http_worker_request_done, &client);
+		tt_assert(req);
+		evhttp_add_header(evhttp_request_get_output_headers(req),
+		    "Host", "somehost");
+		tt_int_op(evhttp_make_request(evcon[i], req, EVHTTP_REQ_GET,
+			"/worker"), ==, 0);
+	}
+
+	event_base_dispatch(data->base);
+
+	/* a reply is only counted once it has been written */
+	for (i = 0; i < 2; ++i)
+		event_base_loopexit(w[i].base, &tv);
+	for (i = 0; i < 2; ++i)
+		THREAD_JOIN(threads[i]);
+	started = 0;
+
+	tt_int_op(client.ok, ==, 4);
+	tt_int_op(w[0].served, ==, 2);
+	tt_int_op(w[1].served, ==, 2);
+	tt_int_op(evhttp_get_stats(http, NULL, &stats), ==, 0);
+	tt_int_op(stats.requests, ==, 4);
+	tt_int_op(stats.status[1], ==, 4);
+
+	test_ok = 1;
+
+ end:
+	if (started) {
+		for (i = 0; i < 2; ++i)
+			event_base_loopbreak(w[i].base);
+		for (i = 0; i < 2; ++i)
+			THREAD_JOIN(threads[i]);
+	}
+	for (i = 0; i < 4; ++i)
+		if (evcon[i])
+			evhttp_connection_free(evcon[i]);
+	if (http)
+		evhttp_free(http);
+	for (i = 0; i < 2; ++i)
+		if (w[i].base)
+			event_base_free(w[i].base);
+}
+
+static void
+http_workers_max_connections_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct http_worker_data w[2];
+	struct evhttp_connection *evcon = NULL, *evcon2 = NULL;
+	struct evhttp_request *req;
+	struct static_response resp, resp2;
+	struct timeval tv = { 0, 200 * 1000 };
+	THREAD_T thread;
+	int started = 0;
+	ev_uint16_t port = 0;
+	struct evhttp *http = http_setup(&port, data->base, 0);
+
+	memset(w, 0, sizeof(w));
+	memset(&resp, 0, sizeof(resp));
+	memset(&resp2, 0, sizeof(resp2));
+	tt_int_op(evhttp_set_cb(http, "/worker", http_worker_cb, w), ==, 0);
+	evhttp_set_max_connections(http, 1);
+	w[0].base = event_base_new();
+	tt_assert(w[0].base);
+	tt_int_op(evhttp_add_worker_base(http, w[0].base), ==, 0);
+	THREAD_START(thread, http_worker_thread, &w[0]);
+	started = 1;
+
+	evcon = evhttp_connection_base_new(data->base, NULL, "127.0.0.1", port);
+	evcon2 = evhttp_connection_base_new(data->base, NULL, "127.0.0.1", port);
+	tt_assert(evcon && evcon2);
+
+	/* the connection served by the worker counts against the limit */
+	http_static_request(evcon, &resp, EVHTTP_REQ_GET, "/worker", NULL);
+	tt_int_op(resp.code, ==, HTTP_OK);
+	tt_str_op(resp.body, ==, "1");
+
+	resp2.base = data->base;
+	req = evhttp_request_new(http_static_done, &resp2);
+	tt_assert(req);
+	evhttp_add_header(evhttp_request_get_output_headers(req),
+	    "Host", "somehost");
+	tt_int_op(evhttp_make_request(evcon2, req, EVHTTP_REQ_GET, "/worker"),
+	    ==, 0);
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+	tt_int_op(resp2.code, ==, 0);
+
+	/* and once the worker closed it, the next one is accepted */
+	evhttp_connection_free(evcon);
+	evcon = NULL;
+	event_base_dispatch(data->base);
+	tt_int_op(resp2.code, ==, HTTP_OK);
+	tt_int_op(w[0].served, ==, 2);
+
+	test_ok = 1;
+
+ end:
+	if (started) {
+		event_base_loopbreak(w[0].base);
+		THREAD_JOIN(thread);
+	}
+	http_static_response_clear(&resp);
+	http_static_response_clear(&resp2);
+	if (evcon)
+		evhttp_connection_free(evcon);
+	if (evcon2)
+		evhttp_connection_free(evcon2);
+	if (http)
+		evhttp_free(http);
+	if (w[0].base)
+		event_base_free(w[0].base);
+}
+#endif
+
+#ifndef _WIN32
+static void
+http_static_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evhttp_connection *evcon = NULL;
+	struct evhttp_static *st = NULL, *st_nosendfile = NULL;
+	struct static_response resp;
+	ev_uint16_t port = 0;
+	struct evhttp *http = http_setup(&port, data->base, 0);
+	char dir[] = "/tmp/eventtmp.XXXXXX";
+	char path[64], gzpath[64], *etag = NULL, *last_modified = NULL;
+	const char content[] = "0123456789abcdef";
+	FILE *fp;
+
+	memset(&resp, 0, sizeof(resp));
+
+	tt_assert(mkdtemp(dir));
+	evutil_snprintf(path, sizeof(path), "%s/file.txt", dir);
+	tt_assert(fp = fopen(path, "w"));
+	fputs(content, fp);
+	fclose(fp);
+	evutil_snprintf(gzpath, sizeof(gzpath), "%s/file.txt.gz", dir);
+
+	st = evhttp_static_new(data->base, dir, 4, 0);
+	tt_assert(st);
+	evhttp_set_gencb(http, evhttp_static_handler, st);
+
+	evcon = evhttp_connection_base_new(data->base, NULL, "127.0.0.1", port);
+	tt_assert(evcon);
+
+	http_static_request(evcon, &resp, EVHTTP_REQ_GET, "/file.txt", NULL);
+	tt_int_op(resp.code, ==, HTTP_OK);
+	tt_str_op(resp.body, ==, content);
+	tt_assert(resp.etag);
+	tt_assert(resp.last_modified);
+	etag = strdup(resp.etag);
+	last_modified = strdup(resp.last_modified);
+	{
+		struct stat sb;
+		char date[64];
+		tt_int_op(stat(path, &sb), ==, 0);
+		strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT",
+		    gmtime(&sb.st_mtime));
+		tt_str_op(last_modified, ==, date);
+	}
+
+	/* served from the cache */
+	http_static_request(evcon, &resp, EVHTTP_REQ_GET, "/file.txt", NULL);
+	tt_int_op(resp.code, ==, HTTP_OK);
+	tt_str_op(resp.body, ==, content);
+	tt_str_op(resp.etag, ==, etag);
+
+	http_static_request(evcon, &resp, EVHTTP_REQ_HEAD, "/file.txt", NULL);
+	tt_int_op(resp.code, ==, HTTP_OK);
+	tt_str_op(resp.content_length, ==, "16");
+	tt_str_op(resp.body, ==, "");
+
+	http_static_request(evcon, &resp, EVHTTP_REQ_GET, "/file.txt",
+	    "Range", "bytes=2-5", NULL);
+	tt_int_op(resp.code, ==, HTTP_PARTIAL);
+	tt_str_op(resp.body, ==, "2345");
+	tt_str_op(resp.content_range, ==, "bytes 2-5/16");
+
+	http_static_request(evcon, &resp, EVHTTP_REQ_GET, "/file.txt",
+	    "Range", "bytes=-3", NULL);
+	tt_int_op(resp.code, ==, HTTP_PARTIAL);
+	tt_str_op(resp.body, ==, "def");
+
+	http_static_request(evcon, &resp, EVHTTP_REQ_GET, "/file.txt",
+	    "Range", "bytes=16-", NULL);
+	tt_int_op(resp.code, ==, HTTP_BADRANGE);
+	tt_str_op(resp.content_range, ==, "bytes */16");
+
+	/* a stale If-Range gets the whole file */
+	http_static_request(evcon, &resp, EVHTTP_REQ_GET, "/file.txt",
+	    "Range", "bytes=2-5", "If-Range", "\"stale\"", NULL);
+	tt_int_op(resp.code, ==, HTTP_OK);
+	tt_str_op(resp.body, ==, content);
+
+	http_static_request(evcon, &resp, EVHTTP_REQ_GET, "/file.txt",
+	    "If-None-Match", etag, NULL);
+	tt_int_op(resp.code, ==, HTTP_NOTMODIFIED);
+
+	http_static_request(evcon, &resp, EVHTTP_REQ_GET, "/file.txt",
+	    "If-Modified-Since", last_modified, NULL);
+	tt_int_op(resp.code, ==, HTTP_NOTMODIFIED);
+
+	http_static_request(evcon, &resp, EVHTTP_REQ_GET, "/file.txt",
+	    "If-Modified-Since", "Thu, 01 Jan 1970 00:00:00 GMT", NULL);
+	tt_int_op(resp.code, ==, HTTP_OK);
+
+	http_static_request(evcon, &resp, EVHTTP_REQ_GET, "/missing", NULL);
+	tt_int_op(resp.code, ==, HTTP_NOTFOUND);
+
+	http_static_request(evcon, &resp, EVHTTP_REQ_GET,
+	    "/%2e%2e/etc/passwd", NULL);
+	tt_int_op(resp.code, ==, HTTP_NOTFOUND);
+
+	/* precompressed variants */
+	tt_assert(fp = fopen(gzpath, "w"));
+	fputs("compressed", fp);
+	fclose(fp);
+	tt_int_op(evhttp_static_add_precompressed(st, "gzip", ".gz"), ==, 0);
+
+	http_static_request(evcon, &resp, EVHTTP_REQ_GET, "/file.txt",
+	    "Accept-Encoding", "deflate, gzip", NULL);
+	tt_int_op(resp.code, ==, HTTP_OK);
+	tt_str_op(resp.body, ==, "compressed");
+	tt_str_op(resp.content_encoding, ==, "gzip");
+	tt_str_op(resp.vary, ==, "Accept-Encoding");
+
+	http_static_request(evcon, &resp, EVHTTP_REQ_GET, "/file.txt", NULL);
+	tt_int_op(resp.code, ==, HTTP_OK);
+	tt_str_op(resp.body, ==, content);
+	tt_assert(resp.content_encoding == NULL);
+	tt_str_op(resp.vary, ==, "Accept-Encoding");
+	tt_int_op(resp.nvary, ==, 1);
+
+	/* with a content coding as well, Vary is still sent once */
+	tt_int_op(evhttp_add_content_coding(http, "x-upper",
+		http_upper_coding_new, http_upper_coding_encode,
+		http_upper_coding_free, NULL), ==, 0);
+	st_nosendfile = evhttp_static_new(data->base, dir, 4,
+	    EVBUF_FS_DISABLE_SENDFILE);
+	tt_assert(st_nosendfile);
+	tt_int_op(evhttp_static_add_precompressed(st_nosendfile,
+		"gzip", ".gz"), ==, 0);
+	evhttp_set_gencb(http, evhttp_static_handler, st_nosendfile);
+	http_static_request(evcon, &resp, EVHTTP_REQ_GET, "/file.txt", NULL);
+	tt_int_op(resp.code, ==, HTTP_OK);
+	tt_str_op(resp.body, ==, content);
+	tt_str_op(resp.vary, ==, "Accept-Encoding");
+	tt_int_op(resp.nvary, ==, 1);
+
+	test_ok = 1;
+
+ end:
+	http_static_response_clear(&resp);
+	free(etag);
+	free(last_modified);
+	if (evcon)
+		evhttp_connection_free(evcon);
+	if (http)
+		evhttp_free(http);
+	if (st)
+		evhttp_static_free(st);
+	if (st_nosendfile)
+		evhttp_static_free(st_nosendfile);
+	unlink(path);
+	unlink(gzpath);
+	rmdir(dir);
+}
+#endif
+
+static void http_add_output_buffer(int fd, short events, void *arg)
+{
+	evbuffer_add(arg, POST_DATA, strlen(POST_DATA));
+}
+static void
+http_timeout_read_server_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct timeval tv;
+	struct bufferevent *bev;
+	struct evbuffer *out;
+	int fd = -1;
+	ev_uint16_t port = 0;
+	struct evhttp *http = http_setup(&port, data->base, 0);
+
+	test_ok = 0;
+
+	tv.tv_sec = 0;
+	tv.tv_usec = 100000;
+	evhttp_set_write_timeout_tv(http, &tv);
+	tv.tv_usec = 500000;
+	evhttp_set_read_timeout_tv(http, &tv);
+
+	fd = http_connect("127.0.0.1", port);
+	bev = create_bev(data->base, fd, 0);
+	bufferevent_setcb(bev, http_readcb, http_writecb, http_errorcb, data->base);
+	out = bufferevent_get_output(bev);
+
+	evbuffer_add_printf(out,
+	    "POST /postit HTTP/1.1\r\n"
+	    "Host: somehost\r\n"
+	    "Content-Length: " EV_SIZE_FMT "\r\n"
+	    "\r\n", strlen(POST_DATA));
+
+	tv.tv_usec = 200000;
+	event_base_once(data->base, -1, EV_TIMEOUT, http_add_output_buffer, out, &tv);
+
+	event_base_dispatch(data->base);
+	tt_int_op(test_ok, ==, 3);
+
+ end:
+	if (bev)
+		bufferevent_free(bev);
+	if (fd != -1)
+		evutil_closesocket(fd);
+	if (http)
+		evhttp_free(http);
+}
+
+
+
+
+#define HTTP_LEGACY(name)						\
+	{ #name, run_legacy_test_fn, TT_ISOLATED|TT_LEGACY, &legacy_setup, \
+		    http_##name##_test }
+
+#define HTTP_CAST_ARG(a) ((void *)(a))
+#define HTTP_OFF_N(title, name, arg) \
+	{ #title, http_##name##_test, TT_ISOLATED|TT_OFF_BY_DEFAULT, &basic_setup, HTTP_CAST_ARG(arg) }
+#define HTTP_RET_N(title, name, test_opts, arg) \
+	{ #title, http_##name##_test, TT_ISOLATED|TT_RETRIABLE|test_opts, &basic_setup, HTTP_CAST_ARG(arg) }
+#define HTTP_N(title, name, test_opts, arg) \
+	{ #title, http_##name##_test, TT_ISOLATED|test_opts, &basic_setup, HTTP_CAST_ARG(arg) }
+#define HTTP(name) HTTP_N(name, name, 0, NULL)
+#define HTTPS(name) \
+	{ "https_" #name, https_##name##_test, TT_ISOLATED, &basic_setup, NULL }
+
+#ifdef EVENT__HAVE_OPENSSL
+static void https_basic_test(void *arg)
+{ http_basic_test_impl(arg, 1, "GET /test HTTP/1.1"); }
+static void https_filter_basic_test(void *arg)
+{ http_basic_test_impl(arg, 1 | HTTP_SSL_FILTER, "GET /test HTTP/1.1"); }
+static void https_incomplete_test(void *arg)
+{ http_incomplete_test_(arg, 0, 1); }
+static void https_incomplete_timeout_test(void *arg)
+{ http_incomplete_test_(arg, 1, 1); }
+static void https_simple_test(void *arg)
+{ http_simple_test_impl(arg, 1, 0, "/test"); }
+static void https_simple_dirty_test(void *arg)
+{ http_simple_test_impl(arg, 1, 1, "/test"); }
+static void https_connection_retry_conn_address_test(void *arg)
+{ http_connection_retry_conn_address_test_impl(arg, 1); }
+static void https_connection_retry_test(void *arg)
+{ http_connection_retry_test_impl(arg, 1); }
+static void https_chunk_out_test(void *arg)
+{ http_chunk_out_test_impl(arg, 1); }
+static void https_filter_chunk_out_test(void *arg)
+{ http_chunk_out_test_impl(arg, 1 | HTTP_SSL_FILTER); }
+static void https_stream_out_test(void *arg)
 { http_stream_out_test_impl(arg, 1); }
 static void https_connection_fail_test(void *arg)
 { http_connection_fail_test_impl(arg, 1); }
@@ -5376,7 +7468,9 @@ struct testcase_t http_testcases[] = {
 	{ "bad_headers", http_bad_header_test, 0, NULL, NULL },
 	{ "parse_query", http_parse_query_test, 0, NULL, NULL },
 	{ "parse_query_str", http_parse_query_str_test, 0, NULL, NULL },
+	{ "parse_headers_inplace", http_parse_headers_inplace_test, 0, NULL, NULL },
 	{ "parse_query_str_flags", http_parse_query_str_flags_test, 0, NULL, NULL },
+	{ "query_next", http_query_next_test, 0, NULL, NULL },
 	{ "parse_uri", http_parse_uri_test, 0, NULL, NULL },
 	{ "parse_uri_nc", http_parse_uri_test, 0, &basic_setup, (void*)"nc" },
 	{ "uriencode", http_uriencode_test, 0, NULL, NULL },
@@ -5424,6 +7518,7 @@ struct testcase_t http_testcases[] = {
 	HTTP(terminate_chunked),
 	HTTP(terminate_chunked_oneshot),
 	HTTP(on_complete),
+	HTTP(date_header),
 
 	HTTP(highport),
 	HTTP(dispatcher),
@@ -5434,6 +7529,8 @@ struct testcase_t http_testcases[] = {
 
 	HTTP(stream_in),
 	HTTP(stream_in_cancel),
+	HTTP(stream_body),
+	HTTP_N(stream_body_chunked, stream_body, 0, "chunked"),
 
 	HTTP(connection_fail),
 	{ "connection_retry", http_connection_retry_test, TT_ISOLATED|TT_OFF_BY_DEFAULT, &basic_setup, NULL },
@@ -5455,6 +7552,27 @@ struct testcase_t http_testcases[] = {
 	HTTP(write_during_read),
 	HTTP(request_own),
 	HTTP(error_callback),
+	HTTP(client_pool),
+	HTTP(client_pool_connect_fail),
+	HTTP(client_pool_peer_close),
+	HTTP(client_pool_coalesce),
+	HTTP(client_pool_coalesce_fail),
+	HTTP(content_coding),
+	HTTP(admission),
+	HTTP(park_idle),
+	HTTP(chunked_fast),
+	HTTP(proxy),
+	HTTP(stats),
+	HTTP(request_cancel),
+	HTTP(early_hints),
+#ifdef EVTHREAD_USE_PTHREADS_IMPLEMENTED
+	HTTP_N(workers, workers, TT_FORK|TT_NEED_THREADS, NULL),
+	HTTP_N(workers_max_connections, workers_max_connections,
+	    TT_FORK|TT_NEED_THREADS, NULL),
+#endif
+#ifndef _WIN32
+	HTTP(static),
+#endif
 
 	HTTP(request_extra_body),
 
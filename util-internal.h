@@ -251,6 +251,7 @@ EVENT2_EXPORT_SYMBOL
 int EVUTIL_ISALPHA_(char c);
 EVENT2_EXPORT_SYMBOL
 int EVUTIL_ISALNUM_(char c);
+EVENT2_EXPORT_SYMBOL
 int EVUTIL_ISSPACE_(char c);
 EVENT2_EXPORT_SYMBOL
 int EVUTIL_ISDIGIT_(char c);
@@ -291,6 +292,7 @@ void evutil_rtrim_lws_(char *);
 /* As open(pathname, flags, mode), except that the file is always opened with
  * the close-on-exec flag set. (And the mode argument is mandatory.)
  */
+EVENT2_EXPORT_SYMBOL
 int evutil_open_closeonexec_(const char *pathname, int flags, unsigned mode);
 
 EVENT2_EXPORT_SYMBOL